@@ -7,22 +7,29 @@ dist = CAD2D.Distance;
 ray = CAD2D.Ray;
 seg = CAD2D.Arcseg;
 poly = CAD2D.Poly;
+points = CAD2D.PointArray;
+matrix = CAD2D.Matrix;
 xsect = CAD2D.Intersection;
 angle = CAD2D.Angle;
 circle = CAD2D.Circle;
 
+-- All drawing goes through the kernel's buffered output sink. Use
+-- CAD2D.OutputTo to send it to a file or a string buffer; output to
+-- stdout is flushed by OutputFooter, or explicitly with CAD2D.OutputFlush.
+local out = CAD2D.Output
+
 function OutputHeader()
-	print('%!')
-	print('/Times-Roman findfont 0.2 scalefont setfont')
-	print('72 72 scale')
-	print('4.25 6.5 translate')
-	print('0.02 setlinewidth')
+	out('%!')
+	out('/Times-Roman findfont 0.2 scalefont setfont')
+	out('72 72 scale')
+	out('4.25 6.5 translate')
+	out('0.02 setlinewidth')
 
-	print('/circle{ % r\n' ..
+	out('/circle{ % r\n' ..
 		'dup 0 0 moveto\n' ..
 		'0 exch 0 exch 0 360 arc closepath\n' ..
 	'} bind def\n')
-	print('/arrowto { %tipx tipy *arrowto* ---\n' ..
+	out('/arrowto { %tipx tipy *arrowto* ---\n' ..
 		'<< %push mark on stack\n' ..
 		'/tipy 3 -1 roll %arrow tip y coordinate\n' ..
 		'/tipx 5 -1 roll %arrow tip x coordinate\n' ..
@@ -64,7 +71,7 @@ function OutputHeader()
 		'end %pop dictionary fr dictionary stack\n' ..
 		'} def %define the arrowto procedure\n'
 	)
-	print('/ctext { % x y string\n' ..
+	out('/ctext { % x y string\n' ..
 		'3 dict begin\n' ..
 		'/string exch def\n' ..
 		'/y exch def\n' ..
@@ -78,7 +85,7 @@ function OutputHeader()
 		'end\n' ..
 		'} def\n'
 	)
-	print('/textheight {\n' ..
+	out('/textheight {\n' ..
 		'gsave                                  % save graphic context\n' ..
 		'{                            \n' ..
 		'	100 100 moveto                     % move to some point \n' ..
@@ -103,35 +110,36 @@ function OutputHeader()
 	)
 end
 function OutputFooter()
-	print('showpage')
+	out('showpage')
+	CAD2D.OutputFlush()
 end
 
 function OutputText(arg)
 	if CAD2D.IsPoint(arg.at) then
-		print('gsave', arg.at.x, arg.at.y, 'translate')
-		print(string.format('(%s)',
+		out('gsave', arg.at.x, arg.at.y, 'translate')
+		out(string.format('(%s)',
 			string.gsub(tostring(arg[1]), '([%(%)])', '\\%1')
 		))
 		if arg.textplacement == 'center' then
-			print('dup textextents exch -0.5 mul exch -0.5 mul translate')
+			out('dup textextents exch -0.5 mul exch -0.5 mul translate')
 		elseif arg.textplacement == 'below' then
-			print('dup textextents exch -0.5 mul exch neg translate')
+			out('dup textextents exch -0.5 mul exch neg translate')
 		elseif arg.textplacement == 'above' then
-			print('dup textextents exch -0.5 mul exch pop 0 translate')
+			out('dup textextents exch -0.5 mul exch pop 0 translate')
 		elseif arg.textplacement == 'belowleft' then
-			print('dup textextents exch -1 mul exch neg translate')
+			out('dup textextents exch -1 mul exch neg translate')
 		elseif arg.textplacement == 'belowright' then
-			print('dup textextents exch pop 0 exch neg translate')
+			out('dup textextents exch pop 0 exch neg translate')
 		elseif arg.textplacement == 'aboveleft' then
-			print('dup textextents exch -1 mul exch pop 0 translate')
+			out('dup textextents exch -1 mul exch pop 0 translate')
 		elseif arg.textplacement == 'left' then
-			print('dup textextents exch -1 mul exch -0.5 mul translate')
+			out('dup textextents exch -1 mul exch -0.5 mul translate')
 		elseif arg.textplacement == 'right' then
-			print('dup textextents exch pop 0 exch -0.5 mul translate')
+			out('dup textextents exch pop 0 exch -0.5 mul translate')
 		else -- aboveright
 			-- do nothing
 		end
-		print('0 0 moveto show grestore')
+		out('0 0 moveto show grestore')
 	else
 		error('No location specified')
 	end
@@ -153,15 +161,19 @@ function PolygonCenter(arg)
 end
 
 function OutputPolygon(arg)
+	if CAD2D.IsPointArray(arg[1]) then
+		CAD2D.OutputPath(arg[1])
+		return
+	end
 	if not CAD2D.IsPoly(arg[1]) then
 		error('OutputPolygon expected a Poly')
 	end
 	local p = arg[1]
-	print(p[1].x, p[1].y, 'moveto')
+	out(p[1].x, p[1].y, 'moveto')
 	for i = 2,p.n do
-		print(p[i].x, p[i].y, 'lineto')
+		out(p[i].x, p[i].y, 'lineto')
 	end
-	print('closepath')
+	out('closepath')
 end
 
 function OutputRay(arg)
@@ -173,9 +185,9 @@ function OutputRay(arg)
 	if arg.length then
 		l = arg.length
 	end
-	print(r.origin.x, r.origin.y, 'moveto')
+	out(r.origin.x, r.origin.y, 'moveto')
 	local tip = r.origin+l*r.direction
-	print(tip.x, tip.y, 'arrowto')
+	out(tip.x, tip.y, 'arrowto')
 end
 function OutputVector(arg)
 	if not CAD2D.IsVector(arg[1]) then
@@ -183,13 +195,13 @@ function OutputVector(arg)
 	end
 	local v = arg[1]
 	if CAD2D.IsPoint(arg.at) then
-		print('gsave', arg.at.x, arg.at.y, 'translate')
-		print('0 0 moveto')
-		print(v.x, v.y, 'arrowto')
-		print('grestore')
+		out('gsave', arg.at.x, arg.at.y, 'translate')
+		out('0 0 moveto')
+		out(v.x, v.y, 'arrowto')
+		out('grestore')
 	else
-		print('0 0 moveto')
-		print(v.x, v.y, 'arrowto')
+		out('0 0 moveto')
+		out(v.x, v.y, 'arrowto')
 	end
 end
 
@@ -200,34 +212,20 @@ function OutputRect(arg)
 	if CAD2D.IsPoint(arg.center) then
 		c = arg.center
 	end
-	print(c.x - hx, c.y - hy, 'moveto')
-	print(c.x + hx, c.y - hy, 'lineto')
-	print(c.x + hx, c.y + hy, 'lineto')
-	print(c.x - hx, c.y + hy, 'lineto closepath')
+	out(c.x - hx, c.y - hy, 'moveto')
+	out(c.x + hx, c.y - hy, 'lineto')
+	out(c.x + hx, c.y + hy, 'lineto')
+	out(c.x - hx, c.y + hy, 'lineto closepath')
 end
 
 function OutputPoly(arg)
+	if CAD2D.IsPointArray(arg[1]) then
+		return OutputPolygon(arg)
+	end
 	if not CAD2D.IsPoly(arg[1]) then
 		error('OutputPolygon expected a Poly')
 	end
-	local p = arg[1]
-	print(p[1].x, p[1].y, 'moveto')
-	local n = p.n
-	for i = 1,n do
-		local s = p:arcseg(i)
-		if s.angle == 0 then
-			-- do something
-		else
-			local sc = s.center
-			local angle1 = dir(sc, s[0]).angle
-			local angle2 = dir(sc, s[1]).angle
-			if s.angle >= 0 then
-				print(sc.x, sc.y, s.radius, math.deg(angle1), math.deg(angle2), 'arc')
-			else
-				print(sc.x, sc.y, s.radius, math.deg(angle1), math.deg(angle2), 'arcn')
-			end
-		end
-	end
+	CAD2D.OutputPath(arg[1])
 end
 
 function LabelDimension(arg)
@@ -281,10 +279,10 @@ function LabelDimension(arg)
 	else
 		OutputText{str, at=m, textplacement=placement}
 	end
-	print('gsave currentlinewidth 0.5 mul setlinewidth')
-	print(arg[1].x, arg[1].y, 'moveto', p1.x, p1.y, 'lineto stroke')
-	print(arg[2].x, arg[2].y, 'moveto', p2.x, p2.y, 'lineto stroke')
-	print('grestore')
+	out('gsave currentlinewidth 0.5 mul setlinewidth')
+	out(arg[1].x, arg[1].y, 'moveto', p1.x, p1.y, 'lineto stroke')
+	out(arg[2].x, arg[2].y, 'moveto', p2.x, p2.y, 'lineto stroke')
+	out('grestore')
 end
 
 function LabelPoint(arg)
@@ -322,10 +320,10 @@ function LabelPoint(arg)
 end
 
 function Stroke()
-	print('stroke')
+	out('stroke')
 end
 function Fill()
-	print('fill')
+	out('fill')
 end
 
 O = point(0,0)
@@ -1,13 +1,159 @@
+#include <algorithm>
+#if __cplusplus >= 201703L
+#include <charconv>
+#endif
+#include <cctype>
+#include <cfloat>
 #include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
 #include <limits>
+#include <new>
+#include <queue>
+#include <set>
+#include <string>
 #include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 extern "C" {
 #include "Cgeom/geom_la.h"
 #include "Cgeom/geom_arc.h"
+#include "Cgeom/geom_predicates.h"
+#include "Cgeom/geom_bvh.h"
 }
 
 namespace CAD2D{
 
+// Size-class pool for vertex buffers. Requests are rounded up to a power
+// of two and freed blocks are kept on a per-class free list for reuse, so
+// scripts that create and drop many temporary shapes stop hitting malloc
+// once the pool has warmed up. Requests above the largest class go
+// straight to malloc. Not thread safe; the kernel runs in one Lua state.
+class BufferPool{
+	enum{
+		MinShift = 6,    // smallest class is 64 bytes
+		NumClasses = 20  // largest class is 32 MB
+	};
+	struct FreeBlock{ FreeBlock *next; };
+	FreeBlock *freelist[NumClasses];
+public:
+	struct Stats{
+		size_t nalloc, nfree;   // Allocate/Deallocate calls
+		size_t nsystem;         // blocks obtained from malloc
+		size_t nlive;           // blocks currently handed out
+		size_t bytes_live;      // bytes in blocks handed out (rounded)
+		size_t bytes_pooled;    // bytes sitting on free lists
+	};
+private:
+	Stats stats;
+	BufferPool(){
+		memset(freelist, 0, sizeof(freelist));
+		memset(&stats, 0, sizeof(stats));
+	}
+	~BufferPool(){ Release(); }
+	// Returns the size class for a request, or -1 if it is too large
+	static int SizeClass(size_t bytes){
+		size_t sz = (size_t)1 << MinShift;
+		for(int c = 0; c < NumClasses; ++c, sz <<= 1){
+			if(bytes <= sz){ return c; }
+		}
+		return -1;
+	}
+	static size_t ClassBytes(int c){ return (size_t)1 << (MinShift+c); }
+public:
+	static BufferPool& Instance(){
+		static BufferPool pool;
+		return pool;
+	}
+	void *Allocate(size_t bytes){
+		stats.nalloc++;
+		stats.nlive++;
+		const int c = SizeClass(bytes);
+		if(c < 0){
+			void *p = malloc(bytes);
+			if(NULL == p){ throw std::bad_alloc(); }
+			stats.nsystem++;
+			stats.bytes_live += bytes;
+			return p;
+		}
+		const size_t sz = ClassBytes(c);
+		stats.bytes_live += sz;
+		if(NULL != freelist[c]){
+			FreeBlock *b = freelist[c];
+			freelist[c] = b->next;
+			stats.bytes_pooled -= sz;
+			return b;
+		}
+		void *p = malloc(sz);
+		if(NULL == p){ throw std::bad_alloc(); }
+		stats.nsystem++;
+		return p;
+	}
+	void Deallocate(void *p, size_t bytes){
+		if(NULL == p){ return; }
+		stats.nfree++;
+		stats.nlive--;
+		const int c = SizeClass(bytes);
+		if(c < 0){
+			stats.bytes_live -= bytes;
+			free(p);
+			return;
+		}
+		const size_t sz = ClassBytes(c);
+		stats.bytes_live -= sz;
+		stats.bytes_pooled += sz;
+		FreeBlock *b = (FreeBlock*)p;
+		b->next = freelist[c];
+		freelist[c] = b;
+	}
+	// Returns all blocks on the free lists to the system
+	void Release(){
+		for(int c = 0; c < NumClasses; ++c){
+			while(NULL != freelist[c]){
+				FreeBlock *b = freelist[c];
+				freelist[c] = b->next;
+				free(b);
+			}
+		}
+		stats.bytes_pooled = 0;
+	}
+	const Stats& GetStats() const{ return stats; }
+};
+
+// Standard allocator interface over BufferPool
+template <class T>
+struct PoolAllocator{
+	typedef T value_type;
+	typedef T* pointer;
+	typedef const T* const_pointer;
+	typedef T& reference;
+	typedef const T& const_reference;
+	typedef size_t size_type;
+	typedef ptrdiff_t difference_type;
+	template <class U> struct rebind{ typedef PoolAllocator<U> other; };
+
+	PoolAllocator(){}
+	template <class U> PoolAllocator(const PoolAllocator<U> &){}
+	pointer address(reference r) const{ return &r; }
+	const_pointer address(const_reference r) const{ return &r; }
+	pointer allocate(size_type n, const void * = 0){
+		return (pointer)BufferPool::Instance().Allocate(n * sizeof(T));
+	}
+	void deallocate(pointer p, size_type n){
+		BufferPool::Instance().Deallocate(p, n * sizeof(T));
+	}
+	size_type max_size() const{ return ((size_t)-1) / sizeof(T); }
+	void construct(pointer p, const T &val){ new(p) T(val); }
+	void destroy(pointer p){ p->~T(); }
+};
+template <class T, class U>
+bool operator==(const PoolAllocator<T> &, const PoolAllocator<U> &){ return true; }
+template <class T, class U>
+bool operator!=(const PoolAllocator<T> &, const PoolAllocator<U> &){ return false; }
+
 struct Point{
 	double x, y;
 private:
@@ -30,23 +176,6 @@ public:
 double Distance(const Point &p, const Point &q){
 	return hypot(p.x - q.x, p.y - q.y);
 }
-struct Matrix{
-	double m[6];
-public:
-	Matrix(){
-		m[0] = 1; m[1] = 0;
-		m[2] = 0; m[3] = 1;
-		m[4] = 0; m[5] = 0;
-	}
-	Matrix(double s, double r, double tx, double ty){
-		double cs = cos(r);
-		double sn = sin(r);
-		m[0] = s* cs; m[1] = s*sn;
-		m[2] = s*-sn; m[3] = s*cs;
-		m[4] = tx;    m[5] = ty;
-	}
-};
-
 struct Direction{
 	double x, y;
 private:
@@ -151,6 +280,82 @@ Vector operator*(const Direction &v, const double &s){
 	return Vector(s*v.x, s*v.y);
 }
 
+// Affine transform in PostScript order [a b c d tx ty]:
+//   x' = a*x + c*y + tx
+//   y' = b*x + d*y + ty
+// A*B is the transform that applies B first, then A.
+struct Matrix{
+	double m[6];
+public:
+	Matrix(){
+		m[0] = 1; m[1] = 0;
+		m[2] = 0; m[3] = 1;
+		m[4] = 0; m[5] = 0;
+	}
+	Matrix(double s, double r, double tx, double ty){
+		double cs = cos(r);
+		double sn = sin(r);
+		m[0] = s* cs; m[1] = s*sn;
+		m[2] = s*-sn; m[3] = s*cs;
+		m[4] = tx;    m[5] = ty;
+	}
+	Matrix(double a, double b, double c, double d, double tx, double ty){
+		m[0] = a;  m[1] = b;
+		m[2] = c;  m[3] = d;
+		m[4] = tx; m[5] = ty;
+	}
+	static Matrix Translation(double dx, double dy){
+		return Matrix(1, 0, 0, 1, dx, dy);
+	}
+	static Matrix Scaling(double sx, double sy){
+		return Matrix(sx, 0, 0, sy, 0, 0);
+	}
+	static Matrix Rotation(double angle){
+		return Matrix(1, angle, 0, 0);
+	}
+	// Reflection across the line through the origin along d
+	static Matrix Reflection(const Direction &d){
+		const double c2 = d.x*d.x - d.y*d.y;
+		const double s2 = 2*d.x*d.y;
+		return Matrix(c2, s2, s2, -c2, 0, 0);
+	}
+	double Determinant() const{
+		return m[0]*m[3] - m[1]*m[2];
+	}
+	// True if the transform maps circles to circles (uniform scale,
+	// rotation, reflection and translation only).
+	bool IsSimilarity() const{
+		const double tol = 1e-12 * (m[0]*m[0] + m[1]*m[1] + m[2]*m[2] + m[3]*m[3]);
+		return
+			fabs(m[0]*m[2] + m[1]*m[3]) <= tol &&
+			fabs((m[0]*m[0] + m[1]*m[1]) - (m[2]*m[2] + m[3]*m[3])) <= tol;
+	}
+	// Caller must check that the determinant is nonzero.
+	Matrix Inverse() const{
+		const double id = 1. / Determinant();
+		const double a =  m[3]*id, b = -m[1]*id;
+		const double c = -m[2]*id, d =  m[0]*id;
+		return Matrix(a, b, c, d, -(a*m[4] + c*m[5]), -(b*m[4] + d*m[5]));
+	}
+	Matrix operator*(const Matrix &B) const{
+		const double *b = B.m;
+		return Matrix(
+			m[0]*b[0] + m[2]*b[1], m[1]*b[0] + m[3]*b[1],
+			m[0]*b[2] + m[2]*b[3], m[1]*b[2] + m[3]*b[3],
+			m[0]*b[4] + m[2]*b[5] + m[4], m[1]*b[4] + m[3]*b[5] + m[5]
+		);
+	}
+	Point operator*(const Point &p) const{
+		return Point(m[0]*p.x + m[2]*p.y + m[4], m[1]*p.x + m[3]*p.y + m[5]);
+	}
+	Vector operator*(const Vector &v) const{
+		return Vector(m[0]*v.x + m[2]*v.y, m[1]*v.x + m[3]*v.y);
+	}
+	Direction operator*(const Direction &v) const{
+		return Direction(m[0]*v.x + m[2]*v.y, m[1]*v.x + m[3]*v.y);
+	}
+};
+
 struct Ray{
 	Point p;
 	Direction d;
@@ -166,6 +371,10 @@ public:
 	}
 	Direction GetDirection() const{ return d; }
 	Point GetPoint() const{ return p; }
+	void Transform(const Matrix &M){
+		p = M*p;
+		d = M*d;
+	}
 };
 
 struct Arcseg{
@@ -215,26 +424,363 @@ public:
 	double Angle() const{
 		return 2*atan(g);
 	}
+	// Reflections reverse the sense of rotation, so the bulge flips sign.
+	// Arcs remain arcs only if M is a similarity.
+	void Transform(const Matrix &M){
+		p = M*p;
+		q = M*q;
+		if(M.Determinant() < 0){ g = -g; }
+	}
+};
+
+// Structure-of-arrays storage for large batches of points. The
+// coordinates are kept in contiguous x[] and y[] arrays so that bulk
+// transforms are simple loops the compiler can vectorize, and so that
+// no per-point Lua userdata is needed.
+struct PointArray{
+	std::vector<double> x, y;
+public:
+	PointArray(){}
+	PointArray(int n):x(n),y(n){}
+	PointArray(const std::vector<Point> &p):x(p.size()),y(p.size()){
+		for(unsigned int i = 0; i < p.size(); ++i){
+			x[i] = p[i].x;
+			y[i] = p[i].y;
+		}
+	}
+	PointArray(const PointArray &a):x(a.x),y(a.y){}
+	PointArray& operator=(const PointArray &a){
+		x = a.x; y = a.y;
+		return *this;
+	}
+	int NumPoints() const{ return (int)x.size(); }
+	Point operator[](int i) const{
+		return Point(x[i], y[i]);
+	}
+	void Append(double px, double py){
+		x.push_back(px);
+		y.push_back(py);
+	}
+	void Translate(double dx, double dy){
+		const int n = x.size();
+		if(0 == n){ return; }
+		double *px = &x[0], *py = &y[0];
+		for(int i = 0; i < n; ++i){
+			px[i] += dx;
+			py[i] += dy;
+		}
+	}
+	void Scale(double s, double cx = 0, double cy = 0){
+		const int n = x.size();
+		if(0 == n){ return; }
+		double *px = &x[0], *py = &y[0];
+		for(int i = 0; i < n; ++i){
+			px[i] = cx + s*(px[i]-cx);
+			py[i] = cy + s*(py[i]-cy);
+		}
+	}
+	void Rotate(double angle, double cx = 0, double cy = 0){
+		const double cs = cos(angle);
+		const double sn = sin(angle);
+		const int n = x.size();
+		if(0 == n){ return; }
+		double *px = &x[0], *py = &y[0];
+		for(int i = 0; i < n; ++i){
+			const double u = px[i]-cx;
+			const double v = py[i]-cy;
+			px[i] = cx + cs*u - sn*v;
+			py[i] = cy + sn*u + cs*v;
+		}
+	}
+	void Transform(const Matrix &M){
+		const double a = M.m[0], b = M.m[1], c = M.m[2], d = M.m[3];
+		const double tx = M.m[4], ty = M.m[5];
+		const int n = x.size();
+		if(0 == n){ return; }
+		double *px = &x[0], *py = &y[0];
+		for(int i = 0; i < n; ++i){
+			const double u = px[i];
+			const double v = py[i];
+			px[i] = a*u + c*v + tx;
+			py[i] = b*u + d*v + ty;
+		}
+	}
+};
+
+// Result of a batched intersection: all hit points in one contiguous
+// array, and for each hit the index of the ray and of the object it hit.
+struct HitArray{
+	PointArray p;
+	std::vector<int> i, j;
+public:
+	int NumHits() const{ return (int)i.size(); }
+	void Reserve(int n){
+		p.x.reserve(n); p.y.reserve(n);
+		i.reserve(n); j.reserve(n);
+	}
+	void Append(double x, double y, int ii, int jj){
+		p.Append(x, y);
+		i.push_back(ii);
+		j.push_back(jj);
+	}
+};
+
+// Returns true if p lies in the circular segment between the chord a-b
+// and the arc with bulge g (g != 0): inside the circle and strictly on the
+// bulge side of the chord. Positive bulges lie to the right of a->b.
+inline bool InArcSegment(const Point &a, const Point &b, double g, const Point &p){
+	const double abx = b.x - a.x;
+	const double aby = b.y - a.y;
+	const double cr = abx*(p.y - a.y) - aby*(p.x - a.x);
+	if(g > 0 ? cr >= 0 : cr <= 0){ return false; }
+	const double dt2 = (1.+g)*(1.-g)/(4.*g);
+	const double cx = 0.5*(a.x + b.x) - dt2 * aby;
+	const double cy = 0.5*(a.y + b.y) + dt2 * abx;
+	const double k = 0.25 * (1./g + g);
+	const double r2 = k*k * (abx*abx + aby*aby);
+	return (p.x-cx)*(p.x-cx) + (p.y-cy)*(p.y-cy) < r2;
+}
+// Parity contribution of the edge a->b with bulge g to the crossing number
+// of the ray from p in the +x direction. An arc crosses the ray as often
+// as its chord does, plus one more time if p lies between chord and arc.
+inline bool EdgeCrossing(const Point &a, const Point &b, double g, const Point &p){
+	bool c = ((a.y > p.y) != (b.y > p.y)) &&
+		(p.x < (b.x - a.x) * (p.y - a.y) / (b.y - a.y) + a.x);
+	if(0 != g && InArcSegment(a, b, g, p)){ c = !c; }
+	return c;
+}
+
+// Acceleration structure for point containment in a Poly. The y-range of
+// the Poly is split into equal bands, and each band lists the edges whose
+// bounding box (including arc bulges) overlaps it, so a query only tests
+// the edges of one band.
+struct PolyIndex{
+	typedef std::pair<Point,double> PointG;
+	bool built;
+	double ymin, ymax, hinv;
+	int nb;
+	std::vector<int> start, list; // CSR: band b holds list[start[b]..start[b+1])
+public:
+	PolyIndex():built(false),ymin(0),ymax(0),hinv(0),nb(0){}
+	void Clear(){
+		built = false;
+		start.clear();
+		list.clear();
+	}
+	void Build(const PointG *v, int n){
+		std::vector<double> ylo(n), yhi(n);
+		for(int i = 0; i < n; ++i){
+			const int j = (i+1 == n) ? 0 : i+1;
+			const double a[2] = { v[i].first.x, v[i].first.y };
+			const double b[2] = { v[j].first.x, v[j].first.y };
+			double xb[2], yb[2];
+			geom_arc_bound_rect(a, b, v[i].second, xb, yb);
+			ylo[i] = yb[0];
+			yhi[i] = yb[1];
+			if(0 == i || yb[0] < ymin){ ymin = yb[0]; }
+			if(0 == i || yb[1] > ymax){ ymax = yb[1]; }
+		}
+		// Halve the band count until edges spanning many bands no
+		// longer blow up the lists.
+		std::vector<int> count;
+		int total;
+		nb = (n/2 > 1 ? n/2 : 1);
+		for(;;){
+			hinv = (ymax > ymin ? nb / (ymax - ymin) : 0);
+			count.assign(nb+1, 0);
+			for(int i = 0; i < n; ++i){
+				count[Band(ylo[i])]++;
+				count[Band(yhi[i])+1]--;
+			}
+			total = 0;
+			for(int b = 0, run = 0; b < nb; ++b){
+				run += count[b];
+				total += run;
+			}
+			if(total <= 16*n || 1 == nb){ break; }
+			nb /= 2;
+		}
+		start.assign(nb+1, 0);
+		for(int i = 0; i < n; ++i){
+			for(int b = Band(ylo[i]); b <= Band(yhi[i]); ++b){ start[b+1]++; }
+		}
+		for(int b = 0; b < nb; ++b){ start[b+1] += start[b]; }
+		list.resize(total);
+		std::vector<int> fill(start.begin(), start.end()-1);
+		for(int i = 0; i < n; ++i){
+			for(int b = Band(ylo[i]); b <= Band(yhi[i]); ++b){ list[fill[b]++] = i; }
+		}
+		built = true;
+	}
+	int Band(double y) const{
+		int b = (int)((y - ymin) * hinv);
+		if(b < 0){ b = 0; }
+		if(b >= nb){ b = nb-1; }
+		return b;
+	}
+	bool Contains(const PointG *v, int n, const Point &p) const{
+		if(!(ymin <= p.y && p.y <= ymax)){ return false; }
+		const int b = Band(p.y);
+		bool c = false;
+		for(int k = start[b]; k < start[b+1]; ++k){
+			const int i = list[k];
+			const int j = (i+1 == n) ? 0 : i+1;
+			if(EdgeCrossing(v[i].first, v[j].first, v[i].second, p)){ c = !c; }
+		}
+		return c;
+	}
+};
+
+// Uniform grid over the edges of a Poly, for finding whether any edge
+// comes within a given distance of a point. Each cell lists the edges
+// whose bounding box (including arc bulges) overlaps it.
+struct PolyEdgeGrid{
+	typedef std::pair<Point,double> PointG;
+	double x0, y0, cs;
+	int nx, ny;
+	std::vector<int> start, list; // CSR: cell c holds list[start[c]..start[c+1])
+	std::vector<double> box;      // per edge: xmin, xmax, ymin, ymax
+	mutable std::vector<int> stamp;
+	mutable int nquery;
+public:
+	// Cells are at least mincell wide, and there are at most about 4
+	// cells per edge.
+	PolyEdgeGrid(const PointG *v, int n, double mincell):box(4*n),stamp(n, 0),nquery(0){
+		double xb[2] = {0,0}, yb[2] = {0,0}, len = 0;
+		for(int i = 0; i < n; ++i){
+			const int j = (i+1 == n) ? 0 : i+1;
+			const double a[2] = { v[i].first.x, v[i].first.y };
+			const double b[2] = { v[j].first.x, v[j].first.y };
+			geom_arc_bound_rect(a, b, v[i].second, &box[4*i+0], &box[4*i+2]);
+			len += geom_arc_length(a, b, v[i].second);
+			if(0 == i || box[4*i+0] < xb[0]){ xb[0] = box[4*i+0]; }
+			if(0 == i || box[4*i+1] > xb[1]){ xb[1] = box[4*i+1]; }
+			if(0 == i || box[4*i+2] < yb[0]){ yb[0] = box[4*i+2]; }
+			if(0 == i || box[4*i+3] > yb[1]){ yb[1] = box[4*i+3]; }
+		}
+		const double w = xb[1] - xb[0], h = yb[1] - yb[0];
+		cs = std::max(mincell, 2*len/std::max(n, 1));
+		cs = std::max(cs, sqrt(w*h / (4.*std::max(n, 1))));
+		if(!(cs > 0)){ cs = 1; }
+		x0 = xb[0]; y0 = yb[0];
+		nx = (int)(w / cs) + 1;
+		ny = (int)(h / cs) + 1;
+		start.assign(nx*ny+1, 0);
+		for(int pass = 0; pass < 2; ++pass){
+			std::vector<int> fill(start.begin(), start.end()-1);
+			for(int i = 0; i < n; ++i){
+				int c0, c1, r0, r1;
+				Cells(&box[4*i], c0, c1, r0, r1);
+				for(int r = r0; r <= r1; ++r){
+					for(int c = c0; c <= c1; ++c){
+						if(0 == pass){ start[r*nx+c+1]++; }
+						else{ list[fill[r*nx+c]++] = i; }
+					}
+				}
+			}
+			if(0 == pass){
+				for(int c = 0; c < nx*ny; ++c){ start[c+1] += start[c]; }
+				list.resize(start[nx*ny]);
+			}
+		}
+	}
+	// Range of cells overlapped by the box b = {xmin, xmax, ymin, ymax}
+	void Cells(const double *b, int &c0, int &c1, int &r0, int &r1) const{
+		c0 = Clamp((int)floor((b[0] - x0) / cs), nx);
+		c1 = Clamp((int)floor((b[1] - x0) / cs), nx);
+		r0 = Clamp((int)floor((b[2] - y0) / cs), ny);
+		r1 = Clamp((int)floor((b[3] - y0) / cs), ny);
+	}
+	static int Clamp(int i, int n){
+		return (i < 0 ? 0 : (i >= n ? n-1 : i));
+	}
+	// Distance from p to edge i
+	double EdgeDistance(const PointG *v, int n, int i, const Point &p) const{
+		const int j = (i+1 == n) ? 0 : i+1;
+		const double a[2] = { v[i].first.x, v[i].first.y };
+		const double b[2] = { v[j].first.x, v[j].first.y };
+		const double q[2] = { p.x, p.y };
+		return geom_arc_distance(a, b, v[i].second, q);
+	}
+	// True if some edge is closer than r to p
+	bool Near(const PointG *v, int n, const Point &p, double r) const{
+		const double qb[4] = { p.x - r, p.x + r, p.y - r, p.y + r };
+		int c0, c1, r0, r1;
+		Cells(qb, c0, c1, r0, r1);
+		if(++nquery == 0){
+			std::fill(stamp.begin(), stamp.end(), 0);
+			nquery = 1;
+		}
+		for(int row = r0; row <= r1; ++row){
+			for(int c = c0; c <= c1; ++c){
+				const int cell = row*nx + c;
+				for(int k = start[cell]; k < start[cell+1]; ++k){
+					const int i = list[k];
+					if(stamp[i] == nquery){ continue; }
+					stamp[i] = nquery;
+					const double *b = &box[4*i];
+					if(b[0] > qb[1] || b[1] < qb[0] || b[2] > qb[3] || b[3] < qb[2]){ continue; }
+					if(EdgeDistance(v, n, i, p) < r){ return true; }
+				}
+			}
+		}
+		return false;
+	}
 };
 
 struct Poly{
 	typedef std::pair<Point,double> PointG;
-	std::vector<PointG> v;
+	typedef std::vector<PointG, PoolAllocator<PointG> > PointGVector;
+	PointGVector v;
 private:
+	// Built on the first containment query of a large Poly
+	mutable PolyIndex index;
+	static const int INDEX_MIN_VERTICES = 32;
 	Poly(){}
 public:
 	Poly(const std::vector<Point> &p){
+		v.reserve(p.size());
 		for(std::vector<Point>::const_iterator i = p.begin(); i != p.end(); ++i){
 			v.push_back(PointG(*i,0));
 		}
 	}
-	Poly(const std::vector<PointG> &v):v(v){}
+	Poly(const PointArray &p){
+		const int n = p.NumPoints();
+		v.reserve(n);
+		for(int i = 0; i < n; ++i){
+			v.push_back(PointG(Point(p.x[i], p.y[i]),0));
+		}
+	}
+	Poly(const std::vector<PointG> &p):v(p.begin(), p.end()){}
 	Poly(const Poly &p):v(p.v){}
+	// Constructs the image of p under M in a single pass.
+	Poly(const Matrix &M, const Poly &p){
+		const double gs = (M.Determinant() < 0 ? -1 : 1);
+		v.reserve(p.v.size());
+		for(PointGVector::const_iterator i = p.v.begin(); i != p.v.end(); ++i){
+			v.push_back(PointG(M*i->first, gs*i->second));
+		}
+	}
 	Poly& operator=(const Poly &p){
 		v = p.v;
+		index.Clear();
 		return *this;
 	}
 	int NumVertices() const{ return (int)v.size(); }
+	bool HasArcs() const{
+		for(PointGVector::const_iterator i = v.begin(); i != v.end(); ++i){
+			if(0 != i->second){ return true; }
+		}
+		return false;
+	}
+	void Transform(const Matrix &M){
+		const double gs = (M.Determinant() < 0 ? -1 : 1);
+		index.Clear();
+		for(PointGVector::iterator i = v.begin(); i != v.end(); ++i){
+			i->first = M*i->first;
+			i->second *= gs;
+		}
+	}
 	Point operator[](int i) const{
 		int n = v.size();
 		i = (i%n);
@@ -248,17 +794,17 @@ public:
 		int j = (i+1)%n;
 		return Arcseg(v[i].first, v[j].first, v[i].second);
 	}
-	bool Contains(const Point &p) const{ // only works for polygons for now
-		unsigned int i, j;
+	bool Contains(const Point &p) const{
+		const int nv = v.size();
+		if(0 == nv){ return false; }
+		if(nv >= INDEX_MIN_VERTICES){
+			if(!index.built){ index.Build(&v[0], nv); }
+			return index.Contains(&v[0], nv, p);
+		}
 		bool c = false;
-		unsigned int nv = v.size();
-		for(i = 0, j = nv-1; i < nv; j = i++){
-			if(
-				((v[i].first.y > p.y) != (v[j].first.y > p.y)) &&
-				(p.x < (v[j].first.x-v[i].first.x) * (p.y-v[i].first.y) / (v[j].first.y-v[i].first.y) + v[i].first.x)
-			){
-				c = !c;
-			}
+		for(int i = 0, j = 1; i < nv; ++i, ++j){
+			if(j == nv){ j = 0; }
+			if(EdgeCrossing(v[i].first, v[j].first, v[i].second, p)){ c = !c; }
 		}
 		return c;
 	}
@@ -272,7 +818,7 @@ public:
 			if(0 != g){
 				double r = (1.+g*g) / (2*g);
 				double t = 0.5*hypot(v[p].first.x-v[q].first.x, v[p].first.y-v[q].first.y);
-				area += r*t*t*(atan(g)*r - 1.);
+				area += t*t*(2*r*r*atan(g) - (1.-g*g)/(2*g));
 			}
 		}
 		return area;
@@ -287,48 +833,1010 @@ public:
 			if(0 == g){
 				perim += t2;
 			}else{
-				perim += 0.5*(1+g*g)*atan(g)/g;
+				perim += t2*(1+g*g)*atan(g)/g;
 			}
 		}
 		return perim;
 	}
-	Poly Offset(double h) const{
-		return Poly(*this);
+	// Bounding box, including arc bulges
+	void Bounds(double xb[2], double yb[2]) const{
+		const int nv = v.size();
+		xb[0] = yb[0] = std::numeric_limits<double>::infinity();
+		xb[1] = yb[1] = -std::numeric_limits<double>::infinity();
+		for(int i = 0, j = 1; i < nv; ++i, ++j){
+			if(j == nv){ j = 0; }
+			const double a[2] = { v[i].first.x, v[i].first.y };
+			const double b[2] = { v[j].first.x, v[j].first.y };
+			double ex[2], ey[2];
+			geom_arc_bound_rect(a, b, v[i].second, ex, ey);
+			xb[0] = std::min(xb[0], ex[0]); xb[1] = std::max(xb[1], ex[1]);
+			yb[0] = std::min(yb[0], ey[0]); yb[1] = std::max(yb[1], ey[1]);
+		}
 	}
+	// Outward (h > 0) or inward (h < 0) offset with rounded corners. The
+	// result can have several loops; they are returned largest first.
+	std::vector<Poly> Offset(double h) const;
 };
 
-Poly operator+(const Poly &p, const Vector &v){
-	Poly ret(p);
-	for(std::vector<Poly::PointG>::iterator i = ret.v.begin(); i != ret.v.end(); ++i){
-		i->first.x += v.x;
-		i->first.y += v.y;
+// Distance from p to the region bounded by the Poly; 0 inside.
+double Distance(const Poly &P, const Point &p){
+	const int nv = P.v.size();
+	if(0 == nv){ return std::numeric_limits<double>::infinity(); }
+	if(P.Contains(p)){ return 0; }
+	const double q[2] = { p.x, p.y };
+	double d = std::numeric_limits<double>::infinity();
+	for(int i = 0, j = 1; i < nv; ++i, ++j){
+		if(j == nv){ j = 0; }
+		const double a[2] = { P.v[i].first.x, P.v[i].first.y };
+		const double b[2] = { P.v[j].first.x, P.v[j].first.y };
+		d = std::min(d, geom_arc_distance(a, b, P.v[i].second, q));
 	}
-	return ret;
+	return d;
 }
-Poly operator-(const Poly &p, const Vector &v){
-	Poly ret(p);
-	for(std::vector<Poly::PointG>::iterator i = ret.v.begin(); i != ret.v.end(); ++i){
-		i->first.x -= v.x;
-		i->first.y -= v.y;
+
+// Reverses the direction of travel of a closed loop of vertices and bulges
+inline void ReverseLoop(std::vector<Poly::PointG> &u){
+	const int n = u.size();
+	std::vector<Poly::PointG> r(u.rbegin(), u.rend());
+	for(int k = 0; k < n; ++k){
+		r[k].second = -u[(2*n-2-k)%n].second;
+	}
+	u.swap(r);
+}
+
+// Removes vertices closer than tol to the next one, which would leave
+// edges without a direction. The bulge of the following edge is kept.
+inline void DropShortEdges(std::vector<Poly::PointG> &u, double tol){
+	std::vector<Poly::PointG> w;
+	w.reserve(u.size());
+	for(unsigned int i = 0; i < u.size(); ++i){
+		if(!w.empty() && Distance(w.back().first, u[i].first) <= tol){
+			w.back().second = u[i].second;
+			continue;
+		}
+		w.push_back(u[i]);
+	}
+	while(w.size() > 1 && Distance(w.back().first, w[0].first) <= tol){ w.pop_back(); }
+	u.swap(w);
+}
+
+// A point where the raw offset curve crosses itself, as the parameter s
+// along raw edge e. Only s = 0, marking a crossing at the start vertex of
+// e, or 0 < s < 1 occur.
+struct OffsetSplit{
+	int e;
+	double s, x, y;
+	bool operator<(const OffsetSplit &o) const{
+		return (e < o.e) || (e == o.e && s < o.s);
+	}
+};
+struct OffsetStartLess{
+	const std::vector<Poly::PointG> &v;
+	const std::vector<int> &first;
+	OffsetStartLess(const std::vector<Poly::PointG> &v, const std::vector<int> &first):v(v),first(first){}
+	bool operator()(int a, int b) const{ return v[first[a]].first.x < v[first[b]].first.x; }
+};
+
+// The raw offset curve is made of the offset of every edge, with an arc
+// about each vertex joining consecutive edges. At convex corners the join
+// rounds the corner; at concave ones it runs backwards and forms a small
+// loop with the overlapping edge offsets. Arcs that shrink past their
+// center turn inside out in the same way.
+//  The true offset boundary is the part of the raw curve whose distance
+// to the outline is |h|; the rest is closer. That can only change where
+// the raw curve crosses itself, so the raw curve is split at its
+// self-intersections, found with the x-sweep of geom_arc_self_intersect,
+// and one point of each chain between crossings is tested against a grid
+// of the outline edges. The kept chains are then relinked at the
+// crossings. For an outline with n edges and k crossings this takes about
+// O((n+k) log n).
+std::vector<Poly> Poly::Offset(double h) const{
+	std::vector<Poly> ret;
+	if(0 == h){
+		ret.push_back(*this);
+		return ret;
+	}
+	std::vector<PointG> u(v.begin(), v.end());
+	DropShortEdges(u, 0);
+	const int n = u.size();
+	if(n < 2){ return ret; }
+	const bool ccw = (Area() >= 0);
+	if(!ccw){ ReverseLoop(u); }
+
+	// With a counterclockwise outline, outward is to the right of each
+	// edge, which is the side geom_arc_offset offsets to for h > 0.
+	std::vector<Vector> ta, tb;
+	std::vector<Point> ao, bo;
+	ta.reserve(n); tb.reserve(n); ao.reserve(n); bo.reserve(n);
+	double xb[2] = { 0, 0 }, yb[2] = { 0, 0 };
+	for(int i = 0; i < n; ++i){
+		const int j = (i+1 == n) ? 0 : i+1;
+		const double a[2] = { u[i].first.x, u[i].first.y };
+		const double b[2] = { u[j].first.x, u[j].first.y };
+		const double g = u[i].second;
+		double p[2], t[2], ebx[2], eby[2];
+		geom_arc_param(a, b, g, 0, p, t);
+		ta.push_back(Vector(t[0], t[1]));
+		geom_arc_param(a, b, g, 1, p, t);
+		tb.push_back(Vector(t[0], t[1]));
+		double oa[2], ob[2];
+		geom_arc_offset(a, b, g, h, oa, ob);
+		ao.push_back(Point(oa[0], oa[1]));
+		bo.push_back(Point(ob[0], ob[1]));
+		geom_arc_bound_rect(a, b, g, ebx, eby);
+		if(0 == i || ebx[0] < xb[0]){ xb[0] = ebx[0]; }
+		if(0 == i || ebx[1] > xb[1]){ xb[1] = ebx[1]; }
+		if(0 == i || eby[0] < yb[0]){ yb[0] = eby[0]; }
+		if(0 == i || eby[1] > yb[1]){ yb[1] = eby[1]; }
+	}
+	const double ah = fabs(h);
+	const double scale = std::max(xb[1] - xb[0], yb[1] - yb[0]) + ah;
+	const double tol = 1e-10 * scale;
+
+	// Raw curve: the join at vertex i runs from the end of offset edge
+	// i-1 to the start of offset edge i and turns through the same angle
+	// as the outline does there. src records the vertex or edge of the
+	// outline each raw edge comes from.
+	std::vector<PointG> raw;
+	std::vector<int> src;
+	raw.reserve(2*n);
+	src.reserve(2*n);
+	for(int i = 0; i < n; ++i){
+		const int im = (0 == i) ? n-1 : i-1;
+		const double phi = atan2(Cross(tb[im], ta[i]), Dot(tb[im], ta[i]));
+		if(Distance(bo[im], ao[i]) > tol){
+			raw.push_back(PointG(bo[im], tan(0.25*phi)));
+			src.push_back(i);
+		}
+		if(Distance(ao[i], bo[i]) > tol){
+			raw.push_back(PointG(ao[i], u[i].second));
+			src.push_back(i);
+		}
+	}
+	const int m = raw.size();
+	if(m < 2){ return ret; }
+
+	// Self-intersections of the raw curve. Consecutive edges always meet
+	// at their shared vertex, which is not a crossing.
+	std::vector<OffsetSplit> splits;
+	{
+		std::vector<double> ra(2*m), rb(2*m), rg(m);
+		for(int i = 0; i < m; ++i){
+			const int j = (i+1 == m) ? 0 : i+1;
+			ra[2*i+0] = raw[i].first.x; ra[2*i+1] = raw[i].first.y;
+			rb[2*i+0] = raw[j].first.x; rb[2*i+1] = raw[j].first.y;
+			rg[i] = raw[i].second;
+		}
+		double *p;
+		int *ij;
+		const int nhit = geom_arc_self_intersect(m, &ra[0], &rb[0], &rg[0], &p, &ij);
+		static const double seps = 1e-9;
+		for(int k = 0; k < nhit; ++k){
+			const int e[2] = { ij[2*k+0], ij[2*k+1] };
+			double s[2];
+			for(int l = 0; l < 2; ++l){
+				s[l] = geom_arc_unparam(&ra[2*e[l]], &rb[2*e[l]], rg[e[l]], &p[2*k]);
+				if(!(s[l] > seps)){ s[l] = 0; }
+				if(s[l] >= 1-seps){ s[l] = 1; }
+			}
+			if(e[1] == e[0]+1 && 1 == s[0] && 0 == s[1]){ continue; }
+			if(0 == e[0] && e[1] == m-1 && 0 == s[0] && 1 == s[1]){ continue; }
+			for(int l = 0; l < 2; ++l){
+				OffsetSplit sp;
+				sp.e = e[l]; sp.s = s[l];
+				if(1 == s[l]){
+					sp.e = (e[l]+1 == m) ? 0 : e[l]+1;
+					sp.s = 0;
+				}
+				sp.x = p[2*k+0]; sp.y = p[2*k+1];
+				splits.push_back(sp);
+			}
+		}
+		if(nhit > 0){
+			free(p);
+			free(ij);
+		}
+	}
+	std::sort(splits.begin(), splits.end());
+
+	// Refine the raw curve at the splits. brk marks the vertices where a
+	// chain between crossings starts.
+	std::vector<PointG> sub;
+	std::vector<int> ssrc;
+	std::vector<char> brk;
+	sub.reserve(m + splits.size());
+	unsigned int isp = 0;
+	for(int e = 0; e < m; ++e){
+		const double g = raw[e].second;
+		const double q = atan(g);
+		bool atstart = false;
+		while(isp < splits.size() && splits[isp].e == e && 0 == splits[isp].s){
+			atstart = true;
+			++isp;
+		}
+		sub.push_back(PointG(raw[e].first, g));
+		ssrc.push_back(src[e]);
+		brk.push_back(atstart);
+		double s0 = 0;
+		while(isp < splits.size() && splits[isp].e == e){
+			const OffsetSplit &sp = splits[isp++];
+			if(sp.s - s0 <= 1e-12){ continue; }
+			sub.back().second = (0 == g ? 0 : tan((sp.s - s0) * q));
+			sub.push_back(PointG(Point(sp.x, sp.y), 0));
+			ssrc.push_back(src[e]);
+			brk.push_back(1);
+			s0 = sp.s;
+		}
+		sub.back().second = (0 == g ? 0 : tan((1 - s0) * q));
+	}
+	const int ns = sub.size();
+
+	// Chains run from one break to the next; without any crossings the
+	// whole raw curve is one chain.
+	std::vector<int> first;
+	for(int k = 0; k < ns; ++k){
+		if(brk[k]){ first.push_back(k); }
+	}
+	if(first.empty()){ first.push_back(0); }
+	const int nc = first.size();
+
+	// Keep the chains whose middle lies at distance |h| from the outline.
+	// The outline edges next to the source of the tested raw edge are the
+	// likeliest to be too close, so they are tried before the grid.
+	const PolyEdgeGrid grid(&u[0], n, 0.5*ah);
+	const double rtest = ah - (1e-9*ah + 1e-12*scale);
+	std::vector<char> keep(nc);
+	for(int c = 0; c < nc; ++c){
+		const int len = (c+1 < nc ? first[c+1] : first[0] + ns) - first[c];
+		const int k = (first[c] + len/2) % ns;
+		const int kn = (k+1 == ns) ? 0 : k+1;
+		const double a[2] = { sub[k].first.x, sub[k].first.y };
+		const double b[2] = { sub[kn].first.x, sub[kn].first.y };
+		double pm[2];
+		geom_arc_param(a, b, sub[k].second, 0.5, pm, NULL);
+		const Point mid(pm[0], pm[1]);
+		bool near = false;
+		for(int di = -1; di <= 1 && !near; ++di){
+			const int i = (ssrc[k] + di + n) % n;
+			near = (grid.EdgeDistance(&u[0], n, i, mid) < rtest);
+		}
+		keep[c] = !(near || grid.Near(&u[0], n, mid, rtest));
+	}
+
+	// Link each kept chain to the kept chain starting where it ends
+	std::vector<int> starts;
+	for(int c = 0; c < nc; ++c){
+		if(keep[c]){ starts.push_back(c); }
+	}
+	std::sort(starts.begin(), starts.end(), OffsetStartLess(sub, first));
+	std::vector<char> used(nc, 0);
+	std::vector<int> next(nc, -1);
+	const double ltol = 1e-9 * scale;
+	for(int c = 0; c < nc; ++c){
+		if(!keep[c]){ continue; }
+		const Point &pe = sub[(c+1 < nc) ? first[c+1] : first[0]].first;
+		std::vector<int>::const_iterator it = starts.begin();
+		int lo = 0, hi = starts.size();
+		while(lo < hi){
+			const int mi = (lo+hi)/2;
+			if(sub[first[starts[mi]]].first.x < pe.x - ltol){ lo = mi+1; }else{ hi = mi; }
+		}
+		int best = -1;
+		double dbest = ltol;
+		for(it = starts.begin() + lo; it != starts.end() && sub[first[*it]].first.x <= pe.x + ltol; ++it){
+			if(used[*it]){ continue; }
+			const double dd = Distance(sub[first[*it]].first, pe);
+			if(dd <= dbest){ best = *it; dbest = dd; }
+		}
+		if(best >= 0){
+			used[best] = 1;
+			next[c] = best;
+		}
+	}
+
+	// Every chain has at most one successor and one predecessor, so the
+	// links form cycles and open paths. A path can only come from a
+	// crossing that was missed or mislinked; it does not bound anything,
+	// so its chains are dropped rather than closed up. Paths are walked
+	// from their heads first, so that no cycle is entered midway.
+	std::vector<char> done(nc, 0);
+	for(int c0 = 0; c0 < nc; ++c0){
+		if(!keep[c0] || used[c0]){ continue; }
+		for(int c = c0; c >= 0 && !done[c]; c = next[c]){ done[c] = 1; }
+	}
+
+	// Walk the links to assemble the loops
+	std::vector<double> area;
+	for(int c0 = 0; c0 < nc; ++c0){
+		if(!keep[c0] || done[c0]){ continue; }
+		std::vector<PointG> loop;
+		int c = c0;
+		do{
+			done[c] = 1;
+			const int k1 = (c+1 < nc) ? first[c+1] : first[0] + ns;
+			for(int k = first[c]; k < k1; ++k){
+				loop.push_back(sub[k % ns]);
+			}
+			c = next[c];
+		}while(c >= 0 && !done[c]);
+		if(c != c0){ continue; }
+		DropShortEdges(loop, tol);
+		if(loop.size() < 2){ continue; }
+		if(!ccw){ ReverseLoop(loop); }
+		Poly P(loop);
+		const double a = P.Area();
+		if(fabs(a) <= 1e-12 * scale*scale){ continue; }
+		ret.push_back(P);
+		area.push_back(fabs(a));
+	}
+	// Largest loop first
+	for(unsigned int i = 1; i < ret.size(); ++i){
+		for(unsigned int j = i; j > 0 && area[j] > area[j-1]; --j){
+			std::swap(area[j], area[j-1]);
+			std::swap(ret[j], ret[j-1]);
+		}
 	}
 	return ret;
 }
+
+Poly operator*(const Matrix &M, const Poly &p){
+	return Poly(M, p);
+}
+Poly operator+(const Poly &p, const Vector &v){
+	return Poly(Matrix::Translation(v.x, v.y), p);
+}
+Poly operator-(const Poly &p, const Vector &v){
+	return Poly(Matrix::Translation(-v.x, -v.y), p);
+}
 Poly operator*(const double &s, const Poly &p){
-	Poly ret(p);
-	for(std::vector<Poly::PointG>::iterator i = ret.v.begin(); i != ret.v.end(); ++i){
-		i->first.x *= s;
-		i->first.y *= s;
+	return Poly(Matrix::Scaling(s, s), p);
+}
+Poly operator*(const Poly &p, const double &s){
+	return s*p;
+}
+Poly operator/(const Poly &p, const double &s){
+	return Poly(Matrix::Scaling(1./s, 1./s), p);
+}
+
+// Boolean operations on sets of polys with line and arc edges. Each
+// operand is the region enclosed by its polys under the nonzero winding
+// rule, so holes are given as oppositely oriented loops.
+enum PolyBoolOp{ POLY_UNION, POLY_INTERSECTION, POLY_DIFFERENCE };
+
+// An x-monotone piece of an input edge, as split by geom_arc_split_monotone
+struct BoolPiece{
+	double a[2], b[2], g;
+	int op;
+	double xb[2], yb[2];
+};
+// A point where a piece meets another piece, as its parameter s along
+// the piece. The piece endpoints are included as s = 0 and s = 1.
+struct BoolCut{
+	int piece;
+	double s, p[2];
+	bool operator<(const BoolCut &o) const{
+		return (piece < o.piece) || (piece == o.piece && s < o.s);
+	}
+};
+// An edge of the arrangement of all input edges. It runs from its
+// lexicographically smaller vertex v[0] to v[1] with bulge g. Fragments
+// only meet at their endpoints. w holds, for each operand, the change in
+// winding number when crossing the fragment upwards and above the winding
+// number just above it. Arcs also keep their center and midpoint.
+struct BoolFragment{
+	int v[2];
+	double g;
+	int w[2], above[2];
+	double c[2], m[2];
+};
+
+inline bool BoolLexLess(const double a[2], const double b[2]){
+	return (a[0] < b[0]) || (a[0] == b[0] && a[1] < b[1]);
+}
+
+// Direction of travel (left to right) of fragment e at the point p on it
+inline void BoolTangent(const BoolFragment &e, const double *vp, const double p[2], double t[2]){
+	if(0 == e.g){
+		t[0] = vp[2*e.v[1]+0] - vp[2*e.v[0]+0];
+		t[1] = vp[2*e.v[1]+1] - vp[2*e.v[0]+1];
+	}else{
+		// Positive bulges turn counterclockwise about the center
+		const double s = (e.g > 0 ? 1 : -1);
+		t[0] = -s*(p[1] - e.c[1]);
+		t[1] =  s*(p[0] - e.c[0]);
+	}
+}
+
+// Signed curvature of fragment e, positive when turning left
+inline double BoolCurvature(const BoolFragment &e, const double *vp){
+	if(0 == e.g){ return 0; }
+	const double *a = &vp[2*e.v[0]];
+	return (e.g > 0 ? 1 : -1) / hypot(a[0] - e.c[0], a[1] - e.c[1]);
+}
+
+// Returns +1 if fragment f leaves the point p, which lies on both e and f,
+// above e, and -1 if below. The steeper tangent is above; tangent
+// fragments are ordered by how sharply they turn left. Returns 0 if the
+// two cannot be told apart.
+inline int BoolOrderAt(const BoolFragment &e, const BoolFragment &f, const double *vp, const double p[2]){
+	if(0 == e.g && 0 == f.g){
+		const double o = geom_orient2d(&vp[2*e.v[0]], &vp[2*e.v[1]], &vp[2*f.v[1]]);
+		return (o > 0) - (o < 0);
+	}
+	double te[2], tf[2];
+	BoolTangent(e, vp, p, te);
+	BoolTangent(f, vp, p, tf);
+	const double cr = te[0]*tf[1] - te[1]*tf[0];
+	if(fabs(cr) > 1e-9 * hypot(te[0], te[1]) * hypot(tf[0], tf[1])){
+		return (cr > 0) ? 1 : -1;
+	}
+	// Arcs leaving straight up and straight down
+	if(te[0]*tf[0] + te[1]*tf[1] < 0){
+		return (tf[1] > te[1]) ? 1 : -1;
+	}
+	const double ke = BoolCurvature(e, vp), kf = BoolCurvature(f, vp);
+	return (kf > ke) - (kf < ke);
+}
+
+// Returns +1 if the point p lies above fragment e, -1 if below and 0 if
+// on it. p must lie within the x-range of e.
+inline int BoolSide(const BoolFragment &e, const double *vp, const double p[2]){
+	const double *a = &vp[2*e.v[0]];
+	const double *b = &vp[2*e.v[1]];
+	if(0 == e.g){
+		const double o = geom_orient2d(a, b, p);
+		return (o > 0) - (o < 0);
+	}
+	// Going left to right, positive bulges follow the lower half of the
+	// circle and negative bulges the upper half.
+	const double ic = (e.g > 0) ? geom_incircle2d(a, e.m, b, p) : geom_incircle2d(b, e.m, a, p);
+	if(e.g > 0){
+		if(p[1] >= e.c[1] || ic > 0){ return 1; }
+		return (ic < 0) ? -1 : 0;
+	}else{
+		if(p[1] <= e.c[1] || ic > 0){ return -1; }
+		return (ic < 0) ? 1 : 0;
+	}
+}
+
+// Order of the sweep line status, from bottom to top. Fragments are only
+// compared while both cross the sweep line, so the one that starts later
+// is located relative to the other at its start.
+struct BoolStatusLess{
+	const BoolFragment *f;
+	const double *vp;
+	BoolStatusLess(const BoolFragment *f, const double *vp):f(f),vp(vp){}
+	bool operator()(int a, int b) const{
+		if(a == b){ return false; }
+		const BoolFragment &fa = f[a], &fb = f[b];
+		const double *pa = &vp[2*fa.v[0]];
+		const double *pb = &vp[2*fb.v[0]];
+		int s; // +1 if b is above a
+		if(fa.v[0] == fb.v[0]){
+			s = BoolOrderAt(fa, fb, vp, pa);
+		}else if(BoolLexLess(pa, pb)){
+			s = BoolSide(fa, vp, pb);
+			if(0 == s){ s = BoolOrderAt(fa, fb, vp, pb); }
+		}else{
+			s = -BoolSide(fb, vp, pa);
+			if(0 == s){ s = -BoolOrderAt(fb, fa, vp, pa); }
+		}
+		if(0 == s){ return a < b; }
+		return (s > 0);
+	}
+};
+
+// An edge of the result, directed with the result on its left
+struct BoolEdge{
+	int from, to;
+	double g;
+};
+struct BoolEvent{
+	int v, type, f; // type 0 removes fragment f, 1 inserts it
+};
+struct BoolEventLess{
+	const double *vp;
+	BoolEventLess(const double *vp):vp(vp){}
+	bool operator()(const BoolEvent &a, const BoolEvent &b) const{
+		if(a.v != b.v){ return BoolLexLess(&vp[2*a.v], &vp[2*b.v]); }
+		return a.type < b.type;
+	}
+};
+struct BoolFragmentLess{
+	const std::vector<BoolFragment> &f;
+	BoolFragmentLess(const std::vector<BoolFragment> &f):f(f){}
+	bool operator()(int a, int b) const{
+		if(f[a].v[0] != f[b].v[0]){ return f[a].v[0] < f[b].v[0]; }
+		if(f[a].v[1] != f[b].v[1]){ return f[a].v[1] < f[b].v[1]; }
+		return f[a].g < f[b].g;
+	}
+};
+
+// Merges points closer than tol, which are hashed into a grid of cells
+// of size 4*tol. On return vert[i] is the vertex of point i, and vp holds
+// the coordinates of each vertex.
+struct BoolSnapKey{
+	long long ix, iy;
+	int i;
+	bool operator<(const BoolSnapKey &o) const{
+		return (ix < o.ix) || (ix == o.ix && (iy < o.iy || (iy == o.iy && i < o.i)));
+	}
+};
+inline int BoolFind(std::vector<int> &parent, int i){
+	while(parent[i] != i){
+		parent[i] = parent[parent[i]];
+		i = parent[i];
+	}
+	return i;
+}
+inline void BoolSnap(const std::vector<BoolCut> &cut, double tol, std::vector<int> &vert, std::vector<double> &vp){
+	const int n = cut.size();
+	const double cs = 4*tol;
+	std::vector<BoolSnapKey> key(n);
+	std::vector<int> parent(n);
+	for(int i = 0; i < n; ++i){
+		key[i].ix = (long long)floor(cut[i].p[0] / cs);
+		key[i].iy = (long long)floor(cut[i].p[1] / cs);
+		key[i].i = i;
+		parent[i] = i;
+	}
+	std::sort(key.begin(), key.end());
+	for(int k = 0; k < n; ++k){
+		const int i = key[k].i;
+		for(long long dx = 0; dx <= 1; ++dx){
+			for(long long dy = (0 == dx ? 0 : -1); dy <= 1; ++dy){
+				BoolSnapKey lo;
+				lo.ix = key[k].ix + dx; lo.iy = key[k].iy + dy; lo.i = (0 == dx && 0 == dy) ? i+1 : -1;
+				for(std::vector<BoolSnapKey>::const_iterator it = std::lower_bound(key.begin(), key.end(), lo);
+					it != key.end() && it->ix == lo.ix && it->iy == lo.iy; ++it
+				){
+					const int j = it->i;
+					if(hypot(cut[i].p[0]-cut[j].p[0], cut[i].p[1]-cut[j].p[1]) <= tol){
+						parent[BoolFind(parent, i)] = BoolFind(parent, j);
+					}
+				}
+			}
+		}
+	}
+	vert.assign(n, -1);
+	vp.clear();
+	std::vector<int> id(n, -1);
+	for(int i = 0; i < n; ++i){
+		const int r = BoolFind(parent, i);
+		if(id[r] < 0){
+			id[r] = vp.size()/2;
+			vp.push_back(cut[r].p[0]);
+			vp.push_back(cut[r].p[1]);
+		}
+		vert[i] = id[r];
+	}
+}
+
+// Intervals [lo,hi] of y, identified by integers, under insertion and
+// removal: a centered interval tree over a fixed set of keys, which are
+// the lower ends of all the intervals that will be inserted. The keys
+// form an implicit balanced tree. An interval is kept at the highest node
+// whose key it contains, sorted there by both of its ends, and also in a
+// list sorted by its lower end. Finding the m intervals that meet a query
+// interval then takes O(log n + m) time.
+struct BoolIntervalTree{
+	typedef std::set<std::pair<double,int> > List;
+	std::vector<double> key;
+	std::vector<List> bylo, byhi;
+	List all; // by lower end
+	BoolIntervalTree(const std::vector<double> &lo):key(lo){
+		std::sort(key.begin(), key.end());
+		key.erase(std::unique(key.begin(), key.end()), key.end());
+		bylo.resize(key.size());
+		byhi.resize(key.size());
+	}
+	int Node(double lo, double hi) const{
+		int a = 0, b = key.size();
+		while(a < b){
+			const int m = (a + b) / 2;
+			if(hi < key[m]){ b = m; }
+			else if(lo > key[m]){ a = m+1; }
+			else{ return m; }
+		}
+		return -1; // lo is not a key
+	}
+	void Insert(int id, double lo, double hi){
+		const int m = Node(lo, hi);
+		bylo[m].insert(std::make_pair(lo, id));
+		byhi[m].insert(std::make_pair(hi, id));
+		all.insert(std::make_pair(lo, id));
+	}
+	void Remove(int id, double lo, double hi){
+		const int m = Node(lo, hi);
+		bylo[m].erase(std::make_pair(lo, id));
+		byhi[m].erase(std::make_pair(hi, id));
+		all.erase(std::make_pair(lo, id));
+	}
+	// Appends the intervals meeting [lo,hi]: those containing lo, then
+	// those starting above lo, up to hi.
+	void Query(double lo, double hi, std::vector<int> &out) const{
+		int a = 0, b = key.size();
+		while(a < b){
+			const int m = (a + b) / 2;
+			if(lo < key[m]){
+				for(List::const_iterator it = bylo[m].begin(); it != bylo[m].end() && it->first <= lo; ++it){
+					out.push_back(it->second);
+				}
+				b = m;
+			}else if(lo > key[m]){
+				for(List::const_reverse_iterator it = byhi[m].rbegin(); it != byhi[m].rend() && it->first >= lo; ++it){
+					out.push_back(it->second);
+				}
+				a = m+1;
+			}else{
+				for(List::const_iterator it = bylo[m].begin(); it != bylo[m].end(); ++it){
+					out.push_back(it->second);
+				}
+				break;
+			}
+		}
+		for(List::const_iterator it = all.upper_bound(std::make_pair(lo, std::numeric_limits<int>::max()));
+			it != all.end() && it->first <= hi; ++it
+		){
+			out.push_back(it->second);
+		}
+	}
+};
+
+// Merges the edge a-b-c of a loop, with bulges g1 and g2, into a single
+// edge when both lie on the same line or circle. Arcs are merged up to a
+// half circle.
+inline bool BoolMergeable(const Poly::PointG &a, const Poly::PointG &b, const Point &c, double tol, double *g){
+	const double g1 = a.second, g2 = b.second;
+	const Vector u = b.first - a.first, v = c - b.first;
+	if(0 == g1 && 0 == g2){
+		const double l = hypot(u.x + v.x, u.y + v.y);
+		if(Dot(u, v) <= 0 || fabs(Cross(u, v)) > tol * l){ return false; }
+		*g = 0;
+		return true;
+	}
+	if(0 == g1 || 0 == g2 || (g1 > 0) != (g2 > 0)){ return false; }
+	const double q = atan(g1) + atan(g2);
+	if(fabs(q) > 0.25*M_PI * (1 + 1e-12)){ return false; }
+	const Arcseg s1(a.first, b.first, g1), s2(b.first, c, g2);
+	if(Distance(s1.Center(), s2.Center()) > tol || fabs(s1.Radius() - s2.Radius()) > tol){ return false; }
+	*g = tan(q);
+	return true;
+}
+inline void BoolMergeLoop(std::vector<Poly::PointG> &u, double tol){
+	const int n = u.size();
+	std::vector<Poly::PointG> m;
+	m.reserve(n);
+	double g;
+	for(int i = 0; i < n; ++i){
+		m.push_back(u[i]);
+		const Point &next = u[(i+1)%n].first;
+		while(m.size() >= 2 && BoolMergeable(m[m.size()-2], m.back(), next, tol, &g)){
+			m.pop_back();
+			m.back().second = g;
+		}
+	}
+	// Merge across the start of the loop
+	while(m.size() > 2 && BoolMergeable(m.back(), m[0], m[1].first, tol, &g)){
+		m.back().second = g;
+		m.erase(m.begin());
+	}
+	u.swap(m);
+}
+
+// The input edges are split into x-monotone pieces, and the pieces are
+// cut where they cross or touch each other. Candidate pairs are the pieces
+// whose bounding boxes meet, found by a sweep over the x-extents of the
+// pieces that keeps the y-extents of those crossing the sweep line in an
+// interval tree. After merging nearby cut points
+// into vertices, the cut pieces form fragments that only meet at their
+// endpoints; coincident fragments are merged, adding their windings. A
+// Bentley-Ottmann sweep over the fragment endpoints then keeps the
+// fragments crossing the sweep line ordered bottom to top, which gives
+// the winding numbers on both sides of each fragment from the one below
+// it. Fragments with the result on one side only are linked into loops,
+// taking the sharpest left turn at vertices where several meet. This
+// costs O((n+k+m) log n) for n edges, k crossings and m pairs of pieces
+// whose boxes meet; for x-monotone pieces m is rarely much more than k.
+std::vector<Poly> PolyBoolean(
+	const std::vector<const Poly*> &A, const std::vector<const Poly*> &B,
+	PolyBoolOp op
+){
+	std::vector<Poly> ret;
+	std::vector<BoolPiece> pc;
+	double xb[2] = { 0, 0 }, yb[2] = { 0, 0 };
+	for(int k = 0; k < 2; ++k){
+		const std::vector<const Poly*> &S = (0 == k ? A : B);
+		for(unsigned int ip = 0; ip < S.size(); ++ip){
+			const Poly::PointGVector &v = S[ip]->v;
+			const int n = v.size();
+			for(int i = 0; i < n; ++i){
+				const int j = (i+1 == n) ? 0 : i+1;
+				const double a[2] = { v[i].first.x, v[i].first.y };
+				const double b[2] = { v[j].first.x, v[j].first.y };
+				if(a[0] == b[0] && a[1] == b[1]){ continue; }
+				double pg[18];
+				const int ns = geom_arc_split_monotone(a, b, v[i].second, pg);
+				for(int l = 0; l < ns; ++l){
+					BoolPiece P;
+					P.a[0] = pg[3*l+0]; P.a[1] = pg[3*l+1];
+					P.b[0] = pg[3*l+3]; P.b[1] = pg[3*l+4];
+					P.g = pg[3*l+2];
+					P.op = k;
+					geom_arc_bound_rect(P.a, P.b, P.g, P.xb, P.yb);
+					if(pc.empty() || P.xb[0] < xb[0]){ xb[0] = P.xb[0]; }
+					if(pc.empty() || P.xb[1] > xb[1]){ xb[1] = P.xb[1]; }
+					if(pc.empty() || P.yb[0] < yb[0]){ yb[0] = P.yb[0]; }
+					if(pc.empty() || P.yb[1] > yb[1]){ yb[1] = P.yb[1]; }
+					pc.push_back(P);
+				}
+			}
+		}
+	}
+	const int npc = pc.size();
+	if(0 == npc){ return ret; }
+	const double scale = std::max(
+		std::max(xb[1] - xb[0], yb[1] - yb[0]),
+		std::max(std::max(fabs(xb[0]), fabs(xb[1])), std::max(fabs(yb[0]), fabs(yb[1])))
+	);
+	// Crossings of tangent curves are only accurate to about sqrt(eps)
+	const double tol = 1e-8 * scale;
+
+	// Cut points: the piece endpoints, crossings, and endpoints of one
+	// piece lying on another, which covers overlapping edges.
+	std::vector<BoolCut> cut;
+	cut.reserve(2*npc);
+	for(int i = 0; i < npc; ++i){
+		BoolCut c;
+		c.piece = i;
+		c.s = 0; c.p[0] = pc[i].a[0]; c.p[1] = pc[i].a[1];
+		cut.push_back(c);
+		c.s = 1; c.p[0] = pc[i].b[0]; c.p[1] = pc[i].b[1];
+		cut.push_back(c);
+	}
+	{
+		std::vector<std::pair<double,int> > xs(npc);
+		std::vector<double> ylo(npc);
+		for(int i = 0; i < npc; ++i){
+			xs[i] = std::make_pair(pc[i].xb[0], i);
+			ylo[i] = pc[i].yb[0];
+		}
+		std::sort(xs.begin(), xs.end());
+		std::vector<int> rank(npc);
+		for(int k = 0; k < npc; ++k){ rank[xs[k].second] = k; }
+		// Pieces whose x-extent reaches the sweep line, and when they leave
+		BoolIntervalTree active(ylo);
+		std::priority_queue<std::pair<double,int>, std::vector<std::pair<double,int> >, std::greater<std::pair<double,int> > > expire;
+		std::vector<int> cand;
+		for(int k = 0; k < npc; ++k){
+			const int i = xs[k].second;
+			const BoolPiece &P = pc[i];
+			while(!expire.empty() && expire.top().first < P.xb[0] - tol){
+				const int j = expire.top().second;
+				expire.pop();
+				active.Remove(j, pc[j].yb[0], pc[j].yb[1]);
+			}
+			// Taken in sweep order, so the cuts do not depend on the tree
+			cand.clear();
+			active.Query(P.yb[0] - tol, P.yb[1] + tol, cand);
+			for(unsigned int l = 0; l < cand.size(); ++l){ cand[l] = rank[cand[l]]; }
+			std::sort(cand.begin(), cand.end());
+			for(unsigned int l = 0; l < cand.size(); ++l){
+				const int j = xs[cand[l]].second;
+				const BoolPiece &Q = pc[j];
+				double q[4];
+				const int nq = geom_arc_intersect(P.a, P.b, P.g, Q.a, Q.b, Q.g, q);
+				for(int iq = 0; iq < nq; ++iq){
+					BoolCut c;
+					c.p[0] = q[2*iq+0]; c.p[1] = q[2*iq+1];
+					c.piece = i; c.s = geom_arc_unparam(P.a, P.b, P.g, c.p);
+					cut.push_back(c);
+					c.piece = j; c.s = geom_arc_unparam(Q.a, Q.b, Q.g, c.p);
+					cut.push_back(c);
+				}
+				for(int l2 = 0; l2 < 4; ++l2){
+					const BoolPiece &X = (l2 < 2) ? P : Q;
+					const BoolPiece &Y = (l2 < 2) ? Q : P;
+					const double *e = (l2 % 2) ? X.b : X.a;
+					if(geom_arc_distance(Y.a, Y.b, Y.g, e) > tol){ continue; }
+					BoolCut c;
+					c.piece = (l2 < 2) ? j : i;
+					c.p[0] = e[0]; c.p[1] = e[1];
+					c.s = geom_arc_unparam(Y.a, Y.b, Y.g, e);
+					cut.push_back(c);
+				}
+			}
+			active.Insert(i, P.yb[0], P.yb[1]);
+			expire.push(std::make_pair(P.xb[1], i));
+		}
+	}
+	// Points near the ends of a piece can have their parameter wrap
+	// around the circle, so they are pinned to the ends.
+	for(unsigned int i = 0; i < cut.size(); ++i){
+		const BoolPiece &P = pc[cut[i].piece];
+		if(hypot(cut[i].p[0] - P.a[0], cut[i].p[1] - P.a[1]) <= tol){ cut[i].s = 0; }
+		else if(hypot(cut[i].p[0] - P.b[0], cut[i].p[1] - P.b[1]) <= tol){ cut[i].s = 1; }
+		else if(!(cut[i].s > 0)){ cut[i].s = 0; }
+		else if(cut[i].s > 1){ cut[i].s = 1; }
+	}
+	std::sort(cut.begin(), cut.end());
+	std::vector<int> vert;
+	std::vector<double> vp;
+	BoolSnap(cut, tol, vert, vp);
+
+	// Fragments between consecutive cuts of each piece
+	std::vector<BoolFragment> frag;
+	for(unsigned int k = 0; k+1 < cut.size(); ++k){
+		if(cut[k].piece != cut[k+1].piece || vert[k] == vert[k+1]){ continue; }
+		const BoolPiece &P = pc[cut[k].piece];
+		BoolFragment F;
+		F.v[0] = vert[k]; F.v[1] = vert[k+1];
+		F.g = (0 == P.g) ? 0 : tan((cut[k+1].s - cut[k].s) * atan(P.g));
+		F.w[0] = F.w[1] = 0;
+		F.w[P.op] = 1;
+		if(BoolLexLess(&vp[2*F.v[1]], &vp[2*F.v[0]])){
+			std::swap(F.v[0], F.v[1]);
+			F.g = -F.g;
+			F.w[P.op] = -1;
+		}
+		frag.push_back(F);
+	}
+	// Coincident fragments are merged into one carrying both windings
+	{
+		std::vector<int> order(frag.size());
+		for(unsigned int i = 0; i < frag.size(); ++i){ order[i] = i; }
+		std::sort(order.begin(), order.end(), BoolFragmentLess(frag));
+		std::vector<BoolFragment> merged;
+		merged.reserve(frag.size());
+		for(unsigned int k = 0; k < order.size(); ++k){
+			const BoolFragment &F = frag[order[k]];
+			if(!merged.empty()){
+				BoolFragment &M = merged.back();
+				if(M.v[0] == F.v[0] && M.v[1] == F.v[1] && fabs(M.g - F.g) <= 1e-9*(1 + fabs(F.g))){
+					M.w[0] += F.w[0];
+					M.w[1] += F.w[1];
+					continue;
+				}
+			}
+			merged.push_back(F);
+		}
+		frag.clear();
+		for(unsigned int k = 0; k < merged.size(); ++k){
+			if(0 != merged[k].w[0] || 0 != merged[k].w[1]){ frag.push_back(merged[k]); }
+		}
+	}
+	const int nf = frag.size();
+	for(int i = 0; i < nf; ++i){
+		BoolFragment &F = frag[i];
+		F.above[0] = F.above[1] = 0;
+		if(0 != F.g){
+			const double *a = &vp[2*F.v[0]];
+			const double *b = &vp[2*F.v[1]];
+			const Point c = Arcseg(Point(a[0], a[1]), Point(b[0], b[1]), F.g).Center();
+			F.c[0] = c.x; F.c[1] = c.y;
+			geom_arc_param(a, b, F.g, 0.5, F.m, NULL);
+		}
+	}
+
+	// Sweep over the fragment endpoints
+	{
+		std::vector<BoolEvent> ev(2*nf);
+		for(int i = 0; i < nf; ++i){
+			ev[2*i+0].v = frag[i].v[0]; ev[2*i+0].type = 1; ev[2*i+0].f = i;
+			ev[2*i+1].v = frag[i].v[1]; ev[2*i+1].type = 0; ev[2*i+1].f = i;
+		}
+		std::sort(ev.begin(), ev.end(), BoolEventLess(&vp[0]));
+		const BoolStatusLess less(&frag[0], &vp[0]);
+		typedef std::set<int, BoolStatusLess> Status;
+		Status status(less);
+		std::vector<Status::iterator> pos(nf);
+		std::vector<int> group;
+		for(unsigned int k = 0; k < ev.size(); ){
+			const int v = ev[k].v;
+			for(; k < ev.size() && ev[k].v == v && 0 == ev[k].type; ++k){
+				status.erase(pos[ev[k].f]);
+			}
+			group.clear();
+			for(; k < ev.size() && ev[k].v == v; ++k){
+				pos[ev[k].f] = status.insert(ev[k].f).first;
+				group.push_back(ev[k].f);
+			}
+			std::sort(group.begin(), group.end(), less);
+			for(unsigned int l = 0; l < group.size(); ++l){
+				BoolFragment &F = frag[group[l]];
+				Status::iterator it = pos[group[l]];
+				int below[2] = { 0, 0 };
+				if(it != status.begin()){
+					--it;
+					below[0] = frag[*it].above[0];
+					below[1] = frag[*it].above[1];
+				}
+				F.above[0] = below[0] + F.w[0];
+				F.above[1] = below[1] + F.w[1];
+			}
+		}
+	}
+
+	// Boundary edges of the result, directed with the result on the left
+	std::vector<BoolEdge> edge;
+	std::vector<std::pair<std::pair<int,double>,int> > half; // ((vertex, angle), 2*edge + isout)
+	for(int i = 0; i < nf; ++i){
+		const BoolFragment &F = frag[i];
+		bool in[2];
+		for(int l = 0; l < 2; ++l){
+			const int wa = (0 == l) ? F.above[0] : F.above[0] - F.w[0];
+			const int wb = (0 == l) ? F.above[1] : F.above[1] - F.w[1];
+			switch(op){
+			case POLY_UNION:        in[l] = (0 != wa || 0 != wb); break;
+			case POLY_INTERSECTION: in[l] = (0 != wa && 0 != wb); break;
+			default:                in[l] = (0 != wa && 0 == wb); break;
+			}
+		}
+		if(in[0] == in[1]){ continue; }
+		BoolEdge E;
+		if(in[0]){
+			E.from = F.v[0]; E.to = F.v[1]; E.g = F.g;
+		}else{
+			E.from = F.v[1]; E.to = F.v[0]; E.g = -F.g;
+		}
+		// Directions leaving each endpoint along the fragment
+		double t0[2], t1[2];
+		BoolTangent(F, &vp[0], &vp[2*F.v[0]], t0);
+		BoolTangent(F, &vp[0], &vp[2*F.v[1]], t1);
+		const double ang0 = atan2(t0[1], t0[0]);
+		const double ang1 = atan2(-t1[1], -t1[0]);
+		const int ie = edge.size();
+		half.push_back(std::make_pair(std::make_pair(F.v[0], -ang0), 2*ie + (in[0] ? 1 : 0)));
+		half.push_back(std::make_pair(std::make_pair(F.v[1], -ang1), 2*ie + (in[0] ? 0 : 1)));
+		edge.push_back(E);
+	}
+	// Around each vertex, in clockwise order, each incoming edge continues
+	// with the next outgoing one: the sharpest left turn.
+	const int ne = edge.size();
+	std::vector<int> next(ne, -1);
+	std::sort(half.begin(), half.end());
+	for(unsigned int k0 = 0, k1; k0 < half.size(); k0 = k1){
+		for(k1 = k0; k1 < half.size() && half[k1].first.first == half[k0].first.first; ++k1){}
+		const int nh = k1 - k0;
+		std::vector<char> paired(nh, 0);
+		for(int l = 0; l < nh; ++l){
+			if(half[k0+l].second & 1){ continue; }
+			for(int d = 1; d < nh; ++d){
+				const int m = (l + d) % nh;
+				if(!(half[k0+m].second & 1) || paired[m]){ continue; }
+				paired[m] = 1;
+				next[half[k0+l].second/2] = half[k0+m].second/2;
+				break;
+			}
+		}
+	}
+
+	std::vector<char> used(ne, 0);
+	std::vector<Poly> loops;
+	std::vector<std::pair<double,int> > area;
+	for(int e0 = 0; e0 < ne; ++e0){
+		if(used[e0]){ continue; }
+		std::vector<Poly::PointG> loop;
+		int e = e0;
+		while(e >= 0 && !used[e]){
+			used[e] = 1;
+			loop.push_back(Poly::PointG(Point(vp[2*edge[e].from+0], vp[2*edge[e].from+1]), edge[e].g));
+			e = next[e];
+		}
+		if(e != e0){ continue; } // not closed; only on inconsistent input
+		BoolMergeLoop(loop, tol);
+		if(loop.size() < 2){ continue; }
+		Poly P(loop);
+		const double a = P.Area();
+		if(fabs(a) <= 1e-12 * scale*scale){ continue; }
+		area.push_back(std::make_pair(-fabs(a), (int)loops.size()));
+		loops.push_back(P);
 	}
-	return ret;
-}
-Poly operator*(const Poly &p, const double &s){
-	return s*p;
-}
-Poly operator/(const Poly &p, const double &s){
-	Poly ret(p);
-	for(std::vector<Poly::PointG>::iterator i = ret.v.begin(); i != ret.v.end(); ++i){
-		i->first.x /= s;
-		i->first.y /= s;
+	// Largest loop first
+	std::sort(area.begin(), area.end());
+	ret.reserve(loops.size());
+	for(unsigned int i = 0; i < area.size(); ++i){
+		ret.push_back(loops[area[i].second]);
 	}
 	return ret;
 }
@@ -354,6 +1862,239 @@ Point Intersection(const Ray &u, const Ray &v){
 	return Point(u.p.x + s * u.d.x, u.p.y + s * u.d.y);
 }
 
+// Intersects the (infinite) line of the ray with the open polyline
+// through the points of the array. Each segment is treated as the
+// half-open interval [p_i, p_{i+1}) so that shared vertices are only
+// reported once.
+PointArray Intersection(const Ray &r, const PointArray &a){
+	PointArray ret;
+	const int n = a.NumPoints();
+	for(int i = 0; i+1 < n; ++i){
+		const double ex = a.x[i+1] - a.x[i];
+		const double ey = a.y[i+1] - a.y[i];
+		const double den = r.d.x * ey - r.d.y * ex;
+		if(0 == den){ continue; }
+		// a_i + t * e == r.p + s * r.d
+		const double t = (r.d.y * (a.x[i] - r.p.x) - r.d.x * (a.y[i] - r.p.y)) / den;
+		if(t < 0 || t >= 1){ continue; }
+		ret.Append(a.x[i] + t * ex, a.y[i] + t * ey);
+	}
+	return ret;
+}
+
+// A fixed collection of Polys with a BVH over their bounding boxes, for
+// finding the Polys nearest to a point without scanning all of them.
+// Distance(Poly, Point) refines the box distances, so the answer is exact.
+class PolySet{
+	std::vector<Poly> P;
+	geom_bvh2d bvh;
+	// Query statistics; the tree counts nodes and leaves into last, and
+	// each Distance evaluation counts as a shape test (a hit if p is
+	// inside).
+	mutable geom_query_counts last, total;
+	PolySet(const PolySet&);
+	PolySet& operator=(const PolySet&);
+	struct IterData{
+		const PolySet *S;
+		int i;
+	};
+	static int Iterator(double c[2], double h[2], int *tag, void *data){
+		IterData *d = (IterData*)data;
+		double xb[2], yb[2];
+		d->S->P[d->i].Bounds(xb, yb);
+		c[0] = 0.5*(xb[0] + xb[1]); h[0] = 0.5*(xb[1] - xb[0]);
+		c[1] = 0.5*(yb[0] + yb[1]); h[1] = 0.5*(yb[1] - yb[0]);
+		*tag = d->i++;
+		return 1;
+	}
+	static double DistanceFunc(int tag, const double p[2], void *data){
+		const PolySet *S = (const PolySet*)data;
+		const double d = CAD2D::Distance(S->P[tag], Point(p[0], p[1]));
+		S->last.contains++;
+		if(0 == d){ S->last.hits++; }
+		return d;
+	}
+public:
+	PolySet(const std::vector<Poly> &polys):P(polys),bvh(NULL){
+		IterData d = { this, 0 };
+		bvh = geom_bvh2d_new(P.size(), &Iterator, &d);
+		geom_bvh2d_set_counts(bvh, &last);
+		ResetStats();
+	}
+	~PolySet(){ geom_bvh2d_destroy(bvh); }
+	int Size() const{ return (int)P.size(); }
+	const Poly& operator[](int i) const{ return P[i]; }
+	// Finds the (up to) k Polys nearest to p, nearest first. Returns the
+	// number found.
+	int Nearest(const Point &p, int k, int *index, double *dist) const{
+		if(NULL == bvh || k <= 0){ return 0; }
+		const double q[2] = { p.x, p.y };
+		memset(&last, 0, sizeof(last));
+		const int n = geom_bvh2d_query_knn(bvh, q, k, &DistanceFunc, (void*)this, index, dist);
+		last.queries = 1;
+		total.queries++;
+		total.nodes += last.nodes;
+		total.leaves += last.leaves;
+		total.contains += last.contains;
+		total.hits += last.hits;
+		return n;
+	}
+	const geom_query_counts& LastStats() const{ return last; }
+	const geom_query_counts& TotalStats() const{ return total; }
+	void ResetStats(){
+		memset(&last, 0, sizeof(last));
+		memset(&total, 0, sizeof(total));
+	}
+};
+
+// Buffered destination for the PostScript output. Text is accumulated in
+// a large buffer and written in blocks, so a drawing costs one number
+// format per coordinate instead of a Lua print per operator. The target
+// is stdout, a file, or an in-memory buffer that the script retrieves.
+// Like BufferPool, there is one instance per process.
+class OutputSink{
+public:
+	enum Target{ TARGET_STDOUT, TARGET_FILE, TARGET_BUFFER };
+private:
+	enum{ BlockSize = 1 << 16 };
+	Target target;
+	FILE *fp;
+	std::string buf;
+	OutputSink():target(TARGET_STDOUT),fp(stdout){
+		buf.reserve(2*BlockSize);
+	}
+	~OutputSink(){ Close(); }
+	// Writes out the buffer unless it is the final destination
+	bool Drain(){
+		if(TARGET_BUFFER == target || buf.empty()){ return true; }
+		const bool ok = (fwrite(buf.data(), 1, buf.size(), fp) == buf.size());
+		buf.clear();
+		return ok;
+	}
+	// Formats an integer-valued x into s, returning the length
+	static int FormatInteger(double x, char *s){
+		unsigned long long u = (unsigned long long)fabs(x);
+		char tmp[24];
+		int n = 0;
+		do{
+			tmp[n++] = (char)('0' + u%10);
+			u /= 10;
+		}while(u > 0);
+		int len = 0;
+		if(x < 0){ s[len++] = '-'; }
+		while(n > 0){ s[len++] = tmp[--n]; }
+		return len;
+	}
+public:
+	static OutputSink& Instance(){
+		static OutputSink sink;
+		return sink;
+	}
+	// Switches to a new target, flushing the old one. Returns false if
+	// the file cannot be opened, in which case output goes to stdout.
+	bool Open(Target t, const char *path = NULL){
+		Close();
+		if(TARGET_FILE == t){
+			fp = fopen(path, "w");
+			if(NULL == fp){
+				fp = stdout;
+				return false;
+			}
+		}
+		target = t;
+		return true;
+	}
+	// Flushes the current target and reverts to stdout. The contents of
+	// an in-memory buffer are discarded.
+	bool Close(){
+		bool ok = Flush();
+		if(TARGET_FILE == target && NULL != fp){
+			if(0 != fclose(fp)){ ok = false; }
+		}
+		target = TARGET_STDOUT;
+		fp = stdout;
+		buf.clear();
+		return ok;
+	}
+	bool Flush(){
+		if(TARGET_BUFFER == target){ return true; }
+		bool ok = Drain();
+		if(0 != fflush(fp)){ ok = false; }
+		return ok;
+	}
+	Target GetTarget() const{ return target; }
+	const std::string &Contents() const{ return buf; }
+	void Clear(){ buf.clear(); }
+
+	void Write(const char *s, size_t n){
+		buf.append(s, n);
+		if(buf.size() >= BlockSize){ Drain(); }
+	}
+	void Write(char c){
+		buf.push_back(c);
+		if(buf.size() >= BlockSize){ Drain(); }
+	}
+	void Write(const char *s){ Write(s, strlen(s)); }
+	// Writes the shortest decimal that reads back as exactly x.
+	void Write(double x){
+		char s[32];
+		int n;
+		if(x == x && fabs(x) < 1e15 && x == (double)(long long)x){
+			n = FormatInteger(x, s);
+		}else if(x != x || fabs(x) > DBL_MAX){
+			n = snprintf(s, sizeof(s), "%g", x);
+		}else{
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+			n = (int)(std::to_chars(s, s+sizeof(s), x).ptr - s);
+#else
+			n = snprintf(s, sizeof(s), "%.15g", x);
+			if(strtod(s, NULL) != x){
+				n = snprintf(s, sizeof(s), "%.16g", x);
+				if(strtod(s, NULL) != x){
+					n = snprintf(s, sizeof(s), "%.17g", x);
+				}
+			}
+#endif
+		}
+		Write(s, n);
+	}
+	// Writes the path of the polygon: moveto, then lineto or arc/arcn for
+	// each edge, then closepath.
+	void WritePath(const Poly &P){
+		const int n = P.v.size();
+		if(0 == n){ return; }
+		Write(P.v[0].first.x); Write(' ');
+		Write(P.v[0].first.y); Write(" moveto\n");
+		for(int i = 0; i < n; ++i){
+			const Arcseg s(P(i));
+			if(0 == s.g){
+				if(i+1 == n){ break; } // closepath draws the last edge
+				Write(s.q.x); Write(' ');
+				Write(s.q.y); Write(" lineto\n");
+				continue;
+			}
+			const Point c(s.Center());
+			Write(c.x); Write(' ');
+			Write(c.y); Write(' ');
+			Write(fabs(s.Radius())); Write(' ');
+			Write(atan2(s.p.y - c.y, s.p.x - c.x) * (180/M_PI)); Write(' ');
+			Write(atan2(s.q.y - c.y, s.q.x - c.x) * (180/M_PI));
+			Write(s.g > 0 ? " arc\n" : " arcn\n");
+		}
+		Write("closepath\n");
+	}
+	void WritePath(const PointArray &A){
+		const int n = A.NumPoints();
+		if(0 == n){ return; }
+		for(int i = 0; i < n; ++i){
+			Write(A.x[i]); Write(' ');
+			Write(A.y[i]);
+			Write(0 == i ? " moveto\n" : " lineto\n");
+		}
+		Write("closepath\n");
+	}
+};
+
 } // namespace CAD2D
 
 extern "C" {
@@ -370,12 +2111,146 @@ const char VectorClassName[] = "CAD2D::Vector";
 const char RayClassName[] = "CAD2D::Ray";
 const char ArcsegClassName[] = "CAD2D::Arcseg";
 const char PolyClassName[] = "CAD2D::Poly";
+const char PointArrayClassName[] = "CAD2D::PointArray";
+const char MatrixClassName[] = "CAD2D::Matrix";
+const char PolySetClassName[] = "CAD2D::PolySet";
 
-static int Point_push(lua_State *L, const CAD2D::Point &p){
-	CAD2D::Point *P = (CAD2D::Point*)lua_newuserdata(L, sizeof(CAD2D::Point));
-	P = new(P) CAD2D::Point(p);
-	luaL_getmetatable(L, PointClassName);
+// Every kernel userdata starts with a UdataHeader holding a magic number
+// and a type tag, so that type tests and overload dispatch are a load and
+// a compare rather than a registry lookup by class name. Metatables are
+// cached in the registry under the address of their class name string.
+enum TypeTag{
+	TAG_NONE = 0,
+	TAG_POINT,
+	TAG_DIRECTION,
+	TAG_VECTOR,
+	TAG_RAY,
+	TAG_ARCSEG,
+	TAG_POLY,
+	TAG_POINTARRAY,
+	TAG_MATRIX,
+	TAG_POLYSET,
+	TAG_COUNT
+};
+#define TAG_PAIR(a,b) ((a)*TAG_COUNT + (b))
+
+static const char *const TagClassName[TAG_COUNT] = {
+	NULL,
+	PointClassName,
+	DirectionClassName,
+	VectorClassName,
+	RayClassName,
+	ArcsegClassName,
+	PolyClassName,
+	PointArrayClassName,
+	MatrixClassName,
+	PolySetClassName
+};
+
+static const unsigned int UDATA_MAGIC = 0xCAD2D00Du;
+struct UdataHeader{
+	unsigned int magic;
+	unsigned int tag;
+};
+
+// Allocates a tagged userdata with room for an object of the given size,
+// sets its metatable, and returns a pointer to the object storage.
+static void *Udata_new(lua_State *L, unsigned int tag, size_t size){
+	UdataHeader *h = (UdataHeader*)lua_newuserdata(L, sizeof(UdataHeader) + size);
+	h->magic = UDATA_MAGIC;
+	h->tag = tag;
+	lua_rawgetp(L, LUA_REGISTRYINDEX, TagClassName[tag]);
 	lua_setmetatable(L, -2);
+	return h+1;
+}
+// Returns the type tag of the value at narg, or TAG_NONE if it is not a
+// kernel userdata. Only the header is checked; Udata_check also verifies
+// the metatable.
+static unsigned int Udata_tag(lua_State *L, int narg){
+	if(lua_type(L, narg) != LUA_TUSERDATA || lua_rawlen(L, narg) < sizeof(UdataHeader)){
+		return TAG_NONE;
+	}
+	const UdataHeader *h = (const UdataHeader*)lua_touserdata(L, narg);
+	if(UDATA_MAGIC != h->magic || h->tag >= TAG_COUNT){
+		return TAG_NONE;
+	}
+	return h->tag;
+}
+static void *Udata_to(lua_State *L, int narg){
+	return (UdataHeader*)lua_touserdata(L, narg) + 1;
+}
+// Returns whether the value at narg, whose header carries the given tag,
+// has the metatable registered for that tag. The header alone is only a
+// cheap filter: other libraries may store anything in their first words.
+static bool Udata_registered(lua_State *L, int narg, unsigned int tag){
+	if(!lua_getmetatable(L, narg)){
+		return false;
+	}
+	lua_rawgetp(L, LUA_REGISTRYINDEX, TagClassName[tag]);
+	const bool registered = lua_rawequal(L, -1, -2);
+	lua_pop(L, 2);
+	return registered;
+}
+static void *Udata_check(lua_State *L, int narg, unsigned int tag){
+	if(Udata_tag(L, narg) != tag || !Udata_registered(L, narg, tag)){
+		luaL_argerror(L, narg, lua_pushfstring(L, "%s expected, got %s",
+			TagClassName[tag], luaL_typename(L, narg)
+		));
+		return NULL;
+	}
+	return Udata_to(L, narg);
+}
+
+// Field and method names are resolved with a single lookup in a per-class
+// key table, held as the upvalue of the __index closure. Lua strings are
+// interned, so this replaces a chain of strcmp calls with one hash probe.
+// The table maps method names to their C functions and field names to
+// integer field ids.
+struct IndexKey{
+	const char *name;
+	int field;
+	lua_CFunction method;
+};
+// Looks up the key at index 2. Returns its field id, or 0 if the key is
+// unknown. For a method, the function is left on the stack and -1 is
+// returned.
+static int Index_lookup(lua_State *L){
+	lua_pushvalue(L, 2);
+	lua_rawget(L, lua_upvalueindex(1));
+	if(lua_type(L, -1) == LUA_TNUMBER){
+		const int field = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+		return field;
+	}else if(lua_isnil(L, -1)){
+		lua_pop(L, 1);
+		return 0;
+	}
+	return -1;
+}
+static void Class_register(
+	lua_State *L, const char *name, const luaL_Reg *lib,
+	lua_CFunction index, const IndexKey *keys
+){
+	luaL_newmetatable(L, name);
+	luaL_setfuncs(L, lib, 0);
+	lua_newtable(L);
+	for(; NULL != keys->name; ++keys){
+		if(NULL != keys->method){
+			lua_pushcfunction(L, keys->method);
+		}else{
+			lua_pushinteger(L, keys->field);
+		}
+		lua_setfield(L, -2, keys->name);
+	}
+	lua_pushcclosure(L, index, 1);
+	lua_setfield(L, -2, "__index");
+	lua_pushvalue(L, -1);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, name);
+	lua_pop(L, 1);  /* pop new metatable */
+}
+
+static int Point_push(lua_State *L, const CAD2D::Point &p){
+	new(Udata_new(L, TAG_POINT, sizeof(CAD2D::Point))) CAD2D::Point(p);
 	return 1;
 }
 static int Point_create(lua_State *L){
@@ -399,47 +2274,37 @@ static int Point_create(lua_State *L){
 	return Point_push(L, CAD2D::Point(x,y));
 }
 static bool Point_is(lua_State *L, int narg){
-	return (lua_type(L, narg) == LUA_TUSERDATA) && (NULL != luaL_testudata(L, narg, PointClassName));
+	return TAG_POINT == Udata_tag(L, narg);
 }
 static int IsPoint(lua_State *L){
 	lua_pushboolean(L, Point_is(L, 1));
 	return 1;
 }
 static CAD2D::Point *Point_check(lua_State *L, int narg){
-	luaL_checktype(L, narg, LUA_TUSERDATA);
-	void *ud = luaL_checkudata(L, narg, PointClassName);
-	if(!ud){
-		luaL_argerror(L, narg, "expected Point object");
-		return NULL;
-	}
-	return (CAD2D::Point*)ud;
+	return (CAD2D::Point*)Udata_check(L, narg, TAG_POINT);
 }
 static int Point_gc(lua_State *L) {
 	Point_check(L, 1);
 	return 0;
 }
+enum{ POINT_X = 1, POINT_Y };
+static const IndexKey PointKeys[] = {
+	{"x", POINT_X, NULL},
+	{"y", POINT_Y, NULL},
+	{NULL, 0, NULL}
+};
 static int Point_index(lua_State *L) {
 	CAD2D::Point *P = Point_check(L, 1);
-	if(lua_isnumber(L, 2)){
-		if(1 == lua_tointeger(L, 2)){
-			lua_pushnumber(L, P->x);
-		}else if(2 == lua_tointeger(L, 2)){
-			lua_pushnumber(L, P->y);
-		}else{
-			return luaL_error(L, "Invalid indexing of a Point");
-		}
-	}else if(lua_isstring(L, 2)){
-		if(0 == strcmp("x", lua_tostring(L, 2))){
-			lua_pushnumber(L, P->x);
-		}else if(0 == strcmp("y", lua_tostring(L, 2))){
-			lua_pushnumber(L, P->y);
-		}else{
-			return luaL_error(L, "Invalid indexing of a Point");
-		}
-	}else{
-		return luaL_error(L, "Invalid indexing of a Point");
+	const int field = (lua_type(L, 2) == LUA_TNUMBER ? lua_tointeger(L, 2) : Index_lookup(L));
+	switch(field){
+	case POINT_X:
+		lua_pushnumber(L, P->x);
+		return 1;
+	case POINT_Y:
+		lua_pushnumber(L, P->y);
+		return 1;
 	}
-	return 1;
+	return luaL_error(L, "Invalid indexing of a Point");
 }
 
 
@@ -448,10 +2313,7 @@ static bool Vector_is(lua_State *L, int narg);
 static CAD2D::Vector *Vector_check(lua_State *L, int narg);
 
 static int Direction_push(lua_State *L, const CAD2D::Direction &d){
-	CAD2D::Direction *D = (CAD2D::Direction*)lua_newuserdata(L, sizeof(CAD2D::Direction));
-	D = new(D) CAD2D::Direction(d);
-	luaL_getmetatable(L, DirectionClassName);
-	lua_setmetatable(L, -2);
+	new(Udata_new(L, TAG_DIRECTION, sizeof(CAD2D::Direction))) CAD2D::Direction(d);
 	return 1;
 }
 static int Direction_create(lua_State *L){
@@ -482,48 +2344,48 @@ static int Direction_create(lua_State *L){
 	return luaL_error(L, "Invalid syntax for creating a Direction");
 }
 static bool Direction_is(lua_State *L, int narg){
-	return (lua_type(L, narg) == LUA_TUSERDATA) && (NULL != luaL_testudata(L, narg, DirectionClassName));
+	return TAG_DIRECTION == Udata_tag(L, narg);
 }
 static int IsDirection(lua_State *L){
 	lua_pushboolean(L, Direction_is(L, 1));
 	return 1;
 }
 static CAD2D::Direction *Direction_check(lua_State *L, int narg){
-	luaL_checktype(L, narg, LUA_TUSERDATA);
-	void *ud = luaL_checkudata(L, narg, DirectionClassName);
-	if(!ud){
-		luaL_argerror(L, narg, "expected Direction object");
-		return NULL;
-	}
-	return (CAD2D::Direction*)ud;
+	return (CAD2D::Direction*)Udata_check(L, narg, TAG_DIRECTION);
 }
 static int Direction_gc(lua_State *L) {
 	Direction_check(L, 1);
 	return 0;
 }
+enum{ DIRECTION_X = 1, DIRECTION_Y, DIRECTION_ANGLE, DIRECTION_ROT };
+static const IndexKey DirectionKeys[] = {
+	{"x", DIRECTION_X, NULL},
+	{"y", DIRECTION_Y, NULL},
+	{"angle", DIRECTION_ANGLE, NULL},
+	{"rot", DIRECTION_ROT, NULL},
+	{NULL, 0, NULL}
+};
 static int Direction_index(lua_State *L) {
 	CAD2D::Direction *D = Direction_check(L, 1);
-	if(lua_isnumber(L, 2)){
-		if(1 == lua_tointeger(L, 2)){
-			lua_pushnumber(L, D->x);
-			return 1;
-		}else if(2 == lua_tointeger(L, 2)){
-			lua_pushnumber(L, D->y);
-			return 1;
-		}
-	}else if(lua_isstring(L, 2)){
-		if(0 == strcmp("x", lua_tostring(L, 2))){
-			lua_pushnumber(L, D->x);
-			return 1;
-		}else if(0 == strcmp("y", lua_tostring(L, 2))){
-			lua_pushnumber(L, D->y);
-			return 1;
-		}else if(0 == strcmp("angle", lua_tostring(L, 2))){
-			lua_pushnumber(L, D->Angle());
-			return 1;
-		}else if(0 == strcmp("rot", lua_tostring(L, 2))){
-			return Direction_push(L, !(*D));
-		}
+	int field = 0;
+	if(lua_type(L, 2) == LUA_TNUMBER){
+		field = lua_tointeger(L, 2);
+		if(DIRECTION_X != field && DIRECTION_Y != field){ field = 0; }
+	}else{
+		field = Index_lookup(L);
+	}
+	switch(field){
+	case DIRECTION_X:
+		lua_pushnumber(L, D->x);
+		return 1;
+	case DIRECTION_Y:
+		lua_pushnumber(L, D->y);
+		return 1;
+	case DIRECTION_ANGLE:
+		lua_pushnumber(L, D->Angle());
+		return 1;
+	case DIRECTION_ROT:
+		return Direction_push(L, !(*D));
 	}
 	return luaL_error(L, "Invalid indexing of a Direction");
 }
@@ -532,10 +2394,7 @@ static int Direction_index(lua_State *L) {
 
 
 static int Vector_push(lua_State *L, const CAD2D::Vector &d){
-	CAD2D::Vector *D = (CAD2D::Vector*)lua_newuserdata(L, sizeof(CAD2D::Vector));
-	D = new(D) CAD2D::Vector(d);
-	luaL_getmetatable(L, VectorClassName);
-	lua_setmetatable(L, -2);
+	new(Udata_new(L, TAG_VECTOR, sizeof(CAD2D::Vector))) CAD2D::Vector(d);
 	return 1;
 }
 static int Vector_create(lua_State *L){
@@ -564,51 +2423,52 @@ static int Vector_create(lua_State *L){
 	return luaL_error(L, "Invalid syntax for creating a Vector");
 }
 static bool Vector_is(lua_State *L, int narg){
-	return (lua_type(L, narg) == LUA_TUSERDATA) && (NULL != luaL_testudata(L, narg, VectorClassName));
+	return TAG_VECTOR == Udata_tag(L, narg);
 }
 static int IsVector(lua_State *L){
 	lua_pushboolean(L, Vector_is(L, 1));
 	return 1;
 }
 static CAD2D::Vector *Vector_check(lua_State *L, int narg){
-	luaL_checktype(L, narg, LUA_TUSERDATA);
-	void *ud = luaL_checkudata(L, narg, VectorClassName);
-	if(!ud){
-		luaL_argerror(L, narg, "expected Vector object");
-		return NULL;
-	}
-	return (CAD2D::Vector*)ud;
+	return (CAD2D::Vector*)Udata_check(L, narg, TAG_VECTOR);
 }
 static int Vector_gc(lua_State *L) {
 	Vector_check(L, 1);
 	return 0;
 }
+enum{ VECTOR_X = 1, VECTOR_Y, VECTOR_LENGTH, VECTOR_ANGLE, VECTOR_ROT };
+static const IndexKey VectorKeys[] = {
+	{"x", VECTOR_X, NULL},
+	{"y", VECTOR_Y, NULL},
+	{"length", VECTOR_LENGTH, NULL},
+	{"angle", VECTOR_ANGLE, NULL},
+	{"rot", VECTOR_ROT, NULL},
+	{NULL, 0, NULL}
+};
 static int Vector_index(lua_State *L) {
 	CAD2D::Vector *V = Vector_check(L, 1);
-	if(lua_isnumber(L, 2)){
-		if(1 == lua_tointeger(L, 2)){
-			lua_pushnumber(L, V->x);
-			return 1;
-		}else if(2 == lua_tointeger(L, 2)){
-			lua_pushnumber(L, V->y);
-			return 1;
-		}
-	}else if(lua_isstring(L, 2)){
-		if(0 == strcmp("x", lua_tostring(L, 2))){
-			lua_pushnumber(L, V->x);
-			return 1;
-		}else if(0 == strcmp("y", lua_tostring(L, 2))){
-			lua_pushnumber(L, V->y);
-			return 1;
-		}else if(0 == strcmp("length", lua_tostring(L, 2))){
-			lua_pushnumber(L, V->Length());
-			return 1;
-		}else if(0 == strcmp("angle", lua_tostring(L, 2))){
-			lua_pushnumber(L, V->Angle());
-			return 1;
-		}else if(0 == strcmp("rot", lua_tostring(L, 2))){
-			return Vector_push(L, !(*V));
-		}
+	int field = 0;
+	if(lua_type(L, 2) == LUA_TNUMBER){
+		field = lua_tointeger(L, 2);
+		if(VECTOR_X != field && VECTOR_Y != field){ field = 0; }
+	}else{
+		field = Index_lookup(L);
+	}
+	switch(field){
+	case VECTOR_X:
+		lua_pushnumber(L, V->x);
+		return 1;
+	case VECTOR_Y:
+		lua_pushnumber(L, V->y);
+		return 1;
+	case VECTOR_LENGTH:
+		lua_pushnumber(L, V->Length());
+		return 1;
+	case VECTOR_ANGLE:
+		lua_pushnumber(L, V->Angle());
+		return 1;
+	case VECTOR_ROT:
+		return Vector_push(L, !(*V));
 	}
 	return luaL_error(L, "Invalid indexing of a Vector");
 }
@@ -616,10 +2476,7 @@ static int Vector_index(lua_State *L) {
 
 
 static int Ray_push(lua_State *L, const CAD2D::Ray &r){
-	CAD2D::Ray *R = (CAD2D::Ray*)lua_newuserdata(L, sizeof(CAD2D::Ray));
-	R = new(R) CAD2D::Ray(r);
-	luaL_getmetatable(L, RayClassName);
-	lua_setmetatable(L, -2);
+	new(Udata_new(L, TAG_RAY, sizeof(CAD2D::Ray))) CAD2D::Ray(r);
 	return 1;
 }
 static int Ray_create(lua_State *L){
@@ -637,39 +2494,34 @@ static int Ray_create(lua_State *L){
 	return luaL_error(L, "Invalid syntax for creating a Ray");
 }
 static bool Ray_is(lua_State *L, int narg){
-	return (lua_type(L, narg) == LUA_TUSERDATA) && (NULL != luaL_testudata(L, narg, RayClassName));
+	return TAG_RAY == Udata_tag(L, narg);
 }
 static int IsRay(lua_State *L){
 	lua_pushboolean(L, Ray_is(L, 1));
 	return 1;
 }
 static CAD2D::Ray *Ray_check(lua_State *L, int narg){
-	luaL_checktype(L, narg, LUA_TUSERDATA);
-	void *ud = luaL_checkudata(L, narg, RayClassName);
-	if(!ud){
-		luaL_argerror(L, narg, "expected Ray object");
-		return NULL;
-	}
-	return (CAD2D::Ray*)ud;
+	return (CAD2D::Ray*)Udata_check(L, narg, TAG_RAY);
 }
 static int Ray_gc(lua_State *L) {
 	Ray_check(L, 1);
 	return 0;
 }
+enum{ RAY_DIRECTION = 1, RAY_ORIGIN };
+static const IndexKey RayKeys[] = {
+	{"direction", RAY_DIRECTION, NULL},
+	{"origin", RAY_ORIGIN, NULL},
+	{NULL, 0, NULL}
+};
 static int Ray_index(lua_State *L) {
 	CAD2D::Ray *R = Ray_check(L, 1);
-	if(lua_isstring(L, 2)){
-		if(0 == strcmp("direction", lua_tostring(L, 2))){
-			return Direction_push(L, R->d);
-		}else if(0 == strcmp("origin", lua_tostring(L, 2))){
-			return Point_push(L, R->p);
-		}else{
-			return luaL_error(L, "Invalid indexing of a Ray");
-		}
-	}else{
-		return luaL_error(L, "Invalid indexing of a Ray");
+	switch(Index_lookup(L)){
+	case RAY_DIRECTION:
+		return Direction_push(L, R->d);
+	case RAY_ORIGIN:
+		return Point_push(L, R->p);
 	}
-	return 1;
+	return luaL_error(L, "Invalid indexing of a Ray");
 }
 
 
@@ -677,10 +2529,7 @@ static int Ray_index(lua_State *L) {
 
 
 static int Arcseg_push(lua_State *L, const CAD2D::Arcseg &s){
-	CAD2D::Arcseg *S = (CAD2D::Arcseg*)lua_newuserdata(L, sizeof(CAD2D::Arcseg));
-	S = new(S) CAD2D::Arcseg(s);
-	luaL_getmetatable(L, ArcsegClassName);
-	lua_setmetatable(L, -2);
+	new(Udata_new(L, TAG_ARCSEG, sizeof(CAD2D::Arcseg))) CAD2D::Arcseg(s);
 	return 1;
 }
 static int Arcseg_create(lua_State *L){
@@ -699,45 +2548,47 @@ static int Arcseg_create(lua_State *L){
 	return luaL_error(L, "Invalid syntax for creating a Arcseg");
 }
 static bool Arcseg_is(lua_State *L, int narg){
-	return (lua_type(L, narg) == LUA_TUSERDATA) && (NULL != luaL_testudata(L, narg, ArcsegClassName));
+	return TAG_ARCSEG == Udata_tag(L, narg);
 }
 static int IsArcseg(lua_State *L){
 	lua_pushboolean(L, Arcseg_is(L, 1));
 	return 1;
 }
 static CAD2D::Arcseg *Arcseg_check(lua_State *L, int narg){
-	luaL_checktype(L, narg, LUA_TUSERDATA);
-	void *ud = luaL_checkudata(L, narg, ArcsegClassName);
-	if(!ud){
-		luaL_argerror(L, narg, "expected Arcseg object");
-		return NULL;
-	}
-	return (CAD2D::Arcseg*)ud;
+	return (CAD2D::Arcseg*)Udata_check(L, narg, TAG_ARCSEG);
 }
 static int Arcseg_gc(lua_State *L) {
 	Arcseg_check(L, 1);
 	return 0;
 }
+enum{ ARCSEG_LENGTH = 1, ARCSEG_CENTER, ARCSEG_RADIUS, ARCSEG_ANGLE };
+static const IndexKey ArcsegKeys[] = {
+	{"length", ARCSEG_LENGTH, NULL},
+	{"center", ARCSEG_CENTER, NULL},
+	{"radius", ARCSEG_RADIUS, NULL},
+	{"angle", ARCSEG_ANGLE, NULL},
+	{NULL, 0, NULL}
+};
 static int Arcseg_index(lua_State *L){
 	CAD2D::Arcseg *S = Arcseg_check(L, 1);
-	if(lua_isnumber(L, 2)){
+	if(lua_type(L, 2) == LUA_TNUMBER){
 		Ray r = (*S)[lua_tonumber(L, 2)];
 		int ret = Point_push(L, r.p);
 		ret += Direction_push(L, r.d);
 		return ret;
-	}else if(lua_isstring(L, 2)){
-		if(0 == strcmp("length", lua_tostring(L, 2))){
-			lua_pushnumber(L, S->Length());
-			return 1;
-		}else if(0 == strcmp("center", lua_tostring(L, 2))){
-			return Point_push(L, S->Center());
-		}else if(0 == strcmp("radius", lua_tostring(L, 2))){
-			lua_pushnumber(L, S->Radius());
-			return 1;
-		}else if(0 == strcmp("angle", lua_tostring(L, 2))){
-			lua_pushnumber(L, S->Angle());
-			return 1;
-		}
+	}
+	switch(Index_lookup(L)){
+	case ARCSEG_LENGTH:
+		lua_pushnumber(L, S->Length());
+		return 1;
+	case ARCSEG_CENTER:
+		return Point_push(L, S->Center());
+	case ARCSEG_RADIUS:
+		lua_pushnumber(L, S->Radius());
+		return 1;
+	case ARCSEG_ANGLE:
+		lua_pushnumber(L, S->Angle());
+		return 1;
 	}
 	return luaL_error(L, "Invalid indexing of a Arcseg");
 }
@@ -799,62 +2650,529 @@ static int geom_arc_ray_intersect(
 			}
 		}
 	}
-	return ret;
+	return ret;
+}
+std::vector<Point> Intersection(const Ray &r, const Arcseg &s){
+	const double a1[2] = {s.p.x, s.p.y};
+	const double b1[2] = {s.q.x, s.q.y};
+	const double a2[2] = {r.p.x, r.p.y};
+	const double b2[2] = {r.d.x, r.d.y};
+	double p[4];
+	int n = geom_arc_ray_intersect(a1, b1, s.g, a2, b2, p);
+	std::vector<Point> ret;
+	for(int i = 0; i < n; ++i){
+		ret.push_back(Point(p[2*i+0], p[2*i+1]));
+	}
+	return ret;
+}
+
+// Batched intersection of many rays (treated as infinite lines, as in the
+// pairwise functions above) against many rays or curves.
+
+// Line-line kernel: for the ray u against n lines given in SoA form,
+// computes den[j] = vd x ud and the parameter s[j] along u. Entries with
+// den[j] == 0 are parallel and s[j] is meaningless.
+static void LineLineKernel(
+	const Ray &u, int n,
+	const double *vpx, const double *vpy, const double *vdx, const double *vdy,
+	double *s, double *den
+){
+	int j = 0;
+#if defined(__SSE2__)
+	const __m128d upx = _mm_set1_pd(u.p.x);
+	const __m128d upy = _mm_set1_pd(u.p.y);
+	const __m128d udx = _mm_set1_pd(u.d.x);
+	const __m128d udy = _mm_set1_pd(u.d.y);
+	for(; j+2 <= n; j += 2){
+		const __m128d uvx = _mm_sub_pd(_mm_loadu_pd(vpx+j), upx);
+		const __m128d uvy = _mm_sub_pd(_mm_loadu_pd(vpy+j), upy);
+		const __m128d dx = _mm_loadu_pd(vdx+j);
+		const __m128d dy = _mm_loadu_pd(vdy+j);
+		const __m128d num = _mm_sub_pd(_mm_mul_pd(dx, uvy), _mm_mul_pd(dy, uvx));
+		const __m128d d = _mm_sub_pd(_mm_mul_pd(dx, udy), _mm_mul_pd(dy, udx));
+		_mm_storeu_pd(den+j, d);
+		_mm_storeu_pd(s+j, _mm_div_pd(num, d));
+	}
+#endif
+	for(; j < n; ++j){
+		const double uvx = vpx[j] - u.p.x;
+		const double uvy = vpy[j] - u.p.y;
+		den[j] = vdx[j] * u.d.y - vdy[j] * u.d.x;
+		s[j] = (vdx[j] * uvy - vdy[j] * uvx) / den[j];
+	}
+}
+
+HitArray Intersection(const std::vector<Ray> &u, const std::vector<Ray> &v){
+	HitArray ret;
+	const int nu = u.size();
+	const int nv = v.size();
+	if(0 == nu || 0 == nv){ return ret; }
+	std::vector<double> buf(6*nv);
+	double *vpx = &buf[0*nv], *vpy = &buf[1*nv];
+	double *vdx = &buf[2*nv], *vdy = &buf[3*nv];
+	double *s = &buf[4*nv], *den = &buf[5*nv];
+	for(int j = 0; j < nv; ++j){
+		vpx[j] = v[j].p.x; vpy[j] = v[j].p.y;
+		vdx[j] = v[j].d.x; vdy[j] = v[j].d.y;
+	}
+	for(int i = 0; i < nu; ++i){
+		LineLineKernel(u[i], nv, vpx, vpy, vdx, vdy, s, den);
+		for(int j = 0; j < nv; ++j){
+			if(0 == den[j]){ continue; }
+			ret.Append(u[i].p.x + s[j] * u[i].d.x, u[i].p.y + s[j] * u[i].d.y, i, j);
+		}
+	}
+	return ret;
+}
+
+namespace{
+
+struct BatchHit{
+	int i, j;
+	double s, x, y;
+	bool operator<(const BatchHit &h) const{
+		return (i < h.i) || (i == h.i && s < h.s);
+	}
+};
+
+// Orders ray indices by direction so that parallel rays are contiguous
+struct RayDirectionLess{
+	const std::vector<Ray> &r;
+	RayDirectionLess(const std::vector<Ray> &r):r(r){}
+	bool operator()(int a, int b) const{
+		return (r[a].d.x < r[b].d.x) || (r[a].d.x == r[b].d.x && r[a].d.y < r[b].d.y);
+	}
+};
+struct KeyLess{
+	const std::vector<double> &key;
+	KeyLess(const std::vector<double> &key):key(key){}
+	bool operator()(int a, int b) const{ return key[a] < key[b]; }
+};
+
+// Exact test of ray r against curve s; hits are appended to hits.
+void RayCurveHits(const Ray &r, int i, const Arcseg &c, int j, std::vector<BatchHit> &hits){
+	BatchHit h;
+	h.i = i; h.j = j;
+	if(0 == c.g){
+		const double ex = c.q.x - c.p.x;
+		const double ey = c.q.y - c.p.y;
+		const double den = r.d.x * ey - r.d.y * ex;
+		if(0 == den){ return; }
+		const double t = (r.d.y * (c.p.x - r.p.x) - r.d.x * (c.p.y - r.p.y)) / den;
+		if(t < 0 || t >= 1){ return; }
+		h.x = c.p.x + t * ex;
+		h.y = c.p.y + t * ey;
+		h.s = (h.x - r.p.x) * r.d.x + (h.y - r.p.y) * r.d.y;
+		hits.push_back(h);
+	}else{
+		const double a1[2] = {c.p.x, c.p.y};
+		const double b1[2] = {c.q.x, c.q.y};
+		const double a2[2] = {r.p.x, r.p.y};
+		const double b2[2] = {r.d.x, r.d.y};
+		double p[4];
+		const int n = geom_arc_ray_intersect(a1, b1, c.g, a2, b2, p);
+		for(int k = 0; k < n; ++k){
+			h.x = p[2*k+0];
+			h.y = p[2*k+1];
+			h.s = (h.x - r.p.x) * r.d.x + (h.y - r.p.y) * r.d.y;
+			hits.push_back(h);
+		}
+	}
+}
+
+} // anonymous namespace
+
+// Rays with a common direction are processed together. Each curve's
+// bounding box is projected onto the common normal to give an interval
+// of line offsets it can be hit from. For small groups each ray simply
+// tests the intervals; for large groups (hatching) the rays and intervals
+// are swept in order of offset so that each ray only visits the curves
+// whose interval contains it.
+// Straight segments are half-open at their end point, as are arcs, so
+// that a vertex shared by consecutive edges is reported once. Hits are
+// ordered by ray, then by distance along the ray.
+HitArray Intersection(const std::vector<Ray> &r, const std::vector<Arcseg> &c){
+	static const int SWEEP_MIN_RAYS = 16;
+	HitArray ret;
+	const int nr = r.size();
+	const int nc = c.size();
+	if(0 == nr || 0 == nc){ return ret; }
+
+	std::vector<double> bcx(nc), bcy(nc), bhx(nc), bhy(nc);
+	for(int j = 0; j < nc; ++j){
+		const double a[2] = {c[j].p.x, c[j].p.y};
+		const double b[2] = {c[j].q.x, c[j].q.y};
+		double xb[2], yb[2];
+		geom_arc_bound_rect(a, b, c[j].g, xb, yb);
+		bcx[j] = 0.5*(xb[0] + xb[1]); bhx[j] = 0.5*(xb[1] - xb[0]);
+		bcy[j] = 0.5*(yb[0] + yb[1]); bhy[j] = 0.5*(yb[1] - yb[0]);
+	}
+
+	std::vector<int> rorder(nr);
+	for(int i = 0; i < nr; ++i){ rorder[i] = i; }
+	std::sort(rorder.begin(), rorder.end(), RayDirectionLess(r));
+
+	std::vector<double> lo(nc), hi(nc), off(nr);
+	std::vector<int> corder, active;
+	std::vector<BatchHit> hits;
+	for(int g0 = 0; g0 < nr; ){
+		const Direction &d = r[rorder[g0]].d;
+		int g1 = g0+1;
+		while(g1 < nr && r[rorder[g1]].d.x == d.x && r[rorder[g1]].d.y == d.y){ ++g1; }
+
+		const double nx = -d.y, ny = d.x;
+		for(int j = 0; j < nc; ++j){
+			const double mid = nx * bcx[j] + ny * bcy[j];
+			const double ext = fabs(nx) * bhx[j] + fabs(ny) * bhy[j];
+			const double pad = 1e-12 * (fabs(mid) + ext);
+			lo[j] = mid - ext - pad;
+			hi[j] = mid + ext + pad;
+		}
+		for(int k = g0; k < g1; ++k){
+			const Ray &ray = r[rorder[k]];
+			off[rorder[k]] = nx * ray.p.x + ny * ray.p.y;
+		}
+
+		if(g1 - g0 < SWEEP_MIN_RAYS){
+			for(int k = g0; k < g1; ++k){
+				const int i = rorder[k];
+				const double o = off[i];
+				for(int j = 0; j < nc; ++j){
+					if(lo[j] <= o && o <= hi[j]){
+						RayCurveHits(r[i], i, c[j], j, hits);
+					}
+				}
+			}
+		}else{
+			std::sort(rorder.begin()+g0, rorder.begin()+g1, KeyLess(off));
+			corder.resize(nc);
+			for(int j = 0; j < nc; ++j){ corder[j] = j; }
+			std::sort(corder.begin(), corder.end(), KeyLess(lo));
+			active.clear();
+			int next = 0;
+			for(int k = g0; k < g1; ++k){
+				const int i = rorder[k];
+				const double o = off[i];
+				while(next < nc && lo[corder[next]] <= o){
+					active.push_back(corder[next++]);
+				}
+				// Drop curves the sweep has passed while testing the rest
+				unsigned int keep = 0;
+				for(unsigned int a = 0; a < active.size(); ++a){
+					const int j = active[a];
+					if(hi[j] < o){ continue; }
+					active[keep++] = j;
+					RayCurveHits(r[i], i, c[j], j, hits);
+				}
+				active.resize(keep);
+			}
+		}
+		g0 = g1;
+	}
+
+	std::sort(hits.begin(), hits.end());
+	ret.Reserve(hits.size());
+	for(std::vector<BatchHit>::const_iterator h = hits.begin(); h != hits.end(); ++h){
+		ret.Append(h->x, h->y, h->i, h->j);
+	}
+	return ret;
+}
+std::vector<Point> Intersection(const Arcseg &u, const Arcseg &v){
+	const double a1[2] = {u.p.x, u.p.y};
+	const double b1[2] = {u.q.x, u.q.y};
+	const double a2[2] = {v.p.x, v.p.y};
+	const double b2[2] = {v.q.x, v.q.y};
+	double p[4];
+	int n = geom_arc_intersect(a1, b1, u.g, a2, b2, v.g, p);
+	std::vector<Point> ret;
+	for(int i = 0; i < n; ++i){
+		ret.push_back(Point(p[2*i+0], p[2*i+1]));
+	}
+	return ret;
+}
+// Intersects every curve of u with every curve of v. Endpoints are
+// included, and hits are ordered by the pair of curve indices.
+HitArray Intersection(const std::vector<Arcseg> &u, const std::vector<Arcseg> &v){
+	HitArray ret;
+	const int nu = u.size();
+	const int nv = v.size();
+	std::vector<double> a1(2*nu), b1(2*nu), g1(nu);
+	std::vector<double> a2(2*nv), b2(2*nv), g2(nv);
+	for(int i = 0; i < nu; ++i){
+		a1[2*i+0] = u[i].p.x; a1[2*i+1] = u[i].p.y;
+		b1[2*i+0] = u[i].q.x; b1[2*i+1] = u[i].q.y;
+		g1[i] = u[i].g;
+	}
+	for(int i = 0; i < nv; ++i){
+		a2[2*i+0] = v[i].p.x; a2[2*i+1] = v[i].p.y;
+		b2[2*i+0] = v[i].q.x; b2[2*i+1] = v[i].q.y;
+		g2[i] = v[i].g;
+	}
+	double *p;
+	int *ij;
+	const int n = geom_arc_intersect_batch(
+		nu, nu > 0 ? &a1[0] : NULL, nu > 0 ? &b1[0] : NULL, nu > 0 ? &g1[0] : NULL,
+		nv, nv > 0 ? &a2[0] : NULL, nv > 0 ? &b2[0] : NULL, nv > 0 ? &g2[0] : NULL,
+		&p, &ij
+	);
+	if(n <= 0){ return ret; }
+	ret.Reserve(n);
+	for(int k = 0; k < n; ++k){
+		ret.Append(p[2*k+0], p[2*k+1], ij[2*k+0], ij[2*k+1]);
+	}
+	free(p);
+	free(ij);
+	return ret;
+}
+
+
+
+
+
+static CAD2D::PointArray *PointArray_new(lua_State *L){
+	return new(Udata_new(L, TAG_POINTARRAY, sizeof(CAD2D::PointArray))) CAD2D::PointArray();
+}
+static int PointArray_push(lua_State *L, const CAD2D::PointArray &a){
+	CAD2D::PointArray *A = PointArray_new(L);
+	*A = a;
+	return 1;
+}
+static bool PointArray_is(lua_State *L, int narg){
+	return TAG_POINTARRAY == Udata_tag(L, narg);
+}
+static int IsPointArray(lua_State *L){
+	lua_pushboolean(L, PointArray_is(L, 1));
+	return 1;
+}
+static CAD2D::PointArray *PointArray_check(lua_State *L, int narg){
+	return (CAD2D::PointArray*)Udata_check(L, narg, TAG_POINTARRAY);
+}
+static bool Poly_is(lua_State *L, int narg);
+static CAD2D::Poly *Poly_check(lua_State *L, int narg);
+// Fills A from a flat table {x1,y1,x2,y2,...} or a table of Points.
+static void PointArray_fill_table(lua_State *L, int narg, CAD2D::PointArray *A){
+	const int ntab = lua_rawlen(L, narg);
+	if(0 == ntab){ return; }
+	lua_rawgeti(L, narg, 1);
+	const bool flat = (lua_type(L, -1) == LUA_TNUMBER);
+	lua_pop(L, 1);
+	if(flat){
+		if(0 != ntab%2){
+			luaL_error(L, "PointArray expected an even number of coordinates");
+		}
+		const int n = ntab/2;
+		A->x.resize(n);
+		A->y.resize(n);
+		for(int i = 0; i < n; ++i){
+			int isnum;
+			lua_rawgeti(L, narg, 2*i+1);
+			A->x[i] = lua_tonumberx(L, -1, &isnum);
+			if(!isnum){ luaL_error(L, "PointArray expected a number at index %d", 2*i+1); }
+			lua_rawgeti(L, narg, 2*i+2);
+			A->y[i] = lua_tonumberx(L, -1, &isnum);
+			if(!isnum){ luaL_error(L, "PointArray expected a number at index %d", 2*i+2); }
+			lua_pop(L, 2);
+		}
+	}else{
+		A->x.resize(ntab);
+		A->y.resize(ntab);
+		for(int i = 0; i < ntab; ++i){
+			lua_rawgeti(L, narg, i+1);
+			CAD2D::Point *pp = Point_check(L, -1);
+			A->x[i] = pp->x;
+			A->y[i] = pp->y;
+			lua_pop(L, 1);
+		}
+	}
+}
+// Fills A from a string of numbers separated by whitespace or commas.
+static void PointArray_fill_string(lua_State *L, int narg, CAD2D::PointArray *A){
+	size_t len;
+	const char *str = lua_tolstring(L, narg, &len);
+	const char *end = str + len;
+	bool havex = false;
+	double px = 0;
+	while(str < end){
+		if(isspace((unsigned char)*str) || ',' == *str){
+			++str;
+			continue;
+		}
+		char *next;
+		double val = strtod(str, &next);
+		if(next == str){
+			luaL_error(L, "Invalid number in PointArray string near '%s'", str);
+		}
+		str = next;
+		if(havex){
+			A->Append(px, val);
+		}else{
+			px = val;
+		}
+		havex = !havex;
+	}
+	if(havex){
+		luaL_error(L, "PointArray expected an even number of coordinates");
+	}
+}
+static int PointArray_create(lua_State *L){
+	const int narg = lua_gettop(L);
+	if(0 == narg){
+		PointArray_new(L);
+		return 1;
+	}else if(1 == narg){
+		if(lua_type(L, 1) == LUA_TTABLE){
+			CAD2D::PointArray *A = PointArray_new(L);
+			PointArray_fill_table(L, 1, A);
+			return 1;
+		}else if(lua_type(L, 1) == LUA_TSTRING){
+			CAD2D::PointArray *A = PointArray_new(L);
+			PointArray_fill_string(L, 1, A);
+			return 1;
+		}else if(PointArray_is(L, 1)){
+			return PointArray_push(L, *PointArray_check(L, 1));
+		}else if(Poly_is(L, 1)){
+			const CAD2D::Poly *P = Poly_check(L, 1);
+			CAD2D::PointArray *A = PointArray_new(L);
+			const int n = P->NumVertices();
+			A->x.resize(n);
+			A->y.resize(n);
+			for(int i = 0; i < n; ++i){
+				A->x[i] = P->v[i].first.x;
+				A->y[i] = P->v[i].first.y;
+			}
+			return 1;
+		}
+	}
+	return luaL_error(L, "Invalid syntax for creating a PointArray");
+}
+static int PointArray_gc(lua_State *L) {
+	CAD2D::PointArray *A = PointArray_check(L, 1);
+	A->~PointArray();
+	return 0;
+}
+static int PointArray_len(lua_State *L){
+	CAD2D::PointArray *A = PointArray_check(L, 1);
+	lua_pushinteger(L, A->NumPoints());
+	return 1;
+}
+// Gets an optional center Point argument for scale and rotate
+static void PointArray_optcenter(lua_State *L, int narg, double *cx, double *cy){
+	*cx = 0; *cy = 0;
+	if(!lua_isnoneornil(L, narg)){
+		CAD2D::Point *c = Point_check(L, narg);
+		*cx = c->x; *cy = c->y;
+	}
+}
+static int PointArray_translate(lua_State *L){
+	CAD2D::PointArray *A = PointArray_check(L, 1);
+	if(Vector_is(L, 2)){
+		const CAD2D::Vector *v = Vector_check(L, 2);
+		A->Translate(v->x, v->y);
+	}else{
+		A->Translate(luaL_checknumber(L, 2), luaL_checknumber(L, 3));
+	}
+	lua_settop(L, 1);
+	return 1;
 }
-std::vector<Point> Intersection(const Ray &r, const Arcseg &s){
-	const double a1[2] = {s.p.x, s.p.y};
-	const double b1[2] = {s.q.x, s.q.y};
-	const double a2[2] = {r.p.x, r.p.y};
-	const double b2[2] = {r.d.x, r.d.y};
-	double p[4];
-	int n = geom_arc_ray_intersect(a1, b1, s.g, a2, b2, p);
-	std::vector<Point> ret;
-	for(int i = 0; i < n; ++i){
-		ret.push_back(Point(p[2*i+0], p[2*i+1]));
-	}
-	return ret;
+static int PointArray_scale(lua_State *L){
+	CAD2D::PointArray *A = PointArray_check(L, 1);
+	double s = luaL_checknumber(L, 2);
+	double cx, cy;
+	PointArray_optcenter(L, 3, &cx, &cy);
+	A->Scale(s, cx, cy);
+	lua_settop(L, 1);
+	return 1;
 }
-/*
-std::vector<Point> Intersection(const Arcseg &u, const Arcseg &v){
-	const double a1[2] = {u.p.x, u.p.y};
-	const double b1[2] = {u.q.x, u.q.y};
-	const double a2[2] = {v.p.x, v.p.y};
-	const double b2[2] = {v.q.x, v.q.y};
-	double p[4];
-	int n = geom_arc_arc_intersect(a1, b1, u.g, a2, b2, v.g, p);
-	std::vector<Point> ret;
-	for(int i = 0; i < n; ++i){
-		ret.push_back(Point(p[2*i+0], p[2*i+1]));
+static int PointArray_rotate(lua_State *L){
+	CAD2D::PointArray *A = PointArray_check(L, 1);
+	double angle = luaL_checknumber(L, 2);
+	double cx, cy;
+	PointArray_optcenter(L, 3, &cx, &cy);
+	A->Rotate(angle, cx, cy);
+	lua_settop(L, 1);
+	return 1;
+}
+static int PointArray_get(lua_State *L){
+	CAD2D::PointArray *A = PointArray_check(L, 1);
+	int i = luaL_checkint(L, 2);
+	luaL_argcheck(L, 1 <= i && i <= A->NumPoints(), 2, "index out of range");
+	lua_pushnumber(L, A->x[i-1]);
+	lua_pushnumber(L, A->y[i-1]);
+	return 2;
+}
+static int PointArray_copy(lua_State *L){
+	CAD2D::PointArray *A = PointArray_check(L, 1);
+	return PointArray_push(L, *A);
+}
+enum{ POINTARRAY_N = 1 };
+static const IndexKey PointArrayKeys[] = {
+	{"n", POINTARRAY_N, NULL},
+	{"get", 0, &PointArray_get},
+	{"translate", 0, &PointArray_translate},
+	{"scale", 0, &PointArray_scale},
+	{"rotate", 0, &PointArray_rotate},
+	{"copy", 0, &PointArray_copy},
+	{NULL, 0, NULL}
+};
+static int PointArray_index(lua_State *L) {
+	CAD2D::PointArray *A = PointArray_check(L, 1);
+	if(lua_type(L, 2) == LUA_TNUMBER){
+		int i = lua_tointeger(L, 2);
+		if(1 <= i && i <= A->NumPoints()){
+			return Point_push(L, (*A)[i-1]);
+		}
+		return luaL_error(L, "Invalid indexing of a PointArray");
 	}
-	return ret;
+	switch(Index_lookup(L)){
+	case -1:
+		return 1;
+	case POINTARRAY_N:
+		lua_pushinteger(L, A->NumPoints());
+		return 1;
+	}
+	return luaL_error(L, "Invalid indexing of a PointArray");
 }
-*/
-
-
 
 
 
 static int Poly_push(lua_State *L, const CAD2D::Poly &p){
-	CAD2D::Poly *P = (CAD2D::Poly*)lua_newuserdata(L, sizeof(CAD2D::Poly));
-	P = new(P) CAD2D::Poly(p);
-	luaL_getmetatable(L, PolyClassName);
-	lua_setmetatable(L, -2);
+	new(Udata_new(L, TAG_POLY, sizeof(CAD2D::Poly))) CAD2D::Poly(p);
 	return 1;
 }
 static int Poly_create(lua_State *L){
 	std::vector<CAD2D::Point> p;
 	const int narg = lua_gettop(L);
-	if(narg >= 3){
-		if(Arcseg_is(L, 1)){
-			/// TODO
-		}else{
-			for(int i = 1; i <= narg; ++i){
-				CAD2D::Point *pp = Point_check(L, i);
-				p.push_back(*pp);
-			}
+	if(narg >= 2 && Arcseg_is(L, 1)){
+		// Each Arcseg contributes its start point and bulge; the end
+		// point is taken to be the start of the next one.
+		std::vector<CAD2D::Poly::PointG> v;
+		for(int i = 1; i <= narg; ++i){
+			CAD2D::Arcseg *s = Arcseg_check(L, i);
+			v.push_back(CAD2D::Poly::PointG(s->p, s->g));
+		}
+		return Poly_push(L, CAD2D::Poly(v));
+	}else if(narg >= 3){
+		for(int i = 1; i <= narg; ++i){
+			CAD2D::Point *pp = Point_check(L, i);
+			p.push_back(*pp);
 		}
+	}else if(narg == 1 && PointArray_is(L, 1)){
+		return Poly_push(L, CAD2D::Poly(*PointArray_check(L, 1)));
 	}else if(narg == 1 && lua_istable(L, 1) && lua_rawlen(L,1) > 1){
 		int ntab = lua_rawlen(L, 1);
+		lua_rawgeti(L, 1, 1);
+		const bool arcs = Arcseg_is(L, -1);
+		lua_pop(L, 1);
+		if(arcs){
+			std::vector<CAD2D::Poly::PointG> v;
+			for(int i = 1; i <= ntab; ++i){
+				lua_rawgeti(L, 1, i);
+				CAD2D::Arcseg *s = Arcseg_check(L, -1);
+				v.push_back(CAD2D::Poly::PointG(s->p, s->g));
+				lua_pop(L, 1);
+			}
+			return Poly_push(L, CAD2D::Poly(v));
+		}
 		for(int i = 1; i <= ntab; ++i){
 			lua_pushinteger(L, i);
 			lua_gettable(L, 1);
@@ -868,23 +3186,18 @@ static int Poly_create(lua_State *L){
 	return Poly_push(L, CAD2D::Poly(p));
 }
 static bool Poly_is(lua_State *L, int narg){
-	return (lua_type(L, narg) == LUA_TUSERDATA) && (NULL != luaL_testudata(L, narg, PolyClassName));
+	return TAG_POLY == Udata_tag(L, narg);
 }
 static int IsPoly(lua_State *L){
 	lua_pushboolean(L, Poly_is(L, 1));
 	return 1;
 }
 static CAD2D::Poly *Poly_check(lua_State *L, int narg){
-	luaL_checktype(L, narg, LUA_TUSERDATA);
-	void *ud = luaL_checkudata(L, narg, PolyClassName);
-	if(!ud){
-		luaL_argerror(L, narg, "expected Poly object");
-		return NULL;
-	}
-	return (CAD2D::Poly*)ud;
+	return (CAD2D::Poly*)Udata_check(L, narg, TAG_POLY);
 }
 static int Poly_gc(lua_State *L) {
-	Poly_check(L, 1);
+	CAD2D::Poly *P = Poly_check(L, 1);
+	P->~Poly();
 	return 0;
 }
 static int Poly_arcseg(lua_State *L){
@@ -893,45 +3206,458 @@ static int Poly_arcseg(lua_State *L){
 	Arcseg_push(L, (*P)(i-1));
 	return 1;
 }
+// contains(Point) returns a boolean. contains(PointArray) returns a table
+// of booleans, one per point, followed by the number of points inside.
 static int Poly_contains(lua_State *L){
 	CAD2D::Poly *P = Poly_check(L, 1);
+	if(PointArray_is(L, 2)){
+		const CAD2D::PointArray *A = PointArray_check(L, 2);
+		const int n = A->NumPoints();
+		int ninside = 0;
+		lua_createtable(L, n, 0);
+		for(int i = 0; i < n; ++i){
+			const bool inside = P->Contains(CAD2D::Point(A->x[i], A->y[i]));
+			ninside += inside;
+			lua_pushboolean(L, inside);
+			lua_rawseti(L, -2, i+1);
+		}
+		lua_pushinteger(L, ninside);
+		return 2;
+	}
 	CAD2D::Point *pt = Point_check(L, 2);
 	lua_pushboolean(L, P->Contains(*pt));
 	return 1;
 }
+// Pushes the loops of an offset or boolean operation
+static int Poly_push_loops(lua_State *L, const std::vector<CAD2D::Poly> &loops){
+	luaL_checkstack(L, loops.size(), "too many loops");
+	for(unsigned int i = 0; i < loops.size(); ++i){
+		Poly_push(L, loops[i]);
+	}
+	return loops.size();
+}
 static int Poly_offset(lua_State *L){
 	CAD2D::Poly *P = Poly_check(L, 1);
 	double h = luaL_checknumber(L, 2);
-	Poly_push(L, P->Offset(h));
-	return 1;
+	// p:offset(h) grows the poly for h > 0 and shrinks it for h < 0.
+	// Returns each resulting loop, largest first; holes have the opposite
+	// orientation. Returns nothing if the poly vanishes.
+	return Poly_push_loops(L, P->Offset(h));
+}
+// Appends the Poly, or the Polys of the table, at narg to S. Each
+// argument is a region of its own, winding once around its inside: flip
+// gets one entry per Poly, set for those of a lone Poly that runs
+// clockwise, or of a table whose loops have a negative total area.
+static void Poly_collect(lua_State *L, int narg, std::vector<const CAD2D::Poly*> &S, std::vector<char> &flip){
+	if(lua_type(L, narg) != LUA_TTABLE){
+		const CAD2D::Poly *P = Poly_check(L, narg);
+		S.push_back(P);
+		flip.push_back(P->Area() < 0);
+		return;
+	}
+	const int n = lua_rawlen(L, narg);
+	double area = 0;
+	for(int i = 1; i <= n; ++i){
+		lua_rawgeti(L, narg, i);
+		if(Udata_tag(L, -1) != TAG_POLY){
+			luaL_error(L, "Poly expected at index %d of argument %d", i, narg);
+		}
+		// The table keeps the Poly alive
+		S.push_back((const CAD2D::Poly*)Udata_to(L, -1));
+		area += S.back()->Area();
+		lua_pop(L, 1);
+	}
+	flip.resize(S.size(), area < 0);
+}
+// Replaces the Polys of S marked in flip by reversed copies kept in R,
+// which must have been reserved for all of them.
+static void Poly_orient(std::vector<const CAD2D::Poly*> &S, const std::vector<char> &flip, std::vector<CAD2D::Poly> &R){
+	for(unsigned int i = 0; i < S.size(); ++i){
+		if(!flip[i]){ continue; }
+		std::vector<CAD2D::Poly::PointG> u(S[i]->v.begin(), S[i]->v.end());
+		CAD2D::ReverseLoop(u);
+		R.push_back(CAD2D::Poly(u));
+		S[i] = &R.back();
+	}
+}
+// p:union(q, ...), p:intersect(q) and p:subtract(q, ...). Each argument
+// is a Poly or a table of Polys. A lone Poly is solid whichever way it
+// runs; the loops of a table are combined by the nonzero winding rule, as
+// an outline with oppositely oriented holes, and the table as a whole may
+// run either way. The arguments are then joined, so that inputs of
+// opposite orientations do not cancel. Like offset, these return the
+// loops of the result, largest first, with holes oppositely oriented.
+static int Poly_boolean(lua_State *L, CAD2D::PolyBoolOp op){
+	std::vector<const CAD2D::Poly*> A, B;
+	std::vector<char> fa, fb;
+	std::vector<CAD2D::Poly> R;
+	Poly_collect(L, 1, A, fa);
+	const int top = lua_gettop(L);
+	if(CAD2D::POLY_INTERSECTION == op){
+		luaL_checkany(L, 2);
+	}
+	for(int i = 2; i <= top; ++i){
+		if(CAD2D::POLY_UNION == op){
+			Poly_collect(L, i, A, fa);
+		}else{
+			Poly_collect(L, i, B, fb);
+		}
+	}
+	R.reserve(std::count(fa.begin(), fa.end(), 1) + std::count(fb.begin(), fb.end(), 1));
+	Poly_orient(A, fa, R);
+	Poly_orient(B, fb, R);
+	return Poly_push_loops(L, CAD2D::PolyBoolean(A, B, op));
+}
+static int Poly_union(lua_State *L){
+	return Poly_boolean(L, CAD2D::POLY_UNION);
 }
+static int Poly_intersect(lua_State *L){
+	return Poly_boolean(L, CAD2D::POLY_INTERSECTION);
+}
+static int Poly_subtract(lua_State *L){
+	return Poly_boolean(L, CAD2D::POLY_DIFFERENCE);
+}
+enum{ POLY_N = 1, POLY_AREA, POLY_PERIMETER };
+static const IndexKey PolyKeys[] = {
+	{"n", POLY_N, NULL},
+	{"area", POLY_AREA, NULL},
+	{"perimeter", POLY_PERIMETER, NULL},
+	{"arcseg", 0, &Poly_arcseg},
+	{"contains", 0, &Poly_contains},
+	{"offset", 0, &Poly_offset},
+	{"union", 0, &Poly_union},
+	{"intersect", 0, &Poly_intersect},
+	{"subtract", 0, &Poly_subtract},
+	{NULL, 0, NULL}
+};
 static int Poly_index(lua_State *L) {
 	CAD2D::Poly *P = Poly_check(L, 1);
-	if(lua_isnumber(L, 2)){
+	if(lua_type(L, 2) == LUA_TNUMBER){
 		int i = lua_tointeger(L, 2);
 		return Point_push(L, (*P)[i-1]);
-	}else if(lua_isstring(L, 2)){
-		if(0 == strcmp("n", lua_tostring(L, 2))){
-			lua_pushinteger(L, P->NumVertices());
-			return 1;
-		}else if(0 == strcmp("arcseg", lua_tostring(L, 2))){
-			lua_pushcfunction(L, &Poly_arcseg);
-			return 1;
-		}else if(0 == strcmp("contains", lua_tostring(L, 2))){
-			lua_pushcfunction(L, &Poly_contains);
-			return 1;
-		}else if(0 == strcmp("area", lua_tostring(L, 2))){
-			lua_pushnumber(L, P->Area());
-			return 1;
-		}else if(0 == strcmp("perimeter", lua_tostring(L, 2))){
-			lua_pushnumber(L, P->Perimeter());
+	}
+	switch(Index_lookup(L)){
+	case -1:
+		return 1;
+	case POLY_N:
+		lua_pushinteger(L, P->NumVertices());
+		return 1;
+	case POLY_AREA:
+		lua_pushnumber(L, P->Area());
+		return 1;
+	case POLY_PERIMETER:
+		lua_pushnumber(L, P->Perimeter());
+		return 1;
+	}
+	return luaL_error(L, "Invalid indexing of a Poly");
+}
+
+
+
+
+// A PolySet is created from a table of Polys, or from Polys as arguments,
+// and holds its own copies of them.
+static int PolySet_create(lua_State *L){
+	std::vector<CAD2D::Poly> P;
+	const int narg = lua_gettop(L);
+	if(1 == narg && lua_type(L, 1) == LUA_TTABLE){
+		const int n = lua_rawlen(L, 1);
+		P.reserve(n);
+		for(int i = 1; i <= n; ++i){
+			lua_rawgeti(L, 1, i);
+			if(!Poly_is(L, -1)){
+				return luaL_error(L, "PolySet expected a table of Polys");
+			}
+			P.push_back(*Poly_check(L, -1));
+			lua_pop(L, 1);
+		}
+	}else{
+		P.reserve(narg);
+		for(int i = 1; i <= narg; ++i){
+			P.push_back(*Poly_check(L, i));
+		}
+	}
+	new(Udata_new(L, TAG_POLYSET, sizeof(CAD2D::PolySet))) CAD2D::PolySet(P);
+	return 1;
+}
+static bool PolySet_is(lua_State *L, int narg){
+	return TAG_POLYSET == Udata_tag(L, narg);
+}
+static int IsPolySet(lua_State *L){
+	lua_pushboolean(L, PolySet_is(L, 1));
+	return 1;
+}
+static CAD2D::PolySet *PolySet_check(lua_State *L, int narg){
+	return (CAD2D::PolySet*)Udata_check(L, narg, TAG_POLYSET);
+}
+static int PolySet_gc(lua_State *L) {
+	CAD2D::PolySet *S = PolySet_check(L, 1);
+	S->~PolySet();
+	return 0;
+}
+static int PolySet_len(lua_State *L){
+	CAD2D::PolySet *S = PolySet_check(L, 1);
+	lua_pushinteger(L, S->Size());
+	return 1;
+}
+// S:nearest(p) returns the index of the Poly nearest to p and its
+// distance (0 if p is inside), or nil for an empty set. S:nearest(p, k)
+// returns tables of the indices and distances of the k nearest.
+static int PolySet_nearest(lua_State *L){
+	CAD2D::PolySet *S = PolySet_check(L, 1);
+	CAD2D::Point *p = Point_check(L, 2);
+	if(lua_isnoneornil(L, 3)){
+		int index;
+		double dist;
+		if(0 == S->Nearest(*p, 1, &index, &dist)){
+			lua_pushnil(L);
 			return 1;
-		}else if(0 == strcmp("offset", lua_tostring(L, 2))){
-			lua_pushcfunction(L, &Poly_offset);
+		}
+		lua_pushinteger(L, index+1);
+		lua_pushnumber(L, dist);
+		return 2;
+	}
+	const int k = std::min((int)luaL_checkinteger(L, 3), S->Size());
+	luaL_argcheck(L, k >= 0, 3, "k must be nonnegative");
+	std::vector<int> index(k+1);
+	std::vector<double> dist(k+1);
+	const int m = S->Nearest(*p, k, &index[0], &dist[0]);
+	lua_createtable(L, m, 0);
+	for(int i = 0; i < m; ++i){
+		lua_pushinteger(L, index[i]+1);
+		lua_rawseti(L, -2, i+1);
+	}
+	lua_createtable(L, m, 0);
+	for(int i = 0; i < m; ++i){
+		lua_pushnumber(L, dist[i]);
+		lua_rawseti(L, -2, i+1);
+	}
+	return 2;
+}
+static void QueryCounts_push(lua_State *L, const geom_query_counts &c){
+	lua_createtable(L, 0, 5);
+	lua_pushinteger(L, (lua_Integer)c.queries);
+	lua_setfield(L, -2, "queries");
+	lua_pushinteger(L, (lua_Integer)c.nodes);
+	lua_setfield(L, -2, "nodes");
+	lua_pushinteger(L, (lua_Integer)c.leaves);
+	lua_setfield(L, -2, "leaves");
+	lua_pushinteger(L, (lua_Integer)c.contains);
+	lua_setfield(L, -2, "contains");
+	lua_pushinteger(L, (lua_Integer)c.hits);
+	lua_setfield(L, -2, "hits");
+}
+// S:stats() returns tables of the counts summed over all queries since
+// creation or the last S:resetstats(), and of the last query alone.
+static int PolySet_stats(lua_State *L){
+	CAD2D::PolySet *S = PolySet_check(L, 1);
+	QueryCounts_push(L, S->TotalStats());
+	QueryCounts_push(L, S->LastStats());
+	return 2;
+}
+static int PolySet_resetstats(lua_State *L){
+	PolySet_check(L, 1)->ResetStats();
+	return 0;
+}
+enum{ POLYSET_N = 1 };
+static const IndexKey PolySetKeys[] = {
+	{"n", POLYSET_N, NULL},
+	{"nearest", 0, &PolySet_nearest},
+	{"stats", 0, &PolySet_stats},
+	{"resetstats", 0, &PolySet_resetstats},
+	{NULL, 0, NULL}
+};
+static int PolySet_index(lua_State *L) {
+	CAD2D::PolySet *S = PolySet_check(L, 1);
+	if(lua_type(L, 2) == LUA_TNUMBER){
+		int i = lua_tointeger(L, 2);
+		if(1 <= i && i <= S->Size()){
+			return Poly_push(L, (*S)[i-1]);
+		}
+		return luaL_error(L, "Invalid indexing of a PolySet");
+	}
+	switch(Index_lookup(L)){
+	case -1:
+		return 1;
+	case POLYSET_N:
+		lua_pushinteger(L, S->Size());
+		return 1;
+	}
+	return luaL_error(L, "Invalid indexing of a PolySet");
+}
+
+
+
+
+static CAD2D::Matrix *Matrix_new(lua_State *L){
+	return new(Udata_new(L, TAG_MATRIX, sizeof(CAD2D::Matrix))) CAD2D::Matrix();
+}
+static int Matrix_push(lua_State *L, const CAD2D::Matrix &m){
+	CAD2D::Matrix *M = Matrix_new(L);
+	*M = m;
+	return 1;
+}
+static int Matrix_create(lua_State *L){
+	const int narg = lua_gettop(L);
+	if(0 == narg){
+		Matrix_new(L);
+		return 1;
+	}else if(6 == narg){
+		double m[6];
+		for(int i = 0; i < 6; ++i){
+			m[i] = luaL_checknumber(L, i+1);
+		}
+		return Matrix_push(L, CAD2D::Matrix(m[0], m[1], m[2], m[3], m[4], m[5]));
+	}
+	return luaL_error(L, "Invalid syntax for creating a Matrix");
+}
+static bool Matrix_is(lua_State *L, int narg){
+	return TAG_MATRIX == Udata_tag(L, narg);
+}
+static int IsMatrix(lua_State *L){
+	lua_pushboolean(L, Matrix_is(L, 1));
+	return 1;
+}
+static CAD2D::Matrix *Matrix_check(lua_State *L, int narg){
+	return (CAD2D::Matrix*)Udata_check(L, narg, TAG_MATRIX);
+}
+static int Matrix_gc(lua_State *L) {
+	Matrix_check(L, 1);
+	return 0;
+}
+// The builder methods below return M followed by the new transform, so
+// that chains such as M:rotate(a):translate(v) read in the order applied.
+static int Matrix_translate(lua_State *L){
+	const CAD2D::Matrix *M = Matrix_check(L, 1);
+	if(Vector_is(L, 2)){
+		const CAD2D::Vector *v = Vector_check(L, 2);
+		return Matrix_push(L, CAD2D::Matrix::Translation(v->x, v->y) * (*M));
+	}
+	double dx = luaL_checknumber(L, 2);
+	double dy = luaL_checknumber(L, 3);
+	return Matrix_push(L, CAD2D::Matrix::Translation(dx, dy) * (*M));
+}
+// Wraps T so that it acts about the optional center Point at narg
+static CAD2D::Matrix Matrix_about(lua_State *L, int narg, const CAD2D::Matrix &T){
+	if(lua_isnoneornil(L, narg)){ return T; }
+	const CAD2D::Point *c = Point_check(L, narg);
+	return CAD2D::Matrix::Translation(c->x, c->y) * T * CAD2D::Matrix::Translation(-c->x, -c->y);
+}
+static int Matrix_scale(lua_State *L){
+	const CAD2D::Matrix *M = Matrix_check(L, 1);
+	double sx = luaL_checknumber(L, 2);
+	double sy = sx;
+	int ic = 3;
+	if(lua_isnumber(L, 3)){
+		sy = lua_tonumber(L, 3);
+		ic = 4;
+	}
+	return Matrix_push(L, Matrix_about(L, ic, CAD2D::Matrix::Scaling(sx, sy)) * (*M));
+}
+static int Matrix_rotate(lua_State *L){
+	const CAD2D::Matrix *M = Matrix_check(L, 1);
+	double angle = luaL_checknumber(L, 2);
+	return Matrix_push(L, Matrix_about(L, 3, CAD2D::Matrix::Rotation(angle)) * (*M));
+}
+static int Matrix_reflect(lua_State *L){
+	const CAD2D::Matrix *M = Matrix_check(L, 1);
+	if(Ray_is(L, 2)){
+		const CAD2D::Ray *r = Ray_check(L, 2);
+		const CAD2D::Matrix T(
+			CAD2D::Matrix::Translation(r->p.x, r->p.y) *
+			CAD2D::Matrix::Reflection(r->d) *
+			CAD2D::Matrix::Translation(-r->p.x, -r->p.y)
+		);
+		return Matrix_push(L, T * (*M));
+	}
+	const CAD2D::Direction *d = Direction_check(L, 2);
+	return Matrix_push(L, CAD2D::Matrix::Reflection(*d) * (*M));
+}
+static int Matrix_inverse(lua_State *L){
+	const CAD2D::Matrix *M = Matrix_check(L, 1);
+	if(0 == M->Determinant()){
+		return luaL_error(L, "Cannot invert a singular Matrix");
+	}
+	return Matrix_push(L, M->Inverse());
+}
+static void Matrix_checkarcs(lua_State *L, const CAD2D::Matrix &M, bool hasarcs){
+	if(hasarcs && !M.IsSimilarity()){
+		luaL_error(L, "Matrix does not map arcs to arcs");
+	}
+}
+// Transforms each argument after the Matrix in place and returns them.
+static int Matrix_apply(lua_State *L){
+	const CAD2D::Matrix *M = Matrix_check(L, 1);
+	const int narg = lua_gettop(L);
+	for(int i = 2; i <= narg; ++i){
+		switch(Udata_tag(L, i)){
+		case TAG_POLY:
+			{
+				CAD2D::Poly *P = (CAD2D::Poly*)Udata_to(L, i);
+				Matrix_checkarcs(L, *M, P->HasArcs());
+				P->Transform(*M);
+			}
+			break;
+		case TAG_POINTARRAY:
+			((CAD2D::PointArray*)Udata_to(L, i))->Transform(*M);
+			break;
+		case TAG_ARCSEG:
+			{
+				CAD2D::Arcseg *S = (CAD2D::Arcseg*)Udata_to(L, i);
+				Matrix_checkarcs(L, *M, 0 != S->g);
+				S->Transform(*M);
+			}
+			break;
+		case TAG_RAY:
+			((CAD2D::Ray*)Udata_to(L, i))->Transform(*M);
+			break;
+		case TAG_POINT:
+			{
+				CAD2D::Point *p = (CAD2D::Point*)Udata_to(L, i);
+				*p = (*M) * (*p);
+			}
+			break;
+		case TAG_VECTOR:
+			{
+				CAD2D::Vector *v = (CAD2D::Vector*)Udata_to(L, i);
+				*v = (*M) * (*v);
+			}
+			break;
+		default:
+			return luaL_argerror(L, i, "cannot apply Matrix to this object");
+		}
+	}
+	return narg-1;
+}
+enum{ MATRIX_DET = 1 };
+static const IndexKey MatrixKeys[] = {
+	{"det", MATRIX_DET, NULL},
+	{"translate", 0, &Matrix_translate},
+	{"scale", 0, &Matrix_scale},
+	{"rotate", 0, &Matrix_rotate},
+	{"reflect", 0, &Matrix_reflect},
+	{"inverse", 0, &Matrix_inverse},
+	{"apply", 0, &Matrix_apply},
+	{NULL, 0, NULL}
+};
+static int Matrix_index(lua_State *L){
+	CAD2D::Matrix *M = Matrix_check(L, 1);
+	if(lua_type(L, 2) == LUA_TNUMBER){
+		int i = lua_tointeger(L, 2);
+		if(1 <= i && i <= 6){
+			lua_pushnumber(L, M->m[i-1]);
 			return 1;
 		}
+		return luaL_error(L, "Invalid indexing of a Matrix");
 	}
-	return luaL_error(L, "Invalid indexing of a Poly");
+	switch(Index_lookup(L)){
+	case -1:
+		return 1;
+	case MATRIX_DET:
+		lua_pushnumber(L, M->Determinant());
+		return 1;
+	}
+	return luaL_error(L, "Invalid indexing of a Matrix");
 }
 
 
@@ -1022,11 +3748,16 @@ static int Vector_concat(lua_State *L){
 	return 1;
 }
 
+// Pushes the image of p under M, constructed in place in the new userdata
+static int Poly_push_transformed(lua_State *L, const CAD2D::Matrix &M, const CAD2D::Poly &p){
+	new(Udata_new(L, TAG_POLY, sizeof(CAD2D::Poly))) CAD2D::Poly(M, p);
+	return 1;
+}
 static int Poly_add(lua_State *L){
 	const CAD2D::Poly *p = Poly_check(L, 1);
 	if(Vector_is(L, 2)){
 		const CAD2D::Vector *v = Vector_check(L, 2);
-		return Poly_push(L, (*p)+(*v));
+		return Poly_push_transformed(L, CAD2D::Matrix::Translation(v->x, v->y), *p);
 	}
 	return luaL_error(L, "Invalid Poly addition");
 }
@@ -1034,7 +3765,7 @@ static int Poly_sub(lua_State *L){
 	const CAD2D::Poly *p = Poly_check(L, 1);
 	if(Vector_is(L, 2)){
 		const CAD2D::Vector *v = Vector_check(L, 2);
-		return Poly_push(L, (*p)-(*v));
+		return Poly_push_transformed(L, CAD2D::Matrix::Translation(-v->x, -v->y), *p);
 	}
 	return luaL_error(L, "Invalid Poly subtraction");
 }
@@ -1048,12 +3779,155 @@ static int Poly_mul(lua_State *L){
 		p = Poly_check(L, 1);
 		s = luaL_checknumber(L, 2);
 	}
-	return Poly_push(L, s*(*p));
+	return Poly_push_transformed(L, CAD2D::Matrix::Scaling(s, s), *p);
 }
 static int Poly_div(lua_State *L){
 	double s = luaL_checknumber(L, 2);
 	const CAD2D::Poly *p = Poly_check(L, 1);
-	return Poly_push(L, (*p) / s);
+	return Poly_push_transformed(L, CAD2D::Matrix::Scaling(1./s, 1./s), *p);
+}
+
+static int Matrix_mul(lua_State *L){
+	const CAD2D::Matrix *M = Matrix_check(L, 1);
+	switch(Udata_tag(L, 2)){
+	case TAG_MATRIX:
+		return Matrix_push(L, (*M) * (*(CAD2D::Matrix*)Udata_to(L, 2)));
+	case TAG_POLY:
+		{
+			const CAD2D::Poly *p = (CAD2D::Poly*)Udata_to(L, 2);
+			Matrix_checkarcs(L, *M, p->HasArcs());
+			return Poly_push_transformed(L, *M, *p);
+		}
+	case TAG_POINTARRAY:
+		{
+			CAD2D::PointArray *A = PointArray_new(L);
+			*A = *(CAD2D::PointArray*)Udata_to(L, 2);
+			A->Transform(*M);
+			return 1;
+		}
+	case TAG_ARCSEG:
+		{
+			CAD2D::Arcseg s(*(CAD2D::Arcseg*)Udata_to(L, 2));
+			Matrix_checkarcs(L, *M, 0 != s.g);
+			s.Transform(*M);
+			return Arcseg_push(L, s);
+		}
+	case TAG_RAY:
+		{
+			CAD2D::Ray r(*(CAD2D::Ray*)Udata_to(L, 2));
+			r.Transform(*M);
+			return Ray_push(L, r);
+		}
+	case TAG_POINT:
+		return Point_push(L, (*M) * (*(CAD2D::Point*)Udata_to(L, 2)));
+	case TAG_VECTOR:
+		return Vector_push(L, (*M) * (*(CAD2D::Vector*)Udata_to(L, 2)));
+	case TAG_DIRECTION:
+		return Direction_push(L, (*M) * (*(CAD2D::Direction*)Udata_to(L, 2)));
+	}
+	return luaL_error(L, "Invalid Matrix multiplication");
+}
+
+static int MemoryStats(lua_State *L){
+	const CAD2D::BufferPool::Stats &st = CAD2D::BufferPool::Instance().GetStats();
+	lua_createtable(L, 0, 6);
+	lua_pushinteger(L, (lua_Integer)st.nalloc);
+	lua_setfield(L, -2, "allocs");
+	lua_pushinteger(L, (lua_Integer)st.nfree);
+	lua_setfield(L, -2, "frees");
+	lua_pushinteger(L, (lua_Integer)st.nsystem);
+	lua_setfield(L, -2, "system_allocs");
+	lua_pushinteger(L, (lua_Integer)st.nlive);
+	lua_setfield(L, -2, "live");
+	lua_pushinteger(L, (lua_Integer)st.bytes_live);
+	lua_setfield(L, -2, "live_bytes");
+	lua_pushinteger(L, (lua_Integer)st.bytes_pooled);
+	lua_setfield(L, -2, "pooled_bytes");
+	return 1;
+}
+static int ReleaseMemory(lua_State *L){
+	CAD2D::BufferPool::Instance().Release();
+	return 0;
+}
+
+// Output(...) writes its arguments to the output sink like print: tab
+// separated and newline terminated. Numbers are written in the shortest
+// form that reads back exactly.
+static int Output(lua_State *L){
+	CAD2D::OutputSink &out = CAD2D::OutputSink::Instance();
+	const int narg = lua_gettop(L);
+	for(int i = 1; i <= narg; ++i){
+		if(i > 1){ out.Write('\t'); }
+		size_t len;
+		const char *s;
+		switch(lua_type(L, i)){
+		case LUA_TNUMBER:
+			out.Write((double)lua_tonumber(L, i));
+			break;
+		case LUA_TSTRING:
+			s = lua_tolstring(L, i, &len);
+			out.Write(s, len);
+			break;
+		default:
+			s = luaL_tolstring(L, i, &len);
+			out.Write(s, len);
+			lua_pop(L, 1);
+		}
+	}
+	out.Write('\n');
+	return 0;
+}
+// OutputPath(p) writes the path of a Poly or PointArray, closed.
+static int OutputPath(lua_State *L){
+	CAD2D::OutputSink &out = CAD2D::OutputSink::Instance();
+	switch(Udata_tag(L, 1)){
+	case TAG_POLY:
+		out.WritePath(*(CAD2D::Poly*)Udata_to(L, 1));
+		return 0;
+	case TAG_POINTARRAY:
+		out.WritePath(*(CAD2D::PointArray*)Udata_to(L, 1));
+		return 0;
+	}
+	return luaL_argerror(L, 1, "Poly or PointArray expected");
+}
+// OutputTo([target [, path]]) selects 'stdout' (the default), 'file' or
+// 'buffer'. Pending output for the previous target is flushed. Returns
+// true, or nil and a message if the file cannot be opened.
+static int OutputTo(lua_State *L){
+	static const char *const names[] = { "stdout", "file", "buffer", NULL };
+	static const CAD2D::OutputSink::Target targets[] = {
+		CAD2D::OutputSink::TARGET_STDOUT,
+		CAD2D::OutputSink::TARGET_FILE,
+		CAD2D::OutputSink::TARGET_BUFFER
+	};
+	const int i = luaL_checkoption(L, 1, "stdout", names);
+	const char *path = NULL;
+	if(CAD2D::OutputSink::TARGET_FILE == targets[i]){
+		path = luaL_checkstring(L, 2);
+	}
+	if(!CAD2D::OutputSink::Instance().Open(targets[i], path)){
+		lua_pushnil(L);
+		lua_pushfstring(L, "cannot open %s", path);
+		return 2;
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+// OutputFlush() writes out pending output. Returns false on a write error.
+static int OutputFlush(lua_State *L){
+	lua_pushboolean(L, CAD2D::OutputSink::Instance().Flush());
+	return 1;
+}
+// OutputBuffer() returns and clears the text held by the 'buffer' target.
+static int OutputBuffer(lua_State *L){
+	CAD2D::OutputSink &out = CAD2D::OutputSink::Instance();
+	if(CAD2D::OutputSink::TARGET_BUFFER != out.GetTarget()){
+		lua_pushliteral(L, "");
+		return 1;
+	}
+	lua_pushlstring(L, out.Contents().data(), out.Contents().size());
+	out.Clear();
+	return 1;
 }
 
 static int Circle_create(lua_State *L){
@@ -1074,15 +3948,18 @@ static int Circle_create(lua_State *L){
 static int Distance_dispatch(lua_State *L){
 	const int narg = lua_gettop(L);
 	if(2 == narg){
-		if(Point_is(L, 1) && Point_is(L, 2)){
-			CAD2D::Point *p = Point_check(L, 1);
-			CAD2D::Point *q = Point_check(L, 2);
-			lua_pushnumber(L, Distance(*p, *q));
+		switch(TAG_PAIR(Udata_tag(L, 1), Udata_tag(L, 2))){
+		case TAG_PAIR(TAG_POINT, TAG_POINT):
+			lua_pushnumber(L, Distance(*(CAD2D::Point*)Udata_to(L, 1), *(CAD2D::Point*)Udata_to(L, 2)));
 			return 1;
-		}else if(Ray_is(L, 1) && Point_is(L, 2)){
-			CAD2D::Ray *r = Ray_check(L, 1);
-			CAD2D::Point *p = Point_check(L, 2);
-			lua_pushnumber(L, Distance(*r, *p));
+		case TAG_PAIR(TAG_RAY, TAG_POINT):
+			lua_pushnumber(L, Distance(*(CAD2D::Ray*)Udata_to(L, 1), *(CAD2D::Point*)Udata_to(L, 2)));
+			return 1;
+		case TAG_PAIR(TAG_POLY, TAG_POINT):
+			lua_pushnumber(L, Distance(*(CAD2D::Poly*)Udata_to(L, 1), *(CAD2D::Point*)Udata_to(L, 2)));
+			return 1;
+		case TAG_PAIR(TAG_POINT, TAG_POLY):
+			lua_pushnumber(L, Distance(*(CAD2D::Poly*)Udata_to(L, 2), *(CAD2D::Point*)Udata_to(L, 1)));
 			return 1;
 		}
 	}
@@ -1101,42 +3978,126 @@ static int Angle_dispatch(lua_State *L){
 }
 
 
+// Reads a table of kernel objects with the given tag into v
+template <class T>
+static void Batch_read(lua_State *L, int narg, unsigned int tag, std::vector<T> &v){
+	const int n = lua_rawlen(L, narg);
+	v.reserve(n);
+	for(int i = 1; i <= n; ++i){
+		lua_rawgeti(L, narg, i);
+		if(Udata_tag(L, -1) != tag){
+			luaL_error(L, "Intersection expected a table of %s at index %d", TagClassName[tag], i);
+		}
+		v.push_back(*(T*)Udata_to(L, -1));
+		lua_pop(L, 1);
+	}
+}
+// Reads the edges of a Poly, or a table of Arcsegs, at narg
+static void Batch_read_curves(lua_State *L, int narg, std::vector<CAD2D::Arcseg> &v){
+	if(Poly_is(L, narg)){
+		const CAD2D::Poly *P = Poly_check(L, narg);
+		v.reserve(P->NumVertices());
+		for(int i = 0; i < P->NumVertices(); ++i){
+			v.push_back((*P)(i));
+		}
+	}else{
+		Batch_read(L, narg, TAG_ARCSEG, v);
+	}
+}
+// Batched forms of Intersection:
+//   Intersection({rays}, {rays} | {arcsegs} | poly)
+//   Intersection({arcsegs} | poly, {arcsegs} | poly)
+// return all hit points as a PointArray, followed by a flat table of
+// 1-based index pairs {i1, j1, i2, j2, ...} into the two arguments. For a
+// Poly, the index is that of the edge, as used by arcseg().
+static int Intersection_batch(lua_State *L){
+	CAD2D::HitArray hits;
+	if(!Poly_is(L, 2)){
+		luaL_checktype(L, 2, LUA_TTABLE);
+	}
+	if(Poly_is(L, 1)){
+		std::vector<CAD2D::Arcseg> u, v;
+		Batch_read_curves(L, 1, u);
+		Batch_read_curves(L, 2, v);
+		hits = Intersection(u, v);
+	}else{
+		luaL_checktype(L, 1, LUA_TTABLE);
+		lua_rawgeti(L, 1, 1);
+		const unsigned int tag1 = Udata_tag(L, -1);
+		lua_pop(L, 1);
+		lua_rawgeti(L, 2, 1);
+		const unsigned int tag2 = (Poly_is(L, 2) ? TAG_POLY : Udata_tag(L, -1));
+		lua_pop(L, 1);
+		if(TAG_ARCSEG == tag1){
+			std::vector<CAD2D::Arcseg> u, v;
+			Batch_read(L, 1, TAG_ARCSEG, u);
+			Batch_read_curves(L, 2, v);
+			hits = Intersection(u, v);
+		}else{
+			std::vector<CAD2D::Ray> rays;
+			Batch_read(L, 1, TAG_RAY, rays);
+			if(TAG_ARCSEG == tag2 || TAG_POLY == tag2){
+				std::vector<CAD2D::Arcseg> curves;
+				Batch_read_curves(L, 2, curves);
+				hits = Intersection(rays, curves);
+			}else{
+				std::vector<CAD2D::Ray> lines;
+				Batch_read(L, 2, TAG_RAY, lines);
+				hits = Intersection(rays, lines);
+			}
+		}
+	}
+	const int n = hits.NumHits();
+	PointArray_push(L, hits.p);
+	lua_createtable(L, 2*n, 0);
+	for(int k = 0; k < n; ++k){
+		lua_pushinteger(L, hits.i[k]+1);
+		lua_rawseti(L, -2, 2*k+1);
+		lua_pushinteger(L, hits.j[k]+1);
+		lua_rawseti(L, -2, 2*k+2);
+	}
+	return 2;
+}
 static int Intersection_dispatch(lua_State *L){
 	const int narg = lua_gettop(L);
+	if(2 == narg && (lua_istable(L, 1) || (Poly_is(L, 1) && lua_istable(L, 2)))){
+		return Intersection_batch(L);
+	}
 	if(2 == narg){
-		if(Ray_is(L,1) && Ray_is(L,2)){
-			CAD2D::Ray *u = Ray_check(L, 1);
-			CAD2D::Ray *v = Ray_check(L, 2);
-			Point_push(L, Intersection(*u, *v));
-			return 1;
-		}else if(Ray_is(L,1) && Arcseg_is(L,2)){
-			CAD2D::Ray *u = Ray_check(L, 1);
-			CAD2D::Arcseg *s = Arcseg_check(L, 2);
-			std::vector<CAD2D::Point> ret = Intersection(*u, *s);
-			int n = 0;
-			for(int i = 0; i < ret.size(); ++i){
-				n += Point_push(L, ret[i]);
-			}
-			return n;
-		}else if(Ray_is(L,2) && Arcseg_is(L,1)){
-			CAD2D::Ray *u = Ray_check(L, 2);
-			CAD2D::Arcseg *s = Arcseg_check(L, 1);
-			std::vector<CAD2D::Point> ret = Intersection(*u, *s);
-			int n = 0;
-			for(int i = 0; i < ret.size(); ++i){
-				n += Point_push(L, ret[i]);
+		switch(TAG_PAIR(Udata_tag(L, 1), Udata_tag(L, 2))){
+		case TAG_PAIR(TAG_RAY, TAG_RAY):
+			return Point_push(L, Intersection(*(CAD2D::Ray*)Udata_to(L, 1), *(CAD2D::Ray*)Udata_to(L, 2)));
+		case TAG_PAIR(TAG_RAY, TAG_ARCSEG):
+		case TAG_PAIR(TAG_ARCSEG, TAG_RAY):
+			{
+				const bool rayfirst = Ray_is(L, 1);
+				CAD2D::Ray *u = (CAD2D::Ray*)Udata_to(L, rayfirst ? 1 : 2);
+				CAD2D::Arcseg *s = (CAD2D::Arcseg*)Udata_to(L, rayfirst ? 2 : 1);
+				std::vector<CAD2D::Point> ret = Intersection(*u, *s);
+				int n = 0;
+				for(int i = 0; i < ret.size(); ++i){
+					n += Point_push(L, ret[i]);
+				}
+				return n;
 			}
-			return n;
-		}/*else if(Arcseg_is(L,1) && Arcseg_is(L,2)){
-			CAD2D::Arcseg *u = Arcseg_check(L, 1);
-			CAD2D::Arcseg *v = Arcseg_check(L, 2);
-			std::vector<CAD2D::Point> ret = Intersection(*u, *v);
-			int n = 0;
-			for(int i = 0; i < ret.size(); ++i){
-				n += Point_push(L, ret[i]);
+		case TAG_PAIR(TAG_RAY, TAG_POINTARRAY):
+			return PointArray_push(L, Intersection(*(CAD2D::Ray*)Udata_to(L, 1), *(CAD2D::PointArray*)Udata_to(L, 2)));
+		case TAG_PAIR(TAG_POINTARRAY, TAG_RAY):
+			return PointArray_push(L, Intersection(*(CAD2D::Ray*)Udata_to(L, 2), *(CAD2D::PointArray*)Udata_to(L, 1)));
+		case TAG_PAIR(TAG_ARCSEG, TAG_ARCSEG):
+			{
+				CAD2D::Arcseg *u = (CAD2D::Arcseg*)Udata_to(L, 1);
+				CAD2D::Arcseg *v = (CAD2D::Arcseg*)Udata_to(L, 2);
+				std::vector<CAD2D::Point> ret = Intersection(*u, *v);
+				int n = 0;
+				for(int i = 0; i < ret.size(); ++i){
+					n += Point_push(L, ret[i]);
+				}
+				return n;
 			}
-			return n;
-		}*/
+		case TAG_PAIR(TAG_POLY, TAG_POLY):
+			return Intersection_batch(L);
+		}
 	}
 	return luaL_error(L, "Invalid call to Intersection");
 }
@@ -1145,35 +4106,22 @@ static int Intersection_dispatch(lua_State *L){
 void CAD2Dkernel_register(lua_State *L){
 	static const luaL_Reg PointLib[] = {
 		{"__gc", &Point_gc},
-		{"__index", &Point_index},
 		{"__add", &Point_add},
 		{"__sub", &Point_sub},
 		{NULL, NULL}
 	};
-
-	luaL_newmetatable(L, PointClassName);
-	lua_pushvalue(L, -1);
-	lua_setfield(L, -2, "__index");
-	luaL_setfuncs(L, PointLib, 0);
-	lua_pop(L, 1);  /* pop new metatable */
+	Class_register(L, PointClassName, PointLib, &Point_index, PointKeys);
 
 	static const luaL_Reg DirectionLib[] = {
 		{"__gc", &Direction_gc},
-		{"__index", &Direction_index},
 		{"__unm", &Direction_unm},
 		{"__mul", &Direction_mul},
 		{NULL, NULL}
 	};
-
-	luaL_newmetatable(L, DirectionClassName);
-	lua_pushvalue(L, -1);
-	lua_setfield(L, -2, "__index");
-	luaL_setfuncs(L, DirectionLib, 0);
-	lua_pop(L, 1);  /* pop new metatable */
+	Class_register(L, DirectionClassName, DirectionLib, &Direction_index, DirectionKeys);
 
 	static const luaL_Reg VectorLib[] = {
 		{"__gc", &Vector_gc},
-		{"__index", &Vector_index},
 		{"__len", &Vector_len},
 		{"__unm", &Vector_unm},
 		{"__add", &Vector_add},
@@ -1184,52 +4132,60 @@ void CAD2Dkernel_register(lua_State *L){
 		{"__concat", &Vector_concat},
 		{NULL, NULL}
 	};
-
-	luaL_newmetatable(L, VectorClassName);
-	lua_pushvalue(L, -1);
-	lua_setfield(L, -2, "__index");
-	luaL_setfuncs(L, VectorLib, 0);
-	lua_pop(L, 1);  /* pop new metatable */
+	Class_register(L, VectorClassName, VectorLib, &Vector_index, VectorKeys);
 
 	static const luaL_Reg RayLib[] = {
 		{"__gc", &Ray_gc},
-		{"__index", &Ray_index},
 		{NULL, NULL}
 	};
-
-	luaL_newmetatable(L, RayClassName);
-	lua_pushvalue(L, -1);
-	lua_setfield(L, -2, "__index");
-	luaL_setfuncs(L, RayLib, 0);
-	lua_pop(L, 1);  /* pop new metatable */
+	Class_register(L, RayClassName, RayLib, &Ray_index, RayKeys);
 
 	static const luaL_Reg ArcsegLib[] = {
 		{"__gc", &Arcseg_gc},
-		{"__index", &Arcseg_index},
 		{NULL, NULL}
 	};
-
-	luaL_newmetatable(L, ArcsegClassName);
-	lua_pushvalue(L, -1);
-	lua_setfield(L, -2, "__index");
-	luaL_setfuncs(L, ArcsegLib, 0);
-	lua_pop(L, 1);  /* pop new metatable */
+	Class_register(L, ArcsegClassName, ArcsegLib, &Arcseg_index, ArcsegKeys);
 
 	static const luaL_Reg PolyLib[] = {
 		{"__gc", &Poly_gc},
-		{"__index", &Poly_index},
 		{"__add", &Poly_add},
 		{"__sub", &Poly_sub},
 		{"__mul", &Poly_mul},
 		{"__div", &Poly_div},
 		{NULL, NULL}
 	};
+	Class_register(L, PolyClassName, PolyLib, &Poly_index, PolyKeys);
 
-	luaL_newmetatable(L, PolyClassName);
-	lua_pushvalue(L, -1);
-	lua_setfield(L, -2, "__index");
-	luaL_setfuncs(L, PolyLib, 0);
-	lua_pop(L, 1);  /* pop new metatable */
+	static const luaL_Reg PointArrayLib[] = {
+		{"__gc", &PointArray_gc},
+		{"__len", &PointArray_len},
+		{NULL, NULL}
+	};
+	Class_register(L, PointArrayClassName, PointArrayLib, &PointArray_index, PointArrayKeys);
+
+	static const luaL_Reg MatrixLib[] = {
+		{"__gc", &Matrix_gc},
+		{"__mul", &Matrix_mul},
+		{NULL, NULL}
+	};
+	Class_register(L, MatrixClassName, MatrixLib, &Matrix_index, MatrixKeys);
+
+	static const luaL_Reg PolySetLib[] = {
+		{"__gc", &PolySet_gc},
+		{"__len", &PolySet_len},
+		{NULL, NULL}
+	};
+	Class_register(L, PolySetClassName, PolySetLib, &PolySet_index, PolySetKeys);
+
+	// Sentinel whose finalizer returns pooled buffers to the system when
+	// the state is closed. It is created before any shape, so it is
+	// finalized after all of them.
+	lua_newuserdata(L, 1);
+	lua_createtable(L, 0, 1);
+	lua_pushcfunction(L, &ReleaseMemory);
+	lua_setfield(L, -2, "__gc");
+	lua_setmetatable(L, -2);
+	lua_setfield(L, LUA_REGISTRYINDEX, "CAD2D::BufferPool");
 }
 
 
@@ -1244,6 +4200,9 @@ extern "C" int luaopen_CAD2Dkernel(lua_State *L){
 		{"Ray", &Ray_create},
 		{"Arcseg", &Arcseg_create},
 		{"Poly", &Poly_create},
+		{"PointArray", &PointArray_create},
+		{"Matrix", &Matrix_create},
+		{"PolySet", &PolySet_create},
 
 		{"IsPoint", &IsPoint},
 		{"IsDirection", &IsDirection},
@@ -1251,15 +4210,28 @@ extern "C" int luaopen_CAD2Dkernel(lua_State *L){
 		{"IsRay", &IsRay},
 		{"IsArcseg", &IsArcseg},
 		{"IsPoly", &IsPoly},
+		{"IsPointArray", &IsPointArray},
+		{"IsMatrix", &IsMatrix},
+		{"IsPolySet", &IsPolySet},
 
 		{"Circle", &Circle_create},
 
+		{"MemoryStats", &MemoryStats},
+		{"ReleaseMemory", &ReleaseMemory},
+
+		{"Output", &Output},
+		{"OutputPath", &OutputPath},
+		{"OutputTo", &OutputTo},
+		{"OutputFlush", &OutputFlush},
+		{"OutputBuffer", &OutputBuffer},
+
 		{"Distance", &Distance_dispatch},
 		{"Angle", &Angle_dispatch},
 		{"Intersection", &Intersection_dispatch},
 
 		{NULL, NULL}
 	};
+	geom_predicates_init();
 	luaL_newlib(L, CAD2Dkernel_lib);
 
 	CAD2Dkernel_register(L);
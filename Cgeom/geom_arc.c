@@ -1,8 +1,11 @@
 #include <stdio.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <math.h>
 #include <Cgeom/geom_la.h>
 #include <Cgeom/geom_sphereavg.h>
+#include <Cgeom/geom_circle.h>
+#include <Cgeom/geom_arc.h>
 
 #define G_QUARTER 0.4142135623730950488
 
@@ -337,7 +340,7 @@ void geom_arc_bound_circle(
 		c[1] += dt2 * (b[0]-a[0]);
 		/* *r = t * (1+g*g)/(2*g); */
 		/* Since g > 1, we can do better: */
-		*r = 0.25 * t2 * (1./g + g);
+		*r = 0.25 * t2 * fabs(1./g + g);
 	}
 }
 
@@ -520,6 +523,31 @@ static int quadrant_classify(int cw, const double v[2]){
 	}
 }
 
+/* Removes the empty segments from the output of geom_arc_split_monotone,
+ * which occur when an endpoint has an axis-aligned tangent and so is
+ * itself a split point. The endpoints of the arc are kept exactly.
+ * Returns the new number of segments.
+ */
+static int drop_empty_segments(double *pg, int n, double tol){
+	int i, m = 0;
+	for(i = 1; i <= n; ++i){
+		if(hypot(pg[3*i+0]-pg[3*m+0], pg[3*i+1]-pg[3*m+1]) <= tol){
+			if(i < n){
+				pg[3*m+2] = pg[3*i+2];
+			}else if(m > 0){
+				pg[3*m+0] = pg[3*i+0];
+				pg[3*m+1] = pg[3*i+1];
+			}
+			continue;
+		}
+		++m;
+		pg[3*m+0] = pg[3*i+0];
+		pg[3*m+1] = pg[3*i+1];
+		if(i < n){ pg[3*m+2] = pg[3*i+2]; }
+	}
+	return (m > 0 ? m : n);
+}
+
 int geom_arc_split_monotone(
 	const double a[2], const double b[2], double g,
 	double *pg
@@ -574,7 +602,7 @@ int geom_arc_split_monotone(
 			pg[3*(n-1)+2] = qsolve(0, t, -r);
 		}
 //fprintf(stderr, "n = %d\n", n);
-		return n;
+		return drop_empty_segments(pg, n, 1e-12*r);
 	}else{ /* less than a quarter circle */
 		/* We must have 1 or 2 segments */
 		int cs = -1;
@@ -599,7 +627,7 @@ int geom_arc_split_monotone(
 			tanfrac(g, s, &pg[2], &pg[5]);
 			pg[0] = a[0]; pg[1] = a[1];
 			pg[6] = b[0]; pg[7] = b[1];
-			return 2;
+			return drop_empty_segments(pg, 2, 1e-12*hypot(b[0]-a[0], b[1]-a[1]));
 		}else{
 			pg[0] = a[0]; pg[1] = a[1]; pg[2] = g;
 			pg[3] = b[0]; pg[4] = b[1];
@@ -608,6 +636,362 @@ int geom_arc_split_monotone(
 	}
 }
 
+/* Circle of a nonzero-bulge arc, without the angles computed by
+ * geom_arc_circle.
+ */
+static void arc_circle(
+	const double a[2], const double b[2], double g,
+	double c[2], double *r
+){
+	const double t2 = hypot(b[0]-a[0], b[1]-a[1]);
+	const double dt2 = (1.+g)*(1.-g)/(4.*g);
+	c[0] = (0.5*a[0] + 0.5*b[0]) + dt2 * (a[1]-b[1]);
+	c[1] = (0.5*a[1] + 0.5*b[1]) + dt2 * (b[0]-a[0]);
+	*r = 0.25 * t2 * fabs(1./g + g);
+}
+
+/* Returns nonzero if p, which is assumed to lie on the circle of the arc
+ * (or on the line through a and b when g == 0), lies on the arc itself.
+ * An arc is the part of its circle on the bulge side of the chord, so
+ * only a sign test is needed. Endpoints are included, with a small
+ * tolerance so that arcs meeting at a shared endpoint are detected.
+ */
+static int arc_contains_circle_pt(
+	const double a[2], const double b[2], double g,
+	const double p[2]
+){
+	const double ab[2] = { b[0]-a[0], b[1]-a[1] };
+	const double ap[2] = { p[0]-a[0], p[1]-a[1] };
+	const double ab2 = ab[0]*ab[0] + ab[1]*ab[1];
+	const double tol = 1e-12 * ab2;
+	if(0 == g){
+		const double t = ab[0]*ap[0] + ab[1]*ap[1];
+		return (-tol <= t && t <= ab2 + tol);
+	}else{
+		/* Positive bulges lie to the right of ab */
+		const double cr = ab[0]*ap[1] - ab[1]*ap[0];
+		return (g > 0) ? (cr <= tol) : (cr >= -tol);
+	}
+}
+
+/* Intersection without any early rejection */
+static int arc_intersect_exact(
+	const double a1[2], const double b1[2], double g1,
+	const double a2[2], const double b2[2], double g2,
+	double p[4]
+){
+	double q[4];
+	int i, nq, n = 0;
+	if(0 == g1 && 0 == g2){
+		const double u[2] = { b1[0]-a1[0], b1[1]-a1[1] };
+		const double v[2] = { b2[0]-a2[0], b2[1]-a2[1] };
+		const double w[2] = { a2[0]-a1[0], a2[1]-a1[1] };
+		const double den = u[0]*v[1] - u[1]*v[0];
+		double s, t;
+		if(0 == den){ return 0; } /* parallel or overlapping */
+		s = (w[0]*v[1] - w[1]*v[0]) / den;
+		t = (w[0]*u[1] - w[1]*u[0]) / den;
+		if(s < 0 || s > 1 || t < 0 || t > 1){ return 0; }
+		p[0] = a1[0] + s*u[0];
+		p[1] = a1[1] + s*u[1];
+		return 1;
+	}else if(0 == g1 || 0 == g2){
+		/* Make (a1,b1) the segment and (a2,b2,g2) the arc */
+		double c[2], r, t[2];
+		if(0 != g1){
+			const double *tmp;
+			tmp = a1; a1 = a2; a2 = tmp;
+			tmp = b1; b1 = b2; b2 = tmp;
+			g2 = g1;
+		}
+		arc_circle(a2, b2, g2, c, &r);
+		nq = geom_circle_line_intersect(c, r, a1, b1, t);
+		for(i = 0; i < nq; ++i){
+			q[2*i+0] = a1[0] + t[i]*(b1[0]-a1[0]);
+			q[2*i+1] = a1[1] + t[i]*(b1[1]-a1[1]);
+			if(arc_contains_circle_pt(a1, b1, 0, &q[2*i]) && arc_contains_circle_pt(a2, b2, g2, &q[2*i])){
+				p[2*n+0] = q[2*i+0];
+				p[2*n+1] = q[2*i+1];
+				n++;
+			}
+		}
+		return n;
+	}else{
+		double c1[2], r1, c2[2], r2;
+		arc_circle(a1, b1, g1, c1, &r1);
+		arc_circle(a2, b2, g2, c2, &r2);
+		if(hypot(c2[0]-c1[0], c2[1]-c1[1]) <= 1e-12 * (r1+r2)){
+			/* Arcs of (nearly) the same circle, where the circle
+			 * intersection is ill-conditioned. They can only meet along
+			 * an overlap, whose ends are endpoints of the arcs.
+			 */
+			const double *e[4];
+			if(fabs(r1-r2) > 1e-12 * (r1+r2)){ return 0; }
+			e[0] = a1; e[1] = b1; e[2] = a2; e[3] = b2;
+			for(i = 0; i < 4 && n < 2; ++i){
+				if(i < 2 ? !arc_contains_circle_pt(a2, b2, g2, e[i]) : !arc_contains_circle_pt(a1, b1, g1, e[i])){
+					continue;
+				}
+				if(n > 0 && hypot(e[i][0]-p[0], e[i][1]-p[1]) <= 1e-12 * r1){ continue; }
+				p[2*n+0] = e[i][0];
+				p[2*n+1] = e[i][1];
+				n++;
+			}
+			return n;
+		}
+		nq = geom_circle_circle_intersect(c1, r1, c2, r2, q);
+		for(i = 0; i < nq; ++i){
+			if(arc_contains_circle_pt(a1, b1, g1, &q[2*i]) && arc_contains_circle_pt(a2, b2, g2, &q[2*i])){
+				p[2*n+0] = q[2*i+0];
+				p[2*n+1] = q[2*i+1];
+				n++;
+			}
+		}
+		return n;
+	}
+}
+
+int geom_arc_intersect(
+	const double a1[2], const double b1[2], double g1,
+	const double a2[2], const double b2[2], double g2,
+	double p[4]
+){
+	double c1[2], r1, c2[2], r2;
+	double xb1[2], yb1[2], xb2[2], yb2[2];
+	/* Cheap rejection by bounding circles */
+	geom_arc_bound_circle(a1, b1, g1, c1, &r1);
+	geom_arc_bound_circle(a2, b2, g2, c2, &r2);
+	if(hypot(c2[0]-c1[0], c2[1]-c1[1]) > r1 + r2){ return 0; }
+	/* Tighter rejection by bounding rectangles */
+	geom_arc_bound_rect(a1, b1, g1, xb1, yb1);
+	geom_arc_bound_rect(a2, b2, g2, xb2, yb2);
+	if(xb1[1] < xb2[0] || xb2[1] < xb1[0] || yb1[1] < yb2[0] || yb2[1] < yb1[0]){
+		return 0;
+	}
+	return arc_intersect_exact(a1, b1, g1, a2, b2, g2, p);
+}
+
+typedef struct{
+	double xb[2], yb[2];
+	int set, i;
+} arc_box;
+typedef struct{
+	int i, j;
+	double p[2];
+} arc_hit;
+
+static int arc_box_cmp(const void *pa, const void *pb){
+	const arc_box *a = (const arc_box*)pa;
+	const arc_box *b = (const arc_box*)pb;
+	if(a->xb[0] < b->xb[0]){ return -1; }
+	if(a->xb[0] > b->xb[0]){ return 1; }
+	if(a->set != b->set){ return a->set - b->set; }
+	return a->i - b->i;
+}
+static int arc_hit_cmp(const void *pa, const void *pb){
+	const arc_hit *a = (const arc_hit*)pa;
+	const arc_hit *b = (const arc_hit*)pb;
+	if(a->i != b->i){ return a->i - b->i; }
+	if(a->j != b->j){ return a->j - b->j; }
+	if(a->p[0] != b->p[0]){ return (a->p[0] < b->p[0]) ? -1 : 1; }
+	if(a->p[1] != b->p[1]){ return (a->p[1] < b->p[1]) ? -1 : 1; }
+	return 0;
+}
+static void arc_hit_push(
+	arc_hit **hit, int *nhit, int *maxhit,
+	int i, int j, const double q[2]
+){
+	if(*nhit >= *maxhit){
+		*maxhit = (0 == *maxhit) ? 16 : 2*(*maxhit);
+		*hit = (arc_hit*)realloc(*hit, sizeof(arc_hit) * (*maxhit));
+	}
+	(*hit)[*nhit].i = i;
+	(*hit)[*nhit].j = j;
+	(*hit)[*nhit].p[0] = q[0];
+	(*hit)[*nhit].p[1] = q[1];
+	(*nhit)++;
+}
+/* Sorts the hits and copies them out to freshly allocated arrays */
+static int arc_hit_output(arc_hit *hit, int nhit, double **p, int **ij){
+	int k;
+	if(nhit > 0){
+		qsort(hit, nhit, sizeof(arc_hit), &arc_hit_cmp);
+		*p = (double*)malloc(sizeof(double) * 2*nhit);
+		*ij = (int*)malloc(sizeof(int) * 2*nhit);
+		for(k = 0; k < nhit; ++k){
+			(*p)[2*k+0] = hit[k].p[0];
+			(*p)[2*k+1] = hit[k].p[1];
+			(*ij)[2*k+0] = hit[k].i;
+			(*ij)[2*k+1] = hit[k].j;
+		}
+	}
+	free(hit);
+	return nhit;
+}
+
+int geom_arc_intersect_batch(
+	int n1, const double *a1, const double *b1, const double *g1,
+	int n2, const double *a2, const double *b2, const double *g2,
+	double **p, int **ij
+){
+	arc_box *box;
+	arc_hit *hit = NULL;
+	int *active[2];
+	int nactive[2] = { 0, 0 };
+	int nhit = 0, maxhit = 0;
+	int k, i;
+	if(n1 < 0){ return -1; }
+	if(n1 > 0 && (NULL == a1 || NULL == b1 || NULL == g1)){ return -2; }
+	if(n2 < 0){ return -5; }
+	if(n2 > 0 && (NULL == a2 || NULL == b2 || NULL == g2)){ return -6; }
+	if(NULL == p){ return -9; }
+	if(NULL == ij){ return -10; }
+	*p = NULL;
+	*ij = NULL;
+	if(0 == n1 || 0 == n2){ return 0; }
+
+	box = (arc_box*)malloc(sizeof(arc_box) * (n1+n2));
+	active[0] = (int*)malloc(sizeof(int) * n1);
+	active[1] = (int*)malloc(sizeof(int) * n2);
+	for(i = 0; i < n1; ++i){
+		geom_arc_bound_rect(&a1[2*i], &b1[2*i], g1[i], box[i].xb, box[i].yb);
+		box[i].set = 0;
+		box[i].i = i;
+	}
+	for(i = 0; i < n2; ++i){
+		geom_arc_bound_rect(&a2[2*i], &b2[2*i], g2[i], box[n1+i].xb, box[n1+i].yb);
+		box[n1+i].set = 1;
+		box[n1+i].i = i;
+	}
+	qsort(box, n1+n2, sizeof(arc_box), &arc_box_cmp);
+
+	/* Sweep in x. Each box is tested against the active boxes of the
+	 * other set, dropping those that end before it begins.
+	 */
+	for(k = 0; k < n1+n2; ++k){
+		const arc_box *bk = &box[k];
+		const int other = 1 - bk->set;
+		int keep = 0;
+		for(i = 0; i < nactive[other]; ++i){
+			const arc_box *bo = &box[active[other][i]];
+			const arc_box *b1p, *b2p;
+			double q[4];
+			int nq, iq;
+			if(bo->xb[1] < bk->xb[0]){ continue; }
+			active[other][keep++] = active[other][i];
+			if(bo->yb[1] < bk->yb[0] || bk->yb[1] < bo->yb[0]){ continue; }
+			if(0 == bk->set){ b1p = bk; b2p = bo; }else{ b1p = bo; b2p = bk; }
+			nq = arc_intersect_exact(
+				&a1[2*b1p->i], &b1[2*b1p->i], g1[b1p->i],
+				&a2[2*b2p->i], &b2[2*b2p->i], g2[b2p->i], q
+			);
+			for(iq = 0; iq < nq; ++iq){
+				arc_hit_push(&hit, &nhit, &maxhit, b1p->i, b2p->i, &q[2*iq]);
+			}
+		}
+		nactive[other] = keep;
+		active[bk->set][nactive[bk->set]++] = k;
+	}
+	free(active[1]);
+	free(active[0]);
+	free(box);
+	return arc_hit_output(hit, nhit, p, ij);
+}
+
+int geom_arc_self_intersect(
+	int n, const double *a, const double *b, const double *g,
+	double **p, int **ij
+){
+	arc_box *box;
+	arc_hit *hit = NULL;
+	int *active;
+	int nactive = 0;
+	int nhit = 0, maxhit = 0;
+	int k, i;
+	if(n < 0){ return -1; }
+	if(n > 0 && (NULL == a || NULL == b || NULL == g)){ return -2; }
+	if(NULL == p){ return -5; }
+	if(NULL == ij){ return -6; }
+	*p = NULL;
+	*ij = NULL;
+	if(n < 2){ return 0; }
+
+	box = (arc_box*)malloc(sizeof(arc_box) * n);
+	active = (int*)malloc(sizeof(int) * n);
+	for(i = 0; i < n; ++i){
+		geom_arc_bound_rect(&a[2*i], &b[2*i], g[i], box[i].xb, box[i].yb);
+		box[i].set = 0;
+		box[i].i = i;
+	}
+	qsort(box, n, sizeof(arc_box), &arc_box_cmp);
+
+	/* Same sweep as above, but with a single active list so that
+	 * each pair is tested only once.
+	 */
+	for(k = 0; k < n; ++k){
+		const arc_box *bk = &box[k];
+		int keep = 0;
+		for(i = 0; i < nactive; ++i){
+			const arc_box *bo = &box[active[i]];
+			double q[4];
+			int nq, iq, i1, i2;
+			if(bo->xb[1] < bk->xb[0]){ continue; }
+			active[keep++] = active[i];
+			if(bo->yb[1] < bk->yb[0] || bk->yb[1] < bo->yb[0]){ continue; }
+			if(bo->i < bk->i){ i1 = bo->i; i2 = bk->i; }else{ i1 = bk->i; i2 = bo->i; }
+			nq = arc_intersect_exact(
+				&a[2*i1], &b[2*i1], g[i1],
+				&a[2*i2], &b[2*i2], g[i2], q
+			);
+			for(iq = 0; iq < nq; ++iq){
+				arc_hit_push(&hit, &nhit, &maxhit, i1, i2, &q[2*iq]);
+			}
+		}
+		nactive = keep;
+		active[nactive++] = k;
+	}
+	free(active);
+	free(box);
+	return arc_hit_output(hit, nhit, p, ij);
+}
+
+double geom_arc_distance(
+	const double a[2], const double b[2], double g,
+	const double p[2]
+){
+	double da, db;
+	if(0 == g){
+		const double ab[2] = { b[0]-a[0], b[1]-a[1] };
+		const double ab2 = ab[0]*ab[0] + ab[1]*ab[1];
+		double t = 0;
+		if(ab2 > 0){
+			t = ((p[0]-a[0])*ab[0] + (p[1]-a[1])*ab[1]) / ab2;
+			if(t < 0){ t = 0; }
+			if(t > 1){ t = 1; }
+		}
+		return hypot(a[0] + t*ab[0] - p[0], a[1] + t*ab[1] - p[1]);
+	}else{
+		/* The nearest point of the circle is the radial projection of p;
+		 * if it lies on the arc it is the nearest point of the arc too.
+		 * Otherwise the nearest point is an endpoint.
+		 */
+		double c[2], r;
+		arc_circle(a, b, g, c, &r);
+		{
+			const double cp[2] = { p[0]-c[0], p[1]-c[1] };
+			const double lcp = hypot(cp[0], cp[1]);
+			if(0 == lcp){ return r; }
+			{
+				const double q[2] = { c[0] + r*cp[0]/lcp, c[1] + r*cp[1]/lcp };
+				if(arc_contains_circle_pt(a, b, g, q)){ return fabs(lcp - r); }
+			}
+		}
+	}
+	da = hypot(p[0]-a[0], p[1]-a[1]);
+	db = hypot(p[0]-b[0], p[1]-b[1]);
+	return (da < db ? da : db);
+}
+
 void geom_arc_offset(
 	const double a[2], const double b[2], double g,
 	double d, double ao[2], double bo[2]
@@ -628,7 +1012,9 @@ void geom_arc_offset(
 	}else{
 		double c[2], r, theta[2];
 		geom_arc_circle(a, b, g, c, &r, theta);
-		double rd = r+d;
+		/* Right of the direction of travel is away from the center
+		 * for counterclockwise (g > 0) arcs and towards it otherwise. */
+		double rd = (g > 0 ? r+d : r-d);
 		ao[0] = c[0] + rd*cos(theta[0]);
 		ao[1] = c[1] + rd*sin(theta[0]);
 		bo[0] = c[0] + rd*cos(theta[1]);
@@ -1,3 +1,6 @@
+#ifndef GEOM_ARC_H_INCLUDED
+#define GEOM_ARC_H_INCLUDED
+
 /* A circular arc is parameterized by the start and endpoints */
 /* and the bulge factor g. Positive bulges make the arc bulge */
 /* to the right when looking at the endpoint from the start.  */
@@ -82,7 +85,40 @@ int geom_arc_intersect(
 	double p[4]
 );
 
+/* Intersects every arc of one set with every arc of another. Set k has
+ * nk arcs; arc i runs from (ak[2*i],ak[2*i+1]) to (bk[2*i],bk[2*i+1])
+ * with bulge gk[i]. Candidate pairs are found by sorting the bounding
+ * rectangles in x and sweeping. On return *p holds the coordinates of
+ * the intersection points and *ij the corresponding index pairs (arc of
+ * set 1, arc of set 2), ordered by pair. Both arrays are allocated with
+ * malloc and must be freed by the caller (they are NULL if there are no
+ * intersections). Returns the number of points, or a negative value to
+ * indicate an invalid argument.
+ */
+int geom_arc_intersect_batch(
+	int n1, const double *a1, const double *b1, const double *g1,
+	int n2, const double *a2, const double *b2, const double *g2,
+	double **p, int **ij
+);
+
+/* Finds the intersections between distinct arcs of a single set, with
+ * the same conventions as geom_arc_intersect_batch. Each pair is reported
+ * once, with the smaller index first; arcs sharing an endpoint report it
+ * as an intersection.
+ */
+int geom_arc_self_intersect(
+	int n, const double *a, const double *b, const double *g,
+	double **p, int **ij
+);
+
+/* Returns the distance from p to the nearest point of the arc. */
+double geom_arc_distance(
+	const double a[2], const double b[2], double g,
+	const double p[2]
+);
+
 /* Compute the offset curve to the arc.
+ * Positive d offsets to the right of the direction of travel.
  * Note that g stays the same.
  * Otherwise, the arc is extended by d on both ends.
  */
@@ -95,3 +131,5 @@ void geom_arc_extend(
 	const double a[2], const double b[2], double g,
 	const double d[2], double ao[2], double bo[2], double *go
 );
+
+#endif /* GEOM_ARC_H_INCLUDED */
@@ -1,5 +1,12 @@
 #include <Cgeom/geom_bvh.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#if defined(__AVX__)
+# include <immintrin.h>
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+#endif
 
 //#define BVH_DEBUG
 
@@ -11,18 +18,116 @@
 #endif
 
 // The internal representation of boxes is min/max instead of center/halfwidth
+//
+// All nodes of a tree live in one contiguous pool and refer to their
+// children by 32-bit index. After bulk loading, the pool is laid out in
+// breadth-first order, so the children of a node are consecutive and the
+// root is node 0. A node with no children is a leaf.
 
-struct geom_bvh2d_struct{
-	geom_bvh2d child[4];
-	double b[4]; // x-min, x-max, y-min, y-max
+typedef struct{
 	int tag; // for internal nodes, set to max of all subnodes
-};
-struct geom_bvh3d_struct{
-	geom_bvh3d child[8];
+	unsigned int child; // index of first child
+	unsigned int nchild; // 0 for leaves
+	unsigned int parent; // 0 for the root
+} bvh2d_node;
+typedef struct{
 	double b[6]; // x-min, x-max, y-min, y-max, z-min, z-max
 	int tag;
+	unsigned int child;
+	unsigned int nchild;
+} bvh3d_node;
+
+// In 2D, each internal node holds the bounds of its (up to) four children
+// in SoA form, so that a single vector comparison tests all of them. This
+// is the only copy of a node's bounds: they are read from the parent's
+// slot, and the root box is kept in the tree. Unused slots hold an empty
+// box that never matches. STR puts all leaves on the bottom level, so
+// after the breadth-first layout the internal nodes are exactly
+// 0..ninternal-1.
+typedef struct{
+	double xmin[4], xmax[4], ymin[4], ymax[4];
+} bvh2d_wide;
+
+// Dynamic trees are binary and are not laid out in any order: nodes are
+// taken from and returned to a free list as leaves come and go, and refer
+// to their parents as well as their children. The same code serves both
+// dimensions; 2D trees use the first four entries of b.
+typedef struct{
+	double b[6]; // as in bvh3d_node
+	int tag; // for internal nodes, set to max of all subnodes
+	int parent; // -1 for the root; next free node for unused nodes
+	int child[2]; // child[0] is -1 for leaves
+	int height; // 0 for leaves
+} bvh_dnode;
+typedef struct{
+	int dim;
+	int root; // -1 if the tree is empty
+	int n_alloc;
+	int free; // head of the free list
+	bvh_dnode *node;
+	int nleaf;
+	int *leaf; // node holding each tag, or -1; nleaf entries
+} bvh_dyn;
+
+struct geom_bvh2d_struct{
+	unsigned int n; // number of nodes
+	bvh2d_node *node;
+	unsigned int ninternal;
+	bvh2d_wide *wide; // one per internal node
+	double box[4]; // bounds of the root
+	geom_query_counts *counts; // may be NULL
+	bvh_dyn *dyn; // non-NULL for dynamic trees, which use no other fields
+};
+struct geom_bvh3d_struct{
+	unsigned int n;
+	bvh3d_node *node;
+	geom_query_counts *counts;
+	bvh_dyn *dyn;
 };
 
+// The trees are shallow (each level of STR reduces the node count by about
+// the branching factor), so traversal stacks of fixed size suffice.
+#define BVH2D_STACK_SIZE 256
+#define BVH3D_STACK_SIZE 512
+
+// Nodes during construction. The STR passes only permute index arrays
+// into this pool, so children may be scattered until the final layout.
+typedef struct{
+	double b[4];
+	int tag;
+	unsigned int nchild;
+	unsigned int child[4];
+} bvh2d_build_node;
+typedef struct{
+	double b[6];
+	int tag;
+	unsigned int nchild;
+	unsigned int child[8];
+} bvh3d_build_node;
+
+typedef struct{
+	unsigned int n, n_alloc;
+	bvh2d_build_node *node;
+} bvh2d_build;
+typedef struct{
+	unsigned int n, n_alloc;
+	bvh3d_build_node *node;
+} bvh3d_build;
+
+// Ensures room for m more nodes in the build pool
+static void bvh2d_build_reserve(bvh2d_build *T, unsigned int m){
+	if(T->n + m > T->n_alloc){
+		T->n_alloc = 2*T->n_alloc + m;
+		T->node = (bvh2d_build_node*)realloc(T->node, sizeof(bvh2d_build_node) * T->n_alloc);
+	}
+}
+static void bvh3d_build_reserve(bvh3d_build *T, unsigned int m){
+	if(T->n + m > T->n_alloc){
+		T->n_alloc = 2*T->n_alloc + m;
+		T->node = (bvh3d_build_node*)realloc(T->node, sizeof(bvh3d_build_node) * T->n_alloc);
+	}
+}
+
 static int isqrt_ceil(int u){
 	if(u <= 0){ return 0; }
 	int a = 2;
@@ -52,428 +157,2109 @@ static int icbrt_ceil(int x){
 	return (y*y*y == xsave) ? y : y+1;
 }
 
-static void sort_bvh2(geom_bvh2d *B, int beg, int end, int d){
-	if(end > beg+1){
-		geom_bvh2d t, piv = B[beg];
-		int l = beg+1, r = end;
-		while(l < r){
-			if(B[l]->b[2*d+0]+B[l]->b[2*d+1] <= piv->b[2*d+0]+piv->b[2*d+1]){
-				++l;
-			}else{
-				--r;
-				t = B[l];
-				B[l] = B[r];
-				B[r] = t;
+// Sorting. STR sorts the nodes by box centroid along one axis at a time.
+// The centroids are quantized to 32-bit keys over their range and sorted
+// with an LSD radix sort (three 11-bit digits). This is stable and O(n)
+// regardless of the input order; presorted inputs (such as shapes
+// generated on a grid) were the worst case of the quicksort it replaces.
+// Centroids closer than 2^-32 of the range may come out in either order,
+// which does not matter for the quality of the tree.
+
+#define BVH_RADIX_BITS 11
+#define BVH_RADIX_SIZE (1 << BVH_RADIX_BITS)
+
+// Sorts B[0..n) by the keys K[0..n), both in place. tB and tK are
+// scratch arrays of length n.
+static void bvh_radix_sort(unsigned int n, unsigned int *B, unsigned int *K, unsigned int *tB, unsigned int *tK){
+	unsigned int count[3][BVH_RADIX_SIZE];
+	unsigned int *B0 = B;
+	unsigned int i;
+	int pass;
+	if(n < 32){
+		// insertion sort for small slices
+		for(i = 1; i < n; ++i){
+			const unsigned int k = K[i];
+			const unsigned int b = B[i];
+			unsigned int j = i;
+			while(j > 0 && K[j-1] > k){
+				K[j] = K[j-1];
+				B[j] = B[j-1];
+				--j;
 			}
+			K[j] = k;
+			B[j] = b;
 		}
-		--l;
-		t = B[l];
-		B[l] = B[beg];
-		B[beg] = t;
-		sort_bvh2(B, beg, l, d);
-		sort_bvh2(B, r, end, d);
-	}
-}
-static void sort_bvh3(geom_bvh3d *B, int beg, int end, int d){
-	if(end > beg+1){
-		geom_bvh3d t, piv = B[beg];
-		int l = beg+1, r = end;
-		while(l < r){
-			if(B[l]->b[2*d+0]+B[l]->b[2*d+1] <= piv->b[2*d+0]+piv->b[2*d+1]){
-				++l;
-			}else{
-				--r;
-				t = B[l];
-				B[l] = B[r];
-				B[r] = t;
-			}
+		return;
+	}
+	memset(count, 0, sizeof(count));
+	for(i = 0; i < n; ++i){
+		const unsigned int k = K[i];
+		count[0][k & (BVH_RADIX_SIZE-1)]++;
+		count[1][(k >> BVH_RADIX_BITS) & (BVH_RADIX_SIZE-1)]++;
+		count[2][k >> (2*BVH_RADIX_BITS)]++;
+	}
+	for(pass = 0; pass < 3; ++pass){
+		unsigned int *c = count[pass];
+		unsigned int sum = 0;
+		const int shift = BVH_RADIX_BITS*pass;
+		unsigned int *s;
+		// skip digits that are the same for all keys
+		if(c[(K[0] >> shift) & (BVH_RADIX_SIZE-1)] == n){ continue; }
+		for(i = 0; i < BVH_RADIX_SIZE; ++i){
+			const unsigned int t = c[i];
+			c[i] = sum;
+			sum += t;
+		}
+		for(i = 0; i < n; ++i){
+			const unsigned int j = c[(K[i] >> shift) & (BVH_RADIX_SIZE-1)]++;
+			tK[j] = K[i];
+			tB[j] = B[i];
 		}
-		--l;
-		t = B[l];
-		B[l] = B[beg];
-		B[beg] = t;
-		sort_bvh3(B, beg, l, d);
-		sort_bvh3(B, r, end, d);
-	}
-}
-
-static geom_bvh2d geom_bvh2d_make_blank(){
-	geom_bvh2d b = (geom_bvh2d)malloc(sizeof(struct geom_bvh2d_struct));
-	int j;
-	for(j = 0; j < 4; ++j){
-		b->child[j] = NULL;
-	}
-	b->tag = 0;
-	b->b[0] = 0;
-	b->b[1] = 0;
-	b->b[2] = 0;
-	b->b[3] = 0;
-	return b;
-}
-static geom_bvh3d geom_bvh3d_make_blank(){
-	geom_bvh3d b = (geom_bvh3d)malloc(sizeof(struct geom_bvh3d_struct));
-	int j;
-	for(j = 0; j < 8; ++j){
-		b->child[j] = NULL;
-	}
-	b->tag = 0;
-	b->b[0] = 0;
-	b->b[1] = 0;
-	b->b[2] = 0;
-	b->b[3] = 0;
-	b->b[4] = 0;
-	b->b[5] = 0;
-	return b;
-}
-
-static void geom_bvh2d_STR(unsigned int *n_, geom_bvh2d *B){
-	int i, j, k;
-	geom_bvh2d *T = B;
+		s = K; K = tK; tK = s;
+		s = B; B = tB; tB = s;
+	}
+	if(B != B0){
+		// odd number of passes; the keys are not needed afterwards
+		memcpy(B0, B, sizeof(unsigned int) * n);
+	}
+}
+
+// Scratch space for the sorts, sized for the number of leaves. Each
+// slice sorts within its own range of these arrays.
+typedef struct{
+	double *C; // centroid coordinates
+	unsigned int *K, *tK, *tB;
+	unsigned int *parent; // parent indices produced by one STR level
+} bvh_sort_buf;
+
+static void bvh_sort_buf_init(bvh_sort_buf *buf, unsigned int n){
+	buf->C = (double*)malloc(sizeof(double) * n);
+	buf->K = (unsigned int*)malloc(sizeof(unsigned int) * n);
+	buf->tK = (unsigned int*)malloc(sizeof(unsigned int) * n);
+	buf->tB = (unsigned int*)malloc(sizeof(unsigned int) * n);
+	buf->parent = (unsigned int*)malloc(sizeof(unsigned int) * n);
+}
+static void bvh_sort_buf_destroy(bvh_sort_buf *buf){
+	free(buf->C);
+	free(buf->K);
+	free(buf->tK);
+	free(buf->tB);
+	free(buf->parent);
+}
+
+// Quantizes the centroids C[beg..end) and sorts B[beg..end) by them
+static void bvh_sort_range(unsigned int *B, int beg, int end, bvh_sort_buf *buf){
+	const double *C = buf->C;
+	double cmin = HUGE_VAL, cmax = -HUGE_VAL, scale = 0;
+	int i;
+	for(i = beg; i < end; ++i){
+		if(C[i] < cmin){ cmin = C[i]; }
+		if(C[i] > cmax){ cmax = C[i]; }
+	}
+	if(cmax > cmin){
+		scale = 4294967295.0 / (cmax - cmin);
+		if(!(scale < HUGE_VAL)){ scale = 0; }
+	}
+	for(i = beg; i < end; ++i){
+		const double u = (C[i] - cmin) * scale;
+		// NaN compares false and gets key 0
+		buf->K[i] = (u > 0) ? ((u < 4294967295.0) ? (unsigned int)u : 4294967295u) : 0;
+	}
+	bvh_radix_sort(end-beg, B+beg, buf->K+beg, buf->tB+beg, buf->tK+beg);
+}
+
+// Sorts B[beg..end) by centroid along axis d
+static void sort_bvh2(const bvh2d_build_node *N, unsigned int *B, int beg, int end, int d, bvh_sort_buf *buf){
+	int i;
+	for(i = beg; i < end; ++i){
+		const bvh2d_build_node *b = &N[B[i]];
+		buf->C[i] = b->b[2*d+0] + b->b[2*d+1];
+	}
+	bvh_sort_range(B, beg, end, buf);
+}
+static void sort_bvh3(const bvh3d_build_node *N, unsigned int *B, int beg, int end, int d, bvh_sort_buf *buf){
+	int i;
+	for(i = beg; i < end; ++i){
+		const bvh3d_build_node *b = &N[B[i]];
+		buf->C[i] = b->b[2*d+0] + b->b[2*d+1];
+	}
+	bvh_sort_range(B, beg, end, buf);
+}
+
+// Makes node ib the parent of the nodes T[0..nc)
+static void bvh2d_pack(bvh2d_build_node *N, unsigned int ib, const unsigned int *T, int nc){
+	bvh2d_build_node *b = &N[ib];
+	const bvh2d_build_node *c = &N[T[0]];
+	int k;
+	b->nchild = nc;
+	b->child[0] = T[0];
+	b->tag = c->tag;
+	b->b[0] = c->b[0];
+	b->b[1] = c->b[1];
+	b->b[2] = c->b[2];
+	b->b[3] = c->b[3];
+	for(k = 1; k < nc; ++k){
+		c = &N[T[k]];
+		b->child[k] = T[k];
+		if(c->tag > b->tag){ b->tag = c->tag; }
+		if(c->b[0] < b->b[0]){ b->b[0] = c->b[0]; }
+		if(c->b[1] > b->b[1]){ b->b[1] = c->b[1]; }
+		if(c->b[2] < b->b[2]){ b->b[2] = c->b[2]; }
+		if(c->b[3] > b->b[3]){ b->b[3] = c->b[3]; }
+	}
+	BVHDBG("  Making internal node %u, tag=%d, b=%f,%f,%f,%f\n", ib, b->tag, b->b[0], b->b[1], b->b[2], b->b[3]);
+}
+static void bvh3d_pack(bvh3d_build_node *N, unsigned int ib, const unsigned int *T, int nc){
+	bvh3d_build_node *b = &N[ib];
+	const bvh3d_build_node *c = &N[T[0]];
+	int k;
+	b->nchild = nc;
+	b->child[0] = T[0];
+	b->tag = c->tag;
+	b->b[0] = c->b[0];
+	b->b[1] = c->b[1];
+	b->b[2] = c->b[2];
+	b->b[3] = c->b[3];
+	b->b[4] = c->b[4];
+	b->b[5] = c->b[5];
+	for(k = 1; k < nc; ++k){
+		c = &N[T[k]];
+		b->child[k] = T[k];
+		if(c->tag > b->tag){ b->tag = c->tag; }
+		if(c->b[0] < b->b[0]){ b->b[0] = c->b[0]; }
+		if(c->b[1] > b->b[1]){ b->b[1] = c->b[1]; }
+		if(c->b[2] < b->b[2]){ b->b[2] = c->b[2]; }
+		if(c->b[3] > b->b[3]){ b->b[3] = c->b[3]; }
+		if(c->b[4] < b->b[4]){ b->b[4] = c->b[4]; }
+		if(c->b[5] > b->b[5]){ b->b[5] = c->b[5]; }
+	}
+	BVHDBG("  Making internal node %u, tag=%d, b=%f,%f,%f,%f,%f,%f\n", ib, b->tag, b->b[0], b->b[1], b->b[2], b->b[3], b->b[4], b->b[5]);
+}
+
+// One level of STR: packs the n nodes indexed by B into parents, and
+// replaces the first *n_ entries of B with the parent indices.
+// Every slice except the last is full and yields exactly S parents, so
+// the parents of each slice are known up front and the slices are
+// sorted and packed in parallel.
+static void geom_bvh2d_STR(bvh2d_build *N, unsigned int *n_, unsigned int *B, bvh_sort_buf *buf){
 	const int n = *n_;
 	const int P = (n+3)/4;
 	const int S = isqrt_ceil(P);
-	*n_ = 0;
+	const int slice_size = 4*S;
+	const int nslice = (n + slice_size - 1) / slice_size;
+	const int last = n - (nslice-1)*slice_size;
+	const unsigned int np = (nslice-1)*S + (last+3)/4;
+	const unsigned int base = N->n;
+	int s;
+	
+	bvh2d_build_reserve(N, np);
 	
 	// Sort rectangles by first coordinate
-	sort_bvh2(B, 0, n, 0);
+	sort_bvh2(N->node, B, 0, n, 0, buf);
 	
 	// Partition into S slices and sort each slice by second coordinate
-	i = n;
-	while(i > 0){
-		int slice_size = 4*S;
-		if(slice_size > i){ slice_size = i; }
-		BVHDBG(" Slice size = %d\n", slice_size);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for(s = 0; s < nslice; ++s){
+		const int beg = s*slice_size;
+		const int end = (s+1 < nslice) ? beg + slice_size : n;
+		unsigned int ip = s*S;
+		int j;
+		BVHDBG(" Slice size = %d\n", end-beg);
 		
-		sort_bvh2(T, 0, slice_size, 1);
+		sort_bvh2(N->node, B, beg, end, 1, buf);
 		
 		// Now pack all the nodes into runs of length 4
-		j = slice_size;
-		while(j > 0){
-			int pack_size = 4;
-			if(pack_size > j){ pack_size = j; }
+		for(j = beg; j < end; j += 4, ++ip){
+			const int pack_size = (end-j < 4) ? end-j : 4;
+			bvh2d_pack(N->node, base + ip, B+j, pack_size);
+			buf->parent[ip] = base + ip;
+		}
+	}
+	N->n += np;
+	memcpy(B, buf->parent, sizeof(unsigned int) * np);
+	*n_ = np;
+	BVHDBG("Iteration of STR done; n=%d -> %d\n", n, *n_);
+}
+
+// The 3D version sorts into S slabs along x, cuts each slab into S
+// slices along y, and packs each slice in runs of 8 along z. Only the
+// slabs are processed in parallel.
+static void geom_bvh3d_STR(bvh3d_build *N, unsigned int *n_, unsigned int *B, bvh_sort_buf *buf){
+	const int n = *n_;
+	const int P = (n+7)/8;
+	const int S = icbrt_ceil(P);
+	const int slice_size = 8*S;
+	const int slab_size = S*slice_size;
+	const int nslab = (n + slab_size - 1) / slab_size;
+	const int last = n - (nslab-1)*slab_size;
+	const unsigned int np = (nslab-1)*S*S + (last/slice_size)*S + ((last%slice_size)+7)/8;
+	const unsigned int base = N->n;
+	int s;
+	
+	bvh3d_build_reserve(N, np);
+	
+	// Sort boxes by first coordinate
+	sort_bvh3(N->node, B, 0, n, 0, buf);
+	
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for(s = 0; s < nslab; ++s){
+		const int beg = s*slab_size;
+		const int end = (s+1 < nslab) ? beg + slab_size : n;
+		unsigned int ip = s*S*S;
+		int i, j;
+		BVHDBG(" Slab size = %d\n", end-beg);
+		
+		// Sort the slab by second coordinate, then slice it and sort
+		// each slice by the third coordinate
+		sort_bvh3(N->node, B, beg, end, 1, buf);
+		for(i = beg; i < end; i += slice_size){
+			const int iend = (end-i < slice_size) ? end : i+slice_size;
+			BVHDBG("  Slice size = %d\n", iend-i);
 			
-			// Make a new node
-			geom_bvh2d b = geom_bvh2d_make_blank();
-			b->child[0] = T[0];
-			b->tag = T[0]->tag;
-			b->b[0] = T[0]->b[0];
-			b->b[1] = T[0]->b[1];
-			b->b[2] = T[0]->b[2];
-			b->b[3] = T[0]->b[3];
-			for(k = 1; k < pack_size; ++k){
-				b->child[k] = T[k];
-				if(T[k]->tag > b->tag){ b->tag = T[k]->tag; }
-				if(T[k]->b[0] < b->b[0]){ b->b[0] = T[k]->b[0]; }
-				if(T[k]->b[1] > b->b[1]){ b->b[1] = T[k]->b[1]; }
-				if(T[k]->b[2] < b->b[2]){ b->b[2] = T[k]->b[2]; }
-				if(T[k]->b[3] > b->b[3]){ b->b[3] = T[k]->b[3]; }
-			}
-			BVHDBG("  Making internal node %p, tag=%d, b=%f,%f,%f,%f\n", b, b->tag, b->b[0], b->b[1], b->b[2], b->b[3]);
-			for(k = 0; k < pack_size; ++k){
-				BVHDBG("   Child node %p, tag=%d, b=%f,%f,%f,%f\n", T[k], T[k]->tag, T[k]->b[0], T[k]->b[1], T[k]->b[2], T[k]->b[3]);
-			}
-			*B = b;
-			T += pack_size;
-			B++;
-			(*n_)++;
+			sort_bvh3(N->node, B, i, iend, 2, buf);
 			
-			j -= pack_size;
+			for(j = i; j < iend; j += 8, ++ip){
+				const int pack_size = (iend-j < 8) ? iend-j : 8;
+				bvh3d_pack(N->node, base + ip, B+j, pack_size);
+				buf->parent[ip] = base + ip;
+			}
 		}
-		
-		i -= slice_size;
 	}
+	N->n += np;
+	memcpy(B, buf->parent, sizeof(unsigned int) * np);
+	*n_ = np;
 	BVHDBG("Iteration of STR done; n=%d -> %d\n", n, *n_);
 }
-geom_bvh2d geom_bvh2d_new(unsigned int n, int (*shape_iterator)(double c[2], double h[2], int *tag, void *data), void *data){
-	unsigned int i;
-	
-	// Make n boxes for each of the input boxes
-	geom_bvh2d *B = (geom_bvh2d*)malloc(sizeof(geom_bvh2d) * n);
+
+// Morton order build. The box centers are quantized on a grid over their
+// bounding box (2^16 cells per axis in 2D, 2^10 in 3D), the leaves are
+// sorted once by the interleaved bits, and then consecutive runs of 4
+// (or 8) nodes are packed into parents, level by level. Everything after
+// the sort is linear, and all leaves stay on the bottom level as with
+// STR.
+
+// Spreads the low 16 bits of x to the even bits
+static unsigned int morton_spread2(unsigned int x){
+	x &= 0xFFFF;
+	x = (x | (x << 8)) & 0x00FF00FF;
+	x = (x | (x << 4)) & 0x0F0F0F0F;
+	x = (x | (x << 2)) & 0x33333333;
+	x = (x | (x << 1)) & 0x55555555;
+	return x;
+}
+// Spreads the low 10 bits of x to every third bit
+static unsigned int morton_spread3(unsigned int x){
+	x &= 0x3FF;
+	x = (x | (x << 16)) & 0x030000FF;
+	x = (x | (x << 8)) & 0x0300F00F;
+	x = (x | (x << 4)) & 0x030C30C3;
+	x = (x | (x << 2)) & 0x09249249;
+	return x;
+}
+// Returns the grid cell of u along an axis with range [lo,lo+1/scale]
+static unsigned int morton_cell(double u, double lo, double scale, unsigned int max){
+	const double v = (u - lo) * scale;
+	return (v > 0) ? ((v < max) ? (unsigned int)v : max) : 0;
+}
+static void bvh_morton_scale(const double lo[], const double hi[], int dim, unsigned int max, double scale[]){
+	int d;
+	for(d = 0; d < dim; ++d){
+		scale[d] = (hi[d] > lo[d]) ? (double)max / (hi[d] - lo[d]) : 0;
+		if(!(scale[d] < HUGE_VAL)){ scale[d] = 0; }
+	}
+}
+
+// Fills in the SoA child bounds and the parents of the internal nodes of
+// a laid out tree. Takes ownership of box, which holds the bounds of node
+// i at box[4*i].
+static void bvh2d_gather_wide(geom_bvh2d ret, double *box){
+	unsigned int i, head;
+	memcpy(ret->box, box, sizeof(double) * 4);
+	ret->node[0].parent = 0;
+	ret->ninternal = 0;
+	while(ret->ninternal < ret->n && 0 != ret->node[ret->ninternal].nchild){
+		ret->ninternal++;
+	}
+	ret->wide = (bvh2d_wide*)malloc(sizeof(bvh2d_wide) * (ret->ninternal > 0 ? ret->ninternal : 1));
+	for(head = 0; head < ret->ninternal; ++head){
+		const bvh2d_node *b = &ret->node[head];
+		bvh2d_wide *w = &ret->wide[head];
+		for(i = 0; i < 4; ++i){
+			if(i < b->nchild){
+				const double *c = &box[4*(b->child + i)];
+				ret->node[b->child + i].parent = head;
+				w->xmin[i] = c[0];
+				w->xmax[i] = c[1];
+				w->ymin[i] = c[2];
+				w->ymax[i] = c[3];
+			}else{
+				w->xmin[i] = w->ymin[i] = HUGE_VAL;
+				w->xmax[i] = w->ymax[i] = -HUGE_VAL;
+			}
+		}
+	}
+	free(box);
+}
+
+// Lays out the finished build tree breadth-first from the root. The queue
+// position of a node is its final index, so children are appended
+// consecutively. Takes ownership of order, which must hold the root
+// index in order[0] and have room for all N->n nodes.
+static geom_bvh2d bvh2d_layout(const bvh2d_build *N, unsigned int *order){
+	unsigned int i, head = 0, tail = 1;
+	geom_bvh2d ret = (geom_bvh2d)malloc(sizeof(struct geom_bvh2d_struct));
+	double *box = (double*)malloc(sizeof(double) * 4 * N->n);
+	ret->counts = NULL;
+	ret->dyn = NULL;
+	ret->n = N->n;
+	ret->node = (bvh2d_node*)malloc(sizeof(bvh2d_node) * N->n);
+	while(head < tail){
+		const bvh2d_build_node *s = &N->node[order[head]];
+		bvh2d_node *d = &ret->node[head];
+		memcpy(&box[4*head], s->b, sizeof(double) * 4);
+		d->tag = s->tag;
+		d->child = tail;
+		d->nchild = s->nchild;
+		for(i = 0; i < s->nchild; ++i){
+			order[tail++] = s->child[i];
+		}
+		head++;
+	}
+	free(order);
+	bvh2d_gather_wide(ret, box);
+	return ret;
+}
+static geom_bvh3d bvh3d_layout(const bvh3d_build *N, unsigned int *order){
+	unsigned int i, head = 0, tail = 1;
+	geom_bvh3d ret = (geom_bvh3d)malloc(sizeof(struct geom_bvh3d_struct));
+	ret->counts = NULL;
+	ret->dyn = NULL;
+	ret->n = N->n;
+	ret->node = (bvh3d_node*)malloc(sizeof(bvh3d_node) * N->n);
+	while(head < tail){
+		const bvh3d_build_node *s = &N->node[order[head]];
+		bvh3d_node *d = &ret->node[head];
+		d->b[0] = s->b[0];
+		d->b[1] = s->b[1];
+		d->b[2] = s->b[2];
+		d->b[3] = s->b[3];
+		d->b[4] = s->b[4];
+		d->b[5] = s->b[5];
+		d->tag = s->tag;
+		d->child = tail;
+		d->nchild = s->nchild;
+		for(i = 0; i < s->nchild; ++i){
+			order[tail++] = s->child[i];
+		}
+		head++;
+	}
+	free(order);
+	return ret;
+}
+
+// The tree is emitted directly in its final breadth-first layout: levels
+// are stored from the root down, each in Morton order, so the children
+// of node i of a level are nodes 4i..4i+3 (8i..8i+7 in 3D) of the level
+// below. B holds the leaf indices into N on entry.
+static geom_bvh2d geom_bvh2d_morton(const bvh2d_build *N, unsigned int n, unsigned int *B, bvh_sort_buf *buf){
+	unsigned int level[32], off[32]; // level sizes and offsets, leaves first
+	unsigned int i, total = 0;
+	int nlevel = 0, l;
+	double lo[2] = { HUGE_VAL, HUGE_VAL }, hi[2] = { -HUGE_VAL, -HUGE_VAL }, scale[2];
 	geom_bvh2d ret;
+	double *box;
 	for(i = 0; i < n; ++i){
-		double c[2], h[2];
-		B[i] = geom_bvh2d_make_blank();
-		shape_iterator(c, h, &(B[i]->tag), data);
-		B[i]->b[0] = c[0]-h[0];
-		B[i]->b[1] = c[0]+h[0];
-		B[i]->b[2] = c[1]-h[1];
-		B[i]->b[3] = c[1]+h[1];
-		BVHDBG("Making leaf %p, tag=%d, b=%f,%f,%f,%f\n", B[i], B[i]->tag, B[i]->b[0], B[i]->b[1], B[i]->b[2], B[i]->b[3]);
+		const bvh2d_build_node *b = &N->node[B[i]];
+		const double cx = b->b[0] + b->b[1], cy = b->b[2] + b->b[3];
+		if(cx < lo[0]){ lo[0] = cx; }
+		if(cx > hi[0]){ hi[0] = cx; }
+		if(cy < lo[1]){ lo[1] = cy; }
+		if(cy > hi[1]){ hi[1] = cy; }
+	}
+	bvh_morton_scale(lo, hi, 2, 0xFFFF, scale);
+	for(i = 0; i < n; ++i){
+		const bvh2d_build_node *b = &N->node[B[i]];
+		buf->K[i] =
+			morton_spread2(morton_cell(b->b[0] + b->b[1], lo[0], scale[0], 0xFFFF)) |
+			(morton_spread2(morton_cell(b->b[2] + b->b[3], lo[1], scale[1], 0xFFFF)) << 1);
 	}
+	bvh_radix_sort(n, B, buf->K, buf->tB, buf->tK);
 	
-	// Create the tree
-	while(n > 1){
-		geom_bvh2d_STR(&n, B);
+	level[nlevel++] = n;
+	while(level[nlevel-1] > 1){
+		level[nlevel] = (level[nlevel-1]+3)/4;
+		nlevel++;
+	}
+	off[nlevel-1] = 0;
+	for(l = nlevel-2; l >= 0; --l){
+		off[l] = off[l+1] + level[l+1];
 	}
-	ret = B[0];
-	free(B);
+	total = off[0] + n;
+	
+	ret = (geom_bvh2d)malloc(sizeof(struct geom_bvh2d_struct));
+	ret->counts = NULL;
+	ret->dyn = NULL;
+	ret->n = total;
+	ret->node = (bvh2d_node*)malloc(sizeof(bvh2d_node) * total);
+	box = (double*)malloc(sizeof(double) * 4 * total);
+	for(i = 0; i < n; ++i){
+		const bvh2d_build_node *s = &N->node[B[i]];
+		bvh2d_node *d = &ret->node[off[0] + i];
+		memcpy(&box[4*(off[0] + i)], s->b, sizeof(double) * 4);
+		d->tag = s->tag;
+		d->child = 0;
+		d->nchild = 0;
+	}
+	for(l = 1; l < nlevel; ++l){
+		for(i = 0; i < level[l]; ++i){
+			bvh2d_node *d = &ret->node[off[l] + i];
+			double *db = &box[4*(off[l] + i)];
+			const unsigned int first = off[l-1] + 4*i;
+			const unsigned int nc = (level[l-1] - 4*i < 4) ? level[l-1] - 4*i : 4;
+			const bvh2d_node *c = &ret->node[first];
+			const double *cb = &box[4*first];
+			unsigned int k;
+			d->child = first;
+			d->nchild = nc;
+			d->tag = c->tag;
+			memcpy(db, cb, sizeof(double) * 4);
+			for(k = 1; k < nc; ++k){
+				++c;
+				cb += 4;
+				if(c->tag > d->tag){ d->tag = c->tag; }
+				if(cb[0] < db[0]){ db[0] = cb[0]; }
+				if(cb[1] > db[1]){ db[1] = cb[1]; }
+				if(cb[2] < db[2]){ db[2] = cb[2]; }
+				if(cb[3] > db[3]){ db[3] = cb[3]; }
+			}
+		}
+	}
+	bvh2d_gather_wide(ret, box);
 	return ret;
 }
-
-static void geom_bvh3d_STR(unsigned int *n_, geom_bvh3d *B){
-	int i, j, k, l;
-	geom_bvh3d *T = B;
-	const unsigned int n = *n_;
-	const unsigned int P = (n+7)/8;
-	const unsigned int S = icbrt_ceil(P);
-	*n_ = 0;
+static geom_bvh3d geom_bvh3d_morton(const bvh3d_build *N, unsigned int n, unsigned int *B, bvh_sort_buf *buf){
+	unsigned int level[32], off[32];
+	unsigned int i, total = 0;
+	int nlevel = 0, l, d;
+	double lo[3] = { HUGE_VAL, HUGE_VAL, HUGE_VAL }, hi[3] = { -HUGE_VAL, -HUGE_VAL, -HUGE_VAL }, scale[3];
+	geom_bvh3d ret;
+	for(i = 0; i < n; ++i){
+		const bvh3d_build_node *b = &N->node[B[i]];
+		for(d = 0; d < 3; ++d){
+			const double c = b->b[2*d+0] + b->b[2*d+1];
+			if(c < lo[d]){ lo[d] = c; }
+			if(c > hi[d]){ hi[d] = c; }
+		}
+	}
+	bvh_morton_scale(lo, hi, 3, 0x3FF, scale);
+	for(i = 0; i < n; ++i){
+		const bvh3d_build_node *b = &N->node[B[i]];
+		buf->K[i] =
+			morton_spread3(morton_cell(b->b[0] + b->b[1], lo[0], scale[0], 0x3FF)) |
+			(morton_spread3(morton_cell(b->b[2] + b->b[3], lo[1], scale[1], 0x3FF)) << 1) |
+			(morton_spread3(morton_cell(b->b[4] + b->b[5], lo[2], scale[2], 0x3FF)) << 2);
+	}
+	bvh_radix_sort(n, B, buf->K, buf->tB, buf->tK);
 	
-	// Sort rectangles by first coordinate
-	sort_bvh3(B, 0, n, 0);
+	level[nlevel++] = n;
+	while(level[nlevel-1] > 1){
+		level[nlevel] = (level[nlevel-1]+7)/8;
+		nlevel++;
+	}
+	off[nlevel-1] = 0;
+	for(l = nlevel-2; l >= 0; --l){
+		off[l] = off[l+1] + level[l+1];
+	}
+	total = off[0] + n;
 	
-	// Partition into S slices and sort each slice by second coordinate
-	i = n;
-	while(i > 0){
-		int slice_size = 8*S;
-		if(slice_size > i){ slice_size = i; }
-		BVHDBG(" Slice size = %d\n", slice_size);
-		
-		sort_bvh3(T, 0, slice_size, 1);
-		
-		// Now slice by second coordinate and sort by third coord
-		j = slice_size;
-		while(j > 0){
-			int slice_size2 = 8*S;
-			if(slice_size2 > j){ slice_size2 = j; }
-			BVHDBG("  Slice2 size = %d\n", slice_size2);
-			
-			sort_bvh3(T, 0, slice_size2, 2);
-			
-			k = slice_size2;
-			while(k > 0){
-				int pack_size = 8;
-				if(pack_size > k){ pack_size = k; }
-				
-				// Make a new node
-				geom_bvh3d b = geom_bvh3d_make_blank();
-				b->child[0] = T[0];
-				b->tag = T[0]->tag;
-				b->b[0] = T[0]->b[0];
-				b->b[1] = T[0]->b[1];
-				b->b[2] = T[0]->b[2];
-				b->b[3] = T[0]->b[3];
-				b->b[4] = T[0]->b[4];
-				b->b[5] = T[0]->b[5];
-				for(l = 1; l < pack_size; ++l){
-					b->child[l] = T[l];
-					if(T[l]->tag > b->tag){ b->tag = T[l]->tag; }
-					if(T[l]->b[0] < b->b[0]){ b->b[0] = T[l]->b[0]; }
-					if(T[l]->b[1] > b->b[1]){ b->b[1] = T[l]->b[1]; }
-					if(T[l]->b[2] < b->b[2]){ b->b[2] = T[l]->b[2]; }
-					if(T[l]->b[3] > b->b[3]){ b->b[3] = T[l]->b[3]; }
-					if(T[l]->b[4] < b->b[4]){ b->b[4] = T[l]->b[4]; }
-					if(T[l]->b[5] > b->b[5]){ b->b[5] = T[l]->b[5]; }
-				}
-				BVHDBG("  Making internal node %p, tag=%d, b=%f,%f,%f,%f,%f,%f\n", b, b->tag, b->b[0], b->b[1], b->b[2], b->b[3], b->b[4], b->b[5]);
-				for(l = 0; l < pack_size; ++l){
-					BVHDBG("   Child node %p, tag=%d, b=%f,%f,%f,%f,%f,%f\n", T[l], T[l]->tag, T[l]->b[0], T[l]->b[1], T[l]->b[2], T[l]->b[3], T[l]->b[4], T[l]->b[5]);
+	ret = (geom_bvh3d)malloc(sizeof(struct geom_bvh3d_struct));
+	ret->counts = NULL;
+	ret->dyn = NULL;
+	ret->n = total;
+	ret->node = (bvh3d_node*)malloc(sizeof(bvh3d_node) * total);
+	for(i = 0; i < n; ++i){
+		const bvh3d_build_node *s = &N->node[B[i]];
+		bvh3d_node *dn = &ret->node[off[0] + i];
+		for(d = 0; d < 6; ++d){ dn->b[d] = s->b[d]; }
+		dn->tag = s->tag;
+		dn->child = 0;
+		dn->nchild = 0;
+	}
+	for(l = 1; l < nlevel; ++l){
+		for(i = 0; i < level[l]; ++i){
+			bvh3d_node *dn = &ret->node[off[l] + i];
+			const unsigned int first = off[l-1] + 8*i;
+			const unsigned int nc = (level[l-1] - 8*i < 8) ? level[l-1] - 8*i : 8;
+			const bvh3d_node *c = &ret->node[first];
+			unsigned int k;
+			dn->child = first;
+			dn->nchild = nc;
+			dn->tag = c->tag;
+			for(d = 0; d < 6; ++d){ dn->b[d] = c->b[d]; }
+			for(k = 1; k < nc; ++k){
+				++c;
+				if(c->tag > dn->tag){ dn->tag = c->tag; }
+				for(d = 0; d < 6; d += 2){
+					if(c->b[d+0] < dn->b[d+0]){ dn->b[d+0] = c->b[d+0]; }
+					if(c->b[d+1] > dn->b[d+1]){ dn->b[d+1] = c->b[d+1]; }
 				}
-				*B = b;
-				T += pack_size;
-				B++;
-				(*n_)++;
-				k -= pack_size;
 			}
-			
-			j -= slice_size2;
 		}
-		
-		i -= slice_size;
 	}
-	BVHDBG("Iteration of STR done; n=%d -> %d\n", n, *n_);
+	return ret;
 }
-geom_bvh3d geom_bvh3d_new(unsigned int n, int (*shape_iterator)(double c[3], double h[3], int *tag, void *data), void *data){
+
+geom_bvh2d geom_bvh2d_new(unsigned int n, int (*shape_iterator)(double c[2], double h[2], int *tag, void *data), void *data){
+	return geom_bvh2d_new_method(n, shape_iterator, data, GEOM_BVH_STR);
+}
+geom_bvh2d geom_bvh2d_new_method(unsigned int n, int (*shape_iterator)(double c[2], double h[2], int *tag, void *data), void *data, geom_bvh_method method){
 	unsigned int i;
+	bvh2d_build N;
+	bvh_sort_buf buf;
+	unsigned int *B;
+	geom_bvh2d ret;
+	if(0 == n){ return NULL; }
+	
+	// Make n leaves for each of the input boxes
+	N.n = 0;
+	N.n_alloc = 0;
+	N.node = NULL;
+	bvh2d_build_reserve(&N, n + n/3 + 64);
+	B = (unsigned int*)malloc(sizeof(unsigned int) * n);
+	for(i = 0; i < n; ++i){
+		double c[2], h[2];
+		bvh2d_build_node *b = &N.node[i];
+		b->tag = 0;
+		b->nchild = 0;
+		shape_iterator(c, h, &(b->tag), data);
+		b->b[0] = c[0]-h[0];
+		b->b[1] = c[0]+h[0];
+		b->b[2] = c[1]-h[1];
+		b->b[3] = c[1]+h[1];
+		B[i] = i;
+		BVHDBG("Making leaf %u, tag=%d, b=%f,%f,%f,%f\n", i, b->tag, b->b[0], b->b[1], b->b[2], b->b[3]);
+	}
+	N.n = n;
+	
+	// Create the tree
+	bvh_sort_buf_init(&buf, n);
+	if(GEOM_BVH_MORTON == method){
+		ret = geom_bvh2d_morton(&N, n, B, &buf);
+		bvh_sort_buf_destroy(&buf);
+		free(B);
+		free(N.node);
+		return ret;
+	}
+	while(n > 1){
+		geom_bvh2d_STR(&N, &n, B, &buf);
+	}
+	bvh_sort_buf_destroy(&buf);
 	
-	geom_bvh3d *B = (geom_bvh3d*)malloc(sizeof(geom_bvh3d) * n);
+	// B[0] is the root
+	ret = bvh2d_layout(&N, (unsigned int*)realloc(B, sizeof(unsigned int) * N.n));
+	free(N.node);
+	return ret;
+}
+geom_bvh3d geom_bvh3d_new(unsigned int n, int (*shape_iterator)(double c[3], double h[3], int *tag, void *data), void *data){
+	return geom_bvh3d_new_method(n, shape_iterator, data, GEOM_BVH_STR);
+}
+geom_bvh3d geom_bvh3d_new_method(unsigned int n, int (*shape_iterator)(double c[3], double h[3], int *tag, void *data), void *data, geom_bvh_method method){
+	unsigned int i;
+	bvh3d_build N;
+	bvh_sort_buf buf;
+	unsigned int *B;
 	geom_bvh3d ret;
+	if(0 == n){ return NULL; }
+	
+	N.n = 0;
+	N.n_alloc = 0;
+	N.node = NULL;
+	bvh3d_build_reserve(&N, n + n/7 + 64);
+	B = (unsigned int*)malloc(sizeof(unsigned int) * n);
 	for(i = 0; i < n; ++i){
 		double c[3], h[3];
-		B[i] = geom_bvh3d_make_blank();
-		shape_iterator(c, h, &(B[i]->tag), data);
-		B[i]->b[0] = c[0]-h[0];
-		B[i]->b[1] = c[0]+h[0];
-		B[i]->b[2] = c[1]-h[1];
-		B[i]->b[3] = c[1]+h[1];
-		B[i]->b[4] = c[2]-h[2];
-		B[i]->b[5] = c[2]+h[2];
-		BVHDBG("Making leaf %p, tag=%d, b=%f,%f,%f,%f,%f,%f\n", B[i], B[i]->tag, B[i]->b[0], B[i]->b[1], B[i]->b[2], B[i]->b[3], B[i]->b[4], B[i]->b[5]);
+		bvh3d_build_node *b = &N.node[i];
+		b->tag = 0;
+		b->nchild = 0;
+		shape_iterator(c, h, &(b->tag), data);
+		b->b[0] = c[0]-h[0];
+		b->b[1] = c[0]+h[0];
+		b->b[2] = c[1]-h[1];
+		b->b[3] = c[1]+h[1];
+		b->b[4] = c[2]-h[2];
+		b->b[5] = c[2]+h[2];
+		B[i] = i;
+		BVHDBG("Making leaf %u, tag=%d, b=%f,%f,%f,%f,%f,%f\n", i, b->tag, b->b[0], b->b[1], b->b[2], b->b[3], b->b[4], b->b[5]);
 	}
+	N.n = n;
 	
+	bvh_sort_buf_init(&buf, n);
+	if(GEOM_BVH_MORTON == method){
+		ret = geom_bvh3d_morton(&N, n, B, &buf);
+		bvh_sort_buf_destroy(&buf);
+		free(B);
+		free(N.node);
+		return ret;
+	}
 	while(n > 1){
-		geom_bvh3d_STR(&n, B);
+		geom_bvh3d_STR(&N, &n, B, &buf);
 	}
-	ret = B[0];
-	free(B);
+	bvh_sort_buf_destroy(&buf);
+	
+	ret = bvh3d_layout(&N, (unsigned int*)realloc(B, sizeof(unsigned int) * N.n));
+	free(N.node);
 	return ret;
 }
 
+static void bvh_dyn_destroy(bvh_dyn *T);
 void geom_bvh2d_destroy(geom_bvh2d bvh){
-	int i;
 	if(NULL == bvh){ return; }
-	for(i = 0; i < 4; ++i){
-		geom_bvh2d_destroy(bvh->child[i]);
-	}
+	bvh_dyn_destroy(bvh->dyn);
+	free(bvh->wide);
+	free(bvh->node);
 	free(bvh);
 }
 void geom_bvh3d_destroy(geom_bvh3d bvh){
-	int i;
 	if(NULL == bvh){ return; }
-	for(i = 0; i < 8; ++i){
-		geom_bvh3d_destroy(bvh->child[i]);
-	}
+	bvh_dyn_destroy(bvh->dyn);
+	free(bvh->node);
 	free(bvh);
 }
 
-int geom_bvh2d_query_pt(geom_bvh2d bvh, const double p[2], int (*query_func)(int tag, const double c[2], const double h[2], void *data), void *data){
+void geom_bvh2d_set_counts(geom_bvh2d bvh, geom_query_counts *counts){
+	if(NULL == bvh){ return; }
+	bvh->counts = counts;
+}
+void geom_bvh3d_set_counts(geom_bvh3d bvh, geom_query_counts *counts){
+	if(NULL == bvh){ return; }
+	bvh->counts = counts;
+}
+// The queries count into a local record, which is added to the attached
+// one (if any) when the query returns.
+static int bvh_counts_add(geom_query_counts *counts, const geom_query_counts *c, int ret){
+	if(NULL != counts){
+		counts->queries++;
+		counts->nodes += c->nodes;
+		counts->leaves += c->leaves;
+	}
+	return ret;
+}
+
+// Dynamic trees follow the incremental scheme of Box2D's b2DynamicTree.
+// A new leaf goes down the tree toward the child whose surface area
+// (perimeter in 2D) would grow the least, stopping where making it a
+// sibling is cheaper than descending further, and every node on the path
+// back up is refit and given a chance to rotate. Removal splices out the
+// parent of the leaf and refits the same way.
+
+static bvh_dyn *bvh_dyn_new(int dim){
+	bvh_dyn *T = (bvh_dyn*)malloc(sizeof(bvh_dyn));
+	T->dim = dim;
+	T->root = -1;
+	T->n_alloc = 0;
+	T->free = -1;
+	T->node = NULL;
+	T->nleaf = 0;
+	T->leaf = NULL;
+	return T;
+}
+static void bvh_dyn_destroy(bvh_dyn *T){
+	if(NULL == T){ return; }
+	free(T->node);
+	free(T->leaf);
+	free(T);
+}
+static int bvh_dyn_alloc(bvh_dyn *T){
+	bvh_dnode *a;
+	int i;
+	if(T->free < 0){
+		const int n = T->n_alloc;
+		T->n_alloc = 2*n + 16;
+		T->node = (bvh_dnode*)realloc(T->node, sizeof(bvh_dnode) * T->n_alloc);
+		for(i = n; i < T->n_alloc; ++i){
+			T->node[i].parent = i+1;
+			T->node[i].height = -1;
+		}
+		T->node[T->n_alloc-1].parent = -1;
+		T->free = n;
+	}
+	i = T->free;
+	a = &T->node[i];
+	T->free = a->parent;
+	a->parent = -1;
+	a->child[0] = -1;
+	a->child[1] = -1;
+	a->height = 0;
+	return i;
+}
+static void bvh_dyn_release(bvh_dyn *T, int i){
+	T->node[i].parent = T->free;
+	T->node[i].height = -1;
+	T->free = i;
+}
+static double bvh_dyn_area(const double *b, int dim){
+	const double x = b[1] - b[0], y = b[3] - b[2];
+	if(2 == dim){ return x + y; }
+	return x*y + (x + y)*(b[5] - b[4]);
+}
+static void bvh_dyn_union(double *u, const double *a, const double *b, int dim){
+	int d;
+	for(d = 0; d < 2*dim; d += 2){
+		u[d+0] = (a[d+0] < b[d+0]) ? a[d+0] : b[d+0];
+		u[d+1] = (a[d+1] > b[d+1]) ? a[d+1] : b[d+1];
+	}
+}
+// Recomputes the box, tag and height of internal node i from its children
+static void bvh_dyn_fix(bvh_dyn *T, int i){
+	bvh_dnode *a = &T->node[i];
+	const bvh_dnode *c0 = &T->node[a->child[0]];
+	const bvh_dnode *c1 = &T->node[a->child[1]];
+	bvh_dyn_union(a->b, c0->b, c1->b, T->dim);
+	a->tag = (c0->tag > c1->tag) ? c0->tag : c1->tag;
+	a->height = 1 + ((c0->height > c1->height) ? c0->height : c1->height);
+}
+// Swaps a child of node ia with a child of its other child when that
+// shrinks the box of the latter the most (as in Box2D v3). Unlike the
+// rotations of an AVL tree these do not bound the height, but they keep
+// the total area small, which is what the queries pay for.
+static void bvh_dyn_rotate(bvh_dyn *T, int ia){
+	bvh_dnode *N = T->node;
+	double best = 0;
+	int k, j, bk = -1, bj = 0;
+	for(k = 0; k < 2; ++k){
+		const int iu = N[ia].child[k], io = N[ia].child[1-k];
+		if(N[io].child[0] < 0){ continue; }
+		for(j = 0; j < 2; ++j){
+			// iu takes the place of child j of io
+			double u[6], diff;
+			bvh_dyn_union(u, N[iu].b, N[N[io].child[1-j]].b, T->dim);
+			diff = bvh_dyn_area(u, T->dim) - bvh_dyn_area(N[io].b, T->dim);
+			if(diff < best){
+				best = diff;
+				bk = k;
+				bj = j;
+			}
+		}
+	}
+	if(bk < 0){ return; }
+	{
+		const int iu = N[ia].child[bk], io = N[ia].child[1-bk];
+		const int ig = N[io].child[bj];
+		N[ia].child[bk] = ig;
+		N[ig].parent = ia;
+		N[io].child[bj] = iu;
+		N[iu].parent = io;
+		bvh_dyn_fix(T, io);
+	}
+}
+// Rotates and refits the nodes from i up to the root
+static void bvh_dyn_refit_up(bvh_dyn *T, int i){
+	while(i >= 0){
+		bvh_dyn_rotate(T, i);
+		bvh_dyn_fix(T, i);
+		i = T->node[i].parent;
+	}
+}
+static void bvh_dyn_insert_leaf(bvh_dyn *T, int leaf){
+	const int dim = T->dim;
+	const int np = bvh_dyn_alloc(T);
+	bvh_dnode *N = T->node;
+	const double *lb = N[leaf].b;
+	int i = T->root, up;
+	if(i < 0){
+		bvh_dyn_release(T, np);
+		N[leaf].parent = -1;
+		T->root = leaf;
+		return;
+	}
+	while(N[i].child[0] >= 0){
+		double u[6], cost[2];
+		double here, inherited;
+		int k;
+		bvh_dyn_union(u, N[i].b, lb, dim);
+		// Making the leaf a sibling of i creates a node as large as u;
+		// going further down grows i to u anyway.
+		here = 2*bvh_dyn_area(u, dim);
+		inherited = here - 2*bvh_dyn_area(N[i].b, dim);
+		for(k = 0; k < 2; ++k){
+			const bvh_dnode *c = &N[N[i].child[k]];
+			bvh_dyn_union(u, c->b, lb, dim);
+			cost[k] = bvh_dyn_area(u, dim) + inherited;
+			if(c->child[0] >= 0){ cost[k] -= bvh_dyn_area(c->b, dim); }
+		}
+		if(here < cost[0] && here < cost[1]){ break; }
+		i = N[i].child[cost[1] < cost[0]];
+	}
+	up = N[i].parent;
+	N[np].parent = up;
+	N[np].child[0] = i;
+	N[np].child[1] = leaf;
+	N[i].parent = np;
+	N[leaf].parent = np;
+	if(up < 0){
+		T->root = np;
+	}else{
+		N[up].child[N[up].child[1] == i] = np;
+	}
+	bvh_dyn_refit_up(T, np);
+}
+static void bvh_dyn_remove_leaf(bvh_dyn *T, int leaf){
+	bvh_dnode *N = T->node;
+	const int parent = N[leaf].parent;
+	int sibling, up;
+	if(parent < 0){
+		T->root = -1;
+		return;
+	}
+	sibling = N[parent].child[N[parent].child[0] == leaf];
+	up = N[parent].parent;
+	N[sibling].parent = up;
+	bvh_dyn_release(T, parent);
+	if(up < 0){
+		T->root = sibling;
+	}else{
+		N[up].child[N[up].child[1] == parent] = sibling;
+		bvh_dyn_refit_up(T, up);
+	}
+}
+static void bvh_dyn_set_box(bvh_dyn *T, int i, const double *c, const double *h){
+	int d;
+	for(d = 0; d < T->dim; ++d){
+		T->node[i].b[2*d+0] = c[d] - h[d];
+		T->node[i].b[2*d+1] = c[d] + h[d];
+	}
+}
+static int bvh_dyn_insert(bvh_dyn *T, int tag, const double *c, const double *h){
+	int i;
+	if(tag < 0){ return -2; }
+	if(tag >= T->nleaf){
+		const int n = T->nleaf;
+		T->nleaf = (2*n > tag) ? 2*n : tag+1;
+		T->leaf = (int*)realloc(T->leaf, sizeof(int) * T->nleaf);
+		for(i = n; i < T->nleaf; ++i){ T->leaf[i] = -1; }
+	}
+	if(T->leaf[tag] >= 0){ return -2; }
+	i = bvh_dyn_alloc(T);
+	T->node[i].tag = tag;
+	bvh_dyn_set_box(T, i, c, h);
+	T->leaf[tag] = i;
+	bvh_dyn_insert_leaf(T, i);
+	return 0;
+}
+static int bvh_dyn_remove(bvh_dyn *T, int tag){
+	if(tag < 0 || tag >= T->nleaf || T->leaf[tag] < 0){ return -2; }
+	bvh_dyn_remove_leaf(T, T->leaf[tag]);
+	bvh_dyn_release(T, T->leaf[tag]);
+	T->leaf[tag] = -1;
+	return 0;
+}
+// A leaf that stays inside the box of its parent is refit in place: the
+// ancestors can only shrink, and the refit stops at the first one that
+// does not. A leaf that leaves it is reinserted, so that the tree does
+// not degrade as things move about.
+static int bvh_dyn_update(bvh_dyn *T, int tag, const double *c, const double *h){
+	int i, up, d;
+	if(tag < 0 || tag >= T->nleaf || T->leaf[tag] < 0){ return -2; }
+	i = T->leaf[tag];
+	bvh_dyn_set_box(T, i, c, h);
+	up = T->node[i].parent;
+	if(up < 0){ return 0; }
+	for(d = 0; d < T->dim; ++d){
+		if(T->node[i].b[2*d+0] < T->node[up].b[2*d+0] || T->node[up].b[2*d+1] < T->node[i].b[2*d+1]){
+			bvh_dyn_remove_leaf(T, i);
+			bvh_dyn_insert_leaf(T, i);
+			return 0;
+		}
+	}
+	while(up >= 0){
+		double b[6];
+		memcpy(b, T->node[up].b, sizeof(b));
+		bvh_dyn_fix(T, up);
+		if(0 == memcmp(b, T->node[up].b, sizeof(double) * 2*T->dim)){ break; }
+		up = T->node[up].parent;
+	}
+	return 0;
+}
+
+geom_bvh2d geom_bvh2d_new_dynamic(void){
+	geom_bvh2d ret = (geom_bvh2d)malloc(sizeof(struct geom_bvh2d_struct));
+	ret->n = 0;
+	ret->node = NULL;
+	ret->ninternal = 0;
+	ret->wide = NULL;
+	ret->counts = NULL;
+	ret->dyn = bvh_dyn_new(2);
+	return ret;
+}
+geom_bvh3d geom_bvh3d_new_dynamic(void){
+	geom_bvh3d ret = (geom_bvh3d)malloc(sizeof(struct geom_bvh3d_struct));
+	ret->n = 0;
+	ret->node = NULL;
+	ret->counts = NULL;
+	ret->dyn = bvh_dyn_new(3);
+	return ret;
+}
+int geom_bvh2d_insert(geom_bvh2d bvh, int tag, const double c[2], const double h[2]){
+	if(NULL == bvh || NULL == bvh->dyn){ return -1; }
+	if(NULL == c || NULL == h){ return -3; }
+	return bvh_dyn_insert(bvh->dyn, tag, c, h);
+}
+int geom_bvh3d_insert(geom_bvh3d bvh, int tag, const double c[3], const double h[3]){
+	if(NULL == bvh || NULL == bvh->dyn){ return -1; }
+	if(NULL == c || NULL == h){ return -3; }
+	return bvh_dyn_insert(bvh->dyn, tag, c, h);
+}
+int geom_bvh2d_remove(geom_bvh2d bvh, int tag){
+	if(NULL == bvh || NULL == bvh->dyn){ return -1; }
+	return bvh_dyn_remove(bvh->dyn, tag);
+}
+int geom_bvh3d_remove(geom_bvh3d bvh, int tag){
+	if(NULL == bvh || NULL == bvh->dyn){ return -1; }
+	return bvh_dyn_remove(bvh->dyn, tag);
+}
+int geom_bvh2d_update(geom_bvh2d bvh, int tag, const double c[2], const double h[2]){
+	if(NULL == bvh || NULL == bvh->dyn){ return -1; }
+	if(NULL == c || NULL == h){ return -3; }
+	return bvh_dyn_update(bvh->dyn, tag, c, h);
+}
+int geom_bvh3d_update(geom_bvh3d bvh, int tag, const double c[3], const double h[3]){
+	if(NULL == bvh || NULL == bvh->dyn){ return -1; }
+	if(NULL == c || NULL == h){ return -3; }
+	return bvh_dyn_update(bvh->dyn, tag, c, h);
+}
+
+static void bvh2d_box_ch(const double b[4], double c[2], double h[2]){
+	c[0] = 0.5*b[0] + 0.5*b[1];
+	c[1] = 0.5*b[2] + 0.5*b[3];
+	h[0] = 0.5*b[1] - 0.5*b[0];
+	h[1] = 0.5*b[3] - 0.5*b[2];
+}
+static void bvh2d_wide_box(const bvh2d_wide *w, unsigned int k, double b[4]){
+	b[0] = w->xmin[k];
+	b[1] = w->xmax[k];
+	b[2] = w->ymin[k];
+	b[3] = w->ymax[k];
+}
+// Bounds of node i of a static tree, from its slot in the parent
+static void bvh2d_node_bounds(geom_bvh2d bvh, unsigned int i, double b[4]){
+	if(0 == i){
+		memcpy(b, bvh->box, sizeof(double) * 4);
+	}else{
+		const unsigned int p = bvh->node[i].parent;
+		bvh2d_wide_box(&bvh->wide[p], i - bvh->node[p].child, b);
+	}
+}
+// Center and half-sizes of the k-th child of internal node ib
+static void bvh2d_child_box(geom_bvh2d bvh, unsigned int ib, unsigned int k, double c[2], double h[2]){
+	double b[4];
+	bvh2d_wide_box(&bvh->wide[ib], k, b);
+	bvh2d_box_ch(b, c, h);
+}
+static void bvh3d_node_box(const bvh3d_node *b, double c[3], double h[3]){
+	c[0] = 0.5*b->b[0] + 0.5*b->b[1];
+	c[1] = 0.5*b->b[2] + 0.5*b->b[3];
+	c[2] = 0.5*b->b[4] + 0.5*b->b[5];
+	h[0] = 0.5*b->b[1] - 0.5*b->b[0];
+	h[1] = 0.5*b->b[3] - 0.5*b->b[2];
+	h[2] = 0.5*b->b[5] - 0.5*b->b[4];
+}
+
+// Returns a bit mask of the children of internal node w whose boxes
+// contain the point p.
+static unsigned int bvh2d_wide_mask_pt(const bvh2d_wide *w, const double p[2]){
+#if defined(__AVX__)
+	const __m256d px = _mm256_set1_pd(p[0]);
+	const __m256d py = _mm256_set1_pd(p[1]);
+	__m256d m = _mm256_and_pd(
+		_mm256_cmp_pd(_mm256_loadu_pd(w->xmin), px, _CMP_LE_OQ),
+		_mm256_cmp_pd(px, _mm256_loadu_pd(w->xmax), _CMP_LE_OQ)
+	);
+	m = _mm256_and_pd(m, _mm256_cmp_pd(_mm256_loadu_pd(w->ymin), py, _CMP_LE_OQ));
+	m = _mm256_and_pd(m, _mm256_cmp_pd(py, _mm256_loadu_pd(w->ymax), _CMP_LE_OQ));
+	return (unsigned int)_mm256_movemask_pd(m);
+#elif defined(__SSE2__)
+	const __m128d px = _mm_set1_pd(p[0]);
+	const __m128d py = _mm_set1_pd(p[1]);
+	unsigned int mask = 0;
+	int i;
+	for(i = 0; i < 4; i += 2){
+		__m128d m = _mm_and_pd(
+			_mm_cmple_pd(_mm_loadu_pd(w->xmin+i), px),
+			_mm_cmple_pd(px, _mm_loadu_pd(w->xmax+i))
+		);
+		m = _mm_and_pd(m, _mm_cmple_pd(_mm_loadu_pd(w->ymin+i), py));
+		m = _mm_and_pd(m, _mm_cmple_pd(py, _mm_loadu_pd(w->ymax+i)));
+		mask |= (unsigned int)_mm_movemask_pd(m) << i;
+	}
+	return mask;
+#else
+	unsigned int mask = 0;
+	int i;
+	for(i = 0; i < 4; ++i){
+		if(w->xmin[i] <= p[0] && p[0] <= w->xmax[i] && w->ymin[i] <= p[1] && p[1] <= w->ymax[i]){
+			mask |= 1u << i;
+		}
+	}
+	return mask;
+#endif
+}
+// Returns a bit mask of the children of internal node w whose boxes
+// overlap the box [lo,hi]. A child is rejected if it is separated from
+// the box along either axis.
+static unsigned int bvh2d_wide_mask_box(const bvh2d_wide *w, const double lo[2], const double hi[2]){
+#if defined(__AVX__)
+	const __m256d lox = _mm256_set1_pd(lo[0]), hix = _mm256_set1_pd(hi[0]);
+	const __m256d loy = _mm256_set1_pd(lo[1]), hiy = _mm256_set1_pd(hi[1]);
+	const __m256d outx = _mm256_or_pd(
+		_mm256_cmp_pd(_mm256_loadu_pd(w->xmax), lox, _CMP_LT_OQ),
+		_mm256_cmp_pd(hix, _mm256_loadu_pd(w->xmin), _CMP_LT_OQ)
+	);
+	const __m256d outy = _mm256_or_pd(
+		_mm256_cmp_pd(_mm256_loadu_pd(w->ymax), loy, _CMP_LT_OQ),
+		_mm256_cmp_pd(hiy, _mm256_loadu_pd(w->ymin), _CMP_LT_OQ)
+	);
+	return 0xFu & ~(unsigned int)_mm256_movemask_pd(_mm256_or_pd(outx, outy));
+#elif defined(__SSE2__)
+	const __m128d lox = _mm_set1_pd(lo[0]), hix = _mm_set1_pd(hi[0]);
+	const __m128d loy = _mm_set1_pd(lo[1]), hiy = _mm_set1_pd(hi[1]);
+	unsigned int out = 0;
+	int i;
+	for(i = 0; i < 4; i += 2){
+		const __m128d outx = _mm_or_pd(
+			_mm_cmplt_pd(_mm_loadu_pd(w->xmax+i), lox),
+			_mm_cmplt_pd(hix, _mm_loadu_pd(w->xmin+i))
+		);
+		const __m128d outy = _mm_or_pd(
+			_mm_cmplt_pd(_mm_loadu_pd(w->ymax+i), loy),
+			_mm_cmplt_pd(hiy, _mm_loadu_pd(w->ymin+i))
+		);
+		out |= (unsigned int)_mm_movemask_pd(_mm_or_pd(outx, outy)) << i;
+	}
+	return 0xFu & ~out;
+#else
+	unsigned int mask = 0;
+	int i;
+	for(i = 0; i < 4; ++i){
+		if(!(w->xmax[i] < lo[0] || hi[0] < w->xmin[i] || w->ymax[i] < lo[1] || hi[1] < w->ymin[i])){
+			mask |= 1u << i;
+		}
+	}
+	return mask;
+#endif
+}
+
+// A ray p + t*v with the reciprocal direction precomputed for the slab
+// tests. neg[d] selects the near face of a box along axis d. A zero
+// component gives an infinite reciprocal; the resulting NaNs (when p lies
+// on a face) are made harmless by the order of the comparisons below.
+typedef struct{
+	double p[3], inv[3];
+	int neg[3];
+} bvh_ray;
+
+static void bvh_ray_init(bvh_ray *r, const double *p, const double *v, int dim){
+	int d;
+	for(d = 0; d < dim; ++d){
+		r->p[d] = p[d];
+		r->inv[d] = 1. / v[d];
+		r->neg[d] = (r->inv[d] < 0);
+	}
+}
+// Slab test of the ray against a min/max box b over t in [0,tmax]. Returns
+// nonzero on a hit, with the entry parameter in *t.
+static int bvh_ray_box(const bvh_ray *r, const double *b, int dim, double tmax, double *t){
+	double t0 = 0, t1 = tmax;
+	int d;
+	for(d = 0; d < dim; ++d){
+		const double tn = (b[2*d+  r->neg[d]] - r->p[d]) * r->inv[d];
+		const double tf = (b[2*d+1-r->neg[d]] - r->p[d]) * r->inv[d];
+		if(tn > t0){ t0 = tn; }
+		if(tf < t1){ t1 = tf; }
+	}
+	*t = t0;
+	return t0 <= t1;
+}
+// Returns a bit mask of the children of internal node w hit by the ray
+// over [0,tmax], with their entry parameters in t.
+static unsigned int bvh2d_wide_mask_ray(const bvh2d_wide *w, const bvh_ray *r, double tmax, double t[4]){
+	const double *nx = r->neg[0] ? w->xmax : w->xmin, *fx = r->neg[0] ? w->xmin : w->xmax;
+	const double *ny = r->neg[1] ? w->ymax : w->ymin, *fy = r->neg[1] ? w->ymin : w->ymax;
+#if defined(__AVX__)
+	const __m256d px = _mm256_set1_pd(r->p[0]), ix = _mm256_set1_pd(r->inv[0]);
+	const __m256d py = _mm256_set1_pd(r->p[1]), iy = _mm256_set1_pd(r->inv[1]);
+	// max/min return their second operand when either is NaN
+	__m256d t0 = _mm256_setzero_pd(), t1 = _mm256_set1_pd(tmax);
+	t0 = _mm256_max_pd(_mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(nx), px), ix), t0);
+	t0 = _mm256_max_pd(_mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(ny), py), iy), t0);
+	t1 = _mm256_min_pd(_mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(fx), px), ix), t1);
+	t1 = _mm256_min_pd(_mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(fy), py), iy), t1);
+	_mm256_storeu_pd(t, t0);
+	return (unsigned int)_mm256_movemask_pd(_mm256_cmp_pd(t0, t1, _CMP_LE_OQ));
+#elif defined(__SSE2__)
+	const __m128d px = _mm_set1_pd(r->p[0]), ix = _mm_set1_pd(r->inv[0]);
+	const __m128d py = _mm_set1_pd(r->p[1]), iy = _mm_set1_pd(r->inv[1]);
+	unsigned int mask = 0;
+	int i;
+	for(i = 0; i < 4; i += 2){
+		__m128d t0 = _mm_setzero_pd(), t1 = _mm_set1_pd(tmax);
+		t0 = _mm_max_pd(_mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(nx+i), px), ix), t0);
+		t0 = _mm_max_pd(_mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(ny+i), py), iy), t0);
+		t1 = _mm_min_pd(_mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(fx+i), px), ix), t1);
+		t1 = _mm_min_pd(_mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(fy+i), py), iy), t1);
+		_mm_storeu_pd(t+i, t0);
+		mask |= (unsigned int)_mm_movemask_pd(_mm_cmple_pd(t0, t1)) << i;
+	}
+	return mask;
+#else
+	unsigned int mask = 0;
+	int i;
+	for(i = 0; i < 4; ++i){
+		const double tnx = (nx[i] - r->p[0]) * r->inv[0], tfx = (fx[i] - r->p[0]) * r->inv[0];
+		const double tny = (ny[i] - r->p[1]) * r->inv[1], tfy = (fy[i] - r->p[1]) * r->inv[1];
+		double t0 = 0, t1 = tmax;
+		if(tnx > t0){ t0 = tnx; }
+		if(tny > t0){ t0 = tny; }
+		if(tfx < t1){ t1 = tfx; }
+		if(tfy < t1){ t1 = tfy; }
+		t[i] = t0;
+		if(t0 <= t1){ mask |= 1u << i; }
+	}
+	return mask;
+#endif
+}
+// Sorts the first n entries of idx by increasing t[idx[i]]
+static void bvh_sort_near(unsigned int n, unsigned int *idx, const double *t){
+	unsigned int i, j;
+	for(i = 1; i < n; ++i){
+		const unsigned int k = idx[i];
+		for(j = i; j > 0 && t[idx[j-1]] > t[k]; --j){
+			idx[j] = idx[j-1];
+		}
+		idx[j] = k;
+	}
+}
+
+// Queries on dynamic trees; the static trees below do the same with
+// wider nodes. A depth-first traversal holds at most height+1 nodes on
+// its stack, which fits the usual fixed size unless the tree has
+// become unusually deep.
+
+static void bvh_dyn_node_box(const bvh_dyn *T, const bvh_dnode *b, double *c, double *h){
+	int d;
+	for(d = 0; d < T->dim; ++d){
+		c[d] = 0.5*b->b[2*d+0] + 0.5*b->b[2*d+1];
+		h[d] = 0.5*b->b[2*d+1] - 0.5*b->b[2*d+0];
+	}
+}
+typedef struct{
+	int *node;
+	double *t;
+	int local_node[BVH3D_STACK_SIZE];
+	double local_t[BVH3D_STACK_SIZE];
+} bvh_dyn_stack;
+static void bvh_dyn_stack_init(bvh_dyn_stack *S, const bvh_dyn *T){
+	const int need = T->node[T->root].height + 2;
+	S->node = S->local_node;
+	S->t = S->local_t;
+	if(need > BVH3D_STACK_SIZE){
+		S->node = (int*)malloc(sizeof(int) * need);
+		S->t = (double*)malloc(sizeof(double) * need);
+	}
+}
+static void bvh_dyn_stack_destroy(bvh_dyn_stack *S){
+	if(S->node != S->local_node){
+		free(S->node);
+		free(S->t);
+	}
+}
+static int bvh_dyn_query_box(const bvh_dyn *T, const double *lo, const double *hi, int (*query_func)(int tag, const double *c, const double *h, void *data), void *data, geom_query_counts *cnt){
+	bvh_dyn_stack S;
+	int top = 0, ret = 1;
+	if(T->root < 0){ return 1; }
+	bvh_dyn_stack_init(&S, T);
+	S.node[top++] = T->root;
+	while(top > 0){
+		const bvh_dnode *b = &T->node[S.node[--top]];
+		int d;
+		for(d = 0; d < T->dim; ++d){
+			if(b->b[2*d+1] < lo[d] || hi[d] < b->b[2*d+0]){ break; }
+		}
+		if(d < T->dim){ continue; }
+		if(b->child[0] < 0){
+			double c[3], h[3];
+			cnt->leaves++;
+			bvh_dyn_node_box(T, b, c, h);
+			if(0 == query_func(b->tag, c, h, data)){ ret = 0; break; }
+		}else{
+			cnt->nodes++;
+			S.node[top++] = b->child[1];
+			S.node[top++] = b->child[0];
+		}
+	}
+	bvh_dyn_stack_destroy(&S);
+	return ret;
+}
+static int bvh_dyn_query_ray(const bvh_dyn *T, const double *p, const double *v, double tmax, int (*query_func)(int tag, const double *c, const double *h, double t, double *tmax, void *data), void *data, geom_query_counts *cnt){
+	bvh_dyn_stack S;
+	int top = 0, ret = 1;
+	bvh_ray r;
+	double t;
+	if(T->root < 0){ return 1; }
+	bvh_ray_init(&r, p, v, T->dim);
+	if(!bvh_ray_box(&r, T->node[T->root].b, T->dim, tmax, &t)){ return 1; }
+	bvh_dyn_stack_init(&S, T);
+	S.node[top] = T->root;
+	S.t[top++] = t;
+	while(top > 0){
+		const bvh_dnode *b = &T->node[S.node[--top]];
+		if(S.t[top] > tmax){ continue; }
+		if(b->child[0] < 0){
+			double c[3], h[3];
+			cnt->leaves++;
+			bvh_dyn_node_box(T, b, c, h);
+			if(0 == query_func(b->tag, c, h, S.t[top], &tmax, data)){ ret = 0; break; }
+		}else{
+			double tc[2];
+			int hit[2], near;
+			hit[0] = bvh_ray_box(&r, T->node[b->child[0]].b, T->dim, tmax, &tc[0]);
+			hit[1] = bvh_ray_box(&r, T->node[b->child[1]].b, T->dim, tmax, &tc[1]);
+			near = (tc[1] < tc[0]);
+			cnt->nodes++;
+			// Push the farther child first
+			if(hit[!near]){
+				S.node[top] = b->child[!near];
+				S.t[top++] = tc[!near];
+			}
+			if(hit[near]){
+				S.node[top] = b->child[near];
+				S.t[top++] = tc[near];
+			}
+		}
+	}
+	bvh_dyn_stack_destroy(&S);
+	return ret;
+}
+
+// The queries are depth-first with an explicit stack. Children are pushed
+// in reverse so that leaves are reported in the same order as a recursive
+// traversal would.
+
+static int bvh2d_query_pt(geom_bvh2d bvh, const double p[2], int (*query_func)(int tag, const double c[2], const double h[2], void *data), void *data, geom_query_counts *cnt){
+	unsigned int stack[BVH2D_STACK_SIZE];
+	int top = 0;
+	const bvh2d_node *b;
 	if(NULL == bvh){
 		BVHDBG("bvh == NULL in BVH2_query_pt; this should never happen\n");
 		return 1;
 	}
-	BVHDBG("Visiting node %p, tag=%d, b=%f,%f,%f,%f, int=%d\n", bvh, bvh->tag, bvh->b[0], bvh->b[1], bvh->b[2], bvh->b[3], (NULL != bvh->child[0]));
-	if(!(bvh->b[0] <= p[0] && p[0] <= bvh->b[1] && bvh->b[2] <= p[1] && p[1] <= bvh->b[3])){
+	if(NULL != bvh->dyn){
+		return bvh_dyn_query_box(bvh->dyn, p, p, query_func, data, cnt);
+	}
+	b = &bvh->node[0];
+	if(!(bvh->box[0] <= p[0] && p[0] <= bvh->box[1] && bvh->box[2] <= p[1] && p[1] <= bvh->box[3])){
 		// not in box
 		return 1;
 	}
-	if(NULL == bvh->child[0]){
+	if(0 == b->nchild){
 		double c[2], h[2];
-		c[0] = 0.5*bvh->b[0] + 0.5*bvh->b[1];
-		c[1] = 0.5*bvh->b[2] + 0.5*bvh->b[3];
-		h[0] = 0.5*bvh->b[1] - 0.5*bvh->b[0];
-		h[1] = 0.5*bvh->b[3] - 0.5*bvh->b[2];
-		return query_func(bvh->tag, c, h, data);
-	}else{
-		int i;
-		for(i = 0; i < 4; ++i){
-			if(NULL == bvh->child[i]){ break; }
-			if(0 == geom_bvh2d_query_pt(bvh->child[i], p, query_func, data)){ return 0; }
+		cnt->leaves++;
+		bvh2d_box_ch(bvh->box, c, h);
+		return query_func(b->tag, c, h, data);
+	}
+	// Only internal nodes whose boxes contain p are pushed
+	stack[top++] = 0;
+	while(top > 0){
+		const unsigned int ib = stack[--top];
+		unsigned int mask;
+		b = &bvh->node[ib];
+		BVHDBG("Visiting node %u, tag=%d\n", ib, b->tag);
+		cnt->nodes++;
+		mask = bvh2d_wide_mask_pt(&bvh->wide[ib], p) & ((1u << b->nchild) - 1);
+		if(b->child >= bvh->ninternal){
+			// All children are leaves
+			unsigned int i;
+			for(i = 0; 0 != mask; ++i, mask >>= 1){
+				const bvh2d_node *l = &bvh->node[b->child + i];
+				double c[2], h[2];
+				if(0 == (mask & 1)){ continue; }
+				cnt->leaves++;
+				bvh2d_child_box(bvh, ib, i, c, h);
+				if(0 == query_func(l->tag, c, h, data)){ return 0; }
+			}
+		}else{
+			// Push in reverse so the first child is visited first
+			unsigned int i = 4;
+			while(i > 0){
+				--i;
+				if(mask & (1u << i)){ stack[top++] = b->child + i; }
+			}
 		}
+	}
+	return 1;
+}
+int geom_bvh2d_query_pt(geom_bvh2d bvh, const double p[2], int (*query_func)(int tag, const double c[2], const double h[2], void *data), void *data){
+	geom_query_counts cnt = { 0, 0, 0, 0, 0 };
+	const int ret = bvh2d_query_pt(bvh, p, query_func, data, &cnt);
+	return (NULL == bvh) ? ret : bvh_counts_add(bvh->counts, &cnt, ret);
+}
+static int bvh3d_query_pt(geom_bvh3d bvh, const double p[3], int (*query_func)(int tag, const double c[3], const double h[3], void *data), void *data, geom_query_counts *cnt){
+	unsigned int stack[BVH3D_STACK_SIZE];
+	int top = 0;
+	if(NULL == bvh){
+		BVHDBG("bvh == NULL in BVH3_query_pt; this should never happen\n");
 		return 1;
 	}
+	if(NULL != bvh->dyn){
+		return bvh_dyn_query_box(bvh->dyn, p, p, query_func, data, cnt);
+	}
+	stack[top++] = 0;
+	while(top > 0){
+		const bvh3d_node *b = &bvh->node[stack[--top]];
+		BVHDBG("Visiting node %u, tag=%d, b=%f,%f,%f,%f,%f,%f, int=%d\n", (unsigned int)(b - bvh->node), b->tag, b->b[0], b->b[1], b->b[2], b->b[3], b->b[4], b->b[5], (0 != b->nchild));
+		if(!(b->b[0] <= p[0] && p[0] <= b->b[1] && b->b[2] <= p[1] && p[1] <= b->b[3] && b->b[4] <= p[2] && p[2] <= b->b[5])){
+			// not in box
+			continue;
+		}
+		if(0 == b->nchild){
+			double c[3], h[3];
+			cnt->leaves++;
+			bvh3d_node_box(b, c, h);
+			if(0 == query_func(b->tag, c, h, data)){ return 0; }
+		}else{
+			unsigned int i = b->nchild;
+			cnt->nodes++;
+			while(i > 0){
+				stack[top++] = b->child + (--i);
+			}
+		}
+	}
+	return 1;
 }
+
 int geom_bvh3d_query_pt(geom_bvh3d bvh, const double p[3], int (*query_func)(int tag, const double c[3], const double h[3], void *data), void *data){
+	geom_query_counts cnt = { 0, 0, 0, 0, 0 };
+	const int ret = bvh3d_query_pt(bvh, p, query_func, data, &cnt);
+	return (NULL == bvh) ? ret : bvh_counts_add(bvh->counts, &cnt, ret);
+}
+
+// Max-tag queries. Since every internal node carries the largest tag
+// below it, a subtree can be dropped as soon as its tag is no better than
+// the best accepted leaf. Children are visited in decreasing order of
+// tag, so the first leaf accepted tends to be the answer and the rest of
+// the tree is mostly pruned by tag alone.
+
+// Sorts the first n entries of idx by decreasing key, permuting key along
+static void bvh_sort_tag(unsigned int n, unsigned int *idx, int *key){
+	unsigned int i, j;
+	for(i = 1; i < n; ++i){
+		const unsigned int k = idx[i];
+		const int t = key[i];
+		for(j = i; j > 0 && key[j-1] < t; --j){
+			idx[j] = idx[j-1];
+			key[j] = key[j-1];
+		}
+		idx[j] = k;
+		key[j] = t;
+	}
+}
+static int bvh_dyn_query_pt_max(const bvh_dyn *T, const double *p, int best, int (*query_func)(int tag, const double *c, const double *h, void *data), void *data, geom_query_counts *cnt){
+	bvh_dyn_stack S;
+	int top = 0;
+	if(T->root < 0){ return best; }
+	bvh_dyn_stack_init(&S, T);
+	S.node[top++] = T->root;
+	while(top > 0){
+		const bvh_dnode *b = &T->node[S.node[--top]];
+		int d;
+		if(b->tag <= best){ continue; }
+		for(d = 0; d < T->dim; ++d){
+			if(p[d] < b->b[2*d+0] || b->b[2*d+1] < p[d]){ break; }
+		}
+		if(d < T->dim){ continue; }
+		if(b->child[0] < 0){
+			double c[3], h[3];
+			cnt->leaves++;
+			bvh_dyn_node_box(T, b, c, h);
+			if(query_func(b->tag, c, h, data)){ best = b->tag; }
+		}else{
+			// The child with the larger tag goes on top
+			const int swap = (T->node[b->child[0]].tag > T->node[b->child[1]].tag);
+			cnt->nodes++;
+			S.node[top++] = b->child[swap ? 1 : 0];
+			S.node[top++] = b->child[swap ? 0 : 1];
+		}
+	}
+	bvh_dyn_stack_destroy(&S);
+	return best;
+}
+static int bvh2d_query_pt_max(geom_bvh2d bvh, const double p[2], int best, int (*query_func)(int tag, const double c[2], const double h[2], void *data), void *data, geom_query_counts *cnt){
+	unsigned int stack[BVH2D_STACK_SIZE];
+	int top = 0;
+	const bvh2d_node *b;
+	if(NULL == bvh){ return best; }
+	if(NULL != bvh->dyn){
+		return bvh_dyn_query_pt_max(bvh->dyn, p, best, query_func, data, cnt);
+	}
+	b = &bvh->node[0];
+	if(b->tag <= best || !(bvh->box[0] <= p[0] && p[0] <= bvh->box[1] && bvh->box[2] <= p[1] && p[1] <= bvh->box[3])){
+		return best;
+	}
+	if(0 == b->nchild){
+		double c[2], h[2];
+		cnt->leaves++;
+		bvh2d_box_ch(bvh->box, c, h);
+		return query_func(b->tag, c, h, data) ? b->tag : best;
+	}
+	stack[top++] = 0;
+	while(top > 0){
+		const unsigned int ib = stack[--top];
+		unsigned int mask, i, n = 0, idx[4];
+		int key[4];
+		b = &bvh->node[ib];
+		if(b->tag <= best){ continue; } // a better leaf turned up since the push
+		cnt->nodes++;
+		mask = bvh2d_wide_mask_pt(&bvh->wide[ib], p) & ((1u << b->nchild) - 1);
+		for(i = 0; 0 != mask; ++i, mask >>= 1){
+			if((mask & 1) && bvh->node[b->child + i].tag > best){
+				idx[n] = b->child + i;
+				key[n++] = bvh->node[b->child + i].tag;
+			}
+		}
+		bvh_sort_tag(n, idx, key);
+		if(b->child >= bvh->ninternal){
+			// All children are leaves; the first accepted beats the rest
+			for(i = 0; i < n; ++i){
+				const bvh2d_node *l = &bvh->node[idx[i]];
+				double c[2], h[2];
+				cnt->leaves++;
+				bvh2d_child_box(bvh, ib, idx[i] - b->child, c, h);
+				if(query_func(l->tag, c, h, data)){
+					best = l->tag;
+					break;
+				}
+			}
+		}else{
+			while(n > 0){
+				stack[top++] = idx[--n];
+			}
+		}
+	}
+	return best;
+}
+int geom_bvh2d_query_pt_max(geom_bvh2d bvh, const double p[2], int best, int (*query_func)(int tag, const double c[2], const double h[2], void *data), void *data){
+	geom_query_counts cnt = { 0, 0, 0, 0, 0 };
+	const int ret = bvh2d_query_pt_max(bvh, p, best, query_func, data, &cnt);
+	return (NULL == bvh) ? ret : bvh_counts_add(bvh->counts, &cnt, ret);
+}
+static int bvh3d_query_pt_max(geom_bvh3d bvh, const double p[3], int best, int (*query_func)(int tag, const double c[3], const double h[3], void *data), void *data, geom_query_counts *cnt){
+	unsigned int stack[BVH3D_STACK_SIZE];
+	int top = 0;
+	if(NULL == bvh){ return best; }
+	if(NULL != bvh->dyn){
+		return bvh_dyn_query_pt_max(bvh->dyn, p, best, query_func, data, cnt);
+	}
+	stack[top++] = 0;
+	while(top > 0){
+		const bvh3d_node *b = &bvh->node[stack[--top]];
+		if(b->tag <= best){ continue; }
+		if(!(b->b[0] <= p[0] && p[0] <= b->b[1] && b->b[2] <= p[1] && p[1] <= b->b[3] && b->b[4] <= p[2] && p[2] <= b->b[5])){
+			continue;
+		}
+		if(0 == b->nchild){
+			double c[3], h[3];
+			cnt->leaves++;
+			bvh3d_node_box(b, c, h);
+			if(query_func(b->tag, c, h, data)){ best = b->tag; }
+		}else{
+			unsigned int i, n = 0, idx[8];
+			int key[8];
+			cnt->nodes++;
+			for(i = 0; i < b->nchild; ++i){
+				if(bvh->node[b->child + i].tag > best){
+					idx[n] = b->child + i;
+					key[n++] = bvh->node[b->child + i].tag;
+				}
+			}
+			bvh_sort_tag(n, idx, key);
+			while(n > 0){
+				stack[top++] = idx[--n];
+			}
+		}
+	}
+	return best;
+}
+int geom_bvh3d_query_pt_max(geom_bvh3d bvh, const double p[3], int best, int (*query_func)(int tag, const double c[3], const double h[3], void *data), void *data){
+	geom_query_counts cnt = { 0, 0, 0, 0, 0 };
+	const int ret = bvh3d_query_pt_max(bvh, p, best, query_func, data, &cnt);
+	return (NULL == bvh) ? ret : bvh_counts_add(bvh->counts, &cnt, ret);
+}
+
+static int bvh2d_query_box(geom_bvh2d bvh, const double c[2], const double h[2], int (*query_func)(int tag, const double c[2], const double h[2], void *data), void *data, geom_query_counts *cnt){
+	unsigned int stack[BVH2D_STACK_SIZE];
+	int top = 0;
+	const bvh2d_node *b;
+	const double lo[2] = { c[0]-h[0], c[1]-h[1] };
+	const double hi[2] = { c[0]+h[0], c[1]+h[1] };
 	if(NULL == bvh){
-		BVHDBG("bvh == NULL in BVH3_query_pt; this should never happen\n");
+		BVHDBG("bvh == NULL in BVH2_query_box; this should never happen\n");
 		return 1;
 	}
-	BVHDBG("Visiting node %p, tag=%d, b=%f,%f,%f,%f,%f,%f, int=%d\n", bvh, bvh->tag, bvh->b[0], bvh->b[1], bvh->b[2], bvh->b[3], bvh->b[4], bvh->b[5], (NULL != bvh->child[0]));
-	if(!(bvh->b[0] <= p[0] && p[0] <= bvh->b[1] && bvh->b[2] <= p[1] && p[1] <= bvh->b[3] && bvh->b[4] <= p[2] && p[2] <= bvh->b[5])){
+	if(NULL != bvh->dyn){
+		return bvh_dyn_query_box(bvh->dyn, lo, hi, query_func, data, cnt);
+	}
+	b = &bvh->node[0];
+	if(bvh->box[1] < lo[0] || hi[0] < bvh->box[0] || bvh->box[3] < lo[1] || hi[1] < bvh->box[2]){
 		// not in box
 		return 1;
 	}
-	if(NULL == bvh->child[0]){
-		double c[3], h[3];
-		c[0] = 0.5*bvh->b[0] + 0.5*bvh->b[1];
-		c[1] = 0.5*bvh->b[2] + 0.5*bvh->b[3];
-		c[2] = 0.5*bvh->b[4] + 0.5*bvh->b[5];
-		h[0] = 0.5*bvh->b[1] - 0.5*bvh->b[0];
-		h[1] = 0.5*bvh->b[3] - 0.5*bvh->b[2];
-		h[2] = 0.5*bvh->b[5] - 0.5*bvh->b[4];
-		return query_func(bvh->tag, c, h, data);
-	}else{
-		int i;
-		for(i = 0; i < 8; ++i){
-			if(NULL == bvh->child[i]){ break; }
-			if(0 == geom_bvh3d_query_pt(bvh->child[i], p, query_func, data)){ return 0; }
+	if(0 == b->nchild){
+		double bc[2], bh[2];
+		cnt->leaves++;
+		bvh2d_box_ch(bvh->box, bc, bh);
+		return query_func(b->tag, bc, bh, data);
+	}
+	stack[top++] = 0;
+	while(top > 0){
+		const unsigned int ib = stack[--top];
+		unsigned int mask;
+		b = &bvh->node[ib];
+		BVHDBG("Visiting node %u, tag=%d\n", ib, b->tag);
+		cnt->nodes++;
+		mask = bvh2d_wide_mask_box(&bvh->wide[ib], lo, hi) & ((1u << b->nchild) - 1);
+		if(b->child >= bvh->ninternal){
+			unsigned int i;
+			for(i = 0; 0 != mask; ++i, mask >>= 1){
+				const bvh2d_node *l = &bvh->node[b->child + i];
+				double bc[2], bh[2];
+				if(0 == (mask & 1)){ continue; }
+				cnt->leaves++;
+				bvh2d_child_box(bvh, ib, i, bc, bh);
+				if(0 == query_func(l->tag, bc, bh, data)){ return 0; }
+			}
+		}else{
+			unsigned int i = 4;
+			while(i > 0){
+				--i;
+				if(mask & (1u << i)){ stack[top++] = b->child + i; }
+			}
 		}
-		return 1;
 	}
+	return 1;
 }
 
 int geom_bvh2d_query_box(geom_bvh2d bvh, const double c[2], const double h[2], int (*query_func)(int tag, const double c[2], const double h[2], void *data), void *data){
+	geom_query_counts cnt = { 0, 0, 0, 0, 0 };
+	const int ret = bvh2d_query_box(bvh, c, h, query_func, data, &cnt);
+	return (NULL == bvh) ? ret : bvh_counts_add(bvh->counts, &cnt, ret);
+}
+int geom_bvh2d_query_box_counts(geom_bvh2d bvh, const double c[2], const double h[2], int (*query_func)(int tag, const double c[2], const double h[2], void *data), void *data, geom_query_counts *counts){
+	geom_query_counts cnt = { 0, 0, 0, 0, 0 };
+	const int ret = bvh2d_query_box(bvh, c, h, query_func, data, &cnt);
+	return bvh_counts_add(counts, &cnt, ret);
+}
+
+static int bvh3d_query_box(geom_bvh3d bvh, const double c[3], const double h[3], int (*query_func)(int tag, const double c[3], const double h[3], void *data), void *data, geom_query_counts *cnt){
+	unsigned int stack[BVH3D_STACK_SIZE];
+	int top = 0;
 	if(NULL == bvh){
-		BVHDBG("bvh == NULL in BVH2_query_box; this should never happen\n");
+		BVHDBG("bvh == NULL in BVH3_query_box; this should never happen\n");
 		return 1;
 	}
-	BVHDBG("Visiting node %p, tag=%d, b=%f,%f,%f,%f, int=%d\n", bvh, bvh->tag, bvh->b[0], bvh->b[1], bvh->b[2], bvh->b[3], (NULL != bvh->child[0]));
-	if((bvh->b[1] < c[0]-h[0] || c[0]+h[0] < bvh->b[0]) && (bvh->b[3] < c[1]-h[1] || c[1]+h[1] < bvh->b[2])){
-		// not in box
+	if(NULL != bvh->dyn){
+		const double lo[3] = { c[0]-h[0], c[1]-h[1], c[2]-h[2] };
+		const double hi[3] = { c[0]+h[0], c[1]+h[1], c[2]+h[2] };
+		return bvh_dyn_query_box(bvh->dyn, lo, hi, query_func, data, cnt);
+	}
+	stack[top++] = 0;
+	while(top > 0){
+		const bvh3d_node *b = &bvh->node[stack[--top]];
+		BVHDBG("Visiting node %u, tag=%d, b=%f,%f,%f,%f,%f,%f, int=%d\n", (unsigned int)(b - bvh->node), b->tag, b->b[0], b->b[1], b->b[2], b->b[3], b->b[4], b->b[5], (0 != b->nchild));
+		if(b->b[1] < c[0]-h[0] || c[0]+h[0] < b->b[0] || b->b[3] < c[1]-h[1] || c[1]+h[1] < b->b[2] || b->b[5] < c[2]-h[2] || c[2]+h[2] < b->b[4]){
+			// not in box
+			continue;
+		}
+		if(0 == b->nchild){
+			double bc[3], bh[3];
+			cnt->leaves++;
+			bvh3d_node_box(b, bc, bh);
+			if(0 == query_func(b->tag, bc, bh, data)){ return 0; }
+		}else{
+			unsigned int i = b->nchild;
+			cnt->nodes++;
+			while(i > 0){
+				stack[top++] = b->child + (--i);
+			}
+		}
+	}
+	return 1;
+}
+
+int geom_bvh3d_query_box(geom_bvh3d bvh, const double c[3], const double h[3], int (*query_func)(int tag, const double c[3], const double h[3], void *data), void *data){
+	geom_query_counts cnt = { 0, 0, 0, 0, 0 };
+	const int ret = bvh3d_query_box(bvh, c, h, query_func, data, &cnt);
+	return (NULL == bvh) ? ret : bvh_counts_add(bvh->counts, &cnt, ret);
+}
+
+// The ray queries visit the children of each node front to back: the hit
+// children are sorted by entry parameter and pushed farthest first. Each
+// stack entry keeps its entry parameter, so that nodes entered beyond a
+// tmax lowered by the callback are dropped when popped.
+
+static int bvh2d_query_ray(geom_bvh2d bvh, const double p[2], const double v[2], double tmax, int (*query_func)(int tag, const double c[2], const double h[2], double t, double *tmax, void *data), void *data, geom_query_counts *cnt){
+	unsigned int stack[BVH2D_STACK_SIZE];
+	double stack_t[BVH2D_STACK_SIZE];
+	int top = 0;
+	const bvh2d_node *b;
+	bvh_ray r;
+	double t;
+	if(NULL == bvh){
+		BVHDBG("bvh == NULL in BVH2_query_ray; this should never happen\n");
 		return 1;
 	}
-	if(NULL == bvh->child[0]){
+	if(NULL != bvh->dyn){
+		return bvh_dyn_query_ray(bvh->dyn, p, v, tmax, query_func, data, cnt);
+	}
+	bvh_ray_init(&r, p, v, 2);
+	b = &bvh->node[0];
+	if(!bvh_ray_box(&r, bvh->box, 2, tmax, &t)){
+		return 1;
+	}
+	if(0 == b->nchild){
 		double c[2], h[2];
-		c[0] = 0.5*bvh->b[0] + 0.5*bvh->b[1];
-		c[1] = 0.5*bvh->b[2] + 0.5*bvh->b[3];
-		h[0] = 0.5*bvh->b[1] - 0.5*bvh->b[0];
-		h[1] = 0.5*bvh->b[3] - 0.5*bvh->b[2];
-		return query_func(bvh->tag, c, h, data);
-	}else{
-		int i;
-		for(i = 0; i < 4; ++i){
-			if(NULL == bvh->child[i]){ break; }
-			if(0 == geom_bvh2d_query_box(bvh->child[i], c, h, query_func, data)){ return 0; }
+		cnt->leaves++;
+		bvh2d_box_ch(bvh->box, c, h);
+		return query_func(b->tag, c, h, t, &tmax, data);
+	}
+	stack[top] = 0;
+	stack_t[top++] = t;
+	while(top > 0){
+		const unsigned int ib = stack[--top];
+		double tc[4];
+		unsigned int mask, idx[4], nhit = 0, i;
+		if(stack_t[top] > tmax){ continue; }
+		b = &bvh->node[ib];
+		BVHDBG("Visiting node %u, tag=%d\n", ib, b->tag);
+		cnt->nodes++;
+		mask = bvh2d_wide_mask_ray(&bvh->wide[ib], &r, tmax, tc) & ((1u << b->nchild) - 1);
+		for(i = 0; 0 != mask; ++i, mask >>= 1){
+			if(mask & 1){ idx[nhit++] = i; }
+		}
+		bvh_sort_near(nhit, idx, tc);
+		if(b->child >= bvh->ninternal){
+			for(i = 0; i < nhit; ++i){
+				const bvh2d_node *l = &bvh->node[b->child + idx[i]];
+				double c[2], h[2];
+				if(tc[idx[i]] > tmax){ break; }
+				cnt->leaves++;
+				bvh2d_child_box(bvh, ib, idx[i], c, h);
+				if(0 == query_func(l->tag, c, h, tc[idx[i]], &tmax, data)){ return 0; }
+			}
+		}else{
+			while(nhit > 0){
+				--nhit;
+				stack[top] = b->child + idx[nhit];
+				stack_t[top++] = tc[idx[nhit]];
+			}
 		}
+	}
+	return 1;
+}
+static int geom_bvh2d_query_ray_range(geom_bvh2d bvh, const double p[2], const double v[2], double tmax, int (*query_func)(int tag, const double c[2], const double h[2], double t, double *tmax, void *data), void *data){
+	geom_query_counts cnt = { 0, 0, 0, 0, 0 };
+	const int ret = bvh2d_query_ray(bvh, p, v, tmax, query_func, data, &cnt);
+	return (NULL == bvh) ? ret : bvh_counts_add(bvh->counts, &cnt, ret);
+}
+int geom_bvh2d_query_ray(geom_bvh2d bvh, const double p[2], const double v[2], int (*query_func)(int tag, const double c[2], const double h[2], double t, double *tmax, void *data), void *data){
+	return geom_bvh2d_query_ray_range(bvh, p, v, HUGE_VAL, query_func, data);
+}
+int geom_bvh2d_query_segment(geom_bvh2d bvh, const double a[2], const double b[2], int (*query_func)(int tag, const double c[2], const double h[2], double t, double *tmax, void *data), void *data){
+	const double v[2] = { b[0]-a[0], b[1]-a[1] };
+	return geom_bvh2d_query_ray_range(bvh, a, v, 1, query_func, data);
+}
+
+static int bvh3d_query_ray(geom_bvh3d bvh, const double p[3], const double v[3], double tmax, int (*query_func)(int tag, const double c[3], const double h[3], double t, double *tmax, void *data), void *data, geom_query_counts *cnt){
+	unsigned int stack[BVH3D_STACK_SIZE];
+	double stack_t[BVH3D_STACK_SIZE];
+	int top = 0;
+	bvh_ray r;
+	double t;
+	if(NULL == bvh){
+		BVHDBG("bvh == NULL in BVH3_query_ray; this should never happen\n");
 		return 1;
 	}
+	if(NULL != bvh->dyn){
+		return bvh_dyn_query_ray(bvh->dyn, p, v, tmax, query_func, data, cnt);
+	}
+	bvh_ray_init(&r, p, v, 3);
+	if(!bvh_ray_box(&r, bvh->node[0].b, 3, tmax, &t)){
+		return 1;
+	}
+	stack[top] = 0;
+	stack_t[top++] = t;
+	while(top > 0){
+		const bvh3d_node *b = &bvh->node[stack[--top]];
+		double tc[8];
+		unsigned int idx[8], nhit = 0, i;
+		if(stack_t[top] > tmax){ continue; }
+		BVHDBG("Visiting node %u, tag=%d, b=%f,%f,%f,%f,%f,%f, int=%d\n", (unsigned int)(b - bvh->node), b->tag, b->b[0], b->b[1], b->b[2], b->b[3], b->b[4], b->b[5], (0 != b->nchild));
+		if(0 == b->nchild){
+			double c[3], h[3];
+			cnt->leaves++;
+			bvh3d_node_box(b, c, h);
+			if(0 == query_func(b->tag, c, h, stack_t[top], &tmax, data)){ return 0; }
+			continue;
+		}
+		cnt->nodes++;
+		for(i = 0; i < b->nchild; ++i){
+			if(bvh_ray_box(&r, bvh->node[b->child + i].b, 3, tmax, &tc[i])){
+				idx[nhit++] = i;
+			}
+		}
+		bvh_sort_near(nhit, idx, tc);
+		while(nhit > 0){
+			--nhit;
+			stack[top] = b->child + idx[nhit];
+			stack_t[top++] = tc[idx[nhit]];
+		}
+	}
+	return 1;
+}
+static int geom_bvh3d_query_ray_range(geom_bvh3d bvh, const double p[3], const double v[3], double tmax, int (*query_func)(int tag, const double c[3], const double h[3], double t, double *tmax, void *data), void *data){
+	geom_query_counts cnt = { 0, 0, 0, 0, 0 };
+	const int ret = bvh3d_query_ray(bvh, p, v, tmax, query_func, data, &cnt);
+	return (NULL == bvh) ? ret : bvh_counts_add(bvh->counts, &cnt, ret);
+}
+int geom_bvh3d_query_ray(geom_bvh3d bvh, const double p[3], const double v[3], int (*query_func)(int tag, const double c[3], const double h[3], double t, double *tmax, void *data), void *data){
+	return geom_bvh3d_query_ray_range(bvh, p, v, HUGE_VAL, query_func, data);
+}
+int geom_bvh3d_query_segment(geom_bvh3d bvh, const double a[3], const double b[3], int (*query_func)(int tag, const double c[3], const double h[3], double t, double *tmax, void *data), void *data){
+	const double v[3] = { b[0]-a[0], b[1]-a[1], b[2]-a[2] };
+	return geom_bvh3d_query_ray_range(bvh, a, v, 1, query_func, data);
 }
 
-int geom_bvh3d_query_box(geom_bvh3d bvh, const double c[3], const double h[3], int (*query_func)(int tag, const double c[3], const double h[3], void *data), void *data){
+// The nearest neighbor queries are best first (Hjaltason and Samet): a
+// binary heap holds nodes keyed by the squared distance from p to their
+// boxes. A leaf popped from the heap gets its exact distance from
+// dist_func, if one is given, and goes back in as a final entry; a final
+// entry at the top of the heap is nearer than everything left, so it is
+// reported. Leaves are therefore reported in order of distance.
+
+typedef struct{
+	double d; // squared distance
+	unsigned int node;
+	int final; // leaf whose distance is exact
+} bvh_heap_item;
+typedef struct{
+	unsigned int n, n_alloc;
+	bvh_heap_item *item;
+	bvh_heap_item local[64];
+} bvh_heap;
+
+static void bvh_heap_init(bvh_heap *H){
+	H->n = 0;
+	H->n_alloc = sizeof(H->local) / sizeof(bvh_heap_item);
+	H->item = H->local;
+}
+static void bvh_heap_destroy(bvh_heap *H){
+	if(H->item != H->local){ free(H->item); }
+}
+static void bvh_heap_push(bvh_heap *H, double d, unsigned int node, int final){
+	bvh_heap_item *a;
+	unsigned int i;
+	if(H->n >= H->n_alloc){
+		H->n_alloc *= 2;
+		if(H->item == H->local){
+			H->item = (bvh_heap_item*)malloc(sizeof(bvh_heap_item) * H->n_alloc);
+			memcpy(H->item, H->local, sizeof(H->local));
+		}else{
+			H->item = (bvh_heap_item*)realloc(H->item, sizeof(bvh_heap_item) * H->n_alloc);
+		}
+	}
+	a = H->item;
+	i = H->n++;
+	// Ties go to final entries, so that a leaf is reported as soon as
+	// nothing can be nearer
+	while(i > 0){
+		const unsigned int up = (i-1)/2;
+		if(a[up].d < d || (a[up].d == d && (a[up].final || !final))){ break; }
+		a[i] = a[up];
+		i = up;
+	}
+	a[i].d = d;
+	a[i].node = node;
+	a[i].final = final;
+}
+static bvh_heap_item bvh_heap_pop(bvh_heap *H){
+	bvh_heap_item *a = H->item;
+	const bvh_heap_item top = a[0];
+	const bvh_heap_item last = a[--H->n];
+	unsigned int i = 0;
+	for(;;){
+		unsigned int c = 2*i+1;
+		if(c >= H->n){ break; }
+		if(c+1 < H->n && (a[c+1].d < a[c].d || (a[c+1].d == a[c].d && a[c+1].final && !a[c].final))){ ++c; }
+		if(last.d < a[c].d || (last.d == a[c].d && (last.final || !a[c].final))){ break; }
+		a[i] = a[c];
+		i = c;
+	}
+	a[i] = last;
+	return top;
+}
+// Squared distance from p to a min/max box
+static double bvh_box_dist2(const double *b, const double *p, int dim){
+	double d2 = 0;
+	int d;
+	for(d = 0; d < dim; ++d){
+		double u = 0;
+		if(p[d] < b[2*d+0]){ u = b[2*d+0] - p[d]; }
+		else if(p[d] > b[2*d+1]){ u = p[d] - b[2*d+1]; }
+		d2 += u*u;
+	}
+	return d2;
+}
+
+static int bvh_dyn_query_nearest(const bvh_dyn *T, const double *p, double (*dist_func)(int tag, const double *p, void *data), int (*query_func)(int tag, const double *c, const double *h, double dist, void *data), void *data, geom_query_counts *cnt){
+	bvh_heap H;
+	int ret = 1;
+	if(T->root < 0){ return 1; }
+	bvh_heap_init(&H);
+	bvh_heap_push(&H, bvh_box_dist2(T->node[T->root].b, p, T->dim), T->root, (T->node[T->root].child[0] < 0 && NULL == dist_func));
+	while(H.n > 0){
+		const bvh_heap_item it = bvh_heap_pop(&H);
+		const bvh_dnode *b = &T->node[it.node];
+		if(b->child[0] < 0){
+			if(it.final == (NULL == dist_func)){ cnt->leaves++; }
+			if(it.final){
+				double c[3], h[3];
+				bvh_dyn_node_box(T, b, c, h);
+				if(0 == query_func(b->tag, c, h, sqrt(it.d), data)){ ret = 0; break; }
+			}else{
+				const double d = dist_func(b->tag, p, data);
+				bvh_heap_push(&H, d*d, it.node, 1);
+			}
+		}else{
+			int k;
+			cnt->nodes++;
+			for(k = 0; k < 2; ++k){
+				const int ic = b->child[k];
+				bvh_heap_push(&H, bvh_box_dist2(T->node[ic].b, p, T->dim), ic, (T->node[ic].child[0] < 0 && NULL == dist_func));
+			}
+		}
+	}
+	bvh_heap_destroy(&H);
+	return ret;
+}
+
+int geom_bvh2d_query_nearest(geom_bvh2d bvh, const double p[2], double (*dist_func)(int tag, const double p[2], void *data), int (*query_func)(int tag, const double c[2], const double h[2], double dist, void *data), void *data){
+	bvh_heap H;
+	geom_query_counts cnt = { 0, 0, 0, 0, 0 };
+	int ret = 1;
 	if(NULL == bvh){
-		BVHDBG("bvh == NULL in BVH3_query_box; this should never happen\n");
+		BVHDBG("bvh == NULL in BVH2_query_nearest; this should never happen\n");
 		return 1;
 	}
-	BVHDBG("Visiting node %p, tag=%d, b=%f,%f,%f,%f,%f,%f, int=%d\n", bvh, bvh->tag, bvh->b[0], bvh->b[1], bvh->b[2], bvh->b[3], bvh->b[4], bvh->b[5], (NULL != bvh->child[0]));
-	if((bvh->b[1] < c[0]-h[0] || c[0]+h[0] < bvh->b[0]) && (bvh->b[3] < c[1]-h[1] || c[1]+h[1] < bvh->b[2]) && (bvh->b[5] < c[2]-h[2] || c[2]+h[2] < bvh->b[4])){
-		// not in box
+	if(NULL != bvh->dyn){
+		ret = bvh_dyn_query_nearest(bvh->dyn, p, dist_func, query_func, data, &cnt);
+		return bvh_counts_add(bvh->counts, &cnt, ret);
+	}
+	bvh_heap_init(&H);
+	bvh_heap_push(&H, bvh_box_dist2(bvh->box, p, 2), 0, (0 == bvh->node[0].nchild && NULL == dist_func));
+	while(H.n > 0){
+		const bvh_heap_item it = bvh_heap_pop(&H);
+		const bvh2d_node *b = &bvh->node[it.node];
+		BVHDBG("Visiting node %u, tag=%d, d2=%g, final=%d\n", it.node, b->tag, it.d, it.final);
+		if(0 == b->nchild){
+			// Each leaf is counted once, when it is first popped
+			if(it.final == (NULL == dist_func)){ cnt.leaves++; }
+			if(it.final){
+				double bb[4], c[2], h[2];
+				bvh2d_node_bounds(bvh, it.node, bb);
+				bvh2d_box_ch(bb, c, h);
+				if(0 == query_func(b->tag, c, h, sqrt(it.d), data)){ ret = 0; break; }
+			}else{
+				const double d = dist_func(b->tag, p, data);
+				bvh_heap_push(&H, d*d, it.node, 1);
+			}
+		}else{
+			const int leaves = (b->child >= bvh->ninternal);
+			unsigned int i;
+			cnt.nodes++;
+			for(i = 0; i < b->nchild; ++i){
+				double bb[4];
+				bvh2d_wide_box(&bvh->wide[it.node], i, bb);
+				bvh_heap_push(&H, bvh_box_dist2(bb, p, 2), b->child + i, leaves && NULL == dist_func);
+			}
+		}
+	}
+	bvh_heap_destroy(&H);
+	return bvh_counts_add(bvh->counts, &cnt, ret);
+}
+int geom_bvh3d_query_nearest(geom_bvh3d bvh, const double p[3], double (*dist_func)(int tag, const double p[3], void *data), int (*query_func)(int tag, const double c[3], const double h[3], double dist, void *data), void *data){
+	bvh_heap H;
+	geom_query_counts cnt = { 0, 0, 0, 0, 0 };
+	int ret = 1;
+	if(NULL == bvh){
+		BVHDBG("bvh == NULL in BVH3_query_nearest; this should never happen\n");
 		return 1;
 	}
-	if(NULL == bvh->child[0]){
+	if(NULL != bvh->dyn){
+		ret = bvh_dyn_query_nearest(bvh->dyn, p, dist_func, query_func, data, &cnt);
+		return bvh_counts_add(bvh->counts, &cnt, ret);
+	}
+	bvh_heap_init(&H);
+	bvh_heap_push(&H, bvh_box_dist2(bvh->node[0].b, p, 3), 0, (0 == bvh->node[0].nchild && NULL == dist_func));
+	while(H.n > 0){
+		const bvh_heap_item it = bvh_heap_pop(&H);
+		const bvh3d_node *b = &bvh->node[it.node];
+		BVHDBG("Visiting node %u, tag=%d, d2=%g, final=%d\n", it.node, b->tag, it.d, it.final);
+		if(0 == b->nchild){
+			// Each leaf is counted once, when it is first popped
+			if(it.final == (NULL == dist_func)){ cnt.leaves++; }
+			if(it.final){
+				double c[3], h[3];
+				bvh3d_node_box(b, c, h);
+				if(0 == query_func(b->tag, c, h, sqrt(it.d), data)){ ret = 0; break; }
+			}else{
+				const double d = dist_func(b->tag, p, data);
+				bvh_heap_push(&H, d*d, it.node, 1);
+			}
+		}else{
+			unsigned int i;
+			cnt.nodes++;
+			for(i = 0; i < b->nchild; ++i){
+				const unsigned int ic = b->child + i;
+				const bvh3d_node *c = &bvh->node[ic];
+				bvh_heap_push(&H, bvh_box_dist2(c->b, p, 3), ic, (0 == c->nchild && NULL == dist_func));
+			}
+		}
+	}
+	bvh_heap_destroy(&H);
+	return bvh_counts_add(bvh->counts, &cnt, ret);
+}
+
+// The k nearest are collected by a query that stops after k leaves. The
+// user's dist_func and data are forwarded through the collector.
+struct bvh_knn_data{
+	unsigned int k, n;
+	int *tag;
+	double *dist;
+	double (*dist_func)(int tag, const double p[], void *data);
+	void *data;
+};
+static double bvh_knn_dist(int tag, const double p[], void *data){
+	struct bvh_knn_data *d = (struct bvh_knn_data*)data;
+	return d->dist_func(tag, p, d->data);
+}
+static int bvh_knn_add(struct bvh_knn_data *d, int tag, double dist){
+	d->tag[d->n] = tag;
+	d->dist[d->n] = dist;
+	return (++d->n < d->k);
+}
+static int bvh2d_knn_func(int tag, const double c[2], const double h[2], double dist, void *data){
+	(void)c; (void)h;
+	return bvh_knn_add((struct bvh_knn_data*)data, tag, dist);
+}
+static int bvh3d_knn_func(int tag, const double c[3], const double h[3], double dist, void *data){
+	(void)c; (void)h;
+	return bvh_knn_add((struct bvh_knn_data*)data, tag, dist);
+}
+unsigned int geom_bvh2d_query_knn(geom_bvh2d bvh, const double p[2], unsigned int k, double (*dist_func)(int tag, const double p[2], void *data), void *data, int tag[], double dist[]){
+	struct bvh_knn_data d;
+	if(0 == k){ return 0; }
+	d.k = k;
+	d.n = 0;
+	d.tag = tag;
+	d.dist = dist;
+	d.dist_func = dist_func;
+	d.data = data;
+	geom_bvh2d_query_nearest(bvh, p, (NULL != dist_func) ? &bvh_knn_dist : NULL, &bvh2d_knn_func, &d);
+	return d.n;
+}
+unsigned int geom_bvh3d_query_knn(geom_bvh3d bvh, const double p[3], unsigned int k, double (*dist_func)(int tag, const double p[3], void *data), void *data, int tag[], double dist[]){
+	struct bvh_knn_data d;
+	if(0 == k){ return 0; }
+	d.k = k;
+	d.n = 0;
+	d.tag = tag;
+	d.dist = dist;
+	d.dist_func = dist_func;
+	d.data = data;
+	geom_bvh3d_query_nearest(bvh, p, (NULL != dist_func) ? &bvh_knn_dist : NULL, &bvh3d_knn_func, &d);
+	return d.n;
+}
+
+static int bvh_dyn_traverse(const bvh_dyn *T, int (*func)(int tag, const double *c, const double *h, int leaf, void *data), void *data){
+	bvh_dyn_stack S;
+	int top = 0, ret = 1;
+	if(T->root < 0){ return 1; }
+	bvh_dyn_stack_init(&S, T);
+	S.node[top++] = T->root;
+	while(top > 0){
+		const bvh_dnode *b = &T->node[S.node[--top]];
 		double c[3], h[3];
-		c[0] = 0.5*bvh->b[0] + 0.5*bvh->b[1];
-		c[1] = 0.5*bvh->b[2] + 0.5*bvh->b[3];
-		c[2] = 0.5*bvh->b[4] + 0.5*bvh->b[5];
-		h[0] = 0.5*bvh->b[1] - 0.5*bvh->b[0];
-		h[1] = 0.5*bvh->b[3] - 0.5*bvh->b[2];
-		h[2] = 0.5*bvh->b[5] - 0.5*bvh->b[4];
-		return query_func(bvh->tag, c, h, data);
-	}else{
-		int i;
-		for(i = 0; i < 8; ++i){
-			if(NULL == bvh->child[i]){ break; }
-			if(0 == geom_bvh3d_query_box(bvh->child[i], c, h, query_func, data)){ return 0; }
+		bvh_dyn_node_box(T, b, c, h);
+		if(0 == func(b->tag, c, h, (b->child[0] < 0), data)){ ret = 0; break; }
+		if(b->child[0] >= 0){
+			S.node[top++] = b->child[1];
+			S.node[top++] = b->child[0];
 		}
-		return 1;
 	}
+	bvh_dyn_stack_destroy(&S);
+	return ret;
 }
 
 int geom_bvh2d_traverse(geom_bvh2d bvh, int (*func)(int tag, const double c[2], const double h[2], int leaf, void *data), void *data){
+	unsigned int stack[BVH2D_STACK_SIZE];
+	int top = 0;
 	if(NULL == bvh){
 		BVHDBG("bvh == NULL in BVH2_traverse; this should never happen\n");
 		return 1;
 	}
-	BVHDBG("Visiting node %p, tag=%d, b=%f,%f,%f,%f, int=%d\n", bvh, bvh->tag, bvh->b[0], bvh->b[1], bvh->b[2], bvh->b[3], (NULL != bvh->child[0]));
-	int i;
-	double c[2], h[2];
-	c[0] = 0.5*bvh->b[0] + 0.5*bvh->b[1];
-	c[1] = 0.5*bvh->b[2] + 0.5*bvh->b[3];
-	h[0] = 0.5*bvh->b[1] - 0.5*bvh->b[0];
-	h[1] = 0.5*bvh->b[3] - 0.5*bvh->b[2];
-	if(0 == func(bvh->tag, c, h, (NULL == bvh->child[0]), data)){ return 0; }
-	for(i = 0; i < 4; ++i){
-		if(NULL == bvh->child[i]){ break; }
-		if(0 == geom_bvh2d_traverse(bvh->child[i], func, data)){ return 0; }
+	if(NULL != bvh->dyn){
+		return bvh_dyn_traverse(bvh->dyn, func, data);
+	}
+	stack[top++] = 0;
+	while(top > 0){
+		const unsigned int ib = stack[--top];
+		const bvh2d_node *b = &bvh->node[ib];
+		unsigned int i = b->nchild;
+		double bb[4], c[2], h[2];
+		BVHDBG("Visiting node %u, tag=%d, int=%d\n", ib, b->tag, (0 != b->nchild));
+		bvh2d_node_bounds(bvh, ib, bb);
+		bvh2d_box_ch(bb, c, h);
+		if(0 == func(b->tag, c, h, (0 == b->nchild), data)){ return 0; }
+		while(i > 0){
+			stack[top++] = b->child + (--i);
+		}
 	}
 	return 1;
 }
 
 int geom_bvh3d_traverse(geom_bvh3d bvh, int (*func)(int tag, const double c[3], const double h[3], int leaf, void *data), void *data){
+	unsigned int stack[BVH3D_STACK_SIZE];
+	int top = 0;
 	if(NULL == bvh){
 		BVHDBG("bvh == NULL in BVH3_traverse; this should never happen\n");
 		return 1;
 	}
-	BVHDBG("Visiting node %p, tag=%d, b=%f,%f,%f,%f,%f,%f, int=%d\n", bvh, bvh->tag, bvh->b[0], bvh->b[1], bvh->b[2], bvh->b[3], bvh->b[4], bvh->b[5], (NULL != bvh->child[0]));
-	int i;
-	double c[3], h[3];
-	c[0] = 0.5*bvh->b[0] + 0.5*bvh->b[1];
-	c[1] = 0.5*bvh->b[2] + 0.5*bvh->b[3];
-	c[2] = 0.5*bvh->b[4] + 0.5*bvh->b[5];
-	h[0] = 0.5*bvh->b[1] - 0.5*bvh->b[0];
-	h[1] = 0.5*bvh->b[3] - 0.5*bvh->b[2];
-	h[2] = 0.5*bvh->b[5] - 0.5*bvh->b[4];
-	if(0 == func(bvh->tag, c, h, (NULL == bvh->child[0]), data)){ return 0; }
-	for(i = 0; i < 8; ++i){
-		if(NULL == bvh->child[i]){ break; }
-		if(0 == geom_bvh3d_traverse(bvh->child[i], func, data)){ return 0; }
+	if(NULL != bvh->dyn){
+		return bvh_dyn_traverse(bvh->dyn, func, data);
+	}
+	stack[top++] = 0;
+	while(top > 0){
+		const bvh3d_node *b = &bvh->node[stack[--top]];
+		unsigned int i = b->nchild;
+		double c[3], h[3];
+		BVHDBG("Visiting node %u, tag=%d, b=%f,%f,%f,%f,%f,%f, int=%d\n", (unsigned int)(b - bvh->node), b->tag, b->b[0], b->b[1], b->b[2], b->b[3], b->b[4], b->b[5], (0 != b->nchild));
+		bvh3d_node_box(b, c, h);
+		if(0 == func(b->tag, c, h, (0 == b->nchild), data)){ return 0; }
+		while(i > 0){
+			stack[top++] = b->child + (--i);
+		}
 	}
 	return 1;
 }
@@ -3,25 +3,80 @@
 
 // Bounding volume hierarchy structures
 //
-// The underlying implementation of the BVH is an R-tree. We assume
-// that the structures are _static_; that is, they are created and
-// never modified. This assumption allows us to generate more
-// efficient trees by bulk-loading the trees up front.
+// The underlying implementation of the BVH is an R-tree. Most trees are
+// _static_; that is, they are created and never modified. This
+// assumption allows us to generate more efficient trees by bulk-loading
+// the trees up front.
 //  The bulk loading method we use is Sort-Tile-Recursive (STR) due
-// to its simplicity and reasonable effectiveness.
+// to its simplicity and reasonable effectiveness. When build time
+// matters more than query time, the leaves can instead be packed in
+// Morton (Z-curve) order.
+//  Trees whose contents change are instead created _dynamic_ (see
+// geom_bvh2d_new_dynamic below). These are binary trees grown one leaf
+// at a time, with local rotations that keep the total box area small;
+// their height is not bounded, so a bad insertion order can leave them
+// deep.
 
 typedef struct geom_bvh2d_struct* geom_bvh2d;
 typedef struct geom_bvh3d_struct* geom_bvh3d;
 
+// Bulk loading methods.
+typedef enum{
+	GEOM_BVH_STR,   // Sort-Tile-Recursive; the default
+	GEOM_BVH_MORTON // Morton order of the box centers; one sort, so faster
+	                // to build, at the cost of somewhat looser trees
+} geom_bvh_method;
+
 // Construct a new BVH from an iterator function.
 // The function should fill in the box info (c,h), and an optional tag
 // The data parameter is passed to the iterator.
 geom_bvh2d geom_bvh2d_new(unsigned int n, int (*shape_iterator)(double c[2], double h[2], int *tag, void *data), void *data);
 geom_bvh3d geom_bvh3d_new(unsigned int n, int (*shape_iterator)(double c[2], double h[3], int *tag, void *data), void *data);
 
+// Same as above, with a choice of bulk loading method.
+geom_bvh2d geom_bvh2d_new_method(unsigned int n, int (*shape_iterator)(double c[2], double h[2], int *tag, void *data), void *data, geom_bvh_method method);
+geom_bvh3d geom_bvh3d_new_method(unsigned int n, int (*shape_iterator)(double c[3], double h[3], int *tag, void *data), void *data, geom_bvh_method method);
+
+// Construct an empty dynamic tree. Leaves are added, removed and moved
+// one at a time, and are identified by their tags, which must be
+// nonnegative and distinct (and, since a table indexed by tag is kept,
+// reasonably dense). All the queries below work on dynamic trees, but
+// are somewhat slower than on a static tree of the same boxes.
+geom_bvh2d geom_bvh2d_new_dynamic(void);
+geom_bvh3d geom_bvh3d_new_dynamic(void);
+
+// Insert a leaf box (c,h) with the given tag, remove the leaf with a tag,
+// or change its box. An update that keeps the box within its parent
+// refits the ancestors in place, and otherwise reinserts the leaf.
+// Return 0 on success, -1 if the tree is not dynamic, -2 if the tag is
+// invalid (or already present, for insert), and -3 if c or h is NULL.
+int geom_bvh2d_insert(geom_bvh2d bvh, int tag, const double c[2], const double h[2]);
+int geom_bvh3d_insert(geom_bvh3d bvh, int tag, const double c[3], const double h[3]);
+int geom_bvh2d_remove(geom_bvh2d bvh, int tag);
+int geom_bvh3d_remove(geom_bvh3d bvh, int tag);
+int geom_bvh2d_update(geom_bvh2d bvh, int tag, const double c[2], const double h[2]);
+int geom_bvh3d_update(geom_bvh3d bvh, int tag, const double c[3], const double h[3]);
+
 void geom_bvh2d_destroy(geom_bvh2d bvh);
 void geom_bvh3d_destroy(geom_bvh3d bvh);
 
+// Query statistics. When a counts record is attached to a tree, every
+// query adds to it: one query, the internal nodes it visited (whose
+// children were tested), and the leaves it passed on to query_func (or
+// to dist_func). Layers above the tree keep their own counts in the same
+// record; the shapesets count geom_shape*_contains calls and how many
+// returned true. A record must not be shared by queries running in
+// parallel. Pass NULL to detach.
+typedef struct{
+	unsigned long queries;
+	unsigned long nodes;
+	unsigned long leaves;
+	unsigned long contains;
+	unsigned long hits;
+} geom_query_counts;
+void geom_bvh2d_set_counts(geom_bvh2d bvh, geom_query_counts *counts);
+void geom_bvh3d_set_counts(geom_bvh3d bvh, geom_query_counts *counts);
+
 // p is the query point
 // In 2D, p[2] is {x,y}. In 3D, p[3] is {x,y,z}
 // The query function is passed leaf boxes which contain the point p, along with the tag.
@@ -40,6 +95,24 @@ int geom_bvh3d_query_pt(
 	void *data
 );
 
+// Finds the largest tag among the leaf boxes containing p that query_func
+// accepts by returning nonzero. Leaves with tags no greater than best are
+// not considered, and neither is any subtree whose largest tag is not
+// above the best found so far; children are visited largest tag first.
+// Returns the tag found, or best if there is none.
+int geom_bvh2d_query_pt_max(
+	geom_bvh2d bvh,
+	const double p[2], int best,
+	int (*query_func)(int tag, const double c[2], const double h[2], void *data),
+	void *data
+);
+int geom_bvh3d_query_pt_max(
+	geom_bvh3d bvh,
+	const double p[3], int best,
+	int (*query_func)(int tag, const double c[3], const double h[3], void *data),
+	void *data
+);
+
 // Same as query_pt, but returns all leaf boxes which intersect the given box (c,h).
 int geom_bvh2d_query_box(
 	geom_bvh2d bvh,
@@ -53,6 +126,85 @@ int geom_bvh3d_query_box(
 	int (*query_func)(int tag, const double c[3], const double h[3], void *data),
 	void *data
 );
+// Same as query_box, but counts go to the given record (if not NULL)
+// instead of the one attached to the tree. Queries only read the tree, so
+// threads sharing one can run this at once, each with its own record.
+int geom_bvh2d_query_box_counts(
+	geom_bvh2d bvh,
+	const double c[2], const double h[2],
+	int (*query_func)(int tag, const double c[2], const double h[2], void *data),
+	void *data, geom_query_counts *counts
+);
+
+// Ray queries. The ray is p + t*v for t >= 0 (v need not be normalized),
+// and the segment from a to b is a + t*(b-a) for t in [0,1]. Leaf boxes
+// crossed by the ray are passed to query_func along with t, the parameter
+// at which the ray enters the box (0 if it starts inside). The children
+// of every node are visited front to back, so leaves arrive in roughly
+// increasing t. The function may lower *tmax (initially infinite for a
+// ray, 1 for a segment), for example to the parameter of the closest hit
+// found so far; boxes entered beyond *tmax are then skipped. A zero
+// return value terminates the query.
+int geom_bvh2d_query_ray(
+	geom_bvh2d bvh,
+	const double p[2], const double v[2],
+	int (*query_func)(int tag, const double c[2], const double h[2], double t, double *tmax, void *data),
+	void *data
+);
+int geom_bvh3d_query_ray(
+	geom_bvh3d bvh,
+	const double p[3], const double v[3],
+	int (*query_func)(int tag, const double c[3], const double h[3], double t, double *tmax, void *data),
+	void *data
+);
+int geom_bvh2d_query_segment(
+	geom_bvh2d bvh,
+	const double a[2], const double b[2],
+	int (*query_func)(int tag, const double c[2], const double h[2], double t, double *tmax, void *data),
+	void *data
+);
+int geom_bvh3d_query_segment(
+	geom_bvh3d bvh,
+	const double a[3], const double b[3],
+	int (*query_func)(int tag, const double c[3], const double h[3], double t, double *tmax, void *data),
+	void *data
+);
+
+// Nearest neighbor queries. Leaves are passed to query_func in order of
+// increasing distance from p, along with that distance; a zero return
+// value terminates the query. The distance to a leaf is the distance
+// from p to its box, or if dist_func is given, the value it returns for
+// the leaf: the exact distance to the object in the box, which must be no
+// less than the distance to the box. dist_func is called lazily, only on
+// leaves that may be reported next. data is passed to both functions.
+int geom_bvh2d_query_nearest(
+	geom_bvh2d bvh,
+	const double p[2],
+	double (*dist_func)(int tag, const double p[2], void *data),
+	int (*query_func)(int tag, const double c[2], const double h[2], double dist, void *data),
+	void *data
+);
+int geom_bvh3d_query_nearest(
+	geom_bvh3d bvh,
+	const double p[3],
+	double (*dist_func)(int tag, const double p[3], void *data),
+	int (*query_func)(int tag, const double c[3], const double h[3], double dist, void *data),
+	void *data
+);
+
+// Finds the k nearest leaves to p, as above. Their tags and distances are
+// returned in tag[] and dist[], nearest first. Returns the number found,
+// which is less than k only if the tree has fewer leaves.
+unsigned int geom_bvh2d_query_knn(
+	geom_bvh2d bvh, const double p[2], unsigned int k,
+	double (*dist_func)(int tag, const double p[2], void *data), void *data,
+	int tag[], double dist[]
+);
+unsigned int geom_bvh3d_query_knn(
+	geom_bvh3d bvh, const double p[3], unsigned int k,
+	double (*dist_func)(int tag, const double p[3], void *data), void *data,
+	int tag[], double dist[]
+);
 
 // Performs a full traversal of all the boxes in the BVH.
 // The flag internal is set to 0 for leaf nodes, and 1 for non-leaf nodes.
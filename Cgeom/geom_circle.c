@@ -11,11 +11,12 @@ int geom_circle_circle_intersect(
 	const double rsum = r1+r2;
 	const double rdiff = fabs(r1-r2);
 	if(dl > rsum){ return 0; }
+	if(0 == dl){ return 0; } /* concentric */
 	if(dl == rsum){
 		double t = r1/dl;
 		p[0] = (1-t)*c1[0] + t*c2[0];
 		p[1] = (1-t)*c1[1] + t*c2[1];
-		return 0;
+		return 1;
 	}
 	if(dl < rdiff){ return 0; }
 	if(dl == rdiff){
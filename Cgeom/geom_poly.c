@@ -722,11 +722,11 @@ static int triangle_contains(
 	const double v[2],
 	const double p[2] /* query point */
 ){
-	if(geom_orient2d(org,u,p) >= 0){
-		if(geom_orient2d(org,v,p) <= 0){
-			/* treat org as origin, we have points u and v, just need p-org */
-			double x[2] = {p[0] - org[0], p[1] - org[1]};
-			if(geom_orient2d(u,v,x) >= 0){
+	const double a[2] = {org[0] + u[0], org[1] + u[1]};
+	const double b[2] = {org[0] + v[0], org[1] + v[1]};
+	if(geom_orient2d(org,a,p) >= 0){
+		if(geom_orient2d(a,b,p) >= 0){
+			if(geom_orient2d(b,org,p) >= 0){
 				return 1;
 			}
 		}
@@ -7,6 +7,9 @@
 #include <float.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
 
 #define FFMT "%.14g"
 
@@ -366,7 +369,300 @@ int geom_shape3d_get_aabb(const geom_shape3d *s, geom_aabb3d *b){
 }
 
 
+// A polygon is kept as its triangles, each with its vertices in CCW order
+// followed by its bounding box {xmin,ymin,xmax,ymax}, all relative to the
+// shape origin. Ear clipping takes O(nv^2) time, so large polygons are not
+// triangulated; their overlaps clip the polygon against the triangle.
+//  Polygons with many vertices also get a slab decomposition for point
+// location. The distinct vertex y values cut the plane into horizontal
+// slabs, and as long as edges do not cross, the edges spanning a slab keep
+// the same left to right order throughout it. A point then takes one
+// binary search for its slab and one for the number of edges to its
+// right, whose parity is the crossing test of geom_polygon_inside2d: the
+// same edges are counted, with the same arithmetic. The index is skipped
+// if the slabs would hold more than SHAPE2D_SLAB_MAX_PER_VERTEX entries
+// per vertex, or if two edges spanning a slab cross, as happens when the
+// polygon intersects itself. The order of edges in a slab is decided by
+// exact orientation tests (geom_orient2d, so geom_predicates_init must
+// have been called), since interpolated x can misorder edges meeting at a
+// vertex that is only an ulp or two from the next vertex in y.
+#define SHAPE2D_TRIANGULATE_MAX_NV 4096
+#define SHAPE2D_SLAB_MIN_NV 64
+#define SHAPE2D_SLAB_MAX_PER_VERTEX 64
+struct geom_shape2d_accel_struct{
+	unsigned int nt; // number of triangles; 0 if too large to triangulate
+	int simple; // 0 if the triangulation failed
+	double box[4]; // of the whole polygon
+	double *tri; // 10 values per triangle
+	unsigned int nslab; // number of slabs; 0 if there is no index
+	double *slab_y; // slab k is slab_y[k] <= y < slab_y[k+1]
+	unsigned int *slab_off; // edges of slab k are slab_edge[slab_off[k]..slab_off[k+1])
+	unsigned int *slab_edge; // edge i runs from vertex i to vertex i-1
+};
+static void polygon_accel_free(geom_shape2d_accel *a){
+	if(NULL == a){ return; }
+	free(a->slab_y);
+	free(a);
+}
+static int slab_cmp_double(const void *a, const void *b){
+	const double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+typedef struct{
+	double x;
+	unsigned int edge;
+} slab_entry;
+static int slab_cmp_entry(const void *a, const void *b){
+	const double x = ((const slab_entry*)a)->x, y = ((const slab_entry*)b)->x;
+	return (x > y) - (x < y);
+}
+// Index of y in the sorted array ys[0..n)
+static unsigned int slab_find(unsigned int n, const double *ys, double y){
+	unsigned int lo = 0, hi = n;
+	while(hi - lo > 1){
+		const unsigned int mid = (lo + hi) / 2;
+		if(ys[mid] <= y){ lo = mid; }else{ hi = mid; }
+	}
+	return lo;
+}
+// x at height y of the line through edge i, as in geom_polygon_inside2d
+static double slab_edge_x(unsigned int nv, const double *v, unsigned int i, double y){
+	const unsigned int j = (i > 0) ? i-1 : nv-1;
+	return (v[2*j+0]-v[2*i+0]) * (y-v[2*i+1]) / (v[2*j+1]-v[2*i+1]) + v[2*i+0];
+}
+// Side of edge b relative to edge a over the range of y that both span:
+// 1 if b is to the right, -1 if to the left, 0 if they are collinear, or 2
+// if they cross. Only exact orientation tests of endpoints are used, at
+// the bottom and then the top of the shared range, so edges meeting at a
+// vertex are told apart by their far endpoints, however short the slab.
+static int slab_edge_side(unsigned int nv, const double *v, unsigned int a, unsigned int b){
+	const unsigned int ja = (a > 0) ? a-1 : nv-1, jb = (b > 0) ? b-1 : nv-1;
+	const double *la = &v[2*a], *ua = &v[2*ja], *lb = &v[2*b], *ub = &v[2*jb];
+	double lo, hi;
+	if(la[1] > ua[1]){ const double *t = la; la = ua; ua = t; }
+	if(lb[1] > ub[1]){ const double *t = lb; lb = ub; ub = t; }
+	// The endpoint of one edge at each end of the range lies within the
+	// y-range of the other; a point of b left of a means b is left.
+	lo = (lb[1] >= la[1]) ? -geom_orient2d(la, ua, lb) : geom_orient2d(lb, ub, la);
+	hi = (ub[1] <= ua[1]) ? -geom_orient2d(la, ua, ub) : geom_orient2d(lb, ub, ua);
+	if((lo > 0 && hi < 0) || (lo < 0 && hi > 0)){ return 2; }
+	if(0 == lo){ lo = hi; }
+	return (lo > 0) - (lo < 0);
+}
+static void polygon_slab_build(geom_shape2d_accel *a, unsigned int nv, const double *v){
+	double *ys;
+	unsigned int *cnt, *off, *edge;
+	slab_entry *buf;
+	unsigned int i, k, m, n, nslab;
+	int ordered = 1;
+	size_t total = 0, maxcnt = 0;
+	void *mem;
+	ys = (double*)malloc(sizeof(double) * nv);
+	for(i = 0; i < nv; ++i){ ys[i] = v[2*i+1]; }
+	qsort(ys, nv, sizeof(double), &slab_cmp_double);
+	for(i = 1, m = 1; i < nv; ++i){
+		if(ys[i] != ys[m-1]){ ys[m++] = ys[i]; }
+	}
+	if(m < 2){ free(ys); return; }
+	nslab = m-1;
+	// Count the edges spanning each slab with a difference array
+	cnt = (unsigned int*)calloc(nslab+1, sizeof(unsigned int));
+	for(i = 0; i < nv; ++i){
+		const unsigned int j = (i > 0) ? i-1 : nv-1;
+		const double y0 = (v[2*i+1] < v[2*j+1]) ? v[2*i+1] : v[2*j+1];
+		const double y1 = (v[2*i+1] < v[2*j+1]) ? v[2*j+1] : v[2*i+1];
+		unsigned int k0, k1;
+		if(y0 == y1){ continue; }
+		k0 = slab_find(m, ys, y0);
+		k1 = slab_find(m, ys, y1);
+		total += k1 - k0;
+		cnt[k0]++;
+		cnt[k1]--;
+	}
+	if(total > (size_t)SHAPE2D_SLAB_MAX_PER_VERTEX * nv){
+		free(cnt);
+		free(ys);
+		return;
+	}
+	mem = malloc(sizeof(double) * m + sizeof(unsigned int) * (nslab + 1 + total));
+	if(NULL == mem){
+		free(cnt);
+		free(ys);
+		return;
+	}
+	a->slab_y = (double*)mem;
+	memcpy(a->slab_y, ys, sizeof(double) * m);
+	off = (unsigned int*)(a->slab_y + m);
+	edge = off + nslab + 1;
+	off[0] = 0;
+	for(k = 0, n = 0; k < nslab; ++k){
+		n += cnt[k]; // the difference array summed up to k
+		off[k+1] = off[k] + n;
+		if(n > maxcnt){ maxcnt = n; }
+		cnt[k] = off[k]; // now the fill position
+	}
+	for(i = 0; i < nv; ++i){
+		const unsigned int j = (i > 0) ? i-1 : nv-1;
+		const double y0 = (v[2*i+1] < v[2*j+1]) ? v[2*i+1] : v[2*j+1];
+		const double y1 = (v[2*i+1] < v[2*j+1]) ? v[2*j+1] : v[2*i+1];
+		unsigned int k0, k1;
+		if(y0 == y1){ continue; }
+		k0 = slab_find(m, ys, y0);
+		k1 = slab_find(m, ys, y1);
+		for(k = k0; k < k1; ++k){
+			edge[cnt[k]++] = i;
+		}
+	}
+	// Order each slab by x at its middle, then settle the order of
+	// neighbors exactly with slab_edge_side, which rounding can get wrong
+	// in thin slabs; the floating point order is nearly right, so the
+	// insertion sort does little work. If no two neighbors cross, no two
+	// edges cross inside the slab.
+	buf = (slab_entry*)malloc(sizeof(slab_entry) * (maxcnt > 0 ? maxcnt : 1));
+	for(k = 0; k < nslab && ordered; ++k){
+		const double ym = 0.5*ys[k] + 0.5*ys[k+1];
+		n = off[k+1] - off[k];
+		for(i = 0; i < n; ++i){
+			buf[i].edge = edge[off[k]+i];
+			buf[i].x = slab_edge_x(nv, v, buf[i].edge, ym);
+		}
+		qsort(buf, n, sizeof(slab_entry), &slab_cmp_entry);
+		for(i = 0; i < n && ordered; ++i){
+			const unsigned int e = buf[i].edge;
+			unsigned int l = i;
+			while(l > 0){
+				const int side = slab_edge_side(nv, v, edge[off[k]+l-1], e);
+				if(2 == side){ ordered = 0; }
+				if(side >= 0){ break; }
+				edge[off[k]+l] = edge[off[k]+l-1];
+				--l;
+			}
+			edge[off[k]+l] = e;
+		}
+	}
+	free(buf);
+	free(cnt);
+	free(ys);
+	if(!ordered){
+		free(a->slab_y);
+		a->slab_y = NULL;
+		return;
+	}
+	a->nslab = nslab;
+	a->slab_off = off;
+	a->slab_edge = edge;
+}
+static int polygon_slab_inside(const geom_shape2d_accel *a, unsigned int nv, const double *v, const double p[2]){
+	const unsigned int *edge;
+	unsigned int k, lo, hi;
+	if(p[1] < a->slab_y[0] || p[1] >= a->slab_y[a->nslab]){ return 0; }
+	k = slab_find(a->nslab + 1, a->slab_y, p[1]);
+	edge = &a->slab_edge[a->slab_off[k]];
+	// Find the first edge to the right of p
+	lo = 0;
+	hi = a->slab_off[k+1] - a->slab_off[k];
+	while(lo < hi){
+		const unsigned int mid = (lo + hi) / 2;
+		if(p[0] < slab_edge_x(nv, v, edge[mid], p[1])){ hi = mid; }else{ lo = mid+1; }
+	}
+	return (a->slab_off[k+1] - a->slab_off[k] - lo) & 1;
+}
+static geom_shape2d_accel *polygon_accel_new(unsigned int nv, const double *v, int with_index){
+	geom_shape2d_accel *a;
+	unsigned int *idx;
+	double *vr = NULL;
+	const unsigned int nt = (nv <= SHAPE2D_TRIANGULATE_MAX_NV) ? nv-2 : 0;
+	unsigned int i, j;
+	if(nv < 3){ return NULL; }
+	a = (geom_shape2d_accel*)malloc(sizeof(geom_shape2d_accel) + sizeof(double) * 10*nt);
+	if(NULL == a){ return NULL; }
+	a->tri = (double*)(a+1);
+	a->nt = 0;
+	a->simple = 1;
+	a->nslab = 0;
+	a->slab_y = NULL;
+	a->slab_off = NULL;
+	a->slab_edge = NULL;
+	a->box[0] = a->box[2] = v[0];
+	a->box[1] = a->box[3] = v[1];
+	for(i = 1; i < nv; ++i){
+		if(v[2*i+0] < a->box[0]){ a->box[0] = v[2*i+0]; }
+		if(v[2*i+1] < a->box[1]){ a->box[1] = v[2*i+1]; }
+		if(v[2*i+0] > a->box[2]){ a->box[2] = v[2*i+0]; }
+		if(v[2*i+1] > a->box[3]){ a->box[3] = v[2*i+1]; }
+	}
+	if(with_index && nv >= SHAPE2D_SLAB_MIN_NV){
+		polygon_slab_build(a, nv, v);
+	}
+	if(0 == nt){ return a; }
+	// The triangulation needs the vertices in CCW order
+	if(geom_polygon_area2d(nv, v) < 0){
+		vr = (double*)malloc(sizeof(double)*2*nv);
+		for(i = 0; i < nv; ++i){
+			vr[2*i+0] = v[2*(nv-1-i)+0];
+			vr[2*i+1] = v[2*(nv-1-i)+1];
+		}
+		v = vr;
+	}
+	idx = (unsigned int*)malloc(sizeof(unsigned int)*3*nt);
+	a->simple = (0 == geom_polygon_triangulate2d(nv, v, idx));
+	a->nt = a->simple ? nt : 0;
+	for(i = 0; i < a->nt; ++i){
+		double *T = &a->tri[10*i];
+		for(j = 0; j < 3; ++j){
+			T[2*j+0] = v[2*idx[3*i+j]+0];
+			T[2*j+1] = v[2*idx[3*i+j]+1];
+		}
+		T[6] = T[0]; T[7] = T[1]; T[8] = T[0]; T[9] = T[1];
+		for(j = 1; j < 3; ++j){
+			if(T[2*j+0] < T[6]){ T[6] = T[2*j+0]; }
+			if(T[2*j+1] < T[7]){ T[7] = T[2*j+1]; }
+			if(T[2*j+0] > T[8]){ T[8] = T[2*j+0]; }
+			if(T[2*j+1] > T[9]){ T[9] = T[2*j+1]; }
+		}
+	}
+	free(idx);
+	free(vr);
+	return a;
+}
+// Area of the polygon within the CCW triangle P, by clipping the polygon
+// to each side of P in turn (Sutherland-Hodgman). A concave polygon may
+// be cut into pieces joined by zero-width bridges, which add no area.
+static double polygon_clip_area(unsigned int nv, const double *v, const double P[6]){
+	double *buf = (double*)malloc(sizeof(double) * 4*(2*nv+6));
+	double *in = buf, *out = buf + 2*(2*nv+6);
+	unsigned int n = nv, i, k;
+	double area;
+	memcpy(in, v, sizeof(double) * 2*nv);
+	for(k = 0; k < 3 && n > 0; ++k){
+		const double *a = &P[2*k], *b = &P[2*((k+1)%3)];
+		unsigned int m = 0;
+		for(i = 0; i < n; ++i){
+			const double *p = &in[2*((i+n-1)%n)], *q = &in[2*i];
+			const double sp = (b[0]-a[0])*(p[1]-a[1]) - (b[1]-a[1])*(p[0]-a[0]);
+			const double sq = (b[0]-a[0])*(q[1]-a[1]) - (b[1]-a[1])*(q[0]-a[0]);
+			if((sp >= 0) != (sq >= 0)){
+				const double s = sp / (sp - sq);
+				out[2*m+0] = p[0] + s*(q[0]-p[0]);
+				out[2*m+1] = p[1] + s*(q[1]-p[1]);
+				m++;
+			}
+			if(sq >= 0){
+				out[2*m+0] = q[0];
+				out[2*m+1] = q[1];
+				m++;
+			}
+		}
+		{ double *tmp = in; in = out; out = tmp; }
+		n = m;
+	}
+	area = (n >= 3) ? fabs(geom_polygon_area2d(n, in)) : 0;
+	free(buf);
+	return area;
+}
+
 int geom_shape2d_init(geom_shape2d *s){
+	s->accel = NULL;
 	switch(s->type){
 	case GEOM_SHAPE2D_ELLIPSE:
 		{
@@ -377,10 +673,24 @@ int geom_shape2d_init(geom_shape2d *s){
 			geom_matinv2d(s->s.ellipse.B);
 			return 0;
 		}
+	case GEOM_SHAPE2D_POLYGON:
+		s->accel = polygon_accel_new(s->s.polygon.nv, s->s.polygon.v, 1);
+		return 0;
 	default:
 		return 0;
 	}
 }
+void geom_shape2d_release(geom_shape2d *s){
+	if(NULL == s){ return; }
+	polygon_accel_free(s->accel);
+	s->accel = NULL;
+}
+void geom_shape3d_release(geom_shape3d *s){
+	if(NULL == s){ return; }
+	if(GEOM_SHAPE3D_EXTRUSION == s->type){
+		geom_shape2d_release(&s->s.extrusion.s2);
+	}
+}
 int geom_shape3d_init(geom_shape3d *s){
 	switch(s->type){
 	case GEOM_SHAPE3D_TET:
@@ -466,7 +776,7 @@ int geom_shape3d_init(geom_shape3d *s){
 geom_shape3d *geom_shape3d_clone(geom_shape3d *s){
 	if(NULL == s){ return NULL; }
 	geom_shape3d *r = NULL;
-	size_t sz = sizeof(geom_shape2d);
+	size_t sz = sizeof(geom_shape3d);
 	switch(s->type){
 	case GEOM_SHAPE3D_POLY:
 		sz += sizeof(double) * 4*(s->s.poly.np-1);
@@ -485,6 +795,9 @@ geom_shape3d *geom_shape3d_clone(geom_shape3d *s){
 	}
 	r = (geom_shape3d*)malloc(sz);
 	memcpy(r, s, sz);
+	if(GEOM_SHAPE3D_EXTRUSION == r->type){
+		geom_shape2d_init(&r->s.extrusion.s2);
+	}
 	return r;
 }
 geom_shape2d *geom_shape2d_clone(geom_shape2d *s){
@@ -500,6 +813,7 @@ geom_shape2d *geom_shape2d_clone(geom_shape2d *s){
 	}
 	r = (geom_shape2d*)malloc(sz);
 	memcpy(r, s, sz);
+	geom_shape2d_init(r);
 	return r;
 }
 
@@ -512,6 +826,13 @@ static int geom_shape2d_contains_org(const geom_shape2d *s, const double p[2]){
 			return geom_norm2d(v) <= 1.;
 		}
 	case GEOM_SHAPE2D_POLYGON:
+		if(NULL != s->accel){
+			const double *box = s->accel->box;
+			if(p[0] < box[0] || p[1] < box[1] || p[0] > box[2] || p[1] > box[3]){ return 0; }
+			if(s->accel->nslab > 0){
+				return polygon_slab_inside(s->accel, s->s.polygon.nv, s->s.polygon.v, p);
+			}
+		}
 		return geom_polygon_inside2d(s->s.polygon.nv, s->s.polygon.v, p);
 	default:
 		return 0;
@@ -582,6 +903,202 @@ int geom_shape3d_contains(const geom_shape3d *s, const double p[3]){
 	return geom_shape3d_contains_org(s, po);
 }
 
+// Batch containment. The kernels test the points (x[i],y[i],z[i]) - o,
+// so o is the shape origin for absolute points and zero for points that
+// are already relative to it. Bit i%32 of mask[i/32] is set for each
+// point inside (mask may be NULL, and is assumed cleared), and the count
+// inside is returned. Ellipses, ellipsoids, blocks, tets and convex
+// polyhedra take four points at a time when built with AVX; the scalar
+// loops do the same arithmetic for the remainder, so the masks agree with
+// contains up to rounding of points on the boundary. Other shapes go
+// through contains one point at a time.
+static unsigned int batch_set1(unsigned int mask[], unsigned int i, int in){
+	if(!in){ return 0; }
+	if(NULL != mask){ mask[i/32] |= 1u << (i%32); }
+	return 1;
+}
+#ifdef __AVX__
+static const unsigned char batch_nbits4[16] = { 0,1,1,2, 1,2,2,3, 1,2,2,3, 2,3,3,4 };
+
+static unsigned int batch_set4(unsigned int mask[], unsigned int i, int m){
+	// i is a multiple of 4, so the 4 bits never straddle two words
+	if(NULL != mask){ mask[i/32] |= (unsigned int)m << (i%32); }
+	return batch_nbits4[m];
+}
+#endif
+
+// The faces of a tet as halfspaces h[4*f+0..2].p < h[4*f+3], matching the
+// orientation tests in geom_shape3d_contains_org.
+static void tet_halfspaces(const double *v, double h[16]){
+	static const unsigned char face[12] = { 0,3,6, 0,9,3, 0,6,9, 3,9,6 };
+	unsigned int f;
+	for(f = 0; f < 4; ++f){
+		const double *a = &v[face[3*f+0]], *b = &v[face[3*f+1]], *c = &v[face[3*f+2]];
+		const double ab[3] = { b[0]-a[0], b[1]-a[1], b[2]-a[2] };
+		const double ac[3] = { c[0]-a[0], c[1]-a[1], c[2]-a[2] };
+		// orient3d(a,b,c,p) < 0 iff (ab x ac).(p-a) > 0
+		h[4*f+0] = ab[2]*ac[1] - ab[1]*ac[2];
+		h[4*f+1] = ab[0]*ac[2] - ab[2]*ac[0];
+		h[4*f+2] = ab[1]*ac[0] - ab[0]*ac[1];
+		h[4*f+3] = h[4*f+0]*a[0] + h[4*f+1]*a[1] + h[4*f+2]*a[2];
+	}
+}
+
+// Intersection of np halfspaces h[4*k+0..2].p <= h[4*k+3], or < if strict.
+static unsigned int halfspace_batch(
+	unsigned int np, const double *h, int strict, const double o[3],
+	unsigned int n, const double *x, const double *y, const double *z, unsigned int mask[]
+){
+	unsigned int i = 0, k, count = 0;
+#ifdef __AVX__
+	const __m256d ox = _mm256_set1_pd(o[0]), oy = _mm256_set1_pd(o[1]), oz = _mm256_set1_pd(o[2]);
+	for(; i+4 <= n; i += 4){
+		const __m256d px = _mm256_sub_pd(_mm256_loadu_pd(&x[i]), ox);
+		const __m256d py = _mm256_sub_pd(_mm256_loadu_pd(&y[i]), oy);
+		const __m256d pz = _mm256_sub_pd(_mm256_loadu_pd(&z[i]), oz);
+		int m = 0xF;
+		for(k = 0; k < np && 0 != m; ++k){
+			const __m256d d = _mm256_add_pd(_mm256_add_pd(
+				_mm256_mul_pd(_mm256_set1_pd(h[4*k+0]), px),
+				_mm256_mul_pd(_mm256_set1_pd(h[4*k+1]), py)),
+				_mm256_mul_pd(_mm256_set1_pd(h[4*k+2]), pz));
+			const __m256d hd = _mm256_set1_pd(h[4*k+3]);
+			m &= _mm256_movemask_pd(strict ? _mm256_cmp_pd(d, hd, _CMP_LT_OQ) : _mm256_cmp_pd(d, hd, _CMP_LE_OQ));
+		}
+		count += batch_set4(mask, i, m);
+	}
+#endif
+	for(; i < n; ++i){
+		const double p[3] = { x[i]-o[0], y[i]-o[1], z[i]-o[2] };
+		int in = 1;
+		for(k = 0; k < np && in; ++k){
+			const double d = h[4*k+0]*p[0] + h[4*k+1]*p[1] + h[4*k+2]*p[2];
+			in = strict ? (d < h[4*k+3]) : (d <= h[4*k+3]);
+		}
+		count += batch_set1(mask, i, in);
+	}
+	return count;
+}
+
+static unsigned int geom_shape2d_contains_batch_org(
+	const geom_shape2d *s, const double o[2],
+	unsigned int n, const double *x, const double *y, unsigned int mask[]
+){
+	unsigned int i = 0, count = 0;
+	if(GEOM_SHAPE2D_ELLIPSE == s->type){
+		const double *B = s->s.ellipse.B;
+#ifdef __AVX__
+		const __m256d ox = _mm256_set1_pd(o[0]), oy = _mm256_set1_pd(o[1]), one = _mm256_set1_pd(1.);
+		const __m256d b0 = _mm256_set1_pd(B[0]), b1 = _mm256_set1_pd(B[1]);
+		const __m256d b2 = _mm256_set1_pd(B[2]), b3 = _mm256_set1_pd(B[3]);
+		for(; i+4 <= n; i += 4){
+			const __m256d px = _mm256_sub_pd(_mm256_loadu_pd(&x[i]), ox);
+			const __m256d py = _mm256_sub_pd(_mm256_loadu_pd(&y[i]), oy);
+			const __m256d u = _mm256_add_pd(_mm256_mul_pd(b0, px), _mm256_mul_pd(b2, py));
+			const __m256d v = _mm256_add_pd(_mm256_mul_pd(b1, px), _mm256_mul_pd(b3, py));
+			const __m256d r = _mm256_add_pd(_mm256_mul_pd(u, u), _mm256_mul_pd(v, v));
+			count += batch_set4(mask, i, _mm256_movemask_pd(_mm256_cmp_pd(r, one, _CMP_LE_OQ)));
+		}
+#endif
+		for(; i < n; ++i){
+			const double px = x[i]-o[0], py = y[i]-o[1];
+			const double u = B[0]*px + B[2]*py;
+			const double v = B[1]*px + B[3]*py;
+			count += batch_set1(mask, i, u*u + v*v <= 1.);
+		}
+		return count;
+	}
+	for(i = 0; i < n; ++i){
+		const double p[2] = { x[i]-o[0], y[i]-o[1] };
+		count += batch_set1(mask, i, geom_shape2d_contains_org(s, p));
+	}
+	return count;
+}
+
+static unsigned int geom_shape3d_contains_batch_org(
+	const geom_shape3d *s, const double o[3],
+	unsigned int n, const double *x, const double *y, const double *z, unsigned int mask[]
+){
+	unsigned int i = 0, count = 0;
+	switch(s->type){
+	case GEOM_SHAPE3D_TET:
+		{
+			double h[16];
+			tet_halfspaces(s->s.tet.v, h);
+			return halfspace_batch(4, h, 1, o, n, x, y, z, mask);
+		}
+	case GEOM_SHAPE3D_POLY:
+		return halfspace_batch(s->s.poly.np, s->s.poly.p, 0, o, n, x, y, z, mask);
+	case GEOM_SHAPE3D_BLOCK:
+	case GEOM_SHAPE3D_ELLIPSOID:
+		{
+			// |B p|_inf <= 1 for a block, |B p|_2 <= 1 for an ellipsoid
+			const int block = (GEOM_SHAPE3D_BLOCK == s->type);
+			const double *B = block ? s->s.block.B : s->s.ellipsoid.B;
+#ifdef __AVX__
+			const __m256d ox = _mm256_set1_pd(o[0]), oy = _mm256_set1_pd(o[1]), oz = _mm256_set1_pd(o[2]);
+			const __m256d one = _mm256_set1_pd(1.), sign = _mm256_set1_pd(-0.);
+			__m256d b[9];
+			unsigned int j;
+			for(j = 0; j < 9; ++j){ b[j] = _mm256_set1_pd(B[j]); }
+			for(; i+4 <= n; i += 4){
+				const __m256d px = _mm256_sub_pd(_mm256_loadu_pd(&x[i]), ox);
+				const __m256d py = _mm256_sub_pd(_mm256_loadu_pd(&y[i]), oy);
+				const __m256d pz = _mm256_sub_pd(_mm256_loadu_pd(&z[i]), oz);
+				__m256d v[3], r;
+				for(j = 0; j < 3; ++j){
+					v[j] = _mm256_add_pd(_mm256_add_pd(
+						_mm256_mul_pd(b[j+0], px), _mm256_mul_pd(b[j+3], py)), _mm256_mul_pd(b[j+6], pz));
+				}
+				if(block){
+					r = _mm256_max_pd(_mm256_max_pd(
+						_mm256_andnot_pd(sign, v[0]), _mm256_andnot_pd(sign, v[1])), _mm256_andnot_pd(sign, v[2]));
+				}else{
+					r = _mm256_add_pd(_mm256_add_pd(
+						_mm256_mul_pd(v[0], v[0]), _mm256_mul_pd(v[1], v[1])), _mm256_mul_pd(v[2], v[2]));
+				}
+				count += batch_set4(mask, i, _mm256_movemask_pd(_mm256_cmp_pd(r, one, _CMP_LE_OQ)));
+			}
+#endif
+			for(; i < n; ++i){
+				const double p[3] = { x[i]-o[0], y[i]-o[1], z[i]-o[2] };
+				double v[3];
+				geom_matvec3d(B, p, v);
+				if(block){
+					count += batch_set1(mask, i, fabs(v[0]) <= 1. && fabs(v[1]) <= 1. && fabs(v[2]) <= 1.);
+				}else{
+					count += batch_set1(mask, i, v[0]*v[0] + v[1]*v[1] + v[2]*v[2] <= 1.);
+				}
+			}
+			return count;
+		}
+	default:
+		for(i = 0; i < n; ++i){
+			const double p[3] = { x[i]-o[0], y[i]-o[1], z[i]-o[2] };
+			count += batch_set1(mask, i, geom_shape3d_contains_org(s, p));
+		}
+		return count;
+	}
+}
+
+int geom_shape2d_contains_batch(
+	const geom_shape2d *s, unsigned int n, const double *x, const double *y, unsigned int mask[]
+){
+	if(NULL == s){ return -1; }
+	if(n > 0 && (NULL == x || NULL == y)){ return -2; }
+	if(NULL != mask){ memset(mask, 0, sizeof(unsigned int) * ((n+31)/32)); }
+	return (int)geom_shape2d_contains_batch_org(s, s->org, n, x, y, mask);
+}
+
+int geom_shape3d_contains_batch(
+	const geom_shape3d *s, unsigned int n, const double *x, const double *y, const double *z, unsigned int mask[]
+){
+	if(NULL == s){ return -1; }
+	if(n > 0 && (NULL == x || NULL == y || NULL == z)){ return -2; }
+	if(NULL != mask){ memset(mask, 0, sizeof(unsigned int) * ((n+31)/32)); }
+	return (int)geom_shape3d_contains_batch_org(s, s->org, n, x, y, z, mask);
+}
+
 int geom_shape2d_normal(const geom_shape2d *s, const double p[2], double n[2]){
 	const double po[3] = {p[0]-s->org[0], p[1]-s->org[1]};
 	switch(s->type){
@@ -608,6 +1125,80 @@ int geom_shape2d_normal(const geom_shape2d *s, const double p[2], double n[2]){
 	return 0;
 }
 
+// Distance from p to the segment a-b
+static double segment_distance2d(const double a[2], const double b[2], const double p[2]){
+	const double v[2] = { b[0]-a[0], b[1]-a[1] };
+	const double w[2] = { p[0]-a[0], p[1]-a[1] };
+	const double vv = geom_dot2d(v, v);
+	double t = 0, d[2];
+	if(vv > 0){
+		t = geom_dot2d(v, w) / vv;
+		if(t < 0){ t = 0; }else if(t > 1){ t = 1; }
+	}
+	d[0] = w[0] - t*v[0];
+	d[1] = w[1] - t*v[1];
+	return geom_norm2d(d);
+}
+// Distance from a point outside the ellipse x^T.M.x = 1 to the ellipse,
+// with M = B^T.B symmetric positive definite. In the principal frame, the
+// ellipse has semi-axes e[0], e[1] and the nearest point to y is
+//   x[i] = e[i]^2 y[i] / (t + e[i]^2)
+// where t > 0 is the root of
+//   F(t) = sum_i (e[i] y[i] / (t + e[i]^2))^2 - 1.
+// F is convex and decreasing for t > 0 with F(0) > 0, so Newton's method
+// started from 0 increases monotonically to the root.
+static double ellipse_distance2d(const double B[4], const double po[2]){
+	const double M00 = B[0]*B[0] + B[1]*B[1];
+	const double M11 = B[2]*B[2] + B[3]*B[3];
+	const double M01 = B[0]*B[2] + B[1]*B[3];
+	const double theta = 0.5 * atan2(2*M01, M00 - M11);
+	const double cs = cos(theta), sn = sin(theta);
+	// Eigenvalues of M along (cs,sn) and (-sn,cs)
+	const double l0 = M00*cs*cs + 2*M01*cs*sn + M11*sn*sn;
+	const double l1 = M00*sn*sn - 2*M01*cs*sn + M11*cs*cs;
+	const double e2[2] = { 1./l0, 1./l1 };
+	const double y[2] = {
+		fabs( cs*po[0] + sn*po[1]),
+		fabs(-sn*po[0] + cs*po[1])
+	};
+	double t = 0, d[2];
+	int iter;
+	for(iter = 0; iter < 64; ++iter){
+		const double r0 = y[0] / (t + e2[0]), r1 = y[1] / (t + e2[1]);
+		const double F = e2[0]*r0*r0 + e2[1]*r1*r1 - 1;
+		const double dF = -2 * (e2[0]*r0*r0 / (t + e2[0]) + e2[1]*r1*r1 / (t + e2[1]));
+		const double tn = t - F / dF;
+		if(!(tn > t)){ break; }
+		t = tn;
+	}
+	d[0] = y[0] * t / (t + e2[0]);
+	d[1] = y[1] * t / (t + e2[1]);
+	return geom_norm2d(d);
+}
+
+double geom_shape2d_distance(const geom_shape2d *s, const double p[2]){
+	const double po[2] = {p[0]-s->org[0], p[1]-s->org[1]};
+	if(geom_shape2d_contains_org(s, po)){ return 0; }
+	switch(s->type){
+	case GEOM_SHAPE2D_ELLIPSE:
+		return ellipse_distance2d(s->s.ellipse.B, po);
+	case GEOM_SHAPE2D_POLYGON:
+		{
+			const unsigned int nv = s->s.polygon.nv;
+			const double *v = s->s.polygon.v;
+			double dmin = HUGE_VAL;
+			unsigned int i, j;
+			for(i = nv-1, j = 0; j < nv; i = j++){
+				const double d = segment_distance2d(&v[2*i], &v[2*j], po);
+				if(d < dmin){ dmin = d; }
+			}
+			return dmin;
+		}
+	default:
+		return HUGE_VAL;
+	}
+}
+
 int geom_shape3d_normal(const geom_shape3d *s, const double p[3], double n[3]){
 	const double po[3] = {p[0]-s->org[0], p[1]-s->org[1], p[2]-s->org[2]};
 	switch(s->type){
@@ -759,9 +1350,15 @@ int geom_shape3d_normal(const geom_shape3d *s, const double p[3], double n[3]){
 	return 0;
 }
 
+// The samples are relative to the shape origin, and are tested in chunks
+// by the batch kernels.
+#define SHAPE_BATCH_SIZE 256
+
 double geom_shape2d_simplex_overlap_stratified(const geom_shape2d *s, const double torg[2], const double t[6], unsigned int n){
 	const double org[2] = { torg[0]-s->org[0], torg[1]-s->org[1] };
-	unsigned int i, j;
+	static const double zero[2] = { 0, 0 };
+	double x[SHAPE_BATCH_SIZE], y[SHAPE_BATCH_SIZE];
+	unsigned int i, j, m = 0;
 	unsigned int count = 0;
 	double in = 1./n;
 	for(i = 0; i < n; ++i){
@@ -769,21 +1366,23 @@ double geom_shape2d_simplex_overlap_stratified(const geom_shape2d *s, const doub
 			double a = in*(i + (1./3.));
 			double b = in*(j + (1./3.));
 			double c = 1-a-b;
-			double p[2] = {
-				org[0] + a*t[0] + b*t[2] + c*t[4],
-				org[1] + a*t[1] + b*t[3] + c*t[5]
-			};
-			if(geom_shape2d_contains_org(s, p)){
-				count++;
+			x[m] = org[0] + a*t[0] + b*t[2] + c*t[4];
+			y[m] = org[1] + a*t[1] + b*t[3] + c*t[5];
+			if(++m == SHAPE_BATCH_SIZE){
+				count += geom_shape2d_contains_batch_org(s, zero, m, x, y, NULL);
+				m = 0;
 			}
 		}
 	}
+	count += geom_shape2d_contains_batch_org(s, zero, m, x, y, NULL);
 	return (double)count*2. / (double)(n*(n+1));
 }
 
 double geom_shape3d_simplex_overlap_stratified(const geom_shape3d *s,const double torg[3],  const double t[12], unsigned int n){
 	const double org[3] = { torg[0]-s->org[0], torg[1]-s->org[1], torg[2]-s->org[2] };
-	unsigned int i, j, k;
+	static const double zero[3] = { 0, 0, 0 };
+	double x[SHAPE_BATCH_SIZE], y[SHAPE_BATCH_SIZE], z[SHAPE_BATCH_SIZE];
+	unsigned int i, j, k, m = 0;
 	unsigned int count = 0;
 	double in = 1./n;
 	for(i = 0; i < n; ++i){
@@ -793,60 +1392,55 @@ double geom_shape3d_simplex_overlap_stratified(const geom_shape3d *s,const doubl
 				double b = in*(j + 0.25);
 				double c = in*(k + 0.25);
 				double d = 1-a-b-c;
-				double p[3] = {
-					org[0] + a*t[0] + b*t[3] + c*t[6] + d*t[ 9],
-					org[1] + a*t[1] + b*t[4] + c*t[7] + d*t[10],
-					org[2] + a*t[2] + b*t[5] + c*t[8] + d*t[11]
-				};
-				if(geom_shape3d_contains(s, p)){
-					count++;
+				x[m] = org[0] + a*t[0] + b*t[3] + c*t[6] + d*t[ 9];
+				y[m] = org[1] + a*t[1] + b*t[4] + c*t[7] + d*t[10];
+				z[m] = org[2] + a*t[2] + b*t[5] + c*t[8] + d*t[11];
+				if(++m == SHAPE_BATCH_SIZE){
+					count += geom_shape3d_contains_batch_org(s, zero, m, x, y, z, NULL);
+					m = 0;
 				}
 			}
 		}
 	}
+	count += geom_shape3d_contains_batch_org(s, zero, m, x, y, z, NULL);
 	return (double)count*6. / (double)(n*(n+1)*(n+2));
 }
 
 
-// circle radius r=1, chord length s
-// r > 0, s > 0, 2*r > s
-static double circular_sector_area(double s){
-	if(s <= 0){ return 0; }
-
-	// area = area of circular wedge - area of triangle part
-	// area = theta*r*r - s/2*sqrt(r^2 - (s/2)^2)
-	s *= 0.5;
-	// area = asin(s/r)*r*r - s*sqrt(r^2 - s^2)
-	// area = r*s*[ asin(s/r)/(s/r) - sqrt(1-(s/r)^2) ]
-	double x = s;
-	if(x < (1./32.)){ // use taylor expansion for stuff in brackets
-		static const double c2 = 2./3.;
-		static const double c4 = 1./5.;
-		static const double c6 = 3./28.;
-		static const double c8 = 3./72.;
-		x *= x;
-		return s*(c2 + (c4 + (c6 + c8*x)*x)*x)*x;
-	}else{
-		return s*(asin(x)/x - sqrt((1.+x)*(1.-x)));
-	}
-}
-// returns 1 if inside or on boundary, 0 otherwise
-static int triangle_contains(
-	const double org[2], // triangle vertices are {org,org+u,org+v}, in CCW orientation
-	const double u[2],
-	const double v[2],
-	const double p[2] // query point
-){
-	if(geom_orient2d(org,u,p) >= 0){
-		if(geom_orient2d(org,v,p) <= 0){
-			// treat org as origin, we have points u and v, just need p-org
-			double x[2] = {p[0] - org[0], p[1] - org[1]};
-			if(geom_orient2d(u,v,x) >= 0){
-				return 1;
-			}
+// Signed area of the intersection of the unit circle centered at the origin
+// with the triangle {origin, a, b}; positive if a, b is CCW about the origin.
+// The segment from a to b is split where it crosses the circle: the part
+// inside contributes a triangle, the parts outside a circular sector.
+static double circle_wedge_overlap(const double a[2], const double b[2]){
+	const double d[2] = { b[0]-a[0], b[1]-a[1] };
+	// |a + t*d|^2 = 1  =>  dd*t^2 + 2*ad*t + aa - 1 = 0
+	const double dd = d[0]*d[0] + d[1]*d[1];
+	const double ad = a[0]*d[0] + a[1]*d[1];
+	const double aa = a[0]*a[0] + a[1]*a[1];
+	double t0 = 1, t1 = 1; // the part of the segment inside the circle
+	double p0[2], p1[2];
+	double area = 0;
+	if(dd > 0){
+		const double disc = ad*ad - dd*(aa-1);
+		if(disc > 0){
+			const double sq = sqrt(disc);
+			t0 = (-ad - sq) / dd;
+			t1 = (-ad + sq) / dd;
+			if(t0 < 0){ t0 = 0; }
+			if(t1 > 1){ t1 = 1; }
+			if(t0 >= t1){ t0 = t1 = 1; }
 		}
 	}
-	return 0;
+	p0[0] = a[0] + t0*d[0]; p0[1] = a[1] + t0*d[1];
+	p1[0] = a[0] + t1*d[0]; p1[1] = a[1] + t1*d[1];
+	if(t0 > 0){ // sector from a to p0
+		area += 0.5*atan2(a[0]*p0[1] - a[1]*p0[0], a[0]*p0[0] + a[1]*p0[1]);
+	}
+	area += 0.5*(p0[0]*p1[1] - p0[1]*p1[0]);
+	if(t1 < 1){ // sector from p1 to b
+		area += 0.5*atan2(p1[0]*b[1] - p1[1]*b[0], p1[0]*b[0] + p1[1]*b[1]);
+	}
+	return area;
 }
 static double circle_triangle_overlap( // circle is centered at origin with unit radius
 	// triangle vertices: {org, org+u, org+v} are in CCW orientation
@@ -855,207 +1449,62 @@ static double circle_triangle_overlap( // circle is centered at origin with unit
 	const double tri_v[2]
 ){
 	const double origin[2] = {0,0};
-	int i, j;
-	int inside = 0; // bitfield of which triangle vertices are in circle, 4th bit is if circle center is in triangle
-	
 	double vert[6];
+	double area = 0;
+	int i, touch = 0;
 	vert[2*0+0] = tri_org[0];
 	vert[2*0+1] = tri_org[1];
 	vert[2*1+0] = (tri_org[0] + tri_u[0]);
 	vert[2*1+1] = (tri_org[1] + tri_u[1]);
 	vert[2*2+0] = (tri_org[0] + tri_v[0]);
 	vert[2*2+1] = (tri_org[1] + tri_v[1]);
-	
-	double vert_org[6];
-	vert_org[2*0+0] = 0;
-	vert_org[2*0+1] = 0;
-	vert_org[2*1+0] = tri_u[0];
-	vert_org[2*1+1] = tri_u[1];
-	vert_org[2*2+0] = tri_v[0];
-	vert_org[2*2+1] = tri_v[1];
-	
-	double tri_r[3]; // distance from circle center of each vertex of triangle, normalized to radius
-	for(i = 0; i < 3; ++i){
-		tri_r[i] = geom_norm2d(&vert[2*i+0]);
-		if(tri_r[i] <= 1.0){ inside |= (1<<i); }
-	}
-	if(triangle_contains(tri_org, tri_u, tri_v, origin)){ inside |= (1<<3); }
-	if((inside & 0x7) == 0x7){ // all triangle points in circle
-		return 0.5*fabs(geom_orient2d(origin,tri_u,tri_v));
-	}
-
-	double seg[6];
-	seg[2*0+0] = tri_u[0];
-	seg[2*0+1] = tri_u[1];
-	seg[2*1+0] = (tri_v[0] - tri_u[0]);
-	seg[2*1+1] = (tri_v[1] - tri_u[1]);
-	seg[2*2+0] = -tri_v[0];
-	seg[2*2+1] = -tri_v[1];
-	
-	double side_length[3]; // normalized to radius
-	for(i = 0; i < 3; ++i){
-		side_length[i] = geom_norm2d(&seg[2*i+0]);
-	}
-	
-	double seg_dot[3]; // p0.(p1-p0)/r^2
-	for(i = 0; i < 3; ++i){
-		seg_dot[i] = (vert[2*i+0]*seg[2*i+0] + vert[2*i+1]*seg[2*i+1]);
-	}
-	
-	// Get intersections of each segment with each circle
-	// segment 0 is org to u, segment 1 is u to v, segment 2 is v to org
-	double xp[12]; // intersection points
-	int nxp[3]; // number of intersections with each segment
-	int nx = 0;
+	// If no side reaches into the circle, the sectors would only cancel
+	// up to rounding; the circle is then either inside or disjoint.
 	for(i = 0; i < 3; ++i){
-		int ip1 = (i+1)%3;
-		int in0 = (inside & (1<<i)) ? 1 : 0;
-		int in1 = (inside & (1<<ip1)) ? 1 : 0;
-		if(in0 && in1){
-			nxp[i] = 0;
-		}else{
-			// line:   x = p0 + t(p1-p0)
-			// circle: x^2 = r^2
-			// (p0 + t(p1-p0))^2 = r^2
-			// t^2(p1-p0)^2 + 2t(p0).(p1-p0) + (p0)^2 - r^2 = 0
-			// t^2 * side_length^2 + 2*t*seg_dot + tri_r^2 - 1 = 0
-			// t = -seg_dot/side_length^2 +/- sqrt(seg_dot^2/side_length^4 - (tri_r^2-1)/side_length^2)
-			double isl2 = 1./(side_length[i]*side_length[i]);
-			double disc = (seg_dot[i]*seg_dot[i]*isl2 - (tri_r[i]*tri_r[i]-1)) * isl2;
-			double t0 = -seg_dot[i]*isl2;
-			double t, t2, tdist, t2dist;
-			if(in0 != in1){
-				// get the one intersection point
-				nxp[i] = 1;
-				nx += 1;
-
-				if(disc < 0){ disc = 0; }
-				disc = sqrt(disc);
-				t = t0+disc;
-				t2 = t0-disc;
-				if(t > 0.5){ tdist = fabs(t-1.); }else{ tdist = fabs(t); }
-				if(t2 > 0.5){ t2dist = fabs(t2-1.); }else{ t2dist = fabs(t2); }
-				if(t2dist < tdist){ t = t2; }
-				if(t < 0){ t = 0; }
-				if(t > 1){ t = 1; }
-				xp[2*2*i+0] = vert_org[2*i+0] + t*seg[2*i+0];
-				xp[2*2*i+1] = vert_org[2*i+1] + t*seg[2*i+1];
-			}else{
-				// possibly 0 or 2 intersection points; we count 1 degenerate point as none
-				if(disc <= 0){
-					nxp[i] = 0;
-				}else{
-					disc = sqrt(disc);
-					nxp[i] = 0;
-					t = t0-disc;
-					t2 = t0+disc;
-					if(0 < t && t < 1 && 0 < t2 && t2 < 1){
-						xp[2*(2*i+0)+0] = vert_org[2*i+0] + t*seg[2*i+0];
-						xp[2*(2*i+0)+1] = vert_org[2*i+1] + t*seg[2*i+1];
-						xp[2*(2*i+1)+0] = vert_org[2*i+0] + t*seg[2*i+0];
-						xp[2*(2*i+1)+1] = vert_org[2*i+1] + t*seg[2*i+1];
-						nxp[i] += 2;
-						nx += 2;
-					}
-				}
-			}
-		}
+		const double *a = &vert[2*i], *b = &vert[2*((i+1)%3)];
+		const double d[2] = { b[0]-a[0], b[1]-a[1] };
+		const double dd = d[0]*d[0] + d[1]*d[1];
+		double s = (dd > 0) ? -(a[0]*d[0] + a[1]*d[1]) / dd : 0;
+		double x[2];
+		if(s < 0){ s = 0; }
+		if(s > 1){ s = 1; }
+		x[0] = a[0] + s*d[0];
+		x[1] = a[1] + s*d[1];
+		if(x[0]*x[0] + x[1]*x[1] < 1){ touch = 1; break; }
 	}
-/*	
-	printf("tri: (%f,%f) (%f,%f) (%f,%f)\n",
-		vert[0], vert[1], vert[2], vert[3], vert[4], vert[5]);
-	printf("inside = %d, nx = %d\n", inside, nx);
-	printf("xp:");
-	for(i = 0; i < 3; ++i){
-		for(j = 0; j < nxp[i]; ++j){
-			printf(" (%d,%d,{%f,%f})", i, j, tri_org[0]+xp[2*(2*i+j)+0], tri_org[1]+xp[2*(2*i+j)+1]);
-		}
-	}printf("\n");
-*/
-	if(0 == nx){ // either no intersection area, or triangle entirely in circle, or circle in triangle
-		if((inside & 0x7) == 0x7){ // all triangle points in circle
-			// we already dealt with this above; getting here would be an error.
-			return -1;
-		}else{ // either no intersection area, or circle in triangle
-			if(inside & 0x8){ // triangle contains circle center, intersection area is either circle area or triangle area
-				return M_PI;
-			}else{
-				return 0;
-			}
+	if(!touch){
+		if(
+			geom_orient2d(&vert[0], &vert[2], origin) >= 0 &&
+			geom_orient2d(&vert[2], &vert[4], origin) >= 0 &&
+			geom_orient2d(&vert[4], &vert[0], origin) >= 0
+		){
+			return M_PI;
 		}
-	}else if(2 == nx){
-		// Either the 2 intersections are a single side or on two different sides
-		if(nxp[0] < 2 && nxp[1] < 2 && nxp[2] < 2){ // on different sides
-			// The area is determined by tracing
-		}else{
-			for(i = 0; i < 3; ++i){
-				if(nxp[i] > 1){ break; }
-			}
-			// Either the circle is mostly inside with a wedge poking out a side
-			// or the circle is mostly outside with a wedge poking inside
-			const double diff[2] = {
-				xp[2*(2*i+1)+0]-xp[2*2*i+0],
-				xp[2*(2*i+1)+1]-xp[2*2*i+1]
-			};
-			double sector_area = circular_sector_area(geom_norm2d(diff));
-			if(inside & (1 << 3)){
-				// Area of circle minus a wedge
-				return M_PI - sector_area;
-			}else{
-				return sector_area;
-			}
-		}
-	}else if(4 == nx){
-		// The area is determined by tracing
-	}else if(6 == nx){
-		// The area is determined by tracing
-	}else{
-		// There is no way we can get here
-		return -1;
+		return 0;
 	}
-	
-	// At this point we expect to just trace out the intersection shape
-	// The vertices of the intersection shape is either a triangle vertex
-	// or a intersection point on a triangle edge.
-	int vtype[6]; // 1 = triangle vertex, 0 = intersection point
-	double vp[12];
-	int nv = 0; // number of actual vertices
-	
 	for(i = 0; i < 3; ++i){
-		if(inside & (1 << i)){
-			vp[2*nv+0] = vert_org[2*i+0];
-			vp[2*nv+1] = vert_org[2*i+1];
-			vtype[nv++] = 1;
-		}
-		for(j = 0; j < nxp[i]; ++j){
-			vp[2*nv+0] = xp[2*(2*i+j)+0];
-			vp[2*nv+1] = xp[2*(2*i+j)+1];
-			vtype[nv++] = 0;
-		}
-	}
-
-	if(nv < 3){ // this should not be possible
-		return -1;
-	}
-	
-	// All neighboring points in v which are intersection points should have circular caps added
-	double area = geom_polygon_area2d(nv, vp);
-	for(i = 0; i < nv; ++i){
-		int im1 = i-1; if(im1 < 0){ im1 = nv-1; }
-		if((0 == vtype[im1]) && (0 == vtype[i])){
-			const double diff[2] = {
-				vp[2*i+0]-vp[2*im1+0],
-				vp[2*i+1]-vp[2*im1+1]
-			};
-			area += circular_sector_area(geom_norm2d(diff));
-		}
+		area += circle_wedge_overlap(&vert[2*i], &vert[2*((i+1)%3)]);
 	}
-	return area;
+	return fabs(area);
 }
 
 double geom_shape2d_simplex_overlap_exact(const geom_shape2d *s, const double torg[2], const double t[6]){
-	const double org[2] = { torg[0]-s->org[0], torg[1]-s->org[1] };
-	const double areaT = (t[2]-t[0]) * (t[5]-t[1]) - (t[4]-t[0]) * (t[3]-t[1]);
+	// Triangle vertices relative to the shape origin, in CCW order
+	double P[6];
+	double areaT;
+	unsigned int i;
+	for(i = 0; i < 3; ++i){
+		P[2*i+0] = torg[0] + t[2*i+0] - s->org[0];
+		P[2*i+1] = torg[1] + t[2*i+1] - s->org[1];
+	}
+	areaT = 0.5*((P[2]-P[0]) * (P[5]-P[1]) - (P[4]-P[0]) * (P[3]-P[1]));
+	if(areaT < 0){
+		double tmp;
+		tmp = P[2]; P[2] = P[4]; P[4] = tmp;
+		tmp = P[3]; P[3] = P[5]; P[5] = tmp;
+		areaT = -areaT;
+	}
+	if(0 == areaT){ return 0; }
 	switch(s->type){
 	case GEOM_SHAPE2D_ELLIPSE:
 		{
@@ -1065,52 +1514,61 @@ double geom_shape2d_simplex_overlap_exact(const geom_shape2d *s, const double to
 			const double *B = &s->s.ellipse.B[0];
 			const double detB = B[0]*B[3] - B[1]*B[2];
 			double areaI;
-			if(0 == detB || 0 == areaT){ return 0; }
-			double tri_u[2] = {
-				B[0]*(t[2]-t[0]) + B[2]*(t[3]-t[1]),
-				B[1]*(t[2]-t[0]) + B[3]*(t[3]-t[1])
-			};
-			double tri_v[2] = {
-				B[0]*(t[4]-t[0]) + B[2]*(t[5]-t[1]),
-				B[1]*(t[4]-t[0]) + B[3]*(t[5]-t[1])
-			};
-			areaI = circle_triangle_overlap(org, tri_u, tri_v) / detB;
+			double tri_org[2], tri_u[2], tri_v[2];
+			if(0 == detB){ return 0; }
+			geom_matvec2d(B, &P[0], tri_org);
+			geom_matvec2d(B, &P[2], tri_u);
+			geom_matvec2d(B, &P[4], tri_v);
+			tri_u[0] -= tri_org[0]; tri_u[1] -= tri_org[1];
+			tri_v[0] -= tri_org[0]; tri_v[1] -= tri_org[1];
+			if(detB < 0){ // B flips the orientation
+				double tmp;
+				tmp = tri_u[0]; tri_u[0] = tri_v[0]; tri_v[0] = tmp;
+				tmp = tri_u[1]; tri_u[1] = tri_v[1]; tri_v[1] = tmp;
+			}
+			areaI = circle_triangle_overlap(tri_org, tri_u, tri_v) / fabs(detB);
 			if(areaI > areaT){ areaI = areaT; }
 			return areaI;
 		}
 	case GEOM_SHAPE2D_POLYGON:
 		{
+			geom_shape2d_accel *tmp = NULL;
+			const geom_shape2d_accel *acc = s->accel;
 			double areaI = 0;
-			double P[6], Q[6], Pi[14];
-			unsigned int i, j, nPi;
-			unsigned int *tri = (unsigned int*)malloc(sizeof(unsigned int)*3*(s->s.polygon.nv-2));
-			
-			const double u[2] = { t[2]-t[0], t[3]-t[1] };
-			const double v[2] = { t[4]-t[0], t[5]-t[1] };
-			P[2*0+0] = org[0];
-			P[2*0+1] = org[1];
-			P[2*1+0] = P[2*0+0] + u[0];
-			P[2*1+1] = P[2*0+1] + u[1];
-			P[2*2+0] = P[2*1+0] + v[0];
-			P[2*2+1] = P[2*1+1] + v[1];
-			
-			geom_polygon_triangulate2d(s->s.polygon.nv, s->s.polygon.v, tri);
-			/*
-			for(i = 0; i < s->vtab.polygon.n_vertices-2; ++i){
-				fprintf(stderr, " (%d %d %d)", tri[3*i+0], tri[3*i+1], tri[3*i+2]);
-			}fprintf(stderr, "\n");
-			*/
-			for(i = 0; i < s->s.polygon.nv-2; ++i){
-				for(j = 0; j < 3; ++j){
-					Q[2*j+0] = s->s.polygon.v[2*tri[3*i+j]+0];
-					Q[2*j+1] = s->s.polygon.v[2*tri[3*i+j]+1];
+			double box[4], Pi[14];
+			unsigned int nPi;
+			if(NULL == acc){
+				acc = tmp = polygon_accel_new(s->s.polygon.nv, s->s.polygon.v, 0);
+				if(NULL == acc){ return 0; }
+			}
+			if(!acc->simple){
+				// Not a simple polygon; fall back to sampling
+				polygon_accel_free(tmp);
+				return areaT * geom_shape2d_simplex_overlap_stratified(s, torg, t, 16);
+			}
+			box[0] = box[2] = P[0];
+			box[1] = box[3] = P[1];
+			for(i = 1; i < 3; ++i){
+				if(P[2*i+0] < box[0]){ box[0] = P[2*i+0]; }
+				if(P[2*i+1] < box[1]){ box[1] = P[2*i+1]; }
+				if(P[2*i+0] > box[2]){ box[2] = P[2*i+0]; }
+				if(P[2*i+1] > box[3]){ box[3] = P[2*i+1]; }
+			}
+			for(i = 0; i < acc->nt; ++i){
+				const double *Q = &acc->tri[10*i];
+				if(Q[6] > box[2] || Q[8] < box[0] || Q[7] > box[3] || Q[9] < box[1]){ continue; }
+				nPi = 7;
+				if(geom_convex_polygon_intersection2d(3,P,3,Q,&nPi,Pi) < 0){ continue; }
+				if(nPi >= 3){
+					areaI += fabs(geom_polygon_area2d(nPi,Pi));
 				}
-				nPi = 6;
-				geom_convex_polygon_intersection2d(3,P,3,Q,&nPi,Pi);
-				areaI += geom_polygon_area2d(nPi,Pi);
+			}
+			if(0 == acc->nt && acc->box[0] <= box[2] && acc->box[2] >= box[0] && acc->box[1] <= box[3] && acc->box[3] >= box[1]){
+				// Too large to have been triangulated
+				areaI = polygon_clip_area(s->s.polygon.nv, s->s.polygon.v, P);
 			}
 			if(areaI > areaT){ areaI = areaT; }
-			free(tri);
+			polygon_accel_free(tmp);
 			return areaI;
 		}
 		break;
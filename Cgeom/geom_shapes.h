@@ -35,10 +35,16 @@ typedef struct{
 	// v is a variable sized array of size 2*nv
 } geom_shape2d_polygon;
 
+// Data precomputed by geom_shape2d_init to speed up queries: for a
+// polygon, its triangulation and, if it has many vertices, a point
+// location index. Opaque, and owned by the shape.
+typedef struct geom_shape2d_accel_struct geom_shape2d_accel;
+
 typedef struct{
 	geom_shape2d_type type;
 	int tag; // user data
 	double org[2]; // origin point
+	geom_shape2d_accel *accel; // set by geom_shape2d_init; NULL if none
 	union{
 		geom_shape2d_ellipse ellipse;
 		geom_shape2d_polygon polygon;
@@ -163,9 +169,15 @@ int geom_aabb2d_contains(const geom_aabb2d *b, const double p[2]);
 int geom_aabb3d_intersects(const geom_aabb3d *a, const geom_aabb3d *b);
 int geom_aabb2d_intersects(const geom_aabb2d *a, const geom_aabb2d *b);
 
-// Finishes the initialization depending on the shape.
+// Finishes the initialization depending on the shape. This must be done
+// before any query, and again after the shape is changed.
 // 2D:
 //   ellipse: Fills in B from A
+//   polygon: Triangulates the polygon into accel, which is reused by the
+//     overlap and containment queries. Polygons with many vertices also
+//     get a point location index, so that containment takes O(log nv)
+//     time, unless their edges cross; very large ones are not
+//     triangulated.
 // 3D:
 //   tet: ensures positive orientation
 //   ellipsoid, block: Fills in B from A
@@ -175,6 +187,14 @@ int geom_aabb2d_intersects(const geom_aabb2d *a, const geom_aabb2d *b);
 int geom_shape3d_init(geom_shape3d *s);
 int geom_shape2d_init(geom_shape2d *s);
 
+// Frees the data allocated by init (the accel of a 2D shape, or of the
+// base of an extrusion). Call this before freeing an initialized shape,
+// and before initializing it again, since init does not free what was
+// there. Queries still work afterwards, only without the precomputation.
+void geom_shape3d_release(geom_shape3d *s);
+void geom_shape2d_release(geom_shape2d *s);
+
+// Clones are initialized, so they must be released on their own.
 geom_shape3d *geom_shape3d_clone(geom_shape3d *s);
 geom_shape2d *geom_shape2d_clone(geom_shape2d *s);
 
@@ -182,6 +202,23 @@ geom_shape2d *geom_shape2d_clone(geom_shape2d *s);
 int geom_shape3d_contains(const geom_shape3d *s, const double p[3]);
 int geom_shape2d_contains(const geom_shape2d *s, const double p[2]);
 
+// Batch versions of contains for the n points (x[i],y[i],z[i]). Bit i%32
+// of mask[i/32] is set if point i is inside; mask may be NULL, otherwise
+// it must hold (n+31)/32 words. Ellipses, ellipsoids, blocks, tets and
+// convex polyhedra are tested four points at a time when built with AVX
+// (see SIMD in the Makefile); tets use floating point face planes, so
+// points within rounding of the boundary may disagree with contains.
+// Returns the number of points inside, -1 if s is NULL, or -2 if a
+// coordinate array is NULL.
+int geom_shape3d_contains_batch(
+	const geom_shape3d *s, unsigned int n,
+	const double *x, const double *y, const double *z, unsigned int mask[]
+);
+int geom_shape2d_contains_batch(
+	const geom_shape2d *s, unsigned int n,
+	const double *x, const double *y, unsigned int mask[]
+);
+
 // Compute the bounding box of the shape.
 // Returns 0 on success, 1 if unbounded.
 int geom_shape3d_get_aabb(const geom_shape3d *s, geom_aabb3d *b);
@@ -193,6 +230,10 @@ int geom_shape2d_get_aabb(const geom_shape2d *s, geom_aabb2d *b);
 int geom_shape3d_normal(const geom_shape3d *s, const double p[3], double n[3]);
 int geom_shape2d_normal(const geom_shape2d *s, const double p[2], double n[2]);
 
+// Returns the Euclidean distance from p to the shape, which is 0 if p
+// lies inside.
+double geom_shape2d_distance(const geom_shape2d *s, const double p[2]);
+
 // Computes the approximate overlapping volume/area between a shape and
 // the given simplex using O(n^d) stratified samples. The returned value
 // is the fraction of sample points inside the simplex.
@@ -200,7 +241,9 @@ double geom_shape3d_simplex_overlap_stratified(const geom_shape3d *s, const doub
 double geom_shape2d_simplex_overlap_stratified(const geom_shape2d *s, const double torg[2], const double t[6], unsigned int n);
 
 // Computes the exact overlapping area between a shape and the given
-// simplex. The returned value is the actual area of overlap.
+// simplex, the triangle with vertices torg + t[0..1], torg + t[2..3] and
+// torg + t[4..5] in either orientation. The returned value is the actual
+// area of overlap.
 double geom_shape2d_simplex_overlap_exact(const geom_shape2d *s, const double torg[2], const double t[6]);
 
 /*
@@ -1,7 +1,9 @@
 #include <Cgeom/geom_shapeset.h>
 #include <Cgeom/geom_bvh.h>
+#include <Cgeom/geom_la.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 
 #define geom_shapeset2d_threshold 32
 #define geom_shapeset3d_threshold 32
@@ -15,12 +17,41 @@
 # define SSDBG(...)
 #endif
 
+// Each query zeroes stats->last, which the BVH also counts into, and adds
+// it to stats->total when done. Without a stats record, the counts of the
+// shapeset itself go to a scratch record.
+static geom_query_counts *stats_begin(geom_shapeset_stats *stats, geom_query_counts *scratch){
+	geom_query_counts *c = (NULL != stats) ? &stats->last : scratch;
+	memset(c, 0, sizeof(geom_query_counts));
+	return c;
+}
+static void stats_end_queries(geom_shapeset_stats *stats, unsigned long n){
+	if(NULL == stats){ return; }
+	stats->last.queries = n;
+	stats->total.queries += n;
+	stats->total.nodes += stats->last.nodes;
+	stats->total.leaves += stats->last.leaves;
+	stats->total.contains += stats->last.contains;
+	stats->total.hits += stats->last.hits;
+}
+static void stats_end(geom_shapeset_stats *stats){
+	stats_end_queries(stats, 1);
+}
+
 typedef struct geom_shape2d_info_struct{
 	geom_shape2d *s;
 	geom_aabb2d box;
 	unsigned int flags;
+	unsigned int cell_first, cell_len; // its run of cell_img slots
 } geom_shape2d_info;
 
+// A lattice translate of a shape: it contains p if the shape contains
+// p + off
+typedef struct{
+	int index;
+	double off[2];
+} geom_shape2d_image;
+
 struct geom_shapeset2d_struct{
 	unsigned int n;
 	unsigned int n_alloc;
@@ -28,11 +59,37 @@ struct geom_shapeset2d_struct{
 	
 	geom_bvh2d bvh; // may not be used
 	int use_bvh;
+	int bvh_method; // GEOM_SHAPESET_BUILD_*
 	
 	int periodic;
 	double lattice[4];
+	
+	// Periodic point lookup, built by finalize and kept up to date by add
+	// and update: a tree of the lattice translates of the bounded shapes
+	// that reach into the unit cell, and the unbounded shapes at the
+	// neighboring translates.
+	int cell_built;
+	int cell_dynamic; // cell_bvh has been converted for editing
+	int cell_ordered; // cell_img is by increasing index
+	double lattice_inv[4];
+	geom_bvh2d cell_bvh; // NULL if there are no bounded shapes
+	unsigned int ncell_img, ncell_fix, ncell_img_alloc, ncell_fix_alloc;
+	geom_shape2d_image *cell_img; // the tree tags; free slots have index -1
+	geom_shape2d_image *cell_fix; // by decreasing index
+	
+	geom_shapeset_stats *stats; // may be NULL
 };
 
+static void shapeset2d_cell_reset(geom_shapeset2d ss){
+	ss->cell_built = 0;
+	ss->cell_dynamic = 0;
+	ss->cell_ordered = 1;
+	ss->ncell_img = 0;
+	ss->ncell_fix = 0;
+	ss->ncell_img_alloc = 0;
+	ss->ncell_fix_alloc = 0;
+}
+
 geom_shapeset2d geom_shapeset2d_new(){
 	geom_shapeset2d ss = (geom_shapeset2d)malloc(sizeof(struct geom_shapeset2d_struct));
 	ss->n = 0;
@@ -40,15 +97,216 @@ geom_shapeset2d geom_shapeset2d_new(){
 	ss->info = NULL;
 	ss->bvh = NULL;
 	ss->use_bvh = 0;
+	ss->bvh_method = GEOM_SHAPESET_BUILD_STR;
 	ss->periodic = 0;
+	ss->cell_img = NULL;
+	ss->cell_fix = NULL;
+	ss->cell_bvh = NULL;
+	shapeset2d_cell_reset(ss);
+	ss->stats = NULL;
 	return ss;
 }
 
+static void shapeset2d_cell_destroy(geom_shapeset2d ss){
+	geom_bvh2d_destroy(ss->cell_bvh);
+	free(ss->cell_img);
+	free(ss->cell_fix);
+	ss->cell_img = NULL;
+	ss->cell_fix = NULL;
+	ss->cell_bvh = NULL;
+	shapeset2d_cell_reset(ss);
+}
+
+// The cells a box overlaps, from the fractional coordinates of its
+// corners. A box within rounding of a cell boundary counts as crossing it.
+#define SHAPESET_CELL_EPS 1e-9
+static void shapeset2d_cell_range(const double Linv[4], const geom_aabb2d *box, int lo[2], int hi[2]){
+	double fmin[2] = { HUGE_VAL, HUGE_VAL }, fmax[2] = { -HUGE_VAL, -HUGE_VAL };
+	int k, d;
+	for(k = 0; k < 4; ++k){
+		const double x[2] = {
+			box->c[0] + ((k & 1) ? box->h[0] : -box->h[0]),
+			box->c[1] + ((k & 2) ? box->h[1] : -box->h[1])
+		};
+		double f[2];
+		geom_matvec2d(Linv, x, f);
+		for(d = 0; d < 2; ++d){
+			if(f[d] < fmin[d]){ fmin[d] = f[d]; }
+			if(f[d] > fmax[d]){ fmax[d] = f[d]; }
+		}
+	}
+	for(d = 0; d < 2; ++d){
+		lo[d] = (int)floor(fmin[d] - SHAPESET_CELL_EPS);
+		hi[d] = (int)floor(fmax[d] + SHAPESET_CELL_EPS);
+	}
+}
+// Sets im to the image of shape index seen from cell (i,j)
+static void shapeset2d_image_set(geom_shape2d_image *im, const double lattice[4], int index, int i, int j){
+	im->index = index;
+	im->off[0] = (double)i * lattice[0] + (double)j * lattice[2];
+	im->off[1] = (double)i * lattice[1] + (double)j * lattice[3];
+}
+// Appends the image of shape index seen from cell (i,j)
+static void shapeset2d_image_push(
+	geom_shape2d_image **list, unsigned int *n, unsigned int *n_alloc,
+	const double lattice[4], int index, int i, int j
+){
+	if(*n >= *n_alloc){
+		*n_alloc = 2*(*n_alloc) + 16;
+		*list = (geom_shape2d_image*)realloc(*list, sizeof(geom_shape2d_image) * (*n_alloc));
+	}
+	shapeset2d_image_set(&(*list)[(*n)++], lattice, index, i, j);
+}
+struct cell2d_iter_data{
+	unsigned int index;
+	geom_shapeset2d ss;
+};
+static int cell2d_iter(double c[2], double h[2], int *tag, void *data){
+	struct cell2d_iter_data *d = (struct cell2d_iter_data*)data;
+	const geom_shape2d_image *im = &d->ss->cell_img[d->index];
+	const geom_aabb2d *box = &d->ss->info[im->index].box;
+	*tag = d->index;
+	c[0] = box->c[0] - im->off[0];
+	c[1] = box->c[1] - im->off[1];
+	h[0] = box->h[0];
+	h[1] = box->h[1];
+	d->index++;
+	return 1;
+}
+// A bounded shape gets an image in the tree for each cell its box
+// overlaps. Unbounded shapes have no box, so as in the unindexed query
+// they are tried at the neighboring translates of the point.
+static void shapeset2d_cell_build(geom_shapeset2d ss){
+	const double det = ss->lattice[0]*ss->lattice[3] - ss->lattice[1]*ss->lattice[2];
+	int i, u, v;
+	shapeset2d_cell_destroy(ss);
+	if(!ss->periodic || 0 == det){ return; }
+	memcpy(ss->lattice_inv, ss->lattice, sizeof(double) * 4);
+	geom_matinv2d(ss->lattice_inv);
+	for(i = 0; i < (int)ss->n; ++i){
+		int lo[2], hi[2];
+		ss->info[i].cell_first = ss->ncell_img;
+		ss->info[i].cell_len = 0;
+		if(GEOM_SHAPESET2D_FLAG_UNBOUNDED & ss->info[i].flags){ continue; }
+		shapeset2d_cell_range(ss->lattice_inv, &ss->info[i].box, lo, hi);
+		for(u = lo[0]; u <= hi[0]; ++u){
+			for(v = lo[1]; v <= hi[1]; ++v){
+				shapeset2d_image_push(&ss->cell_img, &ss->ncell_img, &ss->ncell_img_alloc, ss->lattice, i, u, v);
+			}
+		}
+		ss->info[i].cell_len = ss->ncell_img - ss->info[i].cell_first;
+	}
+	for(i = (int)ss->n-1; i >= 0; --i){
+		if(!(GEOM_SHAPESET2D_FLAG_UNBOUNDED & ss->info[i].flags)){ continue; }
+		for(u = -1; u <= 1; ++u){
+			for(v = -1; v <= 1; ++v){
+				shapeset2d_image_push(&ss->cell_fix, &ss->ncell_fix, &ss->ncell_fix_alloc, ss->lattice, i, u, v);
+			}
+		}
+	}
+	if(ss->ncell_img > 0){
+		struct cell2d_iter_data d;
+		d.index = 0;
+		d.ss = ss;
+		ss->cell_bvh = geom_bvh2d_new(ss->ncell_img, &cell2d_iter, (void*)&d);
+		if(NULL != ss->stats){
+			geom_bvh2d_set_counts(ss->cell_bvh, &ss->stats->last);
+		}
+	}
+	ss->cell_built = 1;
+}
+
+// Edits to a finalized set keep the periodic lookup up to date. The
+// first converts the cell tree to a dynamic one. The images of a shape
+// fill a run of cell_img slots, which is rewritten in place if it is long
+// enough, or else replaced by a new run at the end, leaving the old one
+// free. A new run for any shape but the last puts the tags out of shape
+// order, so lookups stop relying on it until the next finalize rebuilds
+// the tree.
+static void shapeset2d_cell_edit(geom_shapeset2d ss){
+	unsigned int k;
+	if(ss->cell_dynamic){ return; }
+	geom_bvh2d_destroy(ss->cell_bvh);
+	ss->cell_bvh = geom_bvh2d_new_dynamic();
+	for(k = 0; k < ss->ncell_img; ++k){
+		const geom_shape2d_image *im = &ss->cell_img[k];
+		const geom_aabb2d *box;
+		double c[2];
+		if(im->index < 0){ continue; }
+		box = &ss->info[im->index].box;
+		c[0] = box->c[0] - im->off[0];
+		c[1] = box->c[1] - im->off[1];
+		geom_bvh2d_insert(ss->cell_bvh, k, c, box->h);
+	}
+	if(NULL != ss->stats){
+		geom_bvh2d_set_counts(ss->cell_bvh, &ss->stats->last);
+	}
+	ss->cell_dynamic = 1;
+}
+static void shapeset2d_cell_remove(geom_shapeset2d ss, int index){
+	const geom_shape2d_info *info = &ss->info[index];
+	unsigned int k, m;
+	for(k = info->cell_first; k < info->cell_first + info->cell_len; ++k){
+		if(ss->cell_img[k].index < 0){ continue; }
+		geom_bvh2d_remove(ss->cell_bvh, k);
+		ss->cell_img[k].index = -1;
+	}
+	for(k = 0, m = 0; k < ss->ncell_fix; ++k){
+		if(ss->cell_fix[k].index != index){ ss->cell_fix[m++] = ss->cell_fix[k]; }
+	}
+	ss->ncell_fix = m;
+}
+static void shapeset2d_cell_insert(geom_shapeset2d ss, int index){
+	geom_shape2d_info *info = &ss->info[index];
+	int lo[2], hi[2], u, v;
+	unsigned int k, n;
+	if(GEOM_SHAPESET2D_FLAG_UNBOUNDED & info->flags){
+		// Append the 9 translates, then move them up to their place
+		geom_shape2d_image tmp[9];
+		const unsigned int end = ss->ncell_fix;
+		unsigned int pos = 0;
+		while(pos < end && ss->cell_fix[pos].index > index){ ++pos; }
+		for(u = -1; u <= 1; ++u){
+			for(v = -1; v <= 1; ++v){
+				shapeset2d_image_push(&ss->cell_fix, &ss->ncell_fix, &ss->ncell_fix_alloc, ss->lattice, index, u, v);
+			}
+		}
+		memcpy(tmp, &ss->cell_fix[end], sizeof(tmp));
+		memmove(&ss->cell_fix[pos+9], &ss->cell_fix[pos], sizeof(geom_shape2d_image) * (end - pos));
+		memcpy(&ss->cell_fix[pos], tmp, sizeof(tmp));
+		return;
+	}
+	shapeset2d_cell_range(ss->lattice_inv, &info->box, lo, hi);
+	n = (unsigned int)(hi[0]-lo[0]+1) * (unsigned int)(hi[1]-lo[1]+1);
+	if(n > info->cell_len){
+		if(index+1 != (int)ss->n){ ss->cell_ordered = 0; }
+		info->cell_first = ss->ncell_img;
+		info->cell_len = n;
+	}
+	k = info->cell_first;
+	for(u = lo[0]; u <= hi[0]; ++u){
+		for(v = lo[1]; v <= hi[1]; ++v){
+			if(k == ss->ncell_img){
+				shapeset2d_image_push(&ss->cell_img, &ss->ncell_img, &ss->ncell_img_alloc, ss->lattice, index, u, v);
+				++k;
+			}else{
+				shapeset2d_image_set(&ss->cell_img[k++], ss->lattice, index, u, v);
+			}
+		}
+	}
+	for(k = info->cell_first; k < info->cell_first + n; ++k){
+		const double *off = ss->cell_img[k].off;
+		const double c[2] = { info->box.c[0] - off[0], info->box.c[1] - off[1] };
+		geom_bvh2d_insert(ss->cell_bvh, k, c, info->box.h);
+	}
+}
+
 void geom_shapeset2d_destroy(geom_shapeset2d ss){
 	if(NULL == ss){ return; }
 	if(ss->use_bvh){
 		geom_bvh2d_destroy(ss->bvh);
 	}
+	shapeset2d_cell_destroy(ss);
 	free(ss->info);
 	free(ss);
 }
@@ -64,6 +322,10 @@ int geom_shapeset2d_set_lattice(geom_shapeset2d ss, const double lattice[4]){
 		ss->lattice[2] = lattice[2];
 		ss->lattice[3] = lattice[3];
 	}
+	// A finalized set is reindexed for the new cell
+	if(ss->use_bvh){
+		shapeset2d_cell_build(ss);
+	}
 	return 0;
 }
 
@@ -100,22 +362,93 @@ int geom_shapeset2d_add(geom_shapeset2d ss, geom_shape2d *s){
 	ss->info[i].s = s;
 	ss->info[i].flags = 0;
 	ss->info[i].flags |= geom_shape2d_get_aabb(s, &(ss->info[i].box)) ? GEOM_SHAPESET2D_FLAG_UNBOUNDED : 0;
+	ss->info[i].cell_first = 0;
+	ss->info[i].cell_len = 0;
 	ss->n++;
 	
+	// A finalized set keeps its trees: a dynamic one takes the new shape,
+	// and a static one is first converted, which rebuilds the periodic
+	// lookup along with it.
+	if(ss->use_bvh && GEOM_SHAPESET_BUILD_DYNAMIC != ss->bvh_method){
+		geom_shapeset2d_finalize_method(ss, GEOM_SHAPESET_BUILD_DYNAMIC);
+		return i;
+	}
 	if(ss->use_bvh){
-		ss->use_bvh = 0;
-		geom_bvh2d_destroy(ss->bvh);
+		geom_bvh2d_insert(ss->bvh, i, ss->info[i].box.c, ss->info[i].box.h);
+	}
+	if(ss->cell_built){
+		shapeset2d_cell_edit(ss);
+		shapeset2d_cell_insert(ss, i);
 	}
 	return i;
 }
 
+int geom_shapeset2d_update(geom_shapeset2d ss, int index){
+	geom_shape2d_info *info;
+	if(NULL == ss){ return -1; }
+	if(index < 0 || index >= (int)ss->n){ return -2; }
+	info = &ss->info[index];
+	info->flags = geom_shape2d_get_aabb(info->s, &(info->box)) ? GEOM_SHAPESET2D_FLAG_UNBOUNDED : 0;
+	if(ss->use_bvh && GEOM_SHAPESET_BUILD_DYNAMIC != ss->bvh_method){
+		geom_shapeset2d_finalize_method(ss, GEOM_SHAPESET_BUILD_DYNAMIC);
+		return 0;
+	}
+	if(ss->use_bvh){
+		geom_bvh2d_update(ss->bvh, index, info->box.c, info->box.h);
+	}
+	if(ss->cell_built){
+		shapeset2d_cell_edit(ss);
+		shapeset2d_cell_remove(ss, index);
+		shapeset2d_cell_insert(ss, index);
+	}
+	return 0;
+}
+
 void geom_shapeset2d_finalize(geom_shapeset2d ss){
-	if(NULL == ss || ss->use_bvh){ return; }
-	struct shape2d_iter_data d;
-	d.index = 0;
-	d.info = ss->info;
-	ss->bvh = geom_bvh2d_new(ss->n, &shape2d_iter, (void*)&d);
+	geom_shapeset2d_finalize_method(ss, GEOM_SHAPESET_BUILD_STR);
+}
+void geom_shapeset2d_finalize_method(geom_shapeset2d ss, int method){
+	if(NULL == ss){ return; }
+	if(ss->use_bvh){
+		if(method == ss->bvh_method){
+			if(!ss->cell_built || ss->cell_dynamic){ shapeset2d_cell_build(ss); }
+			return;
+		}
+		ss->use_bvh = 0;
+		geom_bvh2d_destroy(ss->bvh);
+	}
+	if(GEOM_SHAPESET_BUILD_DYNAMIC == method){
+		unsigned int i;
+		ss->bvh = geom_bvh2d_new_dynamic();
+		for(i = 0; i < ss->n; ++i){
+			geom_bvh2d_insert(ss->bvh, i, ss->info[i].box.c, ss->info[i].box.h);
+		}
+	}else{
+		struct shape2d_iter_data d;
+		d.index = 0;
+		d.info = ss->info;
+		ss->bvh = geom_bvh2d_new_method(ss->n, &shape2d_iter, (void*)&d,
+			(GEOM_SHAPESET_BUILD_MORTON == method) ? GEOM_BVH_MORTON : GEOM_BVH_STR
+		);
+	}
 	ss->use_bvh = (NULL != ss->bvh);
+	ss->bvh_method = method;
+	if(NULL != ss->stats){
+		geom_bvh2d_set_counts(ss->bvh, &ss->stats->last);
+	}
+	shapeset2d_cell_build(ss);
+}
+
+void geom_shapeset2d_set_stats(geom_shapeset2d ss, geom_shapeset_stats *stats){
+	if(NULL == ss){ return; }
+	ss->stats = stats;
+	if(NULL != stats){
+		memset(stats, 0, sizeof(geom_shapeset_stats));
+	}
+	if(ss->use_bvh){
+		geom_bvh2d_set_counts(ss->bvh, (NULL != stats) ? &stats->last : NULL);
+	}
+	geom_bvh2d_set_counts(ss->cell_bvh, (NULL != stats) ? &stats->last : NULL);
 }
 
 unsigned int geom_shapeset2d_size(geom_shapeset2d ss){
@@ -138,18 +471,71 @@ int geom_shapeset2d_index_aabb(geom_shapeset2d ss, int index, geom_aabb2d *box){
 
 struct query_pt2d_data{
 	geom_shape2d_info *info;
+	const geom_shape2d_image *img;
 	double pc[2];
 	int ibest;
+	geom_query_counts *counts;
 };
+// Accepts the shapes that contain the point, for query_pt_max
 static int query_pt2d(int tag, const double c[2], const double h[2], void *data){
 	struct query_pt2d_data *d = (struct query_pt2d_data*)data;
-	if(tag > d->ibest){
-		if(geom_shape2d_contains(d->info[tag].s, d->pc)){	
-			d->ibest = tag;
-		}
+	d->counts->contains++;
+	if(geom_shape2d_contains(d->info[tag].s, d->pc)){
+		d->counts->hits++;
+		return 1;
 	}
+	return 0;
+}
+// Tags of the cell tree are images, normally in the same order as their
+// shapes
+static int query_cell2d(int tag, const double c[2], const double h[2], void *data){
+	struct query_pt2d_data *d = (struct query_pt2d_data*)data;
+	const geom_shape2d_image *im = &d->img[tag];
+	const double x[2] = {
+		d->pc[0] + im->off[0],
+		d->pc[1] + im->off[1]
+	};
+	d->counts->contains++;
+	if(geom_shape2d_contains(d->info[im->index].s, x)){
+		d->counts->hits++;
+		return 1;
+	}
+	return 0;
+}
+// Without ordered tags, every image at the point is tried
+static int query_cell2d_any(int tag, const double c[2], const double h[2], void *data){
+	struct query_pt2d_data *d = (struct query_pt2d_data*)data;
+	const int index = d->img[tag].index;
+	if(index > d->ibest && query_cell2d(tag, c, h, data)){ d->ibest = index; }
 	return 1;
 }
+static void shapeset2d_query_cell(geom_shapeset2d ss, const double p[2], struct query_pt2d_data *d){
+	unsigned int j;
+	double f[2];
+	geom_matvec2d(ss->lattice_inv, p, f);
+	f[0] = floor(f[0]);
+	f[1] = floor(f[1]);
+	d->img = ss->cell_img;
+	d->pc[0] = p[0] - f[0] * ss->lattice[0] - f[1] * ss->lattice[2];
+	d->pc[1] = p[1] - f[0] * ss->lattice[1] - f[1] * ss->lattice[3];
+	if(NULL != ss->cell_bvh && ss->cell_ordered){
+		const int best = geom_bvh2d_query_pt_max(ss->cell_bvh, d->pc, -1, &query_cell2d, d);
+		if(best >= 0){ d->ibest = ss->cell_img[best].index; }
+	}else if(NULL != ss->cell_bvh){
+		geom_bvh2d_query_pt(ss->cell_bvh, d->pc, &query_cell2d_any, d);
+	}
+	for(j = 0; j < ss->ncell_fix; ++j){
+		const geom_shape2d_image *im = &ss->cell_fix[j];
+		const double x[2] = { d->pc[0] + im->off[0], d->pc[1] + im->off[1] };
+		if(im->index <= d->ibest){ break; } // the rest are no better
+		d->counts->leaves++;
+		d->counts->contains++;
+		if(geom_shape2d_contains(ss->info[im->index].s, x)){
+			d->counts->hits++;
+			d->ibest = im->index;
+		}
+	}
+}
 
 int geom_shapeset2d_query_pt(geom_shapeset2d ss, const double p[2]){
 	unsigned int c, clim = 1;
@@ -170,9 +556,15 @@ int geom_shapeset2d_query_pt(geom_shapeset2d ss, const double p[2]){
 	if(ss->periodic){
 		clim = 9;
 	}
+	geom_query_counts scratch;
 	struct query_pt2d_data d;
 	d.info = ss->info;
 	d.ibest = -1;
+	d.counts = stats_begin(ss->stats, &scratch);
+	if(ss->cell_built){
+		shapeset2d_query_cell(ss, p, &d);
+		clim = 0;
+	}
 	for(c = 0; c < clim; ++c){
 		d.pc[0] = p[0];
 		d.pc[1] = p[1];
@@ -185,18 +577,23 @@ int geom_shapeset2d_query_pt(geom_shapeset2d ss, const double p[2]){
 			d.pc[1] += (double)off[2*c+1] * ss->lattice[3];
 		}
 		if(ss->use_bvh){
-			geom_bvh2d_query_pt(ss->bvh, d.pc, &query_pt2d, &d);
+			d.ibest = geom_bvh2d_query_pt_max(ss->bvh, d.pc, d.ibest, &query_pt2d, &d);
 		}else{
 			int i;
 			for(i = 0; i < ss->n; ++i){
 				if(i <= d.ibest){ continue; } // skip anything less the current best
+				d.counts->leaves++;
 				if(GEOM_SHAPESET2D_FLAG_UNBOUNDED & ss->info[i].flags){
+					d.counts->contains++;
 					if(geom_shape2d_contains(ss->info[i].s, d.pc)){
+						d.counts->hits++;
 						d.ibest = i;
 					}
 				}else{
 					if(geom_aabb2d_contains(&(ss->info[i].box), d.pc)){
+						d.counts->contains++;
 						if(geom_shape2d_contains(ss->info[i].s, d.pc)){
+							d.counts->hits++;
 							d.ibest = i;
 						}
 					}
@@ -204,8 +601,726 @@ int geom_shapeset2d_query_pt(geom_shapeset2d ss, const double p[2]){
 			}
 		}
 	}
+	stats_end(ss->stats);
 	return d.ibest;
 }
+// Inserts shape i at distance d into the sorted list of the (up to) k
+// nearest, keeping only the smaller distance if i is already listed.
+static void nearest2d_insert(unsigned int k, unsigned int *n, int index[], double dist[], int i, double d){
+	unsigned int j;
+	for(j = 0; j < *n; ++j){
+		if(index[j] == i){ break; }
+	}
+	if(j < *n){
+		if(dist[j] <= d){ return; }
+		// remove the old entry
+		for(; j+1 < *n; ++j){
+			index[j] = index[j+1];
+			dist[j] = dist[j+1];
+		}
+		--*n;
+	}
+	if(*n == k){
+		if(dist[k-1] <= d){ return; }
+		--*n;
+	}
+	for(j = *n; j > 0 && dist[j-1] > d; --j){
+		index[j] = index[j-1];
+		dist[j] = dist[j-1];
+	}
+	index[j] = i;
+	dist[j] = d;
+	++*n;
+}
+static double nearest2d_dist(int tag, const double p[2], void *data){
+	const geom_shape2d_info *info = (const geom_shape2d_info*)data;
+	return geom_shape2d_distance(info[tag].s, p);
+}
+static unsigned int geom_shapeset2d_query_nearest_run(
+	geom_shapeset2d ss, const double p[2], unsigned int k,
+	int index[], double dist[], geom_query_counts *counts
+){
+	unsigned int c, clim = 1, n = 0;
+	static const int off[] = {
+		 0,  0,
+		 1,  0,
+		-1,  0,
+		 0,  1,
+		 0, -1,
+		 1,  1,
+		 1, -1,
+		-1,  1,
+		-1, -1
+	};
+	if(ss->periodic){
+		clim = 9;
+	}
+	for(c = 0; c < clim; ++c){
+		const double pc[2] = {
+			p[0] + (double)off[2*c+0] * ss->lattice[0] + (double)off[2*c+1] * ss->lattice[2],
+			p[1] + (double)off[2*c+0] * ss->lattice[1] + (double)off[2*c+1] * ss->lattice[3]
+		};
+		if(ss->use_bvh){
+			if(1 == clim){
+				n = geom_bvh2d_query_knn(ss->bvh, pc, k, &nearest2d_dist, ss->info, index, dist);
+			}else{
+				// The k nearest over all images are among the k nearest
+				// of each image.
+				int *ci = (int*)malloc(sizeof(int) * k);
+				double *cd = (double*)malloc(sizeof(double) * k);
+				const unsigned int m = geom_bvh2d_query_knn(ss->bvh, pc, k, &nearest2d_dist, ss->info, ci, cd);
+				unsigned int j;
+				for(j = 0; j < m; ++j){
+					nearest2d_insert(k, &n, index, dist, ci[j], cd[j]);
+				}
+				free(ci);
+				free(cd);
+			}
+		}else{
+			int i;
+			counts->leaves += ss->n;
+			for(i = 0; i < ss->n; ++i){
+				nearest2d_insert(k, &n, index, dist, i, geom_shape2d_distance(ss->info[i].s, pc));
+			}
+		}
+	}
+	return n;
+}
+
+int geom_shapeset2d_query_nearest(
+	geom_shapeset2d ss, const double p[2], unsigned int k,
+	int index[], double dist[]
+){
+	geom_query_counts scratch;
+	unsigned int n;
+	if(NULL == ss){ return -1; }
+	if(NULL == p){ return -2; }
+	if(NULL == index || NULL == dist){ return -3; }
+	if(0 == k){ return 0; }
+	n = geom_shapeset2d_query_nearest_run(ss, p, k, index, dist, stats_begin(ss->stats, &scratch));
+	stats_end(ss->stats);
+	return n;
+}
+
+struct query_ray2d_data{
+	geom_shape2d_info *info;
+	int (*func)(int index, geom_shape2d *s, double t, double *tmax, void *data);
+	void *data;
+};
+static int query_ray2d(int tag, const double c[2], const double h[2], double t, double *tmax, void *data){
+	struct query_ray2d_data *d = (struct query_ray2d_data*)data;
+	return d->func(tag, d->info[tag].s, t, tmax, d->data);
+}
+// Without a BVH, every bounded shape gets the same slab test the tree
+// uses for its leaves.
+static int aabb2d_ray(const geom_aabb2d *box, const double p[2], const double v[2], double tmax, double *t){
+	double t0 = 0, t1 = tmax;
+	int d;
+	for(d = 0; d < 2; ++d){
+		const double inv = 1. / v[d];
+		const double s = (inv < 0) ? -1 : 1;
+		const double tn = (box->c[d] - s*box->h[d] - p[d]) * inv;
+		const double tf = (box->c[d] + s*box->h[d] - p[d]) * inv;
+		if(tn > t0){ t0 = tn; }
+		if(tf < t1){ t1 = tf; }
+	}
+	*t = t0;
+	return t0 <= t1;
+}
+static int geom_shapeset2d_query_ray_range(
+	geom_shapeset2d ss, const double p[2], const double v[2], int segment,
+	int (*func)(int index, geom_shape2d *s, double t, double *tmax, void *data),
+	void *data, geom_query_counts *counts
+){
+	if(ss->use_bvh){
+		struct query_ray2d_data d;
+		d.info = ss->info;
+		d.func = func;
+		d.data = data;
+		if(segment){
+			const double b[2] = { p[0]+v[0], p[1]+v[1] };
+			return !geom_bvh2d_query_segment(ss->bvh, p, b, &query_ray2d, &d);
+		}
+		return !geom_bvh2d_query_ray(ss->bvh, p, v, &query_ray2d, &d);
+	}else{
+		double tmax = segment ? 1 : HUGE_VAL;
+		int i;
+		for(i = 0; i < ss->n; ++i){
+			double t = 0;
+			counts->leaves++;
+			if(!(GEOM_SHAPESET2D_FLAG_UNBOUNDED & ss->info[i].flags)){
+				if(!aabb2d_ray(&(ss->info[i].box), p, v, tmax, &t)){ continue; }
+			}
+			if(0 == func(i, ss->info[i].s, t, &tmax, data)){ return 1; }
+		}
+	}
+	return 0;
+}
+int geom_shapeset2d_query_ray(
+	geom_shapeset2d ss, const double p[2], const double v[2],
+	int (*func)(int index, geom_shape2d *s, double t, double *tmax, void *data),
+	void *data
+){
+	geom_query_counts scratch;
+	int ret;
+	if(NULL == ss){ return -1; }
+	if(NULL == p || NULL == v){ return -2; }
+	if(NULL == func){ return -3; }
+	ret = geom_shapeset2d_query_ray_range(ss, p, v, 0, func, data, stats_begin(ss->stats, &scratch));
+	stats_end(ss->stats);
+	return ret;
+}
+int geom_shapeset2d_query_segment(
+	geom_shapeset2d ss, const double a[2], const double b[2],
+	int (*func)(int index, geom_shape2d *s, double t, double *tmax, void *data),
+	void *data
+){
+	geom_query_counts scratch;
+	double v[2];
+	int ret;
+	if(NULL == ss){ return -1; }
+	if(NULL == a || NULL == b){ return -2; }
+	if(NULL == func){ return -3; }
+	v[0] = b[0] - a[0];
+	v[1] = b[1] - a[1];
+	ret = geom_shapeset2d_query_ray_range(ss, a, v, 1, func, data, stats_begin(ss->stats, &scratch));
+	stats_end(ss->stats);
+	return ret;
+}
+
+// Rasterization. The grid is cut into square tiles, and each tile gathers
+// its candidates once: the shapes (or, for periodic sets, the lattice
+// images of shapes) whose boxes overlap the bounding box of its pixel
+// centers, as images (index, off) meaning that the shape is tested at
+// p + off. With many candidates the tile is split in four, each quarter
+// keeping those that overlap it, so pixels only scan short lists. The
+// candidates are kept by decreasing index, and the first that contains
+// the pixel center wins, as in query_pt.
+#define SHAPESET2D_RASTER_TILE 32
+#define SHAPESET2D_RASTER_SPLIT 16
+#define SHAPESET2D_FILL_SAMPLES 16
+typedef struct{
+	geom_shapeset2d ss;
+	double org[2], du[2], dv[2];
+	unsigned int nx, ny;
+	int *index;
+} raster2d;
+// Per-thread candidate stack. The list of a tile is followed by those of
+// its quarters, one at a time.
+typedef struct{
+	unsigned int n, n_alloc;
+	geom_shape2d_image *img;
+	geom_query_counts counts;
+} raster2d_scratch;
+static void raster2d_push(raster2d_scratch *S, int index, double offx, double offy){
+	geom_shape2d_image *im;
+	if(S->n >= S->n_alloc){
+		S->n_alloc = 2*S->n_alloc + 64;
+		S->img = (geom_shape2d_image*)realloc(S->img, sizeof(geom_shape2d_image) * S->n_alloc);
+	}
+	im = &S->img[S->n++];
+	im->index = index;
+	im->off[0] = offx;
+	im->off[1] = offy;
+}
+static int raster2d_cmp(const void *a, const void *b){
+	const int ia = ((const geom_shape2d_image*)a)->index;
+	const int ib = ((const geom_shape2d_image*)b)->index;
+	return (ia < ib) - (ia > ib);
+}
+// Box of the pixels in [i0,i1) x [j0,j1), shrunk by inset steps on each
+// side: 0.5 bounds their centers, 0 the whole pixels
+static void raster2d_box(const double org[2], const double du[2], const double dv[2], unsigned int i0, unsigned int i1, unsigned int j0, unsigned int j1, double inset, geom_aabb2d *box){
+	const double a[2] = { i0 + inset, i1 - inset }, b[2] = { j0 + inset, j1 - inset };
+	double lo[2], hi[2];
+	int d;
+	for(d = 0; d < 2; ++d){
+		const double ua = a[0]*du[d], ub = a[1]*du[d];
+		const double va = b[0]*dv[d], vb = b[1]*dv[d];
+		lo[d] = org[d] + ((ua < ub) ? ua : ub) + ((va < vb) ? va : vb);
+		hi[d] = org[d] + ((ua < ub) ? ub : ua) + ((va < vb) ? vb : va);
+		box->c[d] = 0.5*lo[d] + 0.5*hi[d];
+		box->h[d] = 0.5*hi[d] - 0.5*lo[d];
+	}
+}
+static int aabb2d_overlap(const geom_aabb2d *a, const double c[2], const double h[2]){
+	return fabs(a->c[0] - c[0]) <= a->h[0] + h[0] && fabs(a->c[1] - c[1]) <= a->h[1] + h[1];
+}
+
+struct raster2d_collect_data{
+	raster2d_scratch *S;
+	const geom_shape2d_image *img; // NULL for the main tree
+	double off[2];
+};
+static int raster2d_collect(int tag, const double c[2], const double h[2], void *data){
+	struct raster2d_collect_data *d = (struct raster2d_collect_data*)data;
+	if(NULL == d->img){
+		raster2d_push(d->S, tag, d->off[0], d->off[1]);
+	}else{
+		const geom_shape2d_image *im = &d->img[tag];
+		raster2d_push(d->S, im->index, im->off[0] + d->off[0], im->off[1] + d->off[1]);
+	}
+	return 1;
+}
+// Gathers the candidates of the tile with box B, translated by off
+static void raster2d_collect_at(const geom_shapeset2d ss, raster2d_scratch *S, const geom_aabb2d *B, const double off[2]){
+	const double c[2] = { B->c[0] + off[0], B->c[1] + off[1] };
+	if(ss->use_bvh){
+		struct raster2d_collect_data d;
+		d.S = S;
+		d.img = NULL;
+		d.off[0] = off[0];
+		d.off[1] = off[1];
+		geom_bvh2d_query_box_counts(ss->bvh, c, B->h, &raster2d_collect, &d, &S->counts);
+	}else{
+		int i;
+		for(i = 0; i < ss->n; ++i){
+			if(!(GEOM_SHAPESET2D_FLAG_UNBOUNDED & ss->info[i].flags) && !aabb2d_overlap(&ss->info[i].box, c, B->h)){ continue; }
+			S->counts.leaves++;
+			raster2d_push(S, i, off[0], off[1]);
+		}
+	}
+}
+static void raster2d_gather(const geom_shapeset2d ss, raster2d_scratch *S, const geom_aabb2d *B){
+	int u, v;
+	if(ss->cell_built){
+		// An image in the cell tree seen from cell (u,v) is tested at
+		// p - (u,v).L + off, a lattice translate of p.
+		int lo[2], hi[2];
+		struct raster2d_collect_data d;
+		if(NULL == ss->cell_bvh){ return; }
+		shapeset2d_cell_range(ss->lattice_inv, B, lo, hi);
+		d.S = S;
+		d.img = ss->cell_img;
+		for(u = lo[0]; u <= hi[0]; ++u){
+			for(v = lo[1]; v <= hi[1]; ++v){
+				double c[2];
+				d.off[0] = -(double)u * ss->lattice[0] - (double)v * ss->lattice[2];
+				d.off[1] = -(double)u * ss->lattice[1] - (double)v * ss->lattice[3];
+				c[0] = B->c[0] + d.off[0];
+				c[1] = B->c[1] + d.off[1];
+				geom_bvh2d_query_box_counts(ss->cell_bvh, c, B->h, &raster2d_collect, &d, &S->counts);
+			}
+		}
+	}else if(ss->periodic){
+		for(u = -1; u <= 1; ++u){
+			for(v = -1; v <= 1; ++v){
+				const double off[2] = {
+					(double)u * ss->lattice[0] + (double)v * ss->lattice[2],
+					(double)u * ss->lattice[1] + (double)v * ss->lattice[3]
+				};
+				raster2d_collect_at(ss, S, B, off);
+			}
+		}
+	}else{
+		const double off[2] = { 0, 0 };
+		raster2d_collect_at(ss, S, B, off);
+	}
+}
+static int raster2d_pixel(const raster2d *R, raster2d_scratch *S, unsigned int beg, const double p[2]){
+	const geom_shapeset2d ss = R->ss;
+	int best = -1;
+	unsigned int k;
+	for(k = beg; k < S->n; ++k){
+		const geom_shape2d_image *im = &S->img[k];
+		const geom_shape2d_info *info = &ss->info[im->index];
+		const double x[2] = { p[0] + im->off[0], p[1] + im->off[1] };
+		if(!(GEOM_SHAPESET2D_FLAG_UNBOUNDED & info->flags) && !geom_aabb2d_contains(&info->box, x)){ continue; }
+		S->counts.contains++;
+		if(geom_shape2d_contains(info->s, x)){
+			S->counts.hits++;
+			best = im->index;
+			break;
+		}
+	}
+	if(ss->ncell_fix > 0){
+		// Unbounded shapes, as in shapeset2d_query_cell
+		double f[2], q[2];
+		geom_matvec2d(ss->lattice_inv, p, f);
+		f[0] = floor(f[0]);
+		f[1] = floor(f[1]);
+		q[0] = p[0] - f[0] * ss->lattice[0] - f[1] * ss->lattice[2];
+		q[1] = p[1] - f[0] * ss->lattice[1] - f[1] * ss->lattice[3];
+		for(k = 0; k < ss->ncell_fix; ++k){
+			const geom_shape2d_image *im = &ss->cell_fix[k];
+			const double x[2] = { q[0] + im->off[0], q[1] + im->off[1] };
+			if(im->index <= best){ break; }
+			S->counts.leaves++;
+			S->counts.contains++;
+			if(geom_shape2d_contains(ss->info[im->index].s, x)){
+				S->counts.hits++;
+				best = im->index;
+			}
+		}
+	}
+	return best;
+}
+// Fills [i0,i1) x [j0,j1) from the candidates S->img[beg..S->n)
+static void raster2d_tile(const raster2d *R, raster2d_scratch *S, unsigned int beg, unsigned int i0, unsigned int i1, unsigned int j0, unsigned int j1){
+	unsigned int i, j;
+	if(S->n - beg > SHAPESET2D_RASTER_SPLIT && (i1 - i0 > 1 || j1 - j0 > 1)){
+		const unsigned int end = S->n;
+		const unsigned int im = (i0 + i1 + 1) / 2, jm = (j0 + j1 + 1) / 2;
+		const unsigned int ib[3] = { i0, im, i1 }, jb[3] = { j0, jm, j1 };
+		int a, b;
+		for(b = 0; b < 2; ++b){
+			for(a = 0; a < 2; ++a){
+				geom_aabb2d box;
+				unsigned int k;
+				if(ib[a] == ib[a+1] || jb[b] == jb[b+1]){ continue; }
+				raster2d_box(R->org, R->du, R->dv, ib[a], ib[a+1], jb[b], jb[b+1], 0.5, &box);
+				S->n = end;
+				for(k = beg; k < end; ++k){
+					const geom_shape2d_info *info = &R->ss->info[S->img[k].index];
+					const double c[2] = { box.c[0] + S->img[k].off[0], box.c[1] + S->img[k].off[1] };
+					if(!(GEOM_SHAPESET2D_FLAG_UNBOUNDED & info->flags) && !aabb2d_overlap(&info->box, c, box.h)){ continue; }
+					raster2d_push(S, S->img[k].index, S->img[k].off[0], S->img[k].off[1]);
+				}
+				raster2d_tile(R, S, end, ib[a], ib[a+1], jb[b], jb[b+1]);
+			}
+		}
+		S->n = end;
+		return;
+	}
+	for(j = j0; j < j1; ++j){
+		for(i = i0; i < i1; ++i){
+			const double p[2] = {
+				R->org[0] + (i + 0.5) * R->du[0] + (j + 0.5) * R->dv[0],
+				R->org[1] + (i + 0.5) * R->du[1] + (j + 0.5) * R->dv[1]
+			};
+			R->index[i + j*R->nx] = raster2d_pixel(R, S, beg, p);
+		}
+	}
+}
+int geom_shapeset2d_rasterize(
+	geom_shapeset2d ss, const double org[2], const double du[2], const double dv[2],
+	unsigned int nx, unsigned int ny, int index[]
+){
+	raster2d R;
+	geom_query_counts scratch, *counts;
+	const unsigned int T = SHAPESET2D_RASTER_TILE;
+	const unsigned int ntx = (nx + T - 1) / T, nty = (ny + T - 1) / T;
+	int t;
+	if(NULL == ss){ return -1; }
+	if(NULL == org || NULL == du || NULL == dv || NULL == index){ return -2; }
+	R.ss = ss;
+	R.org[0] = org[0]; R.org[1] = org[1];
+	R.du[0] = du[0]; R.du[1] = du[1];
+	R.dv[0] = dv[0]; R.dv[1] = dv[1];
+	R.nx = nx;
+	R.ny = ny;
+	R.index = index;
+	counts = stats_begin(ss->stats, &scratch);
+	// Each thread counts on its own, since the trees would otherwise add
+	// to the same record at once.
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	{
+		raster2d_scratch S;
+		S.n = 0;
+		S.n_alloc = 0;
+		S.img = NULL;
+		memset(&S.counts, 0, sizeof(geom_query_counts));
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+		for(t = 0; t < (int)(ntx*nty); ++t){
+			const unsigned int i0 = (t % ntx) * T, j0 = (t / ntx) * T;
+			const unsigned int i1 = (i0 + T < nx) ? i0 + T : nx;
+			const unsigned int j1 = (j0 + T < ny) ? j0 + T : ny;
+			geom_aabb2d box;
+			raster2d_box(R.org, R.du, R.dv, i0, i1, j0, j1, 0.5, &box);
+			S.n = 0;
+			raster2d_gather(ss, &S, &box);
+			qsort(S.img, S.n, sizeof(geom_shape2d_image), &raster2d_cmp);
+			raster2d_tile(&R, &S, 0, i0, i1, j0, j1);
+		}
+		free(S.img);
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+		{
+			counts->nodes += S.counts.nodes;
+			counts->leaves += S.counts.leaves;
+			counts->contains += S.counts.contains;
+			counts->hits += S.counts.hits;
+		}
+	}
+	stats_end_queries(ss->stats, (unsigned long)nx * ny);
+	return 0;
+}
+
+// Fill fractions. Rows of cells are spread over threads, and each row is
+// walked in strips of tiles' width that gather their candidates as in
+// rasterize, from the boxes of the whole cells. A candidate that covers
+// all four corners of a cell, and for a polygon has no edge crossing it,
+// fills the cell; a polygon with no corner inside and no edge crossing
+// misses it. Only the remaining cells, which a boundary passes through,
+// are split in two triangles for geom_shape2d_simplex_overlap_exact.
+// Those areas are exact as long as a single shape shows in the cell; when
+// two or more shapes cross it, the cell is sampled on a regular grid
+// instead, each sample going to the highest shape containing it.
+typedef struct{
+	geom_shapeset2d ss;
+	double org[2], du[2], dv[2];
+	double Minv[4]; // maps a displacement to cell steps along du and dv
+	double area; // of a cell
+	double tri[2][6]; // the two halves of a cell, relative to its corner
+	unsigned int nx, ny;
+	double *frac;
+	int *index;
+} fill2d;
+// Whether the segment from a to b meets the unit square [0,1]^2
+static int fill2d_segment_meets_cell(const double a[2], const double b[2]){
+	double t0 = 0, t1 = 1;
+	int d;
+	for(d = 0; d < 2; ++d){
+		const double delta = b[d] - a[d];
+		if(0 == delta){
+			if(a[d] < 0 || a[d] > 1){ return 0; }
+		}else{
+			double ta = (0 - a[d]) / delta, tb = (1 - a[d]) / delta;
+			if(ta > tb){ const double tmp = ta; ta = tb; tb = tmp; }
+			if(ta > t0){ t0 = ta; }
+			if(tb < t1){ t1 = tb; }
+			if(t0 > t1){ return 0; }
+		}
+	}
+	return 1;
+}
+// Area of the cell with corner x (in the frame of shape s) covered by s
+static double fill2d_overlap(const fill2d *F, raster2d_scratch *S, const geom_shape2d *s, const double x[2]){
+	const double corner[8] = {
+		x[0], x[1],
+		x[0] + F->du[0], x[1] + F->du[1],
+		x[0] + F->du[0] + F->dv[0], x[1] + F->du[1] + F->dv[1],
+		x[0] + F->dv[0], x[1] + F->dv[1]
+	};
+	int k, nin = 0;
+	for(k = 0; k < 4; ++k){
+		S->counts.contains++;
+		if(geom_shape2d_contains(s, &corner[2*k])){
+			S->counts.hits++;
+			nin++;
+		}
+	}
+	if(GEOM_SHAPE2D_POLYGON == s->type){
+		const unsigned int nv = s->s.polygon.nv;
+		double a[2], b[2], r[2];
+		unsigned int i;
+		int crossed = 0;
+		r[0] = s->org[0] + s->s.polygon.v[2*(nv-1)+0] - x[0];
+		r[1] = s->org[1] + s->s.polygon.v[2*(nv-1)+1] - x[1];
+		geom_matvec2d(F->Minv, r, a);
+		for(i = 0; i < nv; ++i){
+			r[0] = s->org[0] + s->s.polygon.v[2*i+0] - x[0];
+			r[1] = s->org[1] + s->s.polygon.v[2*i+1] - x[1];
+			geom_matvec2d(F->Minv, r, b);
+			if(fill2d_segment_meets_cell(a, b)){ crossed = 1; break; }
+			a[0] = b[0];
+			a[1] = b[1];
+		}
+		if(!crossed){
+			return (4 == nin) ? F->area : 0;
+		}
+	}else if(4 == nin){ // ellipses are convex
+		return F->area;
+	}
+	return geom_shape2d_simplex_overlap_exact(s, x, F->tri[0])
+	     + geom_shape2d_simplex_overlap_exact(s, x, F->tri[1]);
+}
+// Drops repeated images from the sorted candidates. The cell tree can
+// return one image from two neighboring cells, under offsets that differ
+// only by rounding, while distinct images of a shape are a lattice
+// vector apart.
+static void fill2d_unique(const geom_shapeset2d ss, raster2d_scratch *S){
+	unsigned int k, m, n = 0, run = 0;
+	for(k = 0; k < S->n; ++k){
+		const geom_shape2d_image *im = &S->img[k];
+		int dup = 0;
+		if(n > 0 && S->img[n-1].index != im->index){ run = n; }
+		if(ss->cell_built){
+			for(m = run; m < n; ++m){
+				const double d[2] = { im->off[0] - S->img[m].off[0], im->off[1] - S->img[m].off[1] };
+				double f[2];
+				geom_matvec2d(ss->lattice_inv, d, f);
+				if(fabs(f[0]) < 0.5 && fabs(f[1]) < 0.5){ dup = 1; break; }
+			}
+		}
+		if(!dup){ S->img[n++] = *im; }
+	}
+	S->n = n;
+}
+// Marks the samples of the cell with corner x (in the frame of shape s)
+// that s contains and no earlier shape has taken; returns how many.
+static unsigned int fill2d_sample(
+	const fill2d *F, raster2d_scratch *S, const geom_shape2d *s, const double x[2],
+	unsigned char taken[], unsigned int *ntaken
+){
+	const unsigned int N = SHAPESET2D_FILL_SAMPLES;
+	unsigned int u, v, n = 0;
+	for(v = 0; v < N; ++v){
+		const double fv = (v + 0.5) / N;
+		for(u = 0; u < N; ++u){
+			const double fu = (u + 0.5) / N;
+			const double q[2] = {
+				x[0] + fu * F->du[0] + fv * F->dv[0],
+				x[1] + fu * F->du[1] + fv * F->dv[1]
+			};
+			if(taken[u + v*N]){ continue; }
+			S->counts.contains++;
+			if(geom_shape2d_contains(s, q)){
+				S->counts.hits++;
+				taken[u + v*N] = 1;
+				n++;
+			}
+		}
+	}
+	*ntaken += n;
+	return n;
+}
+// Fills cell (i,j) from the candidates in S, which are sorted by
+// decreasing index, so that a shape hides the part of any lower one it
+// overlaps, as in geom_shapeset2d_query_pt. While one shape meets the cell
+// only in part, and every other is below a shape covering it or misses
+// it, the areas are exact; a second partial shape switches to sampling.
+static void fill2d_cell(const fill2d *F, raster2d_scratch *S, unsigned int i, unsigned int j){
+	const geom_shapeset2d ss = F->ss;
+	const unsigned int NS = SHAPESET2D_FILL_SAMPLES * SHAPESET2D_FILL_SAMPLES;
+	const double p[2] = {
+		F->org[0] + (double)i * F->du[0] + (double)j * F->dv[0],
+		F->org[1] + (double)i * F->du[1] + (double)j * F->dv[1]
+	};
+	geom_aabb2d box;
+	unsigned char taken[SHAPESET2D_FILL_SAMPLES * SHAPESET2D_FILL_SAMPLES];
+	double frac = 0, part = 0; // area of the one partial shape
+	unsigned int ntaken = 0, nbest = 0;
+	int best = -1, sampling = 0;
+	unsigned int k, kpart = 0;
+	raster2d_box(F->org, F->du, F->dv, i, i+1, j, j+1, 0, &box);
+	for(k = 0; k < S->n; ++k){
+		const geom_shape2d_image *im = &S->img[k];
+		const geom_shape2d_info *info = &ss->info[im->index];
+		const double x[2] = { p[0] + im->off[0], p[1] + im->off[1] };
+		const double c[2] = { box.c[0] + im->off[0], box.c[1] + im->off[1] };
+		unsigned int n;
+		double a;
+		if(!(GEOM_SHAPESET2D_FLAG_UNBOUNDED & info->flags) && !aabb2d_overlap(&info->box, c, box.h)){ continue; }
+		a = fill2d_overlap(F, S, info->s, x);
+		if(a <= 0){ continue; }
+		if(!sampling){
+			if(a >= F->area){ // nothing below shows, except around a partial shape
+				frac = 1;
+				if(best < 0 || F->area - part > part){ best = im->index; }
+				break;
+			}
+			if(best < 0){
+				frac = a / F->area;
+				part = a;
+				best = im->index;
+				kpart = k;
+				continue;
+			}
+			// A second partial shape: sample the first one, then go on
+			// sampling the rest.
+			{
+				const geom_shape2d_image *ip = &S->img[kpart];
+				const double xp[2] = { p[0] + ip->off[0], p[1] + ip->off[1] };
+				memset(taken, 0, NS);
+				nbest = fill2d_sample(F, S, ss->info[ip->index].s, xp, taken, &ntaken);
+				sampling = 1;
+			}
+		}
+		n = fill2d_sample(F, S, info->s, x, taken, &ntaken);
+		if(n > nbest){
+			nbest = n;
+			best = im->index;
+		}
+		if(ntaken == NS){ break; }
+	}
+	if(sampling){
+		frac = (double)ntaken / NS;
+	}
+	F->frac[i + j*F->nx] = frac;
+	if(NULL != F->index){
+		F->index[i + j*F->nx] = best;
+	}
+}
+int geom_shapeset2d_fill_fraction(
+	geom_shapeset2d ss, const double org[2], const double du[2], const double dv[2],
+	unsigned int nx, unsigned int ny, double frac[], int index[]
+){
+	fill2d F;
+	geom_query_counts scratch, *counts;
+	const unsigned int T = SHAPESET2D_RASTER_TILE;
+	double det;
+	int j;
+	if(NULL == ss){ return -1; }
+	if(NULL == org || NULL == du || NULL == dv || NULL == frac){ return -2; }
+	det = du[0]*dv[1] - du[1]*dv[0];
+	if(0 == det){ return -3; }
+	F.ss = ss;
+	F.org[0] = org[0]; F.org[1] = org[1];
+	F.du[0] = du[0]; F.du[1] = du[1];
+	F.dv[0] = dv[0]; F.dv[1] = dv[1];
+	F.Minv[0] = du[0]; F.Minv[1] = du[1];
+	F.Minv[2] = dv[0]; F.Minv[3] = dv[1];
+	geom_matinv2d(F.Minv);
+	F.area = fabs(det);
+	F.tri[0][0] = 0;             F.tri[0][1] = 0;
+	F.tri[0][2] = du[0];         F.tri[0][3] = du[1];
+	F.tri[0][4] = du[0] + dv[0]; F.tri[0][5] = du[1] + dv[1];
+	F.tri[1][0] = 0;             F.tri[1][1] = 0;
+	F.tri[1][2] = du[0] + dv[0]; F.tri[1][3] = du[1] + dv[1];
+	F.tri[1][4] = dv[0];         F.tri[1][5] = dv[1];
+	F.nx = nx;
+	F.ny = ny;
+	F.frac = frac;
+	F.index = index;
+	counts = stats_begin(ss->stats, &scratch);
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	{
+		raster2d_scratch S;
+		S.n = 0;
+		S.n_alloc = 0;
+		S.img = NULL;
+		memset(&S.counts, 0, sizeof(geom_query_counts));
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+		for(j = 0; j < (int)ny; ++j){
+			unsigned int i0, i;
+			for(i0 = 0; i0 < nx; i0 += T){
+				const unsigned int i1 = (i0 + T < nx) ? i0 + T : nx;
+				geom_aabb2d box;
+				raster2d_box(F.org, F.du, F.dv, i0, i1, j, j+1, 0, &box);
+				S.n = 0;
+				raster2d_gather(ss, &S, &box);
+				qsort(S.img, S.n, sizeof(geom_shape2d_image), &raster2d_cmp);
+				fill2d_unique(ss, &S);
+				for(i = i0; i < i1; ++i){
+					fill2d_cell(&F, &S, i, j);
+				}
+			}
+		}
+		free(S.img);
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+		{
+			counts->nodes += S.counts.nodes;
+			counts->leaves += S.counts.leaves;
+			counts->contains += S.counts.contains;
+			counts->hits += S.counts.hits;
+		}
+	}
+	stats_end_queries(ss->stats, (unsigned long)nx * ny);
+	return 0;
+}
+
 int geom_shapeset2d_foreach(
 	geom_shapeset2d ss,
 	int (*func)(geom_shape2d *s, const geom_aabb2d *box, unsigned int flags, void *data),
@@ -248,8 +1363,13 @@ typedef struct geom_shape3d_info_struct{
 	geom_shape3d *s;
 	geom_aabb3d box;
 	unsigned int flags;
+	unsigned int cell_first, cell_len; // its run of cell_img slots
 } geom_shape3d_info;
 
+// A lattice translate of a shape: it contains p if the shape contains
+// p + off
+typedef struct{ int index; double off[3]; } geom_shape3d_image;
+
 struct geom_shapeset3d_struct{
 	unsigned int n;
 	unsigned int n_alloc;
@@ -257,11 +1377,37 @@ struct geom_shapeset3d_struct{
 	
 	geom_bvh3d bvh; // may not be used
 	int use_bvh;
+	int bvh_method; // GEOM_SHAPESET_BUILD_*
 	
 	int periodic;
 	double lattice[9];
+	
+	// Periodic point lookup, built by finalize and kept up to date by add
+	// and update: a tree of the lattice translates of the bounded shapes
+	// that reach into the unit cell, and the unbounded shapes at the
+	// neighboring translates.
+	int cell_built;
+	int cell_dynamic; // cell_bvh has been converted for editing
+	int cell_ordered; // cell_img is by increasing index
+	double lattice_inv[9];
+	geom_bvh3d cell_bvh; // NULL if there are no bounded shapes
+	unsigned int ncell_img, ncell_fix, ncell_img_alloc, ncell_fix_alloc;
+	geom_shape3d_image *cell_img; // the tree tags; free slots have index -1
+	geom_shape3d_image *cell_fix; // by decreasing index
+	
+	geom_shapeset_stats *stats; // may be NULL
 };
 
+static void shapeset3d_cell_reset(geom_shapeset3d ss){
+	ss->cell_built = 0;
+	ss->cell_dynamic = 0;
+	ss->cell_ordered = 1;
+	ss->ncell_img = 0;
+	ss->ncell_fix = 0;
+	ss->ncell_img_alloc = 0;
+	ss->ncell_fix_alloc = 0;
+}
+
 geom_shapeset3d geom_shapeset3d_new(){
 	geom_shapeset3d ss = (geom_shapeset3d)malloc(sizeof(struct geom_shapeset3d_struct));
 	ss->n = 0;
@@ -269,15 +1415,220 @@ geom_shapeset3d geom_shapeset3d_new(){
 	ss->info = NULL;
 	ss->bvh = NULL;
 	ss->use_bvh = 0;
+	ss->bvh_method = GEOM_SHAPESET_BUILD_STR;
 	ss->periodic = 0;
+	ss->cell_img = NULL;
+	ss->cell_fix = NULL;
+	ss->cell_bvh = NULL;
+	shapeset3d_cell_reset(ss);
+	ss->stats = NULL;
 	return ss;
 }
 
+static void shapeset3d_cell_destroy(geom_shapeset3d ss){
+	geom_bvh3d_destroy(ss->cell_bvh);
+	free(ss->cell_img);
+	free(ss->cell_fix);
+	ss->cell_img = NULL;
+	ss->cell_fix = NULL;
+	ss->cell_bvh = NULL;
+	shapeset3d_cell_reset(ss);
+}
+
+static void shapeset3d_cell_range(const double Linv[9], const geom_aabb3d *box, int lo[3], int hi[3]){
+	double fmin[3] = { HUGE_VAL, HUGE_VAL, HUGE_VAL }, fmax[3] = { -HUGE_VAL, -HUGE_VAL, -HUGE_VAL };
+	int k, d;
+	for(k = 0; k < 8; ++k){
+		const double x[3] = {
+			box->c[0] + ((k & 1) ? box->h[0] : -box->h[0]),
+			box->c[1] + ((k & 2) ? box->h[1] : -box->h[1]),
+			box->c[2] + ((k & 4) ? box->h[2] : -box->h[2])
+		};
+		double f[3];
+		geom_matvec3d(Linv, x, f);
+		for(d = 0; d < 3; ++d){
+			if(f[d] < fmin[d]){ fmin[d] = f[d]; }
+			if(f[d] > fmax[d]){ fmax[d] = f[d]; }
+		}
+	}
+	for(d = 0; d < 3; ++d){
+		lo[d] = (int)floor(fmin[d] - SHAPESET_CELL_EPS);
+		hi[d] = (int)floor(fmax[d] + SHAPESET_CELL_EPS);
+	}
+}
+static void shapeset3d_image_set(geom_shape3d_image *im, const double lattice[9], int index, const int m[3]){
+	int d;
+	im->index = index;
+	for(d = 0; d < 3; ++d){
+		im->off[d] = (double)m[0] * lattice[d] + (double)m[1] * lattice[3+d] + (double)m[2] * lattice[6+d];
+	}
+}
+static void shapeset3d_image_push(
+	geom_shape3d_image **list, unsigned int *n, unsigned int *n_alloc,
+	const double lattice[9], int index, const int m[3]
+){
+	if(*n >= *n_alloc){
+		*n_alloc = 2*(*n_alloc) + 16;
+		*list = (geom_shape3d_image*)realloc(*list, sizeof(geom_shape3d_image) * (*n_alloc));
+	}
+	shapeset3d_image_set(&(*list)[(*n)++], lattice, index, m);
+}
+struct cell3d_iter_data{
+	unsigned int index;
+	geom_shapeset3d ss;
+};
+static int cell3d_iter(double c[3], double h[3], int *tag, void *data){
+	struct cell3d_iter_data *d = (struct cell3d_iter_data*)data;
+	const geom_shape3d_image *im = &d->ss->cell_img[d->index];
+	const geom_aabb3d *box = &d->ss->info[im->index].box;
+	*tag = d->index;
+	c[0] = box->c[0] - im->off[0];
+	c[1] = box->c[1] - im->off[1];
+	c[2] = box->c[2] - im->off[2];
+	h[0] = box->h[0];
+	h[1] = box->h[1];
+	h[2] = box->h[2];
+	d->index++;
+	return 1;
+}
+static void shapeset3d_cell_build(geom_shapeset3d ss){
+	const double *L = ss->lattice;
+	const double det =
+		L[0]*(L[4]*L[8] - L[5]*L[7]) -
+		L[3]*(L[1]*L[8] - L[2]*L[7]) +
+		L[6]*(L[1]*L[5] - L[2]*L[4]);
+	int i, m[3];
+	shapeset3d_cell_destroy(ss);
+	if(!ss->periodic || 0 == det){ return; }
+	memcpy(ss->lattice_inv, ss->lattice, sizeof(double) * 9);
+	geom_matinv3d(ss->lattice_inv);
+	for(i = 0; i < (int)ss->n; ++i){
+		int lo[3], hi[3];
+		ss->info[i].cell_first = ss->ncell_img;
+		ss->info[i].cell_len = 0;
+		if(GEOM_SHAPESET3D_FLAG_UNBOUNDED & ss->info[i].flags){ continue; }
+		shapeset3d_cell_range(ss->lattice_inv, &ss->info[i].box, lo, hi);
+		for(m[0] = lo[0]; m[0] <= hi[0]; ++m[0]){
+			for(m[1] = lo[1]; m[1] <= hi[1]; ++m[1]){
+				for(m[2] = lo[2]; m[2] <= hi[2]; ++m[2]){
+					shapeset3d_image_push(&ss->cell_img, &ss->ncell_img, &ss->ncell_img_alloc, ss->lattice, i, m);
+				}
+			}
+		}
+		ss->info[i].cell_len = ss->ncell_img - ss->info[i].cell_first;
+	}
+	for(i = (int)ss->n-1; i >= 0; --i){
+		if(!(GEOM_SHAPESET3D_FLAG_UNBOUNDED & ss->info[i].flags)){ continue; }
+		for(m[0] = -1; m[0] <= 1; ++m[0]){
+			for(m[1] = -1; m[1] <= 1; ++m[1]){
+				for(m[2] = -1; m[2] <= 1; ++m[2]){
+					shapeset3d_image_push(&ss->cell_fix, &ss->ncell_fix, &ss->ncell_fix_alloc, ss->lattice, i, m);
+				}
+			}
+		}
+	}
+	if(ss->ncell_img > 0){
+		struct cell3d_iter_data d;
+		d.index = 0;
+		d.ss = ss;
+		ss->cell_bvh = geom_bvh3d_new(ss->ncell_img, &cell3d_iter, (void*)&d);
+		if(NULL != ss->stats){
+			geom_bvh3d_set_counts(ss->cell_bvh, &ss->stats->last);
+		}
+	}
+	ss->cell_built = 1;
+}
+
+// Edits keep the periodic lookup up to date, as in 2D
+static void shapeset3d_cell_edit(geom_shapeset3d ss){
+	unsigned int k;
+	if(ss->cell_dynamic){ return; }
+	geom_bvh3d_destroy(ss->cell_bvh);
+	ss->cell_bvh = geom_bvh3d_new_dynamic();
+	for(k = 0; k < ss->ncell_img; ++k){
+		const geom_shape3d_image *im = &ss->cell_img[k];
+		const geom_aabb3d *box;
+		double c[3];
+		if(im->index < 0){ continue; }
+		box = &ss->info[im->index].box;
+		c[0] = box->c[0] - im->off[0];
+		c[1] = box->c[1] - im->off[1];
+		c[2] = box->c[2] - im->off[2];
+		geom_bvh3d_insert(ss->cell_bvh, k, c, box->h);
+	}
+	if(NULL != ss->stats){
+		geom_bvh3d_set_counts(ss->cell_bvh, &ss->stats->last);
+	}
+	ss->cell_dynamic = 1;
+}
+static void shapeset3d_cell_remove(geom_shapeset3d ss, int index){
+	const geom_shape3d_info *info = &ss->info[index];
+	unsigned int k, m;
+	for(k = info->cell_first; k < info->cell_first + info->cell_len; ++k){
+		if(ss->cell_img[k].index < 0){ continue; }
+		geom_bvh3d_remove(ss->cell_bvh, k);
+		ss->cell_img[k].index = -1;
+	}
+	for(k = 0, m = 0; k < ss->ncell_fix; ++k){
+		if(ss->cell_fix[k].index != index){ ss->cell_fix[m++] = ss->cell_fix[k]; }
+	}
+	ss->ncell_fix = m;
+}
+static void shapeset3d_cell_insert(geom_shapeset3d ss, int index){
+	geom_shape3d_info *info = &ss->info[index];
+	int lo[3], hi[3], m[3];
+	unsigned int k, n;
+	if(GEOM_SHAPESET3D_FLAG_UNBOUNDED & info->flags){
+		// Append the 27 translates, then move them up to their place
+		geom_shape3d_image tmp[27];
+		const unsigned int end = ss->ncell_fix;
+		unsigned int pos = 0;
+		while(pos < end && ss->cell_fix[pos].index > index){ ++pos; }
+		for(m[0] = -1; m[0] <= 1; ++m[0]){
+			for(m[1] = -1; m[1] <= 1; ++m[1]){
+				for(m[2] = -1; m[2] <= 1; ++m[2]){
+					shapeset3d_image_push(&ss->cell_fix, &ss->ncell_fix, &ss->ncell_fix_alloc, ss->lattice, index, m);
+				}
+			}
+		}
+		memcpy(tmp, &ss->cell_fix[end], sizeof(tmp));
+		memmove(&ss->cell_fix[pos+27], &ss->cell_fix[pos], sizeof(geom_shape3d_image) * (end - pos));
+		memcpy(&ss->cell_fix[pos], tmp, sizeof(tmp));
+		return;
+	}
+	shapeset3d_cell_range(ss->lattice_inv, &info->box, lo, hi);
+	n = (unsigned int)(hi[0]-lo[0]+1) * (unsigned int)(hi[1]-lo[1]+1) * (unsigned int)(hi[2]-lo[2]+1);
+	if(n > info->cell_len){
+		if(index+1 != (int)ss->n){ ss->cell_ordered = 0; }
+		info->cell_first = ss->ncell_img;
+		info->cell_len = n;
+	}
+	k = info->cell_first;
+	for(m[0] = lo[0]; m[0] <= hi[0]; ++m[0]){
+		for(m[1] = lo[1]; m[1] <= hi[1]; ++m[1]){
+			for(m[2] = lo[2]; m[2] <= hi[2]; ++m[2]){
+				if(k == ss->ncell_img){
+					shapeset3d_image_push(&ss->cell_img, &ss->ncell_img, &ss->ncell_img_alloc, ss->lattice, index, m);
+					++k;
+				}else{
+					shapeset3d_image_set(&ss->cell_img[k++], ss->lattice, index, m);
+				}
+			}
+		}
+	}
+	for(k = info->cell_first; k < info->cell_first + n; ++k){
+		const double *off = ss->cell_img[k].off;
+		const double c[3] = { info->box.c[0] - off[0], info->box.c[1] - off[1], info->box.c[2] - off[2] };
+		geom_bvh3d_insert(ss->cell_bvh, k, c, info->box.h);
+	}
+}
+
 void geom_shapeset3d_destroy(geom_shapeset3d ss){
 	if(NULL == ss){ return; }
 	if(ss->use_bvh){
 		geom_bvh3d_destroy(ss->bvh);
 	}
+	shapeset3d_cell_destroy(ss);
 	free(ss->info);
 	free(ss);
 }
@@ -298,6 +1649,10 @@ int geom_shapeset3d_set_lattice(geom_shapeset3d ss, const double lattice[9]){
 		ss->lattice[7] = lattice[7];
 		ss->lattice[8] = lattice[8];
 	}
+	// A finalized set is reindexed for the new cell
+	if(ss->use_bvh){
+		shapeset3d_cell_build(ss);
+	}
 	return 0;
 }
 
@@ -336,22 +1691,93 @@ int geom_shapeset3d_add(geom_shapeset3d ss, geom_shape3d *s){
 	ss->info[i].s = s;
 	ss->info[i].flags = 0;
 	ss->info[i].flags |= geom_shape3d_get_aabb(s, &(ss->info[i].box)) ? GEOM_SHAPESET3D_FLAG_UNBOUNDED : 0;
+	ss->info[i].cell_first = 0;
+	ss->info[i].cell_len = 0;
 	ss->n++;
 	
+	// A finalized set keeps its trees: a dynamic one takes the new shape,
+	// and a static one is first converted, which rebuilds the periodic
+	// lookup along with it.
+	if(ss->use_bvh && GEOM_SHAPESET_BUILD_DYNAMIC != ss->bvh_method){
+		geom_shapeset3d_finalize_method(ss, GEOM_SHAPESET_BUILD_DYNAMIC);
+		return i;
+	}
 	if(ss->use_bvh){
-		ss->use_bvh = 0;
-		geom_bvh3d_destroy(ss->bvh);
+		geom_bvh3d_insert(ss->bvh, i, ss->info[i].box.c, ss->info[i].box.h);
+	}
+	if(ss->cell_built){
+		shapeset3d_cell_edit(ss);
+		shapeset3d_cell_insert(ss, i);
 	}
 	return i;
 }
 
+int geom_shapeset3d_update(geom_shapeset3d ss, int index){
+	geom_shape3d_info *info;
+	if(NULL == ss){ return -1; }
+	if(index < 0 || index >= (int)ss->n){ return -2; }
+	info = &ss->info[index];
+	info->flags = geom_shape3d_get_aabb(info->s, &(info->box)) ? GEOM_SHAPESET3D_FLAG_UNBOUNDED : 0;
+	if(ss->use_bvh && GEOM_SHAPESET_BUILD_DYNAMIC != ss->bvh_method){
+		geom_shapeset3d_finalize_method(ss, GEOM_SHAPESET_BUILD_DYNAMIC);
+		return 0;
+	}
+	if(ss->use_bvh){
+		geom_bvh3d_update(ss->bvh, index, info->box.c, info->box.h);
+	}
+	if(ss->cell_built){
+		shapeset3d_cell_edit(ss);
+		shapeset3d_cell_remove(ss, index);
+		shapeset3d_cell_insert(ss, index);
+	}
+	return 0;
+}
+
 void geom_shapeset3d_finalize(geom_shapeset3d ss){
-	if(NULL == ss || ss->use_bvh){ return; }
-	struct shape3d_iter_data d;
-	d.index = 0;
-	d.info = ss->info;
-	ss->bvh = geom_bvh3d_new(ss->n, &shape3d_iter, (void*)&d);
+	geom_shapeset3d_finalize_method(ss, GEOM_SHAPESET_BUILD_STR);
+}
+void geom_shapeset3d_finalize_method(geom_shapeset3d ss, int method){
+	if(NULL == ss){ return; }
+	if(ss->use_bvh){
+		if(method == ss->bvh_method){
+			if(!ss->cell_built || ss->cell_dynamic){ shapeset3d_cell_build(ss); }
+			return;
+		}
+		ss->use_bvh = 0;
+		geom_bvh3d_destroy(ss->bvh);
+	}
+	if(GEOM_SHAPESET_BUILD_DYNAMIC == method){
+		unsigned int i;
+		ss->bvh = geom_bvh3d_new_dynamic();
+		for(i = 0; i < ss->n; ++i){
+			geom_bvh3d_insert(ss->bvh, i, ss->info[i].box.c, ss->info[i].box.h);
+		}
+	}else{
+		struct shape3d_iter_data d;
+		d.index = 0;
+		d.info = ss->info;
+		ss->bvh = geom_bvh3d_new_method(ss->n, &shape3d_iter, (void*)&d,
+			(GEOM_SHAPESET_BUILD_MORTON == method) ? GEOM_BVH_MORTON : GEOM_BVH_STR
+		);
+	}
 	ss->use_bvh = (NULL != ss->bvh);
+	ss->bvh_method = method;
+	if(NULL != ss->stats){
+		geom_bvh3d_set_counts(ss->bvh, &ss->stats->last);
+	}
+	shapeset3d_cell_build(ss);
+}
+
+void geom_shapeset3d_set_stats(geom_shapeset3d ss, geom_shapeset_stats *stats){
+	if(NULL == ss){ return; }
+	ss->stats = stats;
+	if(NULL != stats){
+		memset(stats, 0, sizeof(geom_shapeset_stats));
+	}
+	if(ss->use_bvh){
+		geom_bvh3d_set_counts(ss->bvh, (NULL != stats) ? &stats->last : NULL);
+	}
+	geom_bvh3d_set_counts(ss->cell_bvh, (NULL != stats) ? &stats->last : NULL);
 }
 
 unsigned int geom_shapeset3d_size(geom_shapeset3d ss){
@@ -374,11 +1800,75 @@ int geom_shapeset3d_index_aabb(geom_shapeset3d ss, int index, geom_aabb3d *box){
 
 
 
+struct query_pt3d_data{
+	geom_shape3d_info *info;
+	const geom_shape3d_image *img;
+	double pc[3];
+	int ibest;
+	geom_query_counts *counts;
+};
+// Accepts the shapes that contain the point, for query_pt_max
 static int query_pt3d(int tag, const double c[3], const double h[3], void *data){
-	int *bbest = (int*)data;
-	if(tag > *bbest){ *bbest = tag; }
+	struct query_pt3d_data *d = (struct query_pt3d_data*)data;
+	d->counts->contains++;
+	if(geom_shape3d_contains(d->info[tag].s, d->pc)){
+		d->counts->hits++;
+		return 1;
+	}
+	return 0;
+}
+// Tags of the cell tree are images, normally in the same order as their
+// shapes
+static int query_cell3d(int tag, const double c[3], const double h[3], void *data){
+	struct query_pt3d_data *d = (struct query_pt3d_data*)data;
+	const geom_shape3d_image *im = &d->img[tag];
+	const double x[3] = {
+		d->pc[0] + im->off[0],
+		d->pc[1] + im->off[1],
+		d->pc[2] + im->off[2]
+	};
+	d->counts->contains++;
+	if(geom_shape3d_contains(d->info[im->index].s, x)){
+		d->counts->hits++;
+		return 1;
+	}
+	return 0;
+}
+static int query_cell3d_any(int tag, const double c[3], const double h[3], void *data){
+	struct query_pt3d_data *d = (struct query_pt3d_data*)data;
+	const int index = d->img[tag].index;
+	if(index > d->ibest && query_cell3d(tag, c, h, data)){ d->ibest = index; }
 	return 1;
 }
+static void shapeset3d_query_cell(geom_shapeset3d ss, const double p[3], struct query_pt3d_data *d){
+	unsigned int j;
+	double f[3];
+	geom_matvec3d(ss->lattice_inv, p, f);
+	f[0] = floor(f[0]);
+	f[1] = floor(f[1]);
+	f[2] = floor(f[2]);
+	d->img = ss->cell_img;
+	d->pc[0] = p[0] - f[0] * ss->lattice[0] - f[1] * ss->lattice[3] - f[2] * ss->lattice[6];
+	d->pc[1] = p[1] - f[0] * ss->lattice[1] - f[1] * ss->lattice[4] - f[2] * ss->lattice[7];
+	d->pc[2] = p[2] - f[0] * ss->lattice[2] - f[1] * ss->lattice[5] - f[2] * ss->lattice[8];
+	if(NULL != ss->cell_bvh && ss->cell_ordered){
+		const int best = geom_bvh3d_query_pt_max(ss->cell_bvh, d->pc, -1, &query_cell3d, d);
+		if(best >= 0){ d->ibest = ss->cell_img[best].index; }
+	}else if(NULL != ss->cell_bvh){
+		geom_bvh3d_query_pt(ss->cell_bvh, d->pc, &query_cell3d_any, d);
+	}
+	for(j = 0; j < ss->ncell_fix; ++j){
+		const geom_shape3d_image *im = &ss->cell_fix[j];
+		const double x[3] = { d->pc[0] + im->off[0], d->pc[1] + im->off[1], d->pc[2] + im->off[2] };
+		if(im->index <= d->ibest){ break; } // the rest are no better
+		d->counts->leaves++;
+		d->counts->contains++;
+		if(geom_shape3d_contains(ss->info[im->index].s, x)){
+			d->counts->hits++;
+			d->ibest = im->index;
+		}
+	}
+}
 
 int geom_shapeset3d_query_pt(geom_shapeset3d ss, const double p[3]){
 	unsigned int c, clim = 1;
@@ -417,40 +1907,46 @@ int geom_shapeset3d_query_pt(geom_shapeset3d ss, const double p[3]){
 	if(ss->periodic){
 		clim = 27;
 	}
-	int ibest = -1;
+	geom_query_counts scratch;
+	struct query_pt3d_data d;
+	d.info = ss->info;
+	d.ibest = -1;
+	d.counts = stats_begin(ss->stats, &scratch);
+	if(ss->cell_built){
+		shapeset3d_query_cell(ss, p, &d);
+		clim = 0;
+	}
 	for(c = 0; c < clim; ++c){
-		const double pc[3] = {
-			p[0] + (double)off[3*c+0] * ss->lattice[0] + (double)off[3*c+1] * ss->lattice[3] + (double)off[3*c+2] * ss->lattice[6],
-			p[1] + (double)off[3*c+0] * ss->lattice[1] + (double)off[3*c+1] * ss->lattice[4] + (double)off[3*c+2] * ss->lattice[7],
-			p[2] + (double)off[3*c+0] * ss->lattice[2] + (double)off[3*c+1] * ss->lattice[5] + (double)off[3*c+2] * ss->lattice[8]
-		};
+		d.pc[0] = p[0] + (double)off[3*c+0] * ss->lattice[0] + (double)off[3*c+1] * ss->lattice[3] + (double)off[3*c+2] * ss->lattice[6];
+		d.pc[1] = p[1] + (double)off[3*c+0] * ss->lattice[1] + (double)off[3*c+1] * ss->lattice[4] + (double)off[3*c+2] * ss->lattice[7];
+		d.pc[2] = p[2] + (double)off[3*c+0] * ss->lattice[2] + (double)off[3*c+1] * ss->lattice[5] + (double)off[3*c+2] * ss->lattice[8];
 		if(ss->use_bvh){
-			int bbest = -1;
-			geom_bvh3d_query_pt(ss->bvh, pc, &query_pt3d, &bbest);
-			if(bbest > ibest){
-				if(geom_shape3d_contains(ss->info[bbest].s, pc)){
-					ibest = bbest;
-				}
-			}
+			d.ibest = geom_bvh3d_query_pt_max(ss->bvh, d.pc, d.ibest, &query_pt3d, &d);
 		}else{
 			int i;
 			for(i = 0; i < ss->n; ++i){
-				if(i <= ibest){ continue; } // skip anything less the current best
+				if(i <= d.ibest){ continue; } // skip anything less the current best
+				d.counts->leaves++;
 				if(GEOM_SHAPESET3D_FLAG_UNBOUNDED & ss->info[i].flags){
-					if(geom_shape3d_contains(ss->info[i].s, pc)){
-						ibest = i;
+					d.counts->contains++;
+					if(geom_shape3d_contains(ss->info[i].s, d.pc)){
+						d.counts->hits++;
+						d.ibest = i;
 					}
 				}else{
-					if(geom_aabb3d_contains(&(ss->info[i].box), pc)){
-						if(geom_shape3d_contains(ss->info[i].s, pc)){
-							ibest = i;
+					if(geom_aabb3d_contains(&(ss->info[i].box), d.pc)){
+						d.counts->contains++;
+						if(geom_shape3d_contains(ss->info[i].s, d.pc)){
+							d.counts->hits++;
+							d.ibest = i;
 						}
 					}
 				}
 			}
 		}
 	}
-	return 0;
+	stats_end(ss->stats);
+	return d.ibest;
 }
 int geom_shapeset3d_foreach(
 	geom_shapeset3d ss,
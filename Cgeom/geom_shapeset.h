@@ -2,6 +2,7 @@
 #define GEOM_SHAPESET_H_INCLUDED
 
 #include <Cgeom/geom_shapes.h>
+#include <Cgeom/geom_bvh.h>
 
 // A shapeset is a collection of shapes. This object only stores pointers
 // to shapes without managing memory.
@@ -25,9 +26,43 @@ int geom_shapeset3d_set_lattice(geom_shapeset3d ss, const double lattice[9]);
 int geom_shapeset2d_add(geom_shapeset2d ss, geom_shape2d *s);
 int geom_shapeset3d_add(geom_shapeset3d ss, geom_shape3d *s);
 
+// Builds the BVH used by the queries.
 void geom_shapeset2d_finalize(geom_shapeset2d ss);
 void geom_shapeset3d_finalize(geom_shapeset3d ss);
 
+// Same as finalize, with a choice of tree construction. STR (the default
+// used by finalize) gives the fastest queries; Morton order builds
+// faster, for sets that are rebuilt often. A dynamic tree takes added
+// and moved shapes without a rebuild, for sets that are being edited.
+// Calling this on a set finalized with a different method rebuilds the
+// tree.
+#define GEOM_SHAPESET_BUILD_STR     0
+#define GEOM_SHAPESET_BUILD_MORTON  1
+#define GEOM_SHAPESET_BUILD_DYNAMIC 2
+void geom_shapeset2d_finalize_method(geom_shapeset2d ss, int method);
+void geom_shapeset3d_finalize_method(geom_shapeset3d ss, int method);
+
+// Refreshes the bounding box of a shape after it has been moved or
+// otherwise changed. Both this and add keep the tree of a finalized set
+// up to date; a static tree is converted to a dynamic one the first time,
+// and finalize converts it back once editing is done. The unit cell
+// lookup of a periodic set is updated too, so queries answer as they
+// would after a new finalize. Returns 0, -1 if ss is NULL, or -2 for an
+// invalid index.
+int geom_shapeset2d_update(geom_shapeset2d ss, int index);
+int geom_shapeset3d_update(geom_shapeset3d ss, int index);
+
+// Query statistics. Once a record is attached, every query overwrites
+// last with its own counts and adds them to total; contains and hits
+// count the geom_shape*_contains calls and their successes. Attaching
+// zeroes the record, and NULL detaches it. The record must outlive the
+// shapeset or be detached first.
+typedef struct{
+	geom_query_counts last, total;
+} geom_shapeset_stats;
+void geom_shapeset2d_set_stats(geom_shapeset2d ss, geom_shapeset_stats *stats);
+void geom_shapeset3d_set_stats(geom_shapeset3d ss, geom_shapeset_stats *stats);
+
 unsigned int geom_shapeset2d_size(geom_shapeset2d ss);
 unsigned int geom_shapeset3d_size(geom_shapeset3d ss);
 
@@ -37,10 +72,79 @@ geom_shape3d* geom_shapeset3d_index(geom_shapeset3d ss, int index);
 int geom_shapeset2d_index_aabb(geom_shapeset2d ss, int index, geom_aabb2d *box);
 int geom_shapeset3d_index_aabb(geom_shapeset3d ss, int index, geom_aabb3d *box);
 
-// Returns item of largest index
+// Returns item of largest index containing p, or -1 if there is none.
+// For periodic sets a shape matches if it contains any lattice translate
+// of p. Once finalized, p is reduced into the unit cell and looked up in
+// a tree of the shapes moved into the cell, plus a short list of the
+// images of shapes straddling its boundary; before that, only the
+// neighboring cells are tried.
 int geom_shapeset2d_query_pt(geom_shapeset2d ss, const double p[2]);
 int geom_shapeset3d_query_pt(geom_shapeset3d ss, const double p[3]);
 
+// Finds the k shapes nearest to p by geom_shape2d_distance, so shapes
+// containing p are at distance 0. Their indices and distances are returned
+// in index[] and dist[], nearest first. For periodic sets the distance is
+// to the nearest image among the neighboring cells.
+// Returns the number of shapes found (less than k only if the set has
+// fewer shapes), or a negative value on invalid arguments.
+int geom_shapeset2d_query_nearest(
+	geom_shapeset2d ss, const double p[2], unsigned int k,
+	int index[], double dist[]
+);
+
+// Ray queries. The ray is p + t*v for t >= 0, and the segment from a to b
+// is a + t*(b-a) for t in [0,1]. Shapes whose bounding boxes are crossed
+// are passed to func along with their index and t, the parameter at which
+// the ray enters the box. After finalize, shapes arrive in roughly front
+// to back order. func may lower *tmax (initially infinite for a ray, 1
+// for a segment) to the parameter of the closest hit found so far, which
+// skips everything behind it; returning zero stops the query. The lattice
+// is not taken into account. Returns 0 if the query ran to completion and
+// 1 if it was stopped by func.
+int geom_shapeset2d_query_ray(
+	geom_shapeset2d ss, const double p[2], const double v[2],
+	int (*func)(int index, geom_shape2d *s, double t, double *tmax, void *data),
+	void *data
+);
+int geom_shapeset2d_query_segment(
+	geom_shapeset2d ss, const double a[2], const double b[2],
+	int (*func)(int index, geom_shape2d *s, double t, double *tmax, void *data),
+	void *data
+);
+
+// Samples the set on an nx by ny grid: index[i + j*nx] is set to
+// query_pt of the pixel center org + (i+0.5)*du + (j+0.5)*dv, so the grid
+// may follow the lattice vectors or any other pair of steps. Pixels are
+// processed in tiles that look up their candidate shapes once, and when
+// built with OpenMP the tiles are spread over threads; the result does
+// not depend on the number of threads. Attached stats count each pixel
+// as a query. Returns 0, -1 if ss is NULL, or -2 if any pointer argument
+// is NULL.
+int geom_shapeset2d_rasterize(
+	geom_shapeset2d ss, const double org[2], const double du[2], const double dv[2],
+	unsigned int nx, unsigned int ny, int index[]
+);
+
+// Computes area fractions on an nx by ny grid of cells, where cell (i,j)
+// is the parallelogram org + [i,i+1]*du + [j,j+1]*dv. frac[i + j*nx] is
+// set to the area of the cell covered by the union of the shapes over the
+// cell area. As in geom_shapeset2d_query_pt, a shape hides the parts of
+// shapes with lower indices that it overlaps; if index is not NULL,
+// index[i + j*nx] is set to the shape showing over the most of the cell,
+// the larger index on ties, or -1 if the cell is empty. Cells inside or
+// outside a shape are told apart from its corners, and exact areas
+// (geom_shape2d_simplex_overlap_exact) are only computed on cells that a
+// shape boundary passes through. Where the boundaries of two or more
+// shapes showing in a cell pass through it, both results come from a
+// 16 by 16 grid of samples in the cell. When built with OpenMP the
+// rows are spread over threads. Returns 0, -1 if ss is NULL, -2 if any
+// pointer argument other than index is NULL, or -3 if du and dv are
+// parallel.
+int geom_shapeset2d_fill_fraction(
+	geom_shapeset2d ss, const double org[2], const double du[2], const double dv[2],
+	unsigned int nx, unsigned int ny, double frac[], int index[]
+);
+
 int geom_shapeset2d_foreach(
 	geom_shapeset2d ss,
 	int (*func)(geom_shape2d *s, const geom_aabb2d *box, unsigned int flags, void *data),
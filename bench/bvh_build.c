@@ -0,0 +1,121 @@
+// Times bulk loading of 2D and 3D BVHs over n boxes whose centers are
+// on a square grid (given in sorted or reversed order) or uniformly
+// random, then checks each tree with a batch of point queries.
+//
+// Usage: bvh_build [n] [2|3] [str|morton]
+// The default is n = 10^7 boxes in 2D, built by STR.
+#include <Cgeom/geom_bvh.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#define NQUERY 1000000
+
+static double now(void){
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + 1e-9 * t.tv_nsec;
+}
+static double urand(void){
+	return rand() / (double)RAND_MAX;
+}
+
+typedef struct{
+	const double *x; // center and half-size of box i at x[3*i]
+	unsigned int i;
+} boxes;
+static int boxes_next2d(double c[2], double h[2], int *tag, void *data){
+	boxes *B = (boxes*)data;
+	const double *x = &B->x[3*B->i];
+	c[0] = x[0]; c[1] = x[1];
+	h[0] = h[1] = x[2];
+	*tag = B->i++;
+	return 1;
+}
+static int boxes_next3d(double c[3], double h[3], int *tag, void *data){
+	boxes *B = (boxes*)data;
+	const double *x = &B->x[3*B->i];
+	c[0] = x[0]; c[1] = x[1]; c[2] = 0.5;
+	h[0] = h[1] = h[2] = x[2];
+	*tag = B->i++;
+	return 1;
+}
+
+static int count_hit(int tag, const double *c, const double *h, void *data){
+	(void)tag; (void)c; (void)h;
+	++*(unsigned long*)data;
+	return 1;
+}
+
+// Fills x with n boxes in the given order: "sorted" and "reversed" walk
+// a grid column by column, "random" scatters them over the unit square.
+static void make_boxes(unsigned int n, const char *order, double *x){
+	const unsigned int m = (unsigned int)ceil(sqrt((double)n));
+	unsigned int i;
+	srand(1);
+	for(i = 0; i < n; ++i){
+		const unsigned int k = (0 == strcmp(order, "reversed")) ? n-1-i : i;
+		if(0 == strcmp(order, "random")){
+			x[3*i+0] = urand();
+			x[3*i+1] = urand();
+		}else{
+			x[3*i+0] = (k / m + 0.5) / m;
+			x[3*i+1] = (k % m + 0.5) / m;
+		}
+		x[3*i+2] = 0.4 / m;
+	}
+}
+
+int main(int argc, char *argv[]){
+	static const char *order[3] = { "sorted", "reversed", "random" };
+	const unsigned int n = (argc > 1) ? (unsigned int)atof(argv[1]) : 10000000;
+	const int dim = (argc > 2) ? atoi(argv[2]) : 2;
+	const geom_bvh_method method = (argc > 3 && 0 == strcmp(argv[3], "morton")) ? GEOM_BVH_MORTON : GEOM_BVH_STR;
+	double *x;
+	int o;
+	if(0 == n || (2 != dim && 3 != dim)){
+		fprintf(stderr, "usage: %s [n] [2|3] [str|morton]\n", argv[0]);
+		return 1;
+	}
+	x = (double*)malloc(sizeof(double) * 3 * n);
+	if(NULL == x){ return 1; }
+	for(o = 0; o < 3; ++o){
+		boxes B;
+		unsigned long hits = 0;
+		double t0, t1, t2;
+		int q;
+		make_boxes(n, order[o], x);
+		B.x = x;
+		B.i = 0;
+		srand(5);
+		if(2 == dim){
+			geom_bvh2d T;
+			t0 = now();
+			T = geom_bvh2d_new_method(n, &boxes_next2d, &B, method);
+			t1 = now();
+			for(q = 0; q < NQUERY; ++q){
+				const double p[2] = { urand(), urand() };
+				geom_bvh2d_query_pt(T, p, &count_hit, &hits);
+			}
+			t2 = now();
+			geom_bvh2d_destroy(T);
+		}else{
+			geom_bvh3d T;
+			t0 = now();
+			T = geom_bvh3d_new_method(n, &boxes_next3d, &B, method);
+			t1 = now();
+			for(q = 0; q < NQUERY; ++q){
+				const double p[3] = { urand(), urand(), 0.5 };
+				geom_bvh3d_query_pt(T, p, &count_hit, &hits);
+			}
+			t2 = now();
+			geom_bvh3d_destroy(T);
+		}
+		printf("%dD %-8s n=%u: build %.3f s, %d point queries %.3f s (%lu hits)\n",
+			dim, order[o], n, t1 - t0, NQUERY, t2 - t1, hits);
+	}
+	free(x);
+	return 0;
+}
@@ -0,0 +1,150 @@
+// Measures the node storage of static 2D and 3D BVHs over n uniformly
+// random boxes: heap used by the tree, point and box query times, a full
+// traversal and destroy. The hit counts and tag sums make it easy to
+// check that two builds of the library return the same results.
+//
+// Usage: bvh_pool [n]
+// The default is n = 10^6 boxes.
+#include <Cgeom/geom_bvh.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+#include <malloc.h>
+#define HAVE_MALLINFO2
+#endif
+
+#define NQUERY 1000000
+
+static double now(void){
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + 1e-9 * t.tv_nsec;
+}
+static double urand(void){
+	return rand() / (double)RAND_MAX;
+}
+// Bytes allocated on the heap, or 0 if that cannot be told
+static double heap_used(void){
+#ifdef HAVE_MALLINFO2
+	const struct mallinfo2 m = mallinfo2();
+	return (double)m.uordblks + (double)m.hblkhd;
+#else
+	return 0;
+#endif
+}
+
+typedef struct{
+	const double *x; // center and half-sizes of box i at x[4*i]
+	unsigned int i;
+} boxes;
+static int boxes_next2d(double c[2], double h[2], int *tag, void *data){
+	boxes *B = (boxes*)data;
+	const double *x = &B->x[4*B->i];
+	c[0] = x[0]; c[1] = x[1];
+	h[0] = x[2]; h[1] = x[3];
+	*tag = B->i++;
+	return 1;
+}
+static int boxes_next3d(double c[3], double h[3], int *tag, void *data){
+	boxes *B = (boxes*)data;
+	const double *x = &B->x[4*B->i];
+	c[0] = x[0]; c[1] = x[1]; c[2] = x[2];
+	h[0] = h[1] = h[2] = x[3];
+	*tag = B->i++;
+	return 1;
+}
+
+typedef struct{
+	unsigned long count, sum;
+} tally;
+static int tally_hit(int tag, const double *c, const double *h, void *data){
+	tally *t = (tally*)data;
+	(void)c; (void)h;
+	t->count++;
+	t->sum += tag;
+	return 1;
+}
+static int tally_node(int tag, const double *c, const double *h, int leaf, void *data){
+	tally *t = (tally*)data;
+	(void)c; (void)h;
+	t->count++;
+	if(leaf){ t->sum += tag; }
+	return 1;
+}
+
+int main(int argc, char *argv[]){
+	const unsigned int n = (argc > 1) ? (unsigned int)atof(argv[1]) : 1000000;
+	const double s = 0.5 / sqrt((double)n);
+	double *x, m0, m1, t0, t1, t2, t3, t4;
+	boxes B;
+	tally pt = { 0, 0 }, box = { 0, 0 }, all = { 0, 0 };
+	unsigned int i;
+	int q;
+	if(0 == n){
+		fprintf(stderr, "usage: %s [n]\n", argv[0]);
+		return 1;
+	}
+	x = (double*)malloc(sizeof(double) * 4 * n);
+	if(NULL == x){ return 1; }
+	srand(1);
+	for(i = 0; i < 4*n; i += 4){
+		x[i+0] = urand();
+		x[i+1] = urand();
+		x[i+2] = s * urand();
+		x[i+3] = s * urand();
+	}
+
+	{
+		geom_bvh2d T;
+		B.x = x; B.i = 0;
+		m0 = heap_used();
+		t0 = now();
+		T = geom_bvh2d_new(n, &boxes_next2d, &B);
+		t1 = now();
+		m1 = heap_used();
+		for(q = 0; q < NQUERY; ++q){
+			const double p[2] = { urand(), urand() };
+			geom_bvh2d_query_pt(T, p, &tally_hit, &pt);
+		}
+		t2 = now();
+		for(q = 0; q < NQUERY/1000; ++q){
+			const double c[2] = { urand(), urand() }, h[2] = { 0.01, 0.01 };
+			geom_bvh2d_query_box(T, c, h, &tally_hit, &box);
+		}
+		t3 = now();
+		geom_bvh2d_traverse(T, &tally_node, &all);
+		t4 = now();
+		geom_bvh2d_destroy(T);
+		printf("2D n=%u: build %.3f s, tree %.1f MB\n", n, t1 - t0, (m1 - m0) / 1e6);
+		printf("  %d point queries %.3f s (%lu hits, tag sum %lu)\n", NQUERY, t2 - t1, pt.count, pt.sum);
+		printf("  %d box queries %.3f s (%lu hits, tag sum %lu)\n", NQUERY/1000, t3 - t2, box.count, box.sum);
+		printf("  traversal %lu nodes (tag sum %lu), destroy %.4f s\n", all.count, all.sum, now() - t4);
+	}
+
+	pt.count = pt.sum = all.count = all.sum = 0;
+	srand(2);
+	{
+		geom_bvh3d T;
+		B.x = x; B.i = 0;
+		m0 = heap_used();
+		t0 = now();
+		T = geom_bvh3d_new(n, &boxes_next3d, &B);
+		t1 = now();
+		m1 = heap_used();
+		for(q = 0; q < NQUERY; ++q){
+			const double p[3] = { urand(), urand(), urand() };
+			geom_bvh3d_query_pt(T, p, &tally_hit, &pt);
+		}
+		t2 = now();
+		geom_bvh3d_traverse(T, &tally_node, &all);
+		t3 = now();
+		geom_bvh3d_destroy(T);
+		printf("3D n=%u: build %.3f s, tree %.1f MB\n", n, t1 - t0, (m1 - m0) / 1e6);
+		printf("  %d point queries %.3f s (%lu hits, tag sum %lu)\n", NQUERY, t2 - t1, pt.count, pt.sum);
+		printf("  traversal %lu nodes (tag sum %lu), destroy %.4f s\n", all.count, all.sum, now() - t3);
+	}
+	free(x);
+	return 0;
+}
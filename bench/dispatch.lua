@@ -0,0 +1,46 @@
+-- Per-call overhead of the kernel's userdata dispatch: arithmetic on
+-- points, field and method lookup, and the overloaded free functions.
+-- Each case is called N times; the best of five runs is reported.
+-- Run from bench/ after building CAD2Dkernel.so: lua dispatch.lua [N]
+package.cpath = '../?.so;' .. package.cpath
+local K = require('CAD2Dkernel')
+
+local N = tonumber(arg and arg[1]) or 1000000
+local RUNS = 5
+
+local p = K.Point(1, 2)
+local q = K.Point(3, 5)
+local v = K.Vector(0.5, -0.25)
+local r1 = K.Ray(K.Point(0, 0), K.Direction(1, 1))
+local r2 = K.Ray(K.Point(4, 0), K.Direction(-1, 1))
+local arc = K.Arcseg(K.Point(0, 3), K.Point(4, 3), 0.5)
+local sq = K.Poly(K.Point(0, 0), K.Point(2, 0), K.Point(2, 2), K.Point(0, 2))
+local inside = K.Point(1, 1)
+local dist = K.Distance
+local xsect = K.Intersection
+
+local cases = {
+	{ 'point + vec', function() return p + v end },
+	{ 'point - point', function() return q - p end },
+	{ 'p.x + p.y', function() return p.x + p.y end },
+	{ 'dist(point,point)', function() return dist(p, q) end },
+	{ 'xsect(ray,ray)', function() return xsect(r1, r2) end },
+	{ 'xsect(ray,arcseg)', function() return xsect(r1, arc) end },
+	{ 'poly.area', function() return sq.area end },
+	{ 'poly:contains', function() return sq:contains(inside) end },
+	{ 'empty loop', function() return nil end },
+}
+
+print(string.format('%d calls per case, best of %d runs', N, RUNS))
+print(string.format('  %-20s %10s', 'case', 'ns/call'))
+for _, c in ipairs(cases) do
+	local f = c[2]
+	local best = math.huge
+	for run = 1, RUNS do
+		local t0 = os.clock()
+		for i = 1, N do f() end
+		local t = os.clock() - t0
+		if t < best then best = t end
+	end
+	print(string.format('  %-20s %10.1f', c[1], 1e9 * best / N))
+end
@@ -0,0 +1,87 @@
+// Times point containment in large polygons, which use the slab index of
+// geom_shape2d_init, and checks the answers against the plain crossing
+// test of geom_polygon_inside2d. The outlines are symmetric about the x
+// axis, r(a) = 1 + 0.2*sin(37*a) at evenly spaced angles, so mirrored
+// vertices land an ulp or so apart in y; with misordered edges in those
+// thin slabs the index was dropped and queries took O(nv) time.
+//
+// Usage: slab_index [nv ...]
+// The default is nv = 10^4, 2*10^4 and 10^5. Returns 1 if any answer
+// differs, or if containment is not at least MIN_SPEEDUP times faster
+// than the crossing test, which means the index is missing.
+#include <Cgeom/geom_predicates.h>
+#include <Cgeom/geom_poly.h>
+#include <Cgeom/geom_shapes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#define NQUERY 200000
+#define NCHECK 10000
+#define MIN_SPEEDUP 10
+
+static double now(void){
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + 1e-9 * t.tv_nsec;
+}
+static double urand(void){
+	return 2.4 * rand() / (double)RAND_MAX - 1.2;
+}
+
+// Times NQUERY containment tests on an outline of nv vertices; returns
+// nonzero if the index is missing or gives a wrong answer.
+static int run(unsigned int nv){
+	geom_shape2d *s = (geom_shape2d*)malloc(sizeof(geom_shape2d) + sizeof(double) * 2 * nv);
+	double *p = (double*)malloc(sizeof(double) * 2 * NQUERY);
+	double t0, t1, t2, t3;
+	unsigned int i, bad = 0, hits = 0, inside = 0;
+	s->type = GEOM_SHAPE2D_POLYGON;
+	s->tag = 0;
+	s->org[0] = s->org[1] = 0;
+	s->s.polygon.nv = nv;
+	for(i = 0; i < nv; ++i){
+		const double a = 2*M_PI * i / nv;
+		const double r = 1 + 0.2*sin(37*a);
+		s->s.polygon.v[2*i+0] = r*cos(a);
+		s->s.polygon.v[2*i+1] = r*sin(a);
+	}
+	geom_shape2d_init(s);
+	srand(1);
+	for(i = 0; i < 2*NQUERY; ++i){ p[i] = urand(); }
+	t0 = now();
+	for(i = 0; i < NQUERY; ++i){
+		hits += geom_shape2d_contains(s, &p[2*i]);
+	}
+	t1 = now();
+	for(i = 0; i < NCHECK; ++i){
+		if(geom_shape2d_contains(s, &p[2*i]) != geom_polygon_inside2d(nv, s->s.polygon.v, &p[2*i])){ bad++; }
+	}
+	t2 = now();
+	for(i = 0; i < NCHECK; ++i){
+		inside += geom_polygon_inside2d(nv, s->s.polygon.v, &p[2*i]);
+	}
+	t3 = now();
+	t3 = (t3 - t2) / NCHECK; // per crossing test
+	t1 = (t1 - t0) / NQUERY;
+	printf("nv=%u: %.3f us per query (%u of %d inside), %.1f times the crossing test; %u of %d disagree (%u inside)\n",
+		nv, 1e6 * t1, hits, NQUERY, t3 / t1, bad, NCHECK, inside);
+	geom_shape2d_release(s);
+	free(s);
+	free(p);
+	return (bad > 0 || t3 < MIN_SPEEDUP * t1);
+}
+
+int main(int argc, char *argv[]){
+	int i, bad = 0;
+	geom_predicates_init();
+	if(argc > 1){
+		for(i = 1; i < argc; ++i){ bad += run((unsigned int)atof(argv[i])); }
+	}else{
+		bad += run(10000);
+		bad += run(20000);
+		bad += run(100000);
+	}
+	return bad ? 1 : 0;
+}